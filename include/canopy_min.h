@@ -92,6 +92,15 @@ typedef enum {
 
     /* Network error, either HTTP of websocket */
     CANOPY_ERROR_NETWORK,
+
+    /* there's been an error emitting or parsing a CBOR payload */
+    CANOPY_ERROR_CBOR,
+
+    /* the remote's been failing, so it isn't tried for a while */
+    CANOPY_ERROR_REMOTE_UNAVAILABLE,
+
+    /* the operation didn't finish in the time it was given */
+    CANOPY_ERROR_TIMEOUT,
 } canopy_error;
 
 struct canopy_error_strings {
@@ -117,6 +126,9 @@ const static struct canopy_error_strings canopy_error_strings_table[] = {
         {CANOPY_ERROR_BUFFER_TOO_SMALL, "buffer too small"},
         {CANOPY_ERROR_JSON, "could not emit a JSON string"},
         {CANOPY_ERROR_NETWORK, "network error"},
+        {CANOPY_ERROR_CBOR, "could not emit or parse a CBOR payload"},
+        {CANOPY_ERROR_REMOTE_UNAVAILABLE, "remote is unavailable"},
+        {CANOPY_ERROR_TIMEOUT, "operation timed out"},
 };
 
 inline static const char *canopy_error_string(canopy_error err) {
@@ -141,6 +153,20 @@ typedef struct canopy_context {
     /* List of remotes known to the library.  This may not be needed. */
     struct canopy_remote *remotes;
 
+    /*
+     * Transport state shared by all of the remotes, e.g. the TLS session
+     * and DNS caches.  Owned by the OS layer.
+     */
+    void *comm;
+
+    /* seconds to cache DNS lookups, see canopy_ctx_set_dns_cache_ttl() */
+    int dns_cache_ttl;
+
+    /* background syncing, see canopy_ctx_start_scheduler() */
+    struct canopy_scheduler *scheduler;
+    int sync_min_period;    /* see canopy_ctx_set_adaptive_sync() */
+    int sync_max_period;
+
     /* stuff related to logging */
     bool enabled;
     char* log_file;
@@ -193,6 +219,53 @@ extern canopy_error canopy_ctx_get_logging(canopy_context_t *ctx,
         size_t *logfile_len,
         int *level);
 
+#define CANOPY_DEFAULT_DNS_CACHE_TTL    60
+
+// Set how long the remotes of a context cache the address of their server.
+// The cache, like TLS sessions, is shared by all remotes of the context, so
+// reconnecting doesn't need a fresh lookup or a full handshake.
+//
+// <ttl_seconds> is the time to keep an address, -1 to keep it forever or 0
+// to look it up for every request.  Defaults to CANOPY_DEFAULT_DNS_CACHE_TTL.
+extern canopy_error canopy_ctx_set_dns_cache_ttl(canopy_context_t *ctx,
+        int ttl_seconds);
+
+// Start syncing devices in the background.  A thread of the context syncs
+// the devices passed to canopy_device_schedule_sync() about every
+// <update_period> seconds.  Devices that share a remote are synced together,
+// each remote's timer is jittered by up to 10% so that many devices started
+// at once don't stay in step, and a variable of a scheduled device being set
+// wakes the thread to sync its remote right away.
+//
+// While the scheduler runs, hold canopy_ctx_lock() when touching scheduled
+// devices and their variables.  Every sync takes it while the device's
+// variables are emitted and while the reply is parsed, so change callbacks
+// run holding it, but not while the request is out, so a slow remote doesn't
+// hold up the application; syncs of one device still go one at a time (see
+// canopy_device_sync_with_remote()).  So don't sync a scheduled device, or
+// unschedule one, while holding the lock.
+//
+// canopy_ctx_shutdown() stops the scheduler if it's still running.
+extern canopy_error canopy_ctx_start_scheduler(canopy_context_t *ctx);
+extern canopy_error canopy_ctx_stop_scheduler(canopy_context_t *ctx);
+
+// Let the scheduler adapt each remote's period to how busy its devices are,
+// between <min_seconds> and <max_seconds>.  The first period is
+// update_period.  After a sync in which a device had variables set locally,
+// an IN variable changed on the remote, or the remote reported a change of
+// active or websocket status, the next period is <min_seconds>.  Otherwise
+// it doubles, up to <max_seconds>.  Pass 0 for both to keep update_period.
+//
+// Takes effect from each remote's next sync.
+extern canopy_error canopy_ctx_set_adaptive_sync(canopy_context_t *ctx,
+        int min_seconds,
+        int max_seconds);
+
+// Lock out the scheduler.  Does nothing if it isn't running.  The lock may
+// be taken again by the thread that holds it.
+extern void canopy_ctx_lock(canopy_context_t *ctx);
+extern void canopy_ctx_unlock(canopy_context_t *ctx);
+
 
 /*****************************************************************************/
 // BARRIERS
@@ -221,6 +294,12 @@ typedef struct canopy_barrier {
         struct canopy_device *device;
         struct canopy_user *user;
     } result;
+
+    /* set up by canopy_barrier_init(), the last two are under
+     * remote->sync_lock */
+    cos_time_t deadline;        /* 0 for none */
+    bool cancelled;
+    cos_event_t *wake;          /* what the call is waiting on, if anything */
 } canopy_barrier_t;
 
 typedef canopy_error (*canopy_barrier_cb)(struct canopy_barrier *barrier,
@@ -231,6 +310,19 @@ typedef canopy_error (*canopy_barrier_cb)(struct canopy_barrier *barrier,
 // canopy_barrier_wait_for_complete() or canopy_barrier_cancel() before
 // returning from the scope with the barrier.
 
+// Sets up a barrier for a call to <remote> that must be over within
+// <timeout_ms> of now (0 for no limit beyond the remote's own timeouts).
+//
+// Calls don't run asynchronously yet, so a call given a barrier still blocks
+// until it's done, but it gives up with CANOPY_ERROR_TIMEOUT once the
+// deadline has passed, wherever it's got to (waiting on a sync of the same
+// device, backing off before a retry or in the middle of a request), and
+// another thread can cut it short with canopy_barrier_cancel().  A barrier
+// is for one call at a time, set it up again for the next.
+extern canopy_error canopy_barrier_init(canopy_barrier_t *barrier,
+        struct canopy_remote *remote,
+        uint32_t timeout_ms);
+
 // Block the current thread until the operation has completed, or timeout
 // occurs.  Returns immediately if the requested operation has already
 // finished.
@@ -245,9 +337,11 @@ extern canopy_error canopy_barrier_wait_for_complete(canopy_barrier_t *barrier,
 
 // Cancels the barrier.
 // Any threads blocked in canopy_barrier_wait_for_complete will return with
-// CANOPY_ERROR_CANCELLED.
+// CANOPY_ERROR_CANCELLED, as will a call that's using the barrier, dropping
+// its request if it's in flight.
 // No further callbacks will be triggered for this barrier.
-// After calling this it is safe to deallocate the barrier.
+// After calling this it is safe to deallocate the barrier, once any call
+// that's using it has returned.
 extern canopy_error canopy_barrier_cancel(canopy_barrier_t *barrier);
 
 // Establish a callback that will be triggered when the operation has
@@ -381,12 +475,15 @@ const static struct activity_status activity_status_table[] = {
 inline static const char *activity_status_string(canopy_active_status status) {
     return activity_status_table[status].str;
 }
+#define ACTIVITY_STATUS_PREFIX_LENGTH   7   /* "status_", not sent by the remote */
 inline static canopy_active_status activity_status_from_string(const char* str, int len) {
     int i;
-    for (i = 0; i < sizeof(activity_status_table); i++) {
-        int tl = sizeof(activity_status_table[i].str);
-        int small = LOCAL_MIN(len, tl);
-        if (strncmp(str, activity_status_table[i].str, small) == 0) {
+    for (i = 0; i < sizeof(activity_status_table) /
+            sizeof(activity_status_table[0]); i++) {
+        const char *table_str = activity_status_table[i].str;
+        if (strncmp(str, table_str, len) == 0
+                || strncmp(str, &table_str[ACTIVITY_STATUS_PREFIX_LENGTH],
+                    len) == 0) {
             return activity_status_table[i].status;
         }
     }
@@ -441,10 +538,9 @@ inline static const char *ws_connection_status_string(canopy_ws_connection_statu
 }
 inline static canopy_ws_connection_status ws_connection_statum_string(const char* str, int len) {
     int i;
-    for (i = 0; i < sizeof(ws_connection_status_table); i++) {
-        int tl = sizeof(ws_connection_status_table[i].str);
-        int small = LOCAL_MIN(len, tl);
-        if (strncmp(str, ws_connection_status_table[i].str, small) == 0) {
+    for (i = 0; i < sizeof(ws_connection_status_table) /
+            sizeof(ws_connection_status_table[0]); i++) {
+        if (strncmp(str, ws_connection_status_table[i].str, len) == 0) {
             return ws_connection_status_table[i].status;
         }
     }
@@ -453,6 +549,17 @@ inline static canopy_ws_connection_status ws_connection_statum_string(const char
 
 
 
+/*
+ * Encoding used for the /api/device/self exchange.  CBOR (RFC 7049) payloads
+ * are smaller and cheaper to produce and parse than JSON text.  The format is
+ * negotiated by content type: if the remote answers in JSON, or rejects a
+ * CBOR request, the remote falls back to JSON.
+ */
+typedef enum {
+    CANOPY_WIRE_FORMAT_JSON = 0,    /* application/json */
+    CANOPY_WIRE_FORMAT_CBOR,        /* application/cbor */
+} canopy_wire_format;
+
 /*******************************************************************
  * Parameters to use when talking to a remote.
  */
@@ -468,8 +575,80 @@ typedef struct canopy_remote_params {
     char                     *remote;      // hostname or IP  of remote server
     bool                     use_ws;       // hint: use websockets if available
     bool                     persistent;   // hint: keep comm channel open
+    canopy_wire_format       wire_format;  // Defaults to JSON
+    size_t                   compress_threshold;// gzip request bodies of at
+                                           // least this many bytes, 0: never
+    bool                     accept_compressed;// ask for gzip/deflate replies
+    uint32_t                 query_cache_ttl;// seconds to reuse the results of
+                                           // a device query, 0: never
+    size_t                   query_cache_size;// bytes of results to keep, 0
+                                           // for CANOPY_DEFAULT_QUERY_CACHE_SIZE
+    size_t                   max_response_size;// largest reply to take, 0 for
+                                           // CANOPY_DEFAULT_MAX_RESPONSE_SIZE
+    int                      max_connections;// connections kept open to the
+                                           // remote, 0 for
+                                           // CANOPY_DEFAULT_MAX_CONNECTIONS
+    int                      max_streams;  // requests in flight at once on one
+                                           // HTTP/2 connection, 0 for
+                                           // CANOPY_DEFAULT_MAX_STREAMS
+    int                      retry_attempts;// tries per request, 0 for
+                                           // CANOPY_DEFAULT_RETRY_ATTEMPTS,
+                                           // 1 never to retry
+    uint32_t                 retry_backoff_ms;// wait before the first retry,
+                                           // doubling for each one after, 0
+                                           // for CANOPY_DEFAULT_RETRY_BACKOFF_MS
+    uint32_t                 retry_backoff_max_ms;// longest wait, 0 for
+                                           // CANOPY_DEFAULT_RETRY_BACKOFF_MAX_MS
+    int                      breaker_threshold;// failures in a row that stop
+                                           // requests to the remote, 0 for
+                                           // CANOPY_DEFAULT_BREAKER_THRESHOLD,
+                                           // -1 never to stop them
+    uint32_t                 breaker_cooldown_ms;// how long they're stopped
+                                           // for, 0 for
+                                           // CANOPY_DEFAULT_BREAKER_COOLDOWN_MS
+    uint32_t                 connect_timeout_ms;// longest to wait for a
+                                           // connection, 0 for
+                                           // CANOPY_DEFAULT_CONNECT_TIMEOUT_MS
+    uint32_t                 request_timeout_ms;// longest a try of a request
+                                           // may take, 0 for
+                                           // CANOPY_DEFAULT_REQUEST_TIMEOUT_MS
 } canopy_remote_params_t;
 
+#define CANOPY_DEFAULT_QUERY_CACHE_SIZE (64 * 1024)
+#define CANOPY_DEFAULT_MAX_RESPONSE_SIZE (1024 * 1024)
+#define CANOPY_DEFAULT_MAX_CONNECTIONS 2
+#define CANOPY_DEFAULT_MAX_STREAMS 32
+#define CANOPY_DEFAULT_RETRY_ATTEMPTS 3
+#define CANOPY_DEFAULT_RETRY_BACKOFF_MS 100
+#define CANOPY_DEFAULT_RETRY_BACKOFF_MAX_MS 5000
+#define CANOPY_DEFAULT_BREAKER_THRESHOLD 5
+#define CANOPY_DEFAULT_BREAKER_COOLDOWN_MS 5000
+#define CANOPY_DEFAULT_CONNECT_TIMEOUT_MS 5000
+#define CANOPY_DEFAULT_REQUEST_TIMEOUT_MS 30000
+
+/*
+ * Retries and the circuit breaker.
+ *
+ * A request that fails in a way that might not happen again is retried, up
+ * to retry_attempts tries in all: if the remote couldn't be reached, or, if
+ * the request is idempotent, if the connection broke or the remote answered
+ * 429, 502, 503 or 504.  GETs, DELETEs and device syncs are idempotent, other
+ * POSTs (creating devices, say) are not.  Before each retry it waits out a
+ * backoff that doubles each time, up to retry_backoff_max_ms, of which a
+ * random half is jitter so that clients don't retry in lockstep.
+ *
+ * After breaker_threshold failed tries in a row the remote is taken to be
+ * down, and requests to it fail straight away with
+ * CANOPY_ERROR_REMOTE_UNAVAILABLE for breaker_cooldown_ms.  Then one request
+ * is let through: if it works the remote is back, otherwise it's another
+ * breaker_cooldown_ms.
+ *
+ * A try that takes longer than request_timeout_ms fails with
+ * CANOPY_ERROR_TIMEOUT, and may be retried like a broken connection.  To
+ * bound a whole call, retries and all, give it a barrier set up with
+ * canopy_barrier_init().
+ */
+
 /*
  * canopy_remote:
  *         used to hold information about the remote we're using.
@@ -481,17 +660,94 @@ typedef struct canopy_remote {
     struct canopy_context           *ctx;        /* back pointer to the context */
     struct canopy_remote_params     *params;     /* params for this remote */
 
-    /* general purpose buffer needs to be supplied by client     */
+    /* general purpose buffer, may be supplied by client     */
     char                            *rcv_buffer;
     size_t                          rcv_buffer_size;
-    int                             rcv_end;
+    int                             rcv_end;    /* length of the last reply,
+                                                 * under the pool's lock */
+
+    /* buffers the replies to requests in flight go in */
+    struct canopy_buffer_pool       *pool;
+
+    /* connections the remote's requests share (see max_connections) */
+    struct canopy_connection_pool   *connections;
 
     canopy_ws_connection_status     ws_status;
     bool                            ws_connected;/* currently connection WS */
     canopy_active_status            active_status;
     cos_time_t                      last_activity;
+
+    /* format in use, starts as params->wire_format, may fall back to JSON.
+     * Under sync_lock */
+    canopy_wire_format              wire_format;
+
+    /* recent query results, most recently used first (see query_cache_ttl),
+     * under query_cache_lock.  NULL if there's no lock */
+    struct canopy_query_cache_entry *query_cache;
+    size_t                          query_cache_bytes;
+    cos_mutex_t                     *query_cache_lock;
+
+    /* for coalescing concurrent syncs of a device, the circuit breaker
+     * below and the barriers of calls to the remote.  NULL if there's no
+     * lock */
+    cos_mutex_t                     *sync_lock;
+
+    /* circuit breaker, see breaker_threshold */
+    int                             failures;    /* tries failed in a row */
+    cos_time_t                      open_until;  /* 0 while it's closed */
+    bool                            probing;     /* a try after cooldown */
+    uint32_t                        retry_seed;  /* for backoff jitter */
+
+    /* round trip time of requests that worked, smoothed as in RFC 6298, in
+     * 1/8 ms.  Under sync_lock */
+    uint32_t                        srtt;
+
+    /* for a group (see canopy_remote_group_init()), its endpoints */
+    struct canopy_remote            *endpoints;
+
+    /* for an endpoint, its group and the group's next endpoint */
+    struct canopy_remote            *group;
+    struct canopy_remote            *next_endpoint;
+    bool                            secondary;
+
+    /* devices synced by the scheduler, and when it next syncs them */
+    struct canopy_device            *scheduled;
+    cos_time_t                      next_sync;
+    cos_time_t                      sync_interval; /* ms, if adaptive */
 } canopy_remote_t;
 
+/*
+ * Drops any query results the remote has cached.  Results are dropped anyway
+ * when they expire, or when changes to a device they might include have been
+ * synced to the remote.
+ */
+extern canopy_error canopy_remote_clear_query_cache(canopy_remote_t *remote);
+
+/*
+ * The state of a remote's connection pool.  Requests to the remote share up
+ * to max_connections connections, which are kept open between requests.
+ * Over HTTPS, HTTP/2 is used if the remote speaks it, and up to max_streams
+ * requests at once are multiplexed over each connection, so devices syncing
+ * from several threads don't each need a connection.  Over HTTP/1.1 a
+ * connection carries one request at a time, and requests beyond
+ * max_connections wait for one.
+ */
+typedef struct canopy_connection_stats {
+    int             max_connections;    /* from the params */
+    int             max_streams;
+    int             in_flight;          /* requests being made now */
+    int             peak_in_flight;     /* most there have been at once */
+    unsigned long   requests;           /* made through the pool */
+    unsigned long   connects;           /* that opened a new connection */
+    unsigned long   multiplexed;        /* that went over HTTP/2 */
+} canopy_connection_stats_t;
+
+/*
+ * Fills in <stats> with the state of <remote>'s connection pool.
+ */
+extern canopy_error canopy_remote_get_connection_stats(canopy_remote_t *remote,
+        canopy_connection_stats_t *stats);
+
 
 
 /*****************************************************************************/
@@ -677,6 +933,11 @@ typedef struct canopy_limits {
 } canopy_limits_t;
 
 
+#define CANOPY_QUERY_STRING_MAX_LENGTH  512
+
+/*
+ * A query.  Zero it (e.g. with memset()) before filling in the pointers.
+ */
 typedef struct canopy_query {
     /* the list used for filtering which devices to report. */
     canopy_filter_root_t *filter_root;
@@ -686,8 +947,103 @@ typedef struct canopy_query {
 
     /* How many to return */
     canopy_limits_t *limits;
+
+    /*
+     * The query in URL form, filled in by canopy_query_compile(), or the
+     * first time the query is used.  Not for use by the client.
+     */
+    bool        compiled;
+    char        query_string[CANOPY_QUERY_STRING_MAX_LENGTH];
+    size_t      query_string_len;
+    size_t      limit_offset;       /* where the limit term starts */
+    uint32_t    compiled_start;     /* the limit that was rendered */
+    uint32_t    compiled_count;
 } canopy_query_t;
 
+/*
+ * Checks the query's filter (parentheses balance, AND/OR sit between
+ * operands) and renders the filter, sort and limits into the URL query
+ * string sent to the server.  Queries are compiled on first use anyway, so
+ * this is only needed to catch errors early, or to pick up changes made to
+ * the filter, sort or limits after the query has been used.  Paging through
+ * results with <limits.start> doesn't need a recompile.
+ *
+ * Returns CANOPY_ERROR_BAD_PARAM if the filter doesn't make sense, or
+ * CANOPY_ERROR_BUFFER_TOO_SMALL if the query string would be longer than
+ * CANOPY_QUERY_STRING_MAX_LENGTH.
+ */
+extern canopy_error canopy_query_compile(canopy_query_t *query);
+
+/************************************************************
+ * Local filter evaluation
+ */
+/*
+ * A filter can also be run against devices already held locally (say, from
+ * an earlier canopy_user_devices()) without a trip to the server.  The filter
+ * is compiled once into a canopy_filter_program: a short postfix program
+ * whose variable names have been gathered into slots and whose values have
+ * been parsed up front, so running it against a device is one walk of the
+ * device's variables followed by a few typed comparisons.
+ *
+ * A term compares the device's variable of that name: numbers numerically
+ * (float32 variables at float precision), bools against true or false, and
+ * strings with strcmp() (the value may be quoted).  A term is false if the
+ * device doesn't have the variable, it hasn't been set, or the value doesn't
+ * make sense for its type.  HAS is true if the device has the variable.
+ * "system.ws_connected" is the device's ws_connected flag.
+ *
+ * The program points at the strings in the filter, which must outlive it.
+ */
+#define CANOPY_FILTER_PROGRAM_MAX_OPS   32
+#define CANOPY_FILTER_PROGRAM_MAX_VARS  8
+
+struct canopy_filter_op {
+    uint8_t     code;       /* what to do */
+    uint8_t     relation;   /* canopy_relation_op, for terms */
+    uint8_t     slot;       /* the variable, for terms and HAS */
+    uint8_t     kind;       /* how the term's value parsed */
+    double      number;     /* the value as a number (or 0/1 for a bool) */
+    const char  *string;    /* the value as a string, without quotes */
+    size_t      string_len;
+};
+
+typedef struct canopy_filter_program {
+    int                     nops;
+    struct canopy_filter_op ops[CANOPY_FILTER_PROGRAM_MAX_OPS];
+    int                     nslots;
+    const char              *slots[CANOPY_FILTER_PROGRAM_MAX_VARS];
+} canopy_filter_program_t;
+
+/*
+ * Compiles the filter in <root> into <program>.  An empty filter matches
+ * every device.  Returns CANOPY_ERROR_BAD_PARAM if the filter doesn't make
+ * sense, or CANOPY_ERROR_BUFFER_TOO_SMALL if it needs more than
+ * CANOPY_FILTER_PROGRAM_MAX_OPS operations or CANOPY_FILTER_PROGRAM_MAX_VARS
+ * distinct variables.
+ */
+extern canopy_error canopy_filter_compile(const canopy_filter_root_t *root,
+        canopy_filter_program_t *program);
+
+/*
+ * Sets <out_match> to whether <device> passes the filter in <program>.  This
+ * is a local operation that does not interact with the remote.
+ */
+extern canopy_error canopy_filter_match(const canopy_filter_program_t *program,
+        struct canopy_device *device,
+        bool *out_match);
+
+/*
+ * Copies the devices among the <count> <devices> that pass the filter in
+ * <program> to <matches>, keeping their order, and sets <out_count> to how
+ * many there were.  <matches> must have room for <count> entries, and may be
+ * <devices> itself.
+ */
+extern canopy_error canopy_filter_select(const canopy_filter_program_t *program,
+        struct canopy_device **devices,
+        size_t count,
+        struct canopy_device **matches,
+        size_t *out_count);
+
 
 /*****************************************************************************/
 
@@ -718,7 +1074,11 @@ typedef struct canopy_query {
  *
  *      <rcv_buffer> is a pointer to storage that gets used as temporary data
  *      primarily as the buffer used for payload and response
- *      communication.  (http)
+ *      communication.  (http)  Only canopy_remote_http_get() and friends
+ *      use it, so it may be NULL.  The library's own requests put their
+ *      replies in buffers from a pool on the remote, which grow as replies
+ *      arrive (up to params->max_response_size) and are reused once the
+ *      reply's been parsed, so any number of them can be in flight.
  *
  *      <rcv_buffer_size> is the size of the temporary buffer.
  *
@@ -731,6 +1091,45 @@ extern canopy_error canopy_remote_init(canopy_context_t *ctx,
         size_t rcv_buffer_size,
         canopy_remote_t *remote);
 
+/*
+ * Initializes a remote that stands for a group of endpoints, remotes already
+ * set up with canopy_remote_init() that serve the same devices (regional
+ * replicas, say).  A device synced through the group is synced through
+ * whichever endpoint is doing best at the time:
+ *
+ *      - endpoints whose circuit breaker is open come last,
+ *      - then the secondaries, which are only used while the primaries are
+ *        down, or when they fail,
+ *      - then, of the rest, endpoints whose last try failed,
+ *      - and otherwise the one with the lowest smoothed round trip time.
+ *
+ * If a request fails in a way that it could be retried (see retry_attempts),
+ * once the endpoint's own retries are used up it fails over to the next best
+ * endpoint, and so on through all of them.  For quicker failover set the
+ * endpoints' retry_attempts to 1.
+ *
+ *      <ctx> is the context.
+ *
+ *      <primaries> and <secondaries> are the endpoints, <primary_count> (at
+ *      least one) and <secondary_count> of them, CANOPY_MAX_ENDPOINTS at
+ *      most in all.  They must share credentials, and can't be in another
+ *      group.  The group reads its credentials and settings from the first
+ *      primary's params.
+ *
+ *      <group> is a remote object that is initialized by this call, to be
+ *      passed to canopy_device_sync_with_remote() and the like instead of
+ *      any one endpoint.  It has no connections or reply buffers of its own,
+ *      so its connection stats stay empty; the endpoints' have the requests.
+ */
+#define CANOPY_MAX_ENDPOINTS 8
+
+extern canopy_error canopy_remote_group_init(canopy_context_t *ctx,
+        canopy_remote_t **primaries,
+        int primary_count,
+        canopy_remote_t **secondaries,
+        int secondary_count,
+        canopy_remote_t *group);
+
 /*
  * Shutdown a remote object.
  * Closes persistent connection to server, if any.
@@ -764,24 +1163,31 @@ extern canopy_error canopy_get_local_time(canopy_remote_t *remote,
  * <remote> is the remote object used for connecting to the server.
  *
  * <query> contains the constraints that devices must satisfy to be included in
- * the resulting list.
+ * the resulting list.  May be NULL.
  *
  * <max_count> is the maximum number of devices to fetch.
  *
- * <devices> is an array of at least <max_count> device objects that will store
- * the results of this operation.  The library will copy the internal memory
- * holding the device into the array provided.  It's up to the client to
- * manage its own memory for these
+ * <devices> is an array of at least <max_count> pointers to device objects
+ * that will store the results of this operation.  Each one that's used is
+ * initialized by the library.  It's up to the client to manage its own memory
+ * for these.
+ *
+ * <out_count> is set to the number of devices stored in <devices>.
  *
  * <barrier> will store a new barrier object that can be used to obtain the
  * result when it is ready.  If NULL, this operation will block the current
  * thread.
  *
+ * One call fetches one page: up to <max_count> devices (fewer if
+ * <query->limits.count> is smaller) starting at <query->limits.start>.  To
+ * walk a large list in bounded memory, advance <limits.start> by <out_count>
+ * and call again until fewer devices than asked for come back.
  */
 extern canopy_error canopy_remote_get_devices(canopy_remote_t *remote,
         struct canopy_query *query,
         size_t max_count, 
         struct canopy_device **devices,
+        size_t *out_count,
         struct canopy_barrier *barrier);
 
 /******************************************************************************
@@ -831,6 +1237,13 @@ extern canopy_error canopy_get_self_user(canopy_remote_t *remote,
 #define CANOPY_DEVICE_ID_MAX_LENGTH 36
 #define CANOPY_SECRET_KEY_LENGTH    128
 
+/*
+ * Called when the remote changes the value of an IN or INOUT variable; see
+ * canopy_var_on_change().
+ */
+struct canopy_var;
+typedef void (*canopy_var_callback_t)(struct canopy_var *var, void *userdata);
+
 /*
  * canopy_device:
  *         represents a device known locally or to a remote
@@ -838,7 +1251,7 @@ extern canopy_error canopy_get_self_user(canopy_remote_t *remote,
  */
 typedef struct canopy_device {
     struct canopy_device    *next;        /* hung off of User or remote */
-    char                    device_id[CANOPY_DEVICE_ID_MAX_LENGTH];
+    char                    device_id[CANOPY_DEVICE_ID_MAX_LENGTH + 1];
     char                    secret_key[CANOPY_SECRET_KEY_LENGTH];
     char                    friendly_name[CANOPY_FRIENDLY_NAME_MAX_LENGTH];
     bool                    friendly_name_dirty;
@@ -851,6 +1264,19 @@ typedef struct canopy_device {
 #else
     struct canopy_var       *vars;        /* list of vars on this device */
 #endif
+    struct canopy_var       *class_vars;  /* see canopy_device_instantiate() */
+    int                     class_var_count;
+    struct c_json_var_decls *json_var_decls; /* "var_decls" as last sent */
+    struct c_json_vars_template *json_vars; /* names of "vars", rendered */
+    canopy_var_callback_t   on_var_change;
+    void                    *on_var_change_userdata;
+    struct canopy_device    *scheduled_next; /* on remote->scheduled */
+    bool                    scheduled;
+    bool                    in_changed;  /* since the scheduler last looked */
+    bool                    sched_syncing; /* in the scheduler's round */
+    bool                    sync_in_flight; /* under remote->sync_lock */
+    struct c_sync_waiter    *sync_waiters;  /* for the next one */
+    struct c_sync_waiter    *sync_riders;   /* on the one in flight */
 } canopy_device_t;
 
 /*
@@ -934,6 +1360,13 @@ extern canopy_error canopy_device_update_from_remote   (
  *
  *  <device> must point to an initialized canopy_device_t object (for example,
  *  obtained from canopy_get_self_device()).
+ *
+ *  If a request for <device> is already in flight (from another thread, or
+ *  the scheduler), this waits for it, and then all the calls that turned up
+ *  meanwhile share one follow-up request carrying all their changes.  That
+ *  request is a sync if any of them was canopy_device_sync_with_remote().
+ *  A call whose <barrier> runs out (see canopy_barrier_init()) stops waiting
+ *  even if the request it's riding on is still going.
  */
 extern canopy_error canopy_device_update_to_remote (
         canopy_remote_t *remote,
@@ -950,12 +1383,30 @@ extern canopy_error canopy_device_update_to_remote (
  *
  *  <device> must point to an initialized canopy_device_t object (for example,
  *  obtained from canopy_get_self_device()).
+ *
+ *  Concurrent calls for one device are coalesced, as for
+ *  canopy_device_update_to_remote().
  */
 extern canopy_error canopy_device_sync_with_remote (
         canopy_remote_t *remote,
         canopy_device_t *device, 
         canopy_barrier_t *barrier);
 
+/*
+ * Has the context's scheduler sync <device> with its remote, or stop doing
+ * so.  See canopy_ctx_start_scheduler().  A device may be scheduled before
+ * the scheduler is started, and must be unscheduled before its remote is
+ * shut down.
+ *
+ * Unscheduling waits for a round of syncs that the device is in, after which
+ * the device may be freed.  From a change callback of that round it can't
+ * wait: the device is left out of the rest of the round, but stays in use
+ * until the round is over, so a callback must not free its device.
+ * Unscheduling it again from another thread waits for the round.
+ */
+extern canopy_error canopy_device_schedule_sync(canopy_device_t *device);
+extern canopy_error canopy_device_unschedule_sync(canopy_device_t *device);
+
 /*
  * Get the active status for a device.
  */
@@ -967,18 +1418,36 @@ extern canopy_error canopy_device_get_active_status (
 /*****************************************************************************/
 // USERS
 
+#define CANOPY_USERNAME_MAX_LENGTH  128
+#define CANOPY_EMAIL_MAX_LENGTH     256
+#define CANOPY_PASSWORD_MAX_LENGTH  128
+
 /*
- * TODO:  This needs some thought about who supplies the memory for the device
- * list.
+ * canopy_user:
+ *         represents a user account known to a remote
+ *
+ * All of the storage is in the structure itself, so a user can be fetched
+ * and synced over and over without any allocation.  A password change is
+ * held (as <old_password> and <new_password>) only until it has been sent.
  */
-
 typedef struct canopy_user {
     struct canopy_user *next;
     canopy_remote_t *remote;
-    bool is_activated;
-    char *name;
+    bool is_activated;      // the user has validated their email
+    char name[CANOPY_USERNAME_MAX_LENGTH];
+    char email[CANOPY_EMAIL_MAX_LENGTH];
+    bool email_dirty;
+    char old_password[CANOPY_PASSWORD_MAX_LENGTH];
+    char new_password[CANOPY_PASSWORD_MAX_LENGTH];
+    bool password_dirty;
 } canopy_user_t;
 
+/*
+ * Initializes <user> as an empty user of <remote>.
+ */
+extern canopy_error canopy_user_init(canopy_user_t *user,
+        canopy_remote_t *remote);
+
 // Goes to remote
 extern canopy_error canopy_create_user(canopy_remote_t *remote,
         const char *username,
@@ -988,17 +1457,25 @@ extern canopy_error canopy_create_user(canopy_remote_t *remote,
         canopy_user_t *out_user,
         canopy_barrier_t *barrier);
 
-// Goes to remote
+/*
+ * Goes to remote.  Creates <quantity> devices, named from <names> if it's not
+ * NULL, into <out_devices>, which are initialized with their IDs, names and
+ * secret keys.  Large quantities are created a batch at a time, so if one
+ * fails the batches before it have already been created: <out_count> is set
+ * to the number of devices at the front of <out_devices> that exist on the
+ * remote, whatever's returned.  A retry should start after them.
+ */
 extern canopy_error canopy_user_create_devices(canopy_user_t *user,
         uint32_t quantity,
         char **names,
         canopy_device_t **out_devices,
+        uint32_t *out_count,
         canopy_barrier_t *barrier);
 
 /*
  * Obtained from local copy of the user.  To fetch latest data from the remote
  * be sure to call canopy_user_update_from_remote() or
- * canopy_user_sync_with_remote().
+ * canopy_user_sync_with_remote().  The strings returned point into <user>.
  */
 extern canopy_error canopy_user_get_email(canopy_user_t *user, char **email);
 extern canopy_error canopy_user_get_username(canopy_user_t *user, char **username);
@@ -1060,11 +1537,16 @@ extern canopy_error canopy_user_sync_with_remote(
  *      
  *      WWW-Authentication: BASIC <remote.name>:<remote.password>
  *      GET /api/device/<device.uuid>/devices?sort=<query.sort>&filter=<query.filter>&limit=<query.limit>
+ *
+ *  Results are returned a page at a time, as for canopy_remote_get_devices().
  */
 extern canopy_error canopy_device_devices(
         canopy_remote_t *remote, 
         canopy_device_t *device, 
         canopy_query_t *query,
+        size_t max_count,
+        canopy_device_t **devices,
+        size_t *out_count,
         canopy_barrier_t *barrier);
 
 /*
@@ -1078,11 +1560,18 @@ extern canopy_error canopy_device_users(
 
 /*
  * Get list of devices a user has access to based on a query.
+ *
+ *      GET /api/user/<user.name>/devices?sort=<query.sort>&filter=<query.filter>&limit=<query.limit>
+ *
+ *  Results are returned a page at a time, as for canopy_remote_get_devices().
  */
 extern canopy_error canopy_user_devices(
         canopy_remote_t *remote, 
         canopy_user_t *user, 
         canopy_query_t *query,
+        size_t max_count,
+        canopy_device_t **devices,
+        size_t *out_count,
         canopy_barrier_t *barrier);
 
 /*
@@ -1121,10 +1610,9 @@ inline static const char *canopy_var_direction_string(canopy_var_direction dir)
 }
 inline static canopy_var_direction direction_from_string(const char* str, int len) {
     int i;
-    for (i = 0; i < sizeof(canopy_var_direction_table); i++) {
-        int tl = sizeof(canopy_var_direction_table[i].str);
-        int small = LOCAL_MIN(len, tl);
-        if (strncmp(str, canopy_var_direction_table[i].str, small) == 0) {
+    for (i = 0; i < sizeof(canopy_var_direction_table) /
+            sizeof(canopy_var_direction_table[0]); i++) {
+        if (strncmp(str, canopy_var_direction_table[i].str, len) == 0) {
             return canopy_var_direction_table[i].dir;
         }
     }
@@ -1179,10 +1667,9 @@ inline static const char *canopy_var_datatype_string(canopy_var_datatype type) {
 }
 inline static canopy_var_datatype datatype_from_string(const char* str, int len) {
     int i;
-    for (i = 0; i < sizeof(canopy_var_datatype_table); i++) {
-        int tl = sizeof(canopy_var_datatype_table[i].str);
-        int small = LOCAL_MIN(len, tl);
-        if (strncmp(str, canopy_var_datatype_table[i].str, small) == 0) {
+    for (i = 0; i < sizeof(canopy_var_datatype_table) /
+            sizeof(canopy_var_datatype_table[0]); i++) {
+        if (strncmp(str, canopy_var_datatype_table[i].str, len) == 0) {
             return canopy_var_datatype_table[i].type;
         }
     }
@@ -1213,19 +1700,45 @@ struct canopy_var_value {
 typedef struct canopy_var_value canopy_var_value_t;
 
 #define CANOPY_VAR_NAME_MAX_LENGTH 128
+
+/*
+ * The longest "<direction> <datatype> <name>" declaration.
+ */
+#define CANOPY_VAR_DECL_MAX_LENGTH (CANOPY_VAR_NAME_MAX_LENGTH + 16)
+
+/*
+ * A variable's declaration, kept as it is sent in "var_decls".  Devices of
+ * the same model share one set of declarations through a device class; a
+ * variable declared on its own device has its own.
+ */
+struct canopy_var_decl {
+    canopy_var_direction    direction;
+    canopy_var_datatype     type;
+    uint8_t                 name_offset;  /* where the name starts in decl */
+    char                    decl[CANOPY_VAR_DECL_MAX_LENGTH];
+};
+
 struct canopy_var {
     struct canopy_var       *next;    /* linked list of variables, hung off device */
     struct canopy_device    *device;
-    canopy_var_direction    direction;
-    canopy_var_datatype     type;     /* duplicate of type in the value */
-    char name[CANOPY_VAR_NAME_MAX_LENGTH];
-    bool                    set;      /* This variable has been set */
-    bool                    dirty;    /* Variable needs to be sent to remote */
+    const struct canopy_var_decl *decl; /* name, direction and type */
     cos_time_t              last;     /* when was it changed with remote */
     struct canopy_var_value val;      /* yes, not a pointer, real storage */
+    canopy_var_callback_t   on_change;
+    void                    *on_change_userdata;
+    struct canopy_var_report *report; /* see canopy_var_set_policy(), or NULL */
+    canopy_var_datatype     type;     /* duplicate of type in the decl */
+    bool                    set;      /* This variable has been set */
+    bool                    dirty;    /* Variable needs to be sent to remote */
+    bool                    pending;  /* changed, but reported too recently */
+    bool                    in_flight; /* sent, the remote hasn't answered */
 };
 // typedef struct canopy_var canopy_var_t;
 
+inline static const char *canopy_var_name(const struct canopy_var *var) {
+    return &var->decl->decl[var->decl->name_offset];
+}
+
 /*****************************************************************************
  *
  * Creates the variable defined and attaches it to the device.
@@ -1239,6 +1752,9 @@ struct canopy_var {
  *
  *     This will return CANOPY_ERROR_VAR_IN_USE if the variable already exists
  *
+ *     Don't declare variables of a device while a sync of it is in flight:
+ *     the payload being sent points into what the device had rendered of
+ *     its variables, which declaring one drops.
  */
 canopy_error canopy_device_var_declare(canopy_device_t *device,
         canopy_var_direction direction,
@@ -1246,6 +1762,78 @@ canopy_error canopy_device_var_declare(canopy_device_t *device,
         const char *name,
         struct canopy_var **out_var);
 
+/*****************************************************************************
+ * Device classes.
+ *
+ * A gateway with hundreds of devices of the same model can declare the
+ * model's variables once, in a class, instead of once per device:
+ *
+ *     struct canopy_var_decl decls[40];
+ *     canopy_device_class_t thermostat;
+ *     struct canopy_var vars[NDEVICES][40];
+ *
+ *     canopy_device_class_init(&thermostat, decls, 40);
+ *     canopy_device_class_var_declare(&thermostat, CANOPY_VAR_OUT,
+ *             CANOPY_VAR_DATATYPE_FLOAT32, "temperature", &slot);
+ *     ...
+ *     canopy_device_instantiate(&device[i], &thermostat, vars[i], 40);
+ *     canopy_var_set_float32(canopy_device_var_at(&device[i], slot), 21.5);
+ *
+ * What's shared is the declarations: the names, directions, types and the
+ * "var_decls" text sent to the remote, which a variable declared on its own
+ * keeps in an allocation of its own, next to it.  What each device has of
+ * the class is a struct canopy_var per slot, in storage the caller provides
+ * and with nothing allocated for it: the value, which is most of it, its
+ * time and dirty state, and a few pointers.  A reporting policy's state is
+ * only allocated for the variables given one.  The class must not be changed
+ * once devices have been made from it.
+ */
+typedef struct canopy_device_class {
+    struct canopy_var_decl  *decls;       /* indexed by slot */
+    int                     count;        /* slots declared */
+    int                     max_count;    /* slots in decls */
+} canopy_device_class_t;
+
+/*
+ * Initializes <cls> to declare up to <max_count> variables into <decls>.
+ */
+canopy_error canopy_device_class_init(canopy_device_class_t *cls,
+        struct canopy_var_decl *decls,
+        int max_count);
+
+/*
+ * Declares a variable of the class.  <out_slot> is set to its slot, the
+ * index of its value in every device made from the class.  Returns
+ * CANOPY_ERROR_VAR_IN_USE if the name is already declared and
+ * CANOPY_ERROR_BUFFER_TOO_SMALL if the class is full.
+ */
+canopy_error canopy_device_class_var_declare(canopy_device_class_t *cls,
+        canopy_var_direction direction,
+        canopy_var_datatype type,
+        const char *name,
+        int *out_slot);
+
+/*
+ * Gives <device> the class's variables, using the <count> entries of <vars>
+ * (at least cls->count) for their values.  <vars> must outlive the device.
+ * Variables may still be declared on the device on their own afterwards.
+ */
+canopy_error canopy_device_instantiate(canopy_device_t *device,
+        const canopy_device_class_t *cls,
+        struct canopy_var *vars,
+        int count);
+
+/*
+ * Returns the variable in <slot> of the device's class, or NULL.
+ */
+inline static struct canopy_var *canopy_device_var_at(
+        canopy_device_t *device, int slot) {
+    if (slot < 0 || slot >= device->class_var_count) {
+        return NULL;
+    }
+    return &device->class_vars[slot];
+}
+
 /****************************************************************************
  * Looks up a variable by looking on the device.  If the variable does not
  * exist, this call will return CANOPY_ERROR_VAR_NOT_FOUND.
@@ -1253,6 +1841,9 @@ canopy_error canopy_device_var_declare(canopy_device_t *device,
  * <device>        the device
  * <var_name>    the name of the variable to look up
  * <var>        is a pointer to storage that the variable will be copied into
+ *
+ * The copy is a snapshot.  To follow a variable, look it up once with
+ * canopy_device_var_handle() instead.
  */
 canopy_error canopy_device_get_var_by_name(canopy_device_t *device, 
         const char *var_name, 
@@ -1304,6 +1895,155 @@ canopy_error canopy_var_get_string(struct canopy_var *var,
         char *buf, size_t len,    /* buf is null terminated */
         cos_time_t *last_time);
 
+/*****************************************************************************
+ * Variable handles.
+ *
+ * The struct canopy_var * returned by canopy_device_var_declare(),
+ * canopy_device_var_at() or canopy_device_var_handle() is the variable
+ * itself, and stays valid as long as its device does.  Keeping it saves the
+ * name lookup, and the typed accessors below work directly on the stored
+ * value, with no copy and no checks:
+ *
+ *     struct canopy_var *temp, *reboot;
+ *     canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+ *             CANOPY_VAR_DATATYPE_FLOAT32, "temperature", &temp);
+ *     canopy_device_var_declare(&device, CANOPY_VAR_IN,
+ *             CANOPY_VAR_DATATYPE_BOOL, "reboot_now", &reboot);
+ *     for (;;) {
+ *         canopy_var_put_float32(temp, read_sensor());
+ *         if (canopy_var_is_set(reboot) && canopy_var_bool(reboot)) {
+ *             ...
+ *         }
+ *     }
+ *
+ * Only the accessors for the variable's declared datatype may be used.  The
+ * canopy_var_get_*() and canopy_var_set_*() calls check it.
+ */
+
+/*
+ * Looks up the variable <var_name> of <device>, without copying it.
+ * Returns CANOPY_ERROR_VAR_NOT_FOUND if there's no such variable.
+ */
+canopy_error canopy_device_var_handle(canopy_device_t *device,
+        const char *var_name,
+        struct canopy_var **var);
+
+/*
+ * Marks <var> as changed locally, to be sent on the next sync if its
+ * reporting policy allows.  The canopy_var_put_*() accessors call this after
+ * storing the value.  It's cheap: it wakes the scheduler only when <var>
+ * first becomes dirty, and cached query results are only dropped once the
+ * change has been synced.
+ */
+void canopy_var_changed(struct canopy_var *var);
+
+inline static bool canopy_var_is_set(const struct canopy_var *var) {
+    return var->set;
+}
+
+/*
+ * canopy_var_<type>(var) returns the value, canopy_var_put_<type>(var,
+ * value) stores one.
+ */
+#define CANOPY_VAR_ACCESSORS(suffix, ctype, member, datatype) \
+    inline static ctype canopy_var_##suffix(const struct canopy_var *var) { \
+        COS_ASSERT(var->type == datatype); \
+        return var->val.value.member; \
+    } \
+    inline static void canopy_var_put_##suffix(struct canopy_var *var, \
+            ctype value) { \
+        COS_ASSERT(var->type == datatype); \
+        var->val.value.member = value; \
+        canopy_var_changed(var); \
+    }
+
+CANOPY_VAR_ACCESSORS(bool, bool, val_bool, CANOPY_VAR_DATATYPE_BOOL)
+CANOPY_VAR_ACCESSORS(int8, int8_t, val_int8, CANOPY_VAR_DATATYPE_INT8)
+CANOPY_VAR_ACCESSORS(int16, int16_t, val_int16, CANOPY_VAR_DATATYPE_INT16)
+CANOPY_VAR_ACCESSORS(int32, int32_t, val_int32, CANOPY_VAR_DATATYPE_INT32)
+CANOPY_VAR_ACCESSORS(uint8, uint8_t, val_uint8, CANOPY_VAR_DATATYPE_UINT8)
+CANOPY_VAR_ACCESSORS(uint16, uint16_t, val_uint16, CANOPY_VAR_DATATYPE_UINT16)
+CANOPY_VAR_ACCESSORS(uint32, uint32_t, val_uint32, CANOPY_VAR_DATATYPE_UINT32)
+CANOPY_VAR_ACCESSORS(float32, float, val_float, CANOPY_VAR_DATATYPE_FLOAT32)
+CANOPY_VAR_ACCESSORS(float64, double, val_double, CANOPY_VAR_DATATYPE_FLOAT64)
+CANOPY_VAR_ACCESSORS(datetime, cos_time_t, val_time,
+        CANOPY_VAR_DATATYPE_DATETIME)
+
+/*
+ * Strings are returned in place, and stored with canopy_var_set_string().
+ */
+inline static const char *canopy_var_string(const struct canopy_var *var) {
+    COS_ASSERT(var->type == CANOPY_VAR_DATATYPE_STRING);
+    return var->val.value.val_string;
+}
+
+/*****************************************************************************
+ * Change notification.
+ *
+ * Rather than polling every IN variable after a sync, an application can
+ * register a callback for a variable, or for all of a device's variables.
+ * It is called while the remote's response is parsed, once for each IN or
+ * INOUT variable whose time ("t") is newer than the one last seen and whose
+ * value is different, so the remote echoing a value back wakes nothing.  A
+ * value from the remote that's no newer than the one held isn't stored at
+ * all.  Other variables of the response may not have been updated yet.  The
+ * variable's own callback is called first, then the device's.
+ *
+ * Pass a NULL <callback> to stop being notified.
+ */
+canopy_error canopy_var_on_change(struct canopy_var *var,
+        canopy_var_callback_t callback,
+        void *userdata);
+canopy_error canopy_device_on_var_change(canopy_device_t *device,
+        canopy_var_callback_t callback,
+        void *userdata);
+
+/*****************************************************************************
+ * Reporting policy.
+ *
+ * By default every local set marks a variable to be sent on the next sync,
+ * even if the value hasn't changed.  A noisy sensor can be given a policy
+ * so that only changes that matter are sent.  A new value is a change if it
+ * differs from the one last sent by more than <deadband>, and by more than
+ * <deadband_pct> percent of it; a deadband of 0 is not applied.  Deadbands
+ * apply to numbers and datetimes; bools and strings change when they differ.
+ *
+ * A change is held back until <min_interval> ms have passed since the last
+ * report.  A value only counts as reported once the remote has accepted the
+ * request it went in; if that fails, it's sent again with the next sync.
+ * Once <heartbeat> ms have passed, the variable is sent whether it changed
+ * or not; 0 means no heartbeat.  The policy is applied when the variable is
+ * set and again by every sync of its device, and the scheduler wakes for a
+ * held back change or a heartbeat when its time comes, so neither waits for
+ * the next set.
+ *
+ * One policy may be shared by many variables, and must stay valid while they
+ * use it.  Pass NULL to go back to sending every set.
+ */
+struct canopy_var_policy {
+    double      deadband;       /* absolute change needed */
+    double      deadband_pct;   /* change needed, percent of the last value */
+    cos_time_t  min_interval;   /* ms, shortest time between reports */
+    cos_time_t  heartbeat;      /* ms, longest time between reports */
+};
+
+/*
+ * What a variable with a policy keeps of its reports, allocated when it's
+ * first given one and freed when it's given NULL.
+ */
+struct canopy_var_report {
+    const struct canopy_var_policy *policy;
+    double                  reported; /* the number last sent to the remote */
+    cos_time_t              reported_at; /* when it was sent, 0 for never */
+    double                  sent;     /* the number in flight */
+    char                    strings[]; /* a string variable's reported value,
+                                        * then the one in flight, each
+                                        * CANOPY_VAR_VALUE_MAX_LENGTH long */
+};
+
+canopy_error canopy_var_set_policy(struct canopy_var *var,
+        const struct canopy_var_policy *policy);
+
 #ifdef __cplusplus
 }
 #endif
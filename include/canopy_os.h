@@ -76,14 +76,50 @@ void cos_log(int level, const char *msg, ...);
 char * cos_strdup(const char *src);
 
 /*
- * Get the canopy time.  cos_time_t is a count of milli-seconds since
+ * Get the canopy time.  cos_time_t is a 64-bit count of milli-seconds since
  * some point in time.  There's no intention that this represents the wall
- * clock time.  (While this starts outs as seconds since epoch, we turn
- * seconds into milli-seconts by multiplying it with 1000.)
+ * clock time: it should come from a clock that only moves forward, so
+ * deadlines and intervals measured with it survive the wall clock being set.
  */
 typedef unsigned long long cos_time_t;
 int cos_get_time(cos_time_t *time);
 
+/*
+ * Blocks the calling thread for <ms> milli-seconds.
+ */
+void cos_sleep(cos_time_t ms);
+
+/*
+ * Threads, locks and events.  Only the background scheduler (see
+ * canopy_ctx_start_scheduler()) and the coalescing of concurrent syncs of a
+ * device use these, so a port that needs neither may leave them returning
+ * NULL.
+ *
+ * A thread may lock a mutex again while it holds it.
+ *
+ * An event is signalled by one thread to wake another that waits on it.  A
+ * signal with no one waiting is kept until the next wait.
+ * cos_event_wait() waits at most <timeout> ms, and returns 1 if it was
+ * signalled, 0 if it timed out.
+ */
+typedef struct cos_mutex cos_mutex_t;
+cos_mutex_t * cos_mutex_create(void);
+void cos_mutex_destroy(cos_mutex_t *mutex);
+void cos_mutex_lock(cos_mutex_t *mutex);
+void cos_mutex_unlock(cos_mutex_t *mutex);
+
+typedef struct cos_event cos_event_t;
+cos_event_t * cos_event_create(void);
+void cos_event_destroy(cos_event_t *event);
+void cos_event_signal(cos_event_t *event);
+int cos_event_wait(cos_event_t *event, cos_time_t timeout);
+
+typedef struct cos_thread cos_thread_t;
+cos_thread_t * cos_thread_start(void (*func)(void *arg), void *arg);
+void cos_thread_join(cos_thread_t *thread);
+/* returns 1 if the caller is <thread>, 0 if not */
+int cos_thread_is_current(cos_thread_t *thread);
+
 
 #ifdef __cplusplus
 }
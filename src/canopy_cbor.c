@@ -0,0 +1,527 @@
+// Copyright 2015 Canopy Services, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include	<stdint.h>
+#include	<stdbool.h>
+#include	<string.h>
+
+#include	<canopy_min_internal.h>
+#include	<canopy_min.h>
+#include	<canopy_os.h>
+
+/*
+ * Minimal CBOR (RFC 7049) encoder and decoder.
+ *
+ * Only what the /api/device/self exchange needs is supported: unsigned and
+ * negative integers, text strings, maps, booleans, null and floats.  Byte
+ * strings, arrays and tags are skipped by the decoder.  Indefinite length
+ * maps and arrays are supported, indefinite length strings are not.
+ */
+
+#define CBOR_MAJOR_UINT     0
+#define CBOR_MAJOR_NINT     1
+#define CBOR_MAJOR_BYTES    2
+#define CBOR_MAJOR_TEXT     3
+#define CBOR_MAJOR_ARRAY    4
+#define CBOR_MAJOR_MAP      5
+#define CBOR_MAJOR_TAG      6
+#define CBOR_MAJOR_SIMPLE   7
+
+#define CBOR_INDEFINITE     31
+#define CBOR_FALSE          0xf4
+#define CBOR_TRUE           0xf5
+#define CBOR_NULL           0xf6
+#define CBOR_FLOAT16        0xf9
+#define CBOR_FLOAT32        0xfa
+#define CBOR_FLOAT64        0xfb
+#define CBOR_BREAK          0xff
+
+/*****************************************************************************/
+
+/*		static definitions go here */
+
+/*****************************************************************************/
+
+/******************************************************************************
+ *	Appends <len> raw bytes.
+ */
+static int emit_bytes(struct c_cbor_state *state, const void *bytes, int len) {
+	if (state->offset + len > state->buffer_len && state->grows) {
+		int size = state->buffer_len * 2;
+		uint8_t *buffer;
+
+		if (size < state->offset + len) {
+			size = state->offset + len;
+		}
+		buffer = (uint8_t*)cos_alloc(size);
+		if (buffer != NULL) {
+			memcpy(buffer, state->buffer, state->offset);
+			cos_free(state->buffer);
+			state->buffer = buffer;
+			state->buffer_len = size;
+		}
+	}
+	if (state->offset + len > state->buffer_len) {
+		cos_log(LOG_LEVEL_DEBUG, "buffer out of space emit_bytes()");
+		return C_CBOR_BUFFER_OVERFLOW;
+	}
+	memcpy(&state->buffer[state->offset], bytes, len);
+	state->offset += len;
+	return C_CBOR_OK;
+}
+
+/******************************************************************************
+ *	Appends an initial byte and argument using the shortest encoding.
+ */
+static int emit_head(struct c_cbor_state *state, int major, uint64_t value) {
+	uint8_t head[9];
+	int len;
+
+	if (value < 24) {
+		head[0] = (major << 5) | (uint8_t)value;
+		len = 1;
+	} else if (value <= 0xff) {
+		head[0] = (major << 5) | 24;
+		head[1] = (uint8_t)value;
+		len = 2;
+	} else if (value <= 0xffff) {
+		head[0] = (major << 5) | 25;
+		head[1] = (uint8_t)(value >> 8);
+		head[2] = (uint8_t)value;
+		len = 3;
+	} else if (value <= 0xffffffffULL) {
+		head[0] = (major << 5) | 26;
+		head[1] = (uint8_t)(value >> 24);
+		head[2] = (uint8_t)(value >> 16);
+		head[3] = (uint8_t)(value >> 8);
+		head[4] = (uint8_t)value;
+		len = 5;
+	} else {
+		int i;
+		head[0] = (major << 5) | 27;
+		for (i = 0; i < 8; i++) {
+			head[1 + i] = (uint8_t)(value >> (56 - 8 * i));
+		}
+		len = 9;
+	}
+	return emit_bytes(state, head, len);
+}
+
+/*******************************************************
+ * Initialize the buffer to use to build a CBOR item
+ */
+int c_cbor_buffer_init(struct c_cbor_state *state, uint8_t *buffer, int len) {
+	memset(state, 0, sizeof(struct c_cbor_state));
+	state->buffer = buffer;
+	state->buffer_len = len;
+	state->offset = 0;
+	return C_CBOR_OK;
+}
+
+/*******************************************************
+ * Allocate a buffer, that grows as needed, to build a CBOR item in
+ */
+int c_cbor_buffer_alloc(struct c_cbor_state *state, int len) {
+	uint8_t *buffer = (uint8_t*)cos_alloc(len);
+
+	if (buffer == NULL) {
+		return C_CBOR_BUFFER_OVERFLOW;
+	}
+	c_cbor_buffer_init(state, buffer, len);
+	state->grows = true;
+	return C_CBOR_OK;
+}
+
+/******************************************************************************
+ * Emits a map header for <count> pairs, or an indefinite length map if
+ * <count> is negative.  Indefinite maps must be closed with
+ * c_cbor_emit_break().
+ */
+int c_cbor_emit_map(struct c_cbor_state *state, int count) {
+	uint8_t b;
+	if (count < 0) {
+		b = (CBOR_MAJOR_MAP << 5) | CBOR_INDEFINITE;
+		return emit_bytes(state, &b, 1);
+	}
+	return emit_head(state, CBOR_MAJOR_MAP, count);
+}
+
+/******************************************************************************
+ * Emits the "break" that closes an indefinite length map.
+ */
+int c_cbor_emit_break(struct c_cbor_state *state) {
+	uint8_t b = CBOR_BREAK;
+	return emit_bytes(state, &b, 1);
+}
+
+/******************************************************************************
+ * Emits a text string.  If <len> is negative, strlen(str) is used.
+ */
+int c_cbor_emit_string(struct c_cbor_state *state, const char *str, int len) {
+	int err;
+	if (len < 0) {
+		len = strlen(str);
+	}
+	err = emit_head(state, CBOR_MAJOR_TEXT, len);
+	if (err != C_CBOR_OK) {
+		return err;
+	}
+	return emit_bytes(state, str, len);
+}
+
+/******************************************************************************
+ * Emits an unsigned integer.
+ */
+int c_cbor_emit_uint(struct c_cbor_state *state, uint64_t value) {
+	return emit_head(state, CBOR_MAJOR_UINT, value);
+}
+
+/******************************************************************************
+ * Emits a signed integer.
+ */
+int c_cbor_emit_int(struct c_cbor_state *state, int64_t value) {
+	if (value < 0) {
+		return emit_head(state, CBOR_MAJOR_NINT, (uint64_t)(-1 - value));
+	}
+	return emit_head(state, CBOR_MAJOR_UINT, (uint64_t)value);
+}
+
+/******************************************************************************
+ * Emits true or false.
+ */
+int c_cbor_emit_bool(struct c_cbor_state *state, bool value) {
+	uint8_t b = value ? CBOR_TRUE : CBOR_FALSE;
+	return emit_bytes(state, &b, 1);
+}
+
+/******************************************************************************
+ * Emits a single precision float.
+ */
+int c_cbor_emit_float32(struct c_cbor_state *state, float value) {
+	uint8_t b[5];
+	uint32_t bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	b[0] = CBOR_FLOAT32;
+	b[1] = (uint8_t)(bits >> 24);
+	b[2] = (uint8_t)(bits >> 16);
+	b[3] = (uint8_t)(bits >> 8);
+	b[4] = (uint8_t)bits;
+	return emit_bytes(state, b, sizeof(b));
+}
+
+/******************************************************************************
+ * Emits a double precision float.
+ */
+int c_cbor_emit_float64(struct c_cbor_state *state, double value) {
+	uint8_t b[9];
+	uint64_t bits;
+	int i;
+
+	memcpy(&bits, &value, sizeof(bits));
+	b[0] = CBOR_FLOAT64;
+	for (i = 0; i < 8; i++) {
+		b[1 + i] = (uint8_t)(bits >> (56 - 8 * i));
+	}
+	return emit_bytes(state, b, sizeof(b));
+}
+
+
+/******************************************************************************
+ * Decoding
+ */
+int c_cbor_reader_init(struct c_cbor_reader *reader, const uint8_t *buffer,
+		int len) {
+	memset(reader, 0, sizeof(struct c_cbor_reader));
+	reader->buffer = buffer;
+	reader->buffer_len = len;
+	reader->offset = 0;
+	return C_CBOR_OK;
+}
+
+/******************************************************************************
+ *	Reads a big-endian argument of <len> bytes.
+ */
+static int read_be(struct c_cbor_reader *reader, int len, uint64_t *value) {
+	int i;
+	if (reader->offset + len > reader->buffer_len) {
+		return C_CBOR_PARSE_ERROR;
+	}
+	*value = 0;
+	for (i = 0; i < len; i++) {
+		*value = (*value << 8) | reader->buffer[reader->offset++];
+	}
+	return C_CBOR_OK;
+}
+
+/******************************************************************************
+ *	Converts an IEEE 754 half precision float.
+ */
+static double half_to_double(uint16_t half) {
+	int exp = (half >> 10) & 0x1f;
+	int mant = half & 0x3ff;
+	double val;
+
+	if (exp == 0) {
+		val = mant * (1.0 / (1 << 24));
+	} else if (exp != 31) {
+		val = (mant + 1024) * ((exp >= 25) ? (double)(1 << (exp - 25))
+				: 1.0 / (1 << (25 - exp)));
+	} else {
+		val = (mant == 0) ? __builtin_inf() : __builtin_nan("");
+	}
+	return (half & 0x8000) ? -val : val;
+}
+
+/******************************************************************************
+ * Reads the next item head into <item>.  For strings, <item->str> points at
+ * the (unterminated) contents, which are consumed.  For maps and arrays the
+ * contents are not consumed; iterate them with c_cbor_more() or skip them
+ * with c_cbor_skip().
+ */
+int c_cbor_read(struct c_cbor_reader *reader, struct c_cbor_item *item) {
+	uint8_t ib;
+	int major;
+	int info;
+	uint64_t arg = 0;
+
+	memset(item, 0, sizeof(struct c_cbor_item));
+	if (reader->offset >= reader->buffer_len) {
+		return C_CBOR_PARSE_ERROR;
+	}
+	ib = reader->buffer[reader->offset++];
+	major = ib >> 5;
+	info = ib & 0x1f;
+
+	if (major == CBOR_MAJOR_SIMPLE) {
+		switch (ib) {
+		case CBOR_FALSE:
+		case CBOR_TRUE:
+			item->type = C_CBOR_BOOL;
+			item->boolean = (ib == CBOR_TRUE);
+			return C_CBOR_OK;
+		case CBOR_NULL:
+			item->type = C_CBOR_NULL;
+			return C_CBOR_OK;
+		case CBOR_FLOAT16:
+			if (read_be(reader, 2, &arg) != C_CBOR_OK) {
+				return C_CBOR_PARSE_ERROR;
+			}
+			item->type = C_CBOR_FLOAT;
+			item->real = half_to_double((uint16_t)arg);
+			return C_CBOR_OK;
+		case CBOR_FLOAT32: {
+			uint32_t bits;
+			float f;
+			if (read_be(reader, 4, &arg) != C_CBOR_OK) {
+				return C_CBOR_PARSE_ERROR;
+			}
+			bits = (uint32_t)arg;
+			memcpy(&f, &bits, sizeof(f));
+			item->type = C_CBOR_FLOAT;
+			item->real = f;
+			return C_CBOR_OK;
+		}
+		case CBOR_FLOAT64:
+			if (read_be(reader, 8, &arg) != C_CBOR_OK) {
+				return C_CBOR_PARSE_ERROR;
+			}
+			item->type = C_CBOR_FLOAT;
+			memcpy(&item->real, &arg, sizeof(item->real));
+			return C_CBOR_OK;
+		case CBOR_BREAK:
+			item->type = C_CBOR_BREAK;
+			return C_CBOR_OK;
+		default:
+			/* other simple values are treated as null */
+			if (info >= 24 && info < 28) {
+				if (read_be(reader, 1 << (info - 24), &arg) != C_CBOR_OK) {
+					return C_CBOR_PARSE_ERROR;
+				}
+			}
+			item->type = C_CBOR_NULL;
+			return C_CBOR_OK;
+		}
+	}
+
+	if (info < 24) {
+		arg = info;
+	} else if (info < 28) {
+		if (read_be(reader, 1 << (info - 24), &arg) != C_CBOR_OK) {
+			return C_CBOR_PARSE_ERROR;
+		}
+	} else if (info == CBOR_INDEFINITE &&
+			(major == CBOR_MAJOR_MAP || major == CBOR_MAJOR_ARRAY)) {
+		item->indefinite = true;
+	} else {
+		cos_log(LOG_LEVEL_DEBUG, "unsupported CBOR initial byte 0x%02x\n", ib);
+		return C_CBOR_PARSE_ERROR;
+	}
+
+	switch (major) {
+	case CBOR_MAJOR_UINT:
+		item->type = C_CBOR_UINT;
+		item->uint = arg;
+		break;
+	case CBOR_MAJOR_NINT:
+		item->type = C_CBOR_INT;
+		item->sint = -1 - (int64_t)arg;
+		break;
+	case CBOR_MAJOR_BYTES:
+	case CBOR_MAJOR_TEXT:
+		if (arg > (uint64_t)(reader->buffer_len - reader->offset)) {
+			return C_CBOR_PARSE_ERROR;
+		}
+		item->type = (major == CBOR_MAJOR_TEXT) ? C_CBOR_TEXT : C_CBOR_BYTES;
+		item->str = (const char*)&reader->buffer[reader->offset];
+		item->str_len = (int)arg;
+		reader->offset += (int)arg;
+		break;
+	case CBOR_MAJOR_ARRAY:
+		item->type = C_CBOR_ARRAY;
+		item->count = arg;
+		break;
+	case CBOR_MAJOR_MAP:
+		item->type = C_CBOR_MAP;
+		item->count = arg;
+		break;
+	case CBOR_MAJOR_TAG:
+		/* tags are transparent, return the tagged item */
+		return c_cbor_read(reader, item);
+	}
+	return C_CBOR_OK;
+}
+
+/******************************************************************************
+ * Returns true if the map or array <container> has an entry at index <i>.
+ * Consumes the closing "break" of indefinite containers.
+ */
+bool c_cbor_more(struct c_cbor_reader *reader, struct c_cbor_item *container,
+		uint64_t i) {
+	if (container->indefinite) {
+		if (reader->offset >= reader->buffer_len) {
+			return false;
+		}
+		if (reader->buffer[reader->offset] == CBOR_BREAK) {
+			reader->offset++;
+			return false;
+		}
+		return true;
+	}
+	return i < container->count;
+}
+
+/******************************************************************************
+ * Skips the contents of <item>, which has already been read.  Scalars have
+ * no contents, so this only does work for maps and arrays.
+ */
+int c_cbor_skip(struct c_cbor_reader *reader, struct c_cbor_item *item) {
+	struct c_cbor_item child;
+	uint64_t i;
+	int per_entry;
+	int j;
+
+	if (item->type != C_CBOR_MAP && item->type != C_CBOR_ARRAY) {
+		return C_CBOR_OK;
+	}
+	per_entry = (item->type == C_CBOR_MAP) ? 2 : 1;
+	for (i = 0; c_cbor_more(reader, item, i); i++) {
+		for (j = 0; j < per_entry; j++) {
+			if (c_cbor_read(reader, &child) != C_CBOR_OK) {
+				return C_CBOR_PARSE_ERROR;
+			}
+			if (child.type == C_CBOR_BREAK) {
+				return C_CBOR_PARSE_ERROR;
+			}
+			if (c_cbor_skip(reader, &child) != C_CBOR_OK) {
+				return C_CBOR_PARSE_ERROR;
+			}
+		}
+	}
+	return C_CBOR_OK;
+}
+
+/******************************************************************************
+ * Returns true if <item> is the text string <str>.
+ */
+bool c_cbor_item_is(struct c_cbor_item *item, const char *str) {
+	int len = strlen(str);
+	return (item->type == C_CBOR_TEXT && item->str_len == len &&
+			memcmp(item->str, str, len) == 0);
+}
+
+/******************************************************************************
+ * Copies the text string <item> into <buf>, truncating and NUL terminating.
+ */
+int c_cbor_item_copy_string(struct c_cbor_item *item, char *buf, int len) {
+	int n;
+	if (item->type != C_CBOR_TEXT || len <= 0) {
+		return C_CBOR_PARSE_ERROR;
+	}
+	n = LOCAL_MIN(item->str_len, len - 1);
+	memcpy(buf, item->str, n);
+	buf[n] = '\0';
+	return C_CBOR_OK;
+}
+
+/******************************************************************************
+ * Stores the item following a property's name into <object>.
+ */
+int c_cbor_parse_property(const struct c_property *property, void *object,
+		struct c_cbor_item *value) {
+	char *member = (char*)object + property->offset;
+
+	if (property->type == C_PROPERTY_STRING) {
+		if (c_cbor_item_copy_string(value, member, property->size)
+				!= C_CBOR_OK) {
+			return C_CBOR_PARSE_ERROR;
+		}
+	} else {
+		if (value->type != C_CBOR_BOOL) {
+			return C_CBOR_PARSE_ERROR;
+		}
+		*(bool*)member = value->boolean;
+	}
+	if (property->dirty != C_PROPERTY_NOT_SENT) {
+		*(bool*)((char*)object + property->dirty) = false;
+	}
+	return C_CBOR_OK;
+}
+
+/******************************************************************************
+ * Emits the tag and value of each property of <object> that is to be sent.
+ */
+int c_cbor_emit_properties(struct c_cbor_state *state,
+		const struct c_property *table, int count, const void *object) {
+	int i;
+	int err;
+
+	for (i = 0; i < count; i++) {
+		const char *member = (const char*)object + table[i].offset;
+		if (table[i].dirty == C_PROPERTY_NOT_SENT
+				|| !*(const bool*)((const char*)object + table[i].dirty)) {
+			continue;
+		}
+		err = c_cbor_emit_string(state, table[i].tag, -1);
+		if (err == C_CBOR_OK) {
+			err = (table[i].type == C_PROPERTY_STRING)
+					? c_cbor_emit_string(state, member, -1)
+					: c_cbor_emit_bool(state, *(const bool*)member);
+		}
+		if (err != C_CBOR_OK) {
+			return err;
+		}
+	}
+	return C_CBOR_OK;
+}
@@ -24,6 +24,136 @@ typedef enum {
     CANOPY_HTTP_DELETE
 } canopy_http_method;
 
+/*
+ * Content types the library speaks.  See canopy_wire_format.
+ */
+#define CANOPY_CONTENT_TYPE_JSON    "application/json"
+#define CANOPY_CONTENT_TYPE_CBOR    "application/cbor"
+
+/*
+ * Sets up the transport state that the remotes of <ctx> share (ctx->comm).
+ * Called by canopy_ctx_init().
+ */
+canopy_error canopy_comm_ctx_init(struct canopy_context *ctx);
+
+/*
+ * Releases what canopy_comm_ctx_init() set up.  Called by
+ * canopy_ctx_shutdown().
+ */
+void canopy_comm_ctx_shutdown(struct canopy_context *ctx);
+
+/*
+ * Sets up the transport state of <remote>, the pool its replies go in and
+ * the pool of connections its requests share.  Called by
+ * canopy_remote_init().
+ */
+canopy_error canopy_comm_remote_init(struct canopy_remote *remote);
+
+/*
+ * Releases what canopy_comm_remote_init() set up.  Called for each remote
+ * by canopy_ctx_shutdown().
+ */
+void canopy_comm_remote_shutdown(struct canopy_remote *remote);
+
+/*
+ * Gets whichever thread is running <remote>'s requests to look at them
+ * again, say because one's been cancelled.  May be called from any thread.
+ */
+void canopy_comm_wakeup(struct canopy_remote *remote);
+
+/*
+ * Fills in <stats> from <remote>'s connection pool.
+ */
+void canopy_comm_connection_stats(struct canopy_remote *remote,
+        struct canopy_connection_stats *stats);
+
+/*
+ * One piece of a payload that's sent as a chain of segments rather than a
+ * single buffer.  The transport reads the segments in order, where they
+ * are, so they must stay put until the request completes.
+ */
+struct canopy_http_segment {
+    const char                  *data;
+    size_t                      len;
+    struct canopy_http_segment  *next;
+};
+
+/*
+ * A request for canopy_remote_http_request().
+ *
+ *     <method>         HTTP method to perform (i.e. GET, POST, DELETE)
+ *     <api>            API endpoint and query params (ex: "/api/info")
+ *     <payload>        Optional payload to deliver, or NULL
+ *     <payload_len>    Length of <payload> in bytes (it may be binary), or
+ *                      the total length of <segments>
+ *     <format>         Encoding of <payload>, also the preferred encoding of
+ *                      the response (sent as the Accept header).
+ *     <segments>       If not NULL, the payload is these segments one after
+ *                      the other and <payload> is ignored.
+ *     <idempotent>     For a POST, whether making it twice is the same as
+ *                      making it once, so that it can be retried (GETs and
+ *                      DELETEs always are).
+ */
+struct canopy_http_request {
+    canopy_http_method                  method;
+    const char                          *api;
+    const char                          *payload;
+    size_t                              payload_len;
+    canopy_wire_format                  format;
+    const struct canopy_http_segment    *segments;
+    bool                                idempotent;
+};
+
+/*
+ * The response to a canopy_http_request.
+ *
+ *     <status_code>    HTTP status.
+ *     <format>         Encoding of the body, from the Content-Type header.
+ *     <body>           Points at a buffer from the remote's pool.  It's NUL
+ *                      terminated, but binary bodies may contain NULs, so
+ *                      use <body_len>.  Hand it back with
+ *                      canopy_http_response_release() once it's parsed.
+ *     <body_len>       Length of the body in bytes.
+ *     <pooled>         Whether <body> is from the pool.
+ *     <owner>          The remote whose pool that is.  For a group (see
+ *                      canopy_remote_group_init()) it's the endpoint that
+ *                      answered.
+ *     <transient>      If the request failed, whether it might work if it's
+ *                      made again (the remote couldn't be reached, the
+ *                      connection broke, ...).
+ *     <unsent>         If the request failed, whether it surely never got
+ *                      to the remote.
+ */
+struct canopy_http_response {
+    int                     status_code;
+    canopy_wire_format      format;
+    char                    *body;
+    size_t                  body_len;
+    bool                    pooled;
+    struct canopy_remote    *owner;
+    bool                    transient;
+    bool                    unsent;
+};
+
+/*
+ * Buffers from <remote>'s pool.  canopy_remote_buffer_get() hands out one of
+ * at least <min_size> bytes, setting <size> to how big it is, or returns
+ * NULL if that's more than the remote's max_response_size or there's no
+ * memory.  canopy_remote_buffer_put() takes it back for reuse.  Both may be
+ * called from any thread.
+ */
+char * canopy_remote_buffer_get(struct canopy_remote *remote, size_t min_size,
+        size_t *size);
+void canopy_remote_buffer_put(struct canopy_remote *remote, char *buffer);
+
+/*
+ * Hands the body of <response> back to the pool it came from, if it did:
+ * its owner's, or <remote>'s if it doesn't have one.  Call it once the
+ * body's been parsed.
+ */
+void canopy_http_response_release(struct canopy_remote *remote,
+        struct canopy_http_response *response);
+
 /*
  * Performs an HTTP request.
  *
@@ -137,4 +267,27 @@ canopy_error canopy_remote_http_delete(
         int                     *status_code,
         struct canopy_barrier   *barrier);
 
+/*
+ * Performs an HTTP request to the remote.  This is the general form of
+ * canopy_remote_http_get() and friends, which only deal in JSON text.
+ * Request and response compression follow the remote's params (see
+ * compress_threshold and accept_compressed).  It gives up with
+ * CANOPY_ERROR_TIMEOUT after the remote's request_timeout_ms, or at
+ * <barrier>'s deadline if that's sooner.
+ *
+ *     <remote>     Remote server
+ *     <request>    What to send
+ *     <response>   Filled in with the status and body of the response
+ *     <barrier>    Optional.  The call blocks either way, but cancelling the
+ *                  barrier drops the request with CANOPY_ERROR_CANCELLED.
+ *
+ *     NOTE:    The response goes in a buffer from the remote's pool, which
+ *     the caller hands back with canopy_http_response_release().
+ */
+canopy_error canopy_remote_http_request(
+        struct canopy_remote                *remote,
+        const struct canopy_http_request    *request,
+        struct canopy_http_response         *response,
+        struct canopy_barrier               *barrier);
+
 #endif /* _CANOPY_HTTP_H_ */
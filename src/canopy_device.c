@@ -21,63 +21,67 @@
 #include	<canopy_communication.h>
 #include	<canopy_os.h>
 
+/*
+ * The device's plain properties, for c_json_parse_device() and the sync
+ * payloads.  The variables are handled by canopy_variables.c.
+ */
+static const struct c_property device_properties[] = {
+    C_STRING_PROPERTY(TAG_DEVICE_ID, struct canopy_device, device_id,
+            C_PROPERTY_NOT_SENT),
+    C_STRING_PROPERTY(TAG_FRIENDLY_NAME, struct canopy_device, friendly_name,
+            offsetof(struct canopy_device, friendly_name_dirty)),
+    C_STRING_PROPERTY(TAG_LOCATION_NOTE, struct canopy_device, location_note,
+            offsetof(struct canopy_device, location_note_dirty)),
+    C_STRING_PROPERTY(TAG_SECRET_KEY, struct canopy_device, secret_key,
+            C_PROPERTY_NOT_SENT),
+};
+
 /*
  * _construct_device_sync_payload
  *
  *      Constructs the request payload to POST to /api/device/self during
  *      canopy_device_update_from_remote() and canopy_device_sync_with_remote()
  *
- *      <payload> is the destination buffer where the request will be stored.
- *
- *      <len> is the size of payload in bytes.
+ *      <state> is where the request is emitted, a chain (see
+ *      c_json_chain_init()) so that it can be as big as it needs to be.
  */
 static canopy_error _construct_device_sync_payload(canopy_device_t *device,
-        char *payload, size_t len) {
+        struct c_json_state *state) {
 
     int ierr;
     canopy_error err;
-    struct c_json_state state;
-
-    // init buffer for payload
-    c_json_buffer_init(&state, payload, len);
 
     // construct payload
-    ierr = c_json_emit_open_object(&state);
+    ierr = c_json_emit_open_object(state);
     if (ierr != C_JSON_OK) {
         return CANOPY_ERROR_NETWORK;
     }
 
-    err = c_json_emit_vardcl(device, &state, false);
+    err = c_json_emit_vardcl(device, state, false);
     if (err != CANOPY_SUCCESS) {
         return err;
     }
 
-    err = c_json_emit_vars(device, &state, false, true);
+    err = c_json_emit_vars(device, state, false, true);
     if (err != CANOPY_SUCCESS) {
         return err;
     }
 
-    if (device->friendly_name_dirty) {
-        err = c_json_emit_name_and_value(&state, TAG_FRIENDLY_NAMES,
-                device->friendly_name);
-        if (err != CANOPY_SUCCESS) {
-            return err;
-        }
-    }
-
-    if (device->location_note_dirty) {
-        err = c_json_emit_name_and_value(&state, TAG_LOCATION_NOTE,
-                device->location_note);
-        if (err != CANOPY_SUCCESS) {
-            return err;
-        }
+    ierr = c_json_emit_properties(state, device_properties,
+            C_PROPERTY_COUNT(device_properties), device);
+    if (ierr != C_JSON_OK) {
+        return CANOPY_ERROR_BUFFER_TOO_SMALL;
     }
 
-    ierr = c_json_emit_close_object(&state);
+    ierr = c_json_emit_close_object(state);
     if (ierr != C_JSON_OK) {
         return CANOPY_ERROR_NETWORK;
     }
 
+    if (c_json_chain_close(state) != C_JSON_OK) {
+        return CANOPY_ERROR_OUT_OF_MEMORY;
+    }
+
     return CANOPY_SUCCESS;
 }
 
@@ -91,8 +95,207 @@ static canopy_error _construct_device_sync_payload(canopy_device_t *device,
  * dirty flag for these fields.
  */
 static void _clear_dirty_flags(struct canopy_device *device) {
-    device->friendly_name_dirty = false;
-    device->location_note_dirty = false;
+    c_properties_clean(device_properties,
+            C_PROPERTY_COUNT(device_properties), device);
+}
+
+/*
+ * _construct_device_sync_payload_cbor
+ *
+ *      CBOR version of _construct_device_sync_payload().  <state> should be
+ *      one that grows (see c_cbor_buffer_alloc()).
+ */
+static canopy_error _construct_device_sync_payload_cbor(
+        canopy_device_t *device, struct c_cbor_state *state) {
+
+    canopy_error err;
+    int count = 2 + c_properties_dirty(device_properties,
+            C_PROPERTY_COUNT(device_properties), device);
+
+    if (c_cbor_emit_map(state, count) != C_CBOR_OK) {
+        return CANOPY_ERROR_CBOR;
+    }
+
+    err = c_cbor_emit_vardcl(device, state);
+    if (err != CANOPY_SUCCESS) {
+        return err;
+    }
+
+    err = c_cbor_emit_vars(device, state, true);
+    if (err != CANOPY_SUCCESS) {
+        return err;
+    }
+
+    if (c_cbor_emit_properties(state, device_properties,
+            C_PROPERTY_COUNT(device_properties), device) != C_CBOR_OK) {
+        return CANOPY_ERROR_CBOR;
+    }
+
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * _device_self_request
+ *
+ *      Performs a GET (if <device> is NULL) or a POST of <device>'s changes to
+ *      /api/device/self, in the remote's wire format.
+ *
+ *      If a CBOR POST is rejected with 415 (Unsupported Media Type) the
+ *      remote falls back to JSON for good, and the request is repeated.
+ *
+ *      JSON payloads are sent as a chain of segments, CBOR ones (which are
+ *      compact) from a buffer that grows, so neither has a size limit.
+ */
+static canopy_error _device_self_request(canopy_remote_t *remote,
+        canopy_device_t *device, struct canopy_http_response *response,
+        canopy_barrier_t *barrier) {
+
+    canopy_error err;
+    struct c_json_state json;
+    struct c_json_chain chain;
+    struct c_cbor_state cbor;
+    struct canopy_http_request request;
+    cos_time_t now;
+
+    if (device != NULL) {
+        /* held back changes and heartbeats whose time has come go too */
+        cos_get_time(&now);
+        canopy_ctx_lock(remote->ctx);
+        c_vars_due(device, now, NULL);
+        canopy_ctx_unlock(remote->ctx);
+    }
+
+again:
+    memset(&request, 0, sizeof(request));
+    request.method = (device == NULL) ? CANOPY_HTTP_GET : CANOPY_HTTP_POST;
+    request.api = "/api/device/self";
+    request.format = c_remote_wire_format(remote);
+    /* it sends the device's state, twice is no different from once */
+    request.idempotent = true;
+    memset(&chain, 0, sizeof(chain));
+    memset(&cbor, 0, sizeof(cbor));
+
+    if (device != NULL && request.format == CANOPY_WIRE_FORMAT_CBOR) {
+        if (c_cbor_buffer_alloc(&cbor, 1024) != C_CBOR_OK) {
+            return CANOPY_ERROR_OUT_OF_MEMORY;
+        }
+        canopy_ctx_lock(remote->ctx);
+        err = _construct_device_sync_payload_cbor(device, &cbor);
+        canopy_ctx_unlock(remote->ctx);
+        request.payload = (const char*)cbor.buffer;
+        request.payload_len = cbor.offset;
+    } else if (device != NULL) {
+        if (c_json_chain_init(&json, &chain) != C_JSON_OK) {
+            c_json_chain_free(&chain);
+            return CANOPY_ERROR_OUT_OF_MEMORY;
+        }
+        canopy_ctx_lock(remote->ctx);
+        err = _construct_device_sync_payload(device, &json);
+        canopy_ctx_unlock(remote->ctx);
+        request.segments = chain.head;
+        request.payload_len = chain.len;
+    } else {
+        err = CANOPY_SUCCESS;
+    }
+
+    if (err == CANOPY_SUCCESS) {
+        err = c_remote_request(remote, &request, response, barrier);
+    }
+    c_json_chain_free(&chain);
+    if (cbor.buffer != NULL) {
+        cos_free(cbor.buffer);
+    }
+    if (err != CANOPY_SUCCESS) {
+        cos_log(LOG_LEVEL_ERROR, "Error during %s /api/device/self: %s\n",
+                (device == NULL) ? "GET" : "POST", canopy_error_string(err));
+        return err;
+    }
+
+    if (response->status_code == 415
+            && request.format == CANOPY_WIRE_FORMAT_CBOR) {
+        cos_log(LOG_LEVEL_WARN, "Remote does not accept CBOR, using JSON\n");
+        c_remote_fall_back_to_json(remote);
+        canopy_http_response_release(remote, response);
+        /* so the variables the CBOR one carried go in the JSON one too */
+        if (device != NULL) {
+            canopy_ctx_lock(remote->ctx);
+            c_vars_reported(device, false);
+            canopy_ctx_unlock(remote->ctx);
+        }
+        goto again;
+    }
+
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * _parse_device_response
+ *
+ *      Parses a /api/device/self response into <device>, according to the
+ *      format the remote answered in.
+ */
+static canopy_error _parse_device_response(canopy_device_t *device,
+        struct canopy_http_response *response) {
+
+    jsmntok_t *token = NULL;
+    jsmn_parser parser;
+    canopy_error err;
+    int ierr;
+    int ntokens;
+    int active = 0;
+    bool result_code;
+
+    if (response->format == CANOPY_WIRE_FORMAT_CBOR) {
+        err = c_cbor_parse_device(device, (const uint8_t*)response->body,
+                response->body_len, &result_code);
+    } else {
+        /*
+         * A device has any number of variables, so count the tokens first
+         * and allocate just enough.
+         */
+        jsmn_init(&parser);
+        ntokens = jsmn_parse(&parser, response->body, response->body_len,
+                NULL, 0);
+        if (ntokens <= 0) {
+            cos_log(LOG_LEVEL_ERROR,
+                    "Error during tokenization of /api/device/self response: %d\n",
+                    ntokens);
+            return CANOPY_ERROR_JSON;
+        }
+        token = (jsmntok_t*)cos_alloc(ntokens * sizeof(jsmntok_t));
+        if (token == NULL) {
+            return CANOPY_ERROR_OUT_OF_MEMORY;
+        }
+
+        // Tokenize response
+        ierr = c_json_parse_string(
+                response->body,
+                response->body_len,
+                token,
+                ntokens,
+                &active);
+        if (ierr != C_JSON_OK) {
+            cos_log(LOG_LEVEL_ERROR,
+                    "Error during tokenization of /api/device/self response: %d\n",
+                    ierr);
+            cos_free(token);
+            return CANOPY_ERROR_JSON;
+        }
+
+        err = c_json_parse_device(device, response->body,
+                response->body_len, token, ntokens,
+                &result_code,
+                true);
+        cos_free(token);
+    }
+    if (err != CANOPY_SUCCESS) {
+        cos_log(LOG_LEVEL_ERROR,
+                "Error during parse of /api/device/self response: %s\n",
+                canopy_error_string(err));
+        return err;
+    }
+
+    return CANOPY_SUCCESS;
 }
 
 /****************************************************************************/
@@ -123,11 +326,8 @@ canopy_error canopy_device_init(struct canopy_device *device,
 canopy_error canopy_get_self_device(canopy_remote_t *remote,
         struct canopy_device *device, canopy_barrier_t *barrier) {
 
-    jsmntok_t token[512]; // TODO: large enough?
     canopy_error err;
-    int http_status;
-    int active = 0;
-    bool result_code;
+    struct canopy_http_response response;
 
     COS_ASSERT(remote != NULL);
     COS_ASSERT(device != NULL);
@@ -141,45 +341,22 @@ canopy_error canopy_get_self_device(canopy_remote_t *remote,
     canopy_device_init(device, remote, remote->params->name);
 
     // GET /api/device/self
-    err = canopy_remote_http_get(remote, "/api/device/self",
-    NULL, &http_status, barrier);
+    err = _device_self_request(remote, NULL, &response, barrier);
     if (err != CANOPY_SUCCESS) {
-        cos_log(LOG_LEVEL_ERROR, "Error during GET /api/device/self: %s\n",
-                canopy_error_string(err));
         return err;
     }
 
-    if (http_status != 200) {
+    if (response.status_code != 200) {
         // TODO: Return the appropriate error based on the response
-        return CANOPY_ERROR_UNKNOWN;
-    }
-
-    err = c_json_parse_string(
-            (char*)remote->rcv_buffer, 
-            strlen(remote->rcv_buffer), 
-            token, 
-            sizeof(token) / sizeof(token[0]),
-            &active);
-    if (err != CANOPY_SUCCESS) {
-        cos_log(LOG_LEVEL_ERROR,
-                "Error during tokenization of /api/device/self response: %s\n",
-                canopy_error_string(err));
-        return err;
-    }
-
-    // Parse response and update device object
-    err = c_json_parse_device(device, remote->rcv_buffer,
-            remote->rcv_buffer_size, token, sizeof(token) / sizeof(token[0]),
-            &result_code,
-            true);
-    if (err != CANOPY_SUCCESS) {
-        cos_log(LOG_LEVEL_ERROR,
-                "Error during parse of /api/device/self response: %s\n",
-                canopy_error_string(err));
-        return err;
+        err = CANOPY_ERROR_UNKNOWN;
+    } else {
+        // Parse response and update device object
+        canopy_ctx_lock(remote->ctx);
+        err = _parse_device_response(device, &response);
+        canopy_ctx_unlock(remote->ctx);
     }
-
-    return CANOPY_SUCCESS;
+    canopy_http_response_release(remote, &response);
+    return err;
 }
 
 /*
@@ -188,98 +365,188 @@ canopy_error canopy_get_self_device(canopy_remote_t *remote,
 canopy_error canopy_device_update_from_remote(canopy_remote_t *remote,
         canopy_device_t *device, canopy_barrier_t *barrier) {
 
-    jsmntok_t token[512]; // TODO: large enough?
     canopy_error err;
-    int http_status;
-    bool result_code;
-    int active = 0;
+    struct canopy_http_response response;
 
     COS_ASSERT(remote != NULL);
     COS_ASSERT(device != NULL);
 
     // GET /api/device/self
-    err = canopy_remote_http_get(remote, "/api/device/self",
-    NULL, &http_status, barrier);
+    err = _device_self_request(remote, NULL, &response, barrier);
     if (err != CANOPY_SUCCESS) {
-        cos_log(LOG_LEVEL_ERROR, "Error during GET /api/device/self: %s\n",
-                canopy_error_string(err));
         return err;
     }
 
-    if (http_status != 200) {
+    if (response.status_code != 200) {
         // TODO: Return the appropriate error based on the response
-        return CANOPY_ERROR_UNKNOWN;
+        err = CANOPY_ERROR_UNKNOWN;
+    } else {
+        // Parse response and update device object
+        canopy_ctx_lock(remote->ctx);
+        err = _parse_device_response(device, &response);
+        canopy_ctx_unlock(remote->ctx);
     }
+    canopy_http_response_release(remote, &response);
+    return err;
+}
 
-    // Tokenize response
-    err = c_json_parse_string(
-            (char*)remote->rcv_buffer, 
-            strlen(remote->rcv_buffer), 
-            token, 
-            sizeof(token) / sizeof(token[0]),
-            &active);
-    if (err != CANOPY_SUCCESS) {
-        cos_log(LOG_LEVEL_ERROR,
-                "Error during tokenization of /api/device/self response: %s\n",
-                canopy_error_string(err));
-        return err;
-    }
+/*
+ * _device_sync
+ *
+ *      Sends <device>'s changes to the remote and, if <pull>, updates it
+ *      from the response.
+ *
+ *      Its variables are only touched under canopy_ctx_lock(), which is let
+ *      go while the request is out, so that the scheduler's syncs keep out
+ *      of the application's way and the other way round.
+ */
+static canopy_error _device_sync(canopy_remote_t *remote,
+        canopy_device_t *device, bool pull, canopy_barrier_t *barrier) {
 
-    // Parse response and update device object
-    err = c_json_parse_device(device, remote->rcv_buffer,
-            remote->rcv_buffer_size, token, sizeof(token) / sizeof(token[0]),
-            &result_code,
-            true);
+    canopy_error err;
+    struct canopy_http_response response;
+    bool delivered;
+
+    // construct and send payload
+    err = _device_self_request(remote, device, &response, barrier);
+    delivered = err == CANOPY_SUCCESS && response.status_code / 100 == 2;
+    canopy_ctx_lock(remote->ctx);
+    if (delivered) {
+        c_query_cache_invalidate(device);
+    }
+    c_vars_reported(device, delivered);
     if (err != CANOPY_SUCCESS) {
-        cos_log(LOG_LEVEL_ERROR,
-                "Error during parse of /api/device/self response: %s\n",
-                canopy_error_string(err));
+        canopy_ctx_unlock(remote->ctx);
         return err;
     }
 
-    return CANOPY_SUCCESS;
+    if (response.status_code != 200) {
+        // TODO: Return the appropriate error based on the response
+        err = CANOPY_ERROR_UNKNOWN;
+    } else if (pull) {
+        // Parse response and update device object
+        err = _parse_device_response(device, &response);
+    }
+    if (err == CANOPY_SUCCESS) {
+        // clear dirty flags
+        _clear_dirty_flags(device);
+    }
+    canopy_ctx_unlock(remote->ctx);
+    canopy_http_response_release(remote, &response);
+    return err;
 }
 
 /*
- * canopy_device_update_to_remote
+ * _coalesced_sync
+ *
+ *      Does _device_sync(), unless there's already a request in flight for
+ *      <device>.  Then the caller waits for it to finish, and rides on one
+ *      follow-up request made for everyone who turned up in the meantime.
+ *      The follow-up's payload is built when it starts, so it carries all
+ *      their changes, and it pulls if any of them wanted to.  Each caller
+ *      gets the result of the request that it rode on, unless its barrier
+ *      runs out or is cancelled first.
  */
-canopy_error canopy_device_update_to_remote(canopy_remote_t *remote,
-        canopy_device_t *device, canopy_barrier_t *barrier) {
+static void _unlink_waiter(struct c_sync_waiter **list,
+        struct c_sync_waiter *waiter) {
+    for (; *list != NULL; list = &(*list)->next) {
+        if (*list == waiter) {
+            *list = waiter->next;
+            return;
+        }
+    }
+}
 
-    canopy_error err;
-    char request_payload[2048];
-    int http_status;
+static canopy_error _coalesced_sync(canopy_remote_t *remote,
+        canopy_device_t *device, bool pull, canopy_barrier_t *barrier) {
 
-    COS_ASSERT(remote != NULL);
-    COS_ASSERT(device != NULL);
+    struct c_sync_waiter self;
+    struct c_sync_waiter **tail;
+    struct c_sync_waiter *rider;
+    canopy_error err;
 
-    // construct payload
-    err = _construct_device_sync_payload(device, request_payload,
-            sizeof(request_payload));
-    if (err != CANOPY_SUCCESS) {
-        return err;
+    if (remote->sync_lock == NULL) {
+        return _device_sync(remote, device, pull, barrier);
     }
 
-    // send payload
-    err = canopy_remote_http_post(remote, "/api/device/self", request_payload,
-            &http_status, barrier);
-    if (err != CANOPY_SUCCESS) {
-        cos_log(LOG_LEVEL_ERROR, "Error during POST /api/device/self: %s\n",
-                canopy_error_string(err));
-        return err;
+    cos_mutex_lock(remote->sync_lock);
+    if (device->sync_in_flight) {
+        memset(&self, 0, sizeof(self));
+        self.pull = pull;
+        self.wake = cos_event_create();
+        if (self.wake == NULL) {
+            cos_mutex_unlock(remote->sync_lock);
+            return _device_sync(remote, device, pull, barrier);
+        }
+        for (tail = &device->sync_waiters; *tail != NULL;
+                tail = &(*tail)->next) {
+        }
+        *tail = &self;
+        while (!self.finished && !self.lead) {
+            err = c_barrier_check(barrier);
+            if (err != CANOPY_SUCCESS) {
+                /* out of time, whether it's still waiting or riding */
+                _unlink_waiter(&device->sync_waiters, &self);
+                _unlink_waiter(&device->sync_riders, &self);
+                cos_mutex_unlock(remote->sync_lock);
+                cos_event_destroy(self.wake);
+                return err;
+            }
+            cos_mutex_unlock(remote->sync_lock);
+            c_barrier_wait(barrier, self.wake, 1000);
+            cos_mutex_lock(remote->sync_lock);
+        }
+        cos_event_destroy(self.wake);
+        if (self.finished) {
+            cos_mutex_unlock(remote->sync_lock);
+            return self.result;
+        }
+
+        /* our turn, everyone still waiting rides along */
+        device->sync_riders = device->sync_waiters;
+        device->sync_waiters = NULL;
+        for (rider = device->sync_riders; rider != NULL;
+                rider = rider->next) {
+            pull = pull || rider->pull;
+        }
+    } else {
+        device->sync_in_flight = true;
     }
+    cos_mutex_unlock(remote->sync_lock);
 
-    if (http_status != 200) {
-        // TODO: Return the appropriate error based on the response
-        return CANOPY_ERROR_UNKNOWN;
+    err = _device_sync(remote, device, pull, barrier);
+
+    cos_mutex_lock(remote->sync_lock);
+    while (device->sync_riders != NULL) {
+        rider = device->sync_riders;
+        device->sync_riders = rider->next;
+        rider->result = err;
+        rider->finished = true;
+        cos_event_signal(rider->wake);
     }
+    if (device->sync_waiters != NULL) {
+        rider = device->sync_waiters;
+        device->sync_waiters = rider->next;
+        rider->lead = true;
+        cos_event_signal(rider->wake);
+    } else {
+        device->sync_in_flight = false;
+    }
+    cos_mutex_unlock(remote->sync_lock);
+    return err;
+}
 
-    // clear dirty flags
-    _clear_dirty_flags(device);
+/*
+ * canopy_device_update_to_remote
+ */
+canopy_error canopy_device_update_to_remote(canopy_remote_t *remote,
+        canopy_device_t *device, canopy_barrier_t *barrier) {
 
-    // ignore response since this isn't a "sync"
+    COS_ASSERT(remote != NULL);
+    COS_ASSERT(device != NULL);
 
-    return CANOPY_SUCCESS;
+    // the response is ignored since this isn't a "sync"
+    return _coalesced_sync(remote, device, false, barrier);
 }
 
 /*
@@ -288,67 +555,10 @@ canopy_error canopy_device_update_to_remote(canopy_remote_t *remote,
 canopy_error canopy_device_sync_with_remote(canopy_remote_t *remote,
         canopy_device_t *device, canopy_barrier_t *barrier) {
 
-    canopy_error err;
-    jsmntok_t token[512]; // TODO: large enough?
-    char request_payload[2048];
-    int http_status;
-    bool result_code;
-    int active = 0;
-
     COS_ASSERT(remote != NULL);
     COS_ASSERT(device != NULL);
 
-    // construct payload
-    err = _construct_device_sync_payload(device, request_payload,
-            sizeof(request_payload));
-    if (err != CANOPY_SUCCESS) {
-        return err;
-    }
-
-    // send payload
-    err = canopy_remote_http_post(remote, "/api/device/self", request_payload,
-            &http_status, barrier);
-    if (err != CANOPY_SUCCESS) {
-        cos_log(LOG_LEVEL_ERROR, "Error during POST /api/device/self: %s\n",
-                canopy_error_string(err));
-        return err;
-    }
-
-    if (http_status != 200) {
-        // TODO: Return the appropriate error based on the response
-        return CANOPY_ERROR_UNKNOWN;
-    }
-
-    // Tokenize response
-    err = c_json_parse_string(
-            (char*)remote->rcv_buffer, 
-            strlen(remote->rcv_buffer), 
-            token, 
-            sizeof(token) / sizeof(token[0]),
-            &active);
-    if (err != CANOPY_SUCCESS) {
-        cos_log(LOG_LEVEL_ERROR,
-                "Error during tokenization of /api/device/self response: %s\n",
-                canopy_error_string(err));
-        return err;
-    }
-
-
-    // Parse response and update device object
-    err = c_json_parse_device(device, remote->rcv_buffer,
-            remote->rcv_buffer_size, token, sizeof(token) / sizeof(token[0]),
-            &result_code,
-            true);
-    if (err != CANOPY_SUCCESS) {
-        cos_log(LOG_LEVEL_ERROR,
-                "Error during parse of /api/device/self response: %s\n",
-                canopy_error_string(err));
-        return err;
-    }
-
-    // clear dirty flags
-    _clear_dirty_flags(device);
-    return CANOPY_SUCCESS;
+    return _coalesced_sync(remote, device, true, barrier);
 }
 
 /*
@@ -453,13 +663,30 @@ canopy_error c_json_parse_device(struct canopy_device *device,
         bool *result_code, /* the value of "result : " */
         bool check_obj) { /* expect outer-most object */
 
+    int next_token;
+    return c_json_parse_device_at(device, js, js_len, token, tok_len, 0,
+            &next_token, result_code);
+}
+
+/***************************************************************************
+ *  c_json_parse_device_at()
+ *
+ *      Parses the device object at token[<offset>], which needn't be the
+ *  outer-most one (e.g. an element of a "devices" array).  <next_token> is
+ *  set to the token after the object.
+ */
+canopy_error c_json_parse_device_at(struct canopy_device *device,
+        char* js, int js_len, /* the input JSON and total length  */
+        jsmntok_t *token, int tok_len, /* token array with length */
+        int offset, /* token offset of the device object */
+        int *next_token, /* the token after the object */
+        bool *result_code) { /* the value of "result : " */
+
     int i;
-    int offset = 0;
     char name[128];
     int count;
-    int next_token;
     canopy_error err = CANOPY_SUCCESS;
-    char buf[CANOPY_NOTE_MAX_LENGTH];
+    const struct c_property *property;
 
     COS_ASSERT(device != NULL);
     COS_ASSERT(device->remote != NULL);
@@ -494,26 +721,26 @@ canopy_error c_json_parse_device(struct canopy_device *device,
                     (char*)js, js_len, /* the input JSON and total length  */
                     token, tok_len, /* token array with length */
                     offset, /* token offset for name status */
-                    &next_token);
-            offset = next_token;
+                    next_token);
+            offset = *next_token;
 
         } else if (strncmp(name, TAG_VAR_DECLS, sizeof_name) == 0) {
             err = c_json_parse_vardcl(device,
                     (char*)js, js_len, /* the input JSON and total length  */
                     token, tok_len, /* token array with length */
                     offset, /* token offset for name vardecl */
-                    &next_token,
+                    next_token,
                     false); /* expect outer-most object */
-            offset = next_token;
+            offset = *next_token;
 
         } else if (strncmp(name, TAG_VARS, sizeof_name) == 0) {
             err = c_json_parse_vars(device,
                     (char*)js, js_len, /* the input JSON and total length  */
                     token, tok_len, /* token array with length */
                     offset, /* token offset for name vardecl */
-                    &next_token, /* the token after the decls */
+                    next_token, /* the token after the decls */
                     false); /* expect outer-most object */
-            offset = next_token;
+            offset = *next_token;
 
         } else if (strncmp(name, TAG_RESULT, sizeof_name) == 0) {
             offset++; /* the thing following the name */
@@ -527,95 +754,125 @@ canopy_error c_json_parse_device(struct canopy_device *device,
             }
             offset++;
 
-        } else if (strncmp(name, TAG_DEVICE_ID, sizeof_name) == 0) {
-            memset(&buf, 0, sizeof(buf));
-            offset++; /* the device id as a string */
-            COS_ASSERT(token[offset].type == JSMN_STRING);
-            COS_ASSERT(token[offset].size == 0);
-            strncpy(buf, &js[token[offset].start], (token[offset].end - token[offset].start));
-            strncpy(device->device_id, buf, sizeof(device->device_id));
-
-            offset++; /* to the next name tag */
-
-        } else if (strncmp(name, TAG_FRIENDLY_NAME, sizeof_name) == 0) {
-            memset(&buf, 0, sizeof(buf));
-            offset++; /* the device id as a string */
-            COS_ASSERT(token[offset].type == JSMN_STRING);
-            COS_ASSERT(token[offset].size == 0);
-            strncpy(buf, &js[token[offset].start], (token[offset].end - token[offset].start));
-            strncpy(device->friendly_name, buf, sizeof(device->friendly_name));
-            device->friendly_name_dirty = false;
-
-            offset++; /* to the next name tag */
-
-        } else if (strncmp(name, TAG_LOCATION_NOTE, sizeof_name) == 0) {
-            memset(&buf, 0, sizeof(buf));
-            offset++; /* the device id as a string */
-            COS_ASSERT(token[offset].type == JSMN_STRING);
-            COS_ASSERT(token[offset].size == 0);
-            strncpy(buf, &js[token[offset].start], (token[offset].end - token[offset].start));
-            strncpy(device->location_note, buf, sizeof(device->location_note));
-            device->location_note_dirty = false;
-
-            offset++; /* to the next name tag */
-
-        } else if (strncmp(name, TAG_SECRET_KEY, sizeof_name) == 0) {
-            memset(&buf, 0, sizeof(buf));
-            offset++; /* the device id as a string */
-            COS_ASSERT(token[offset].type == JSMN_STRING);
-            COS_ASSERT(token[offset].size == 0);
-            strncpy(buf, &js[token[offset].start], (token[offset].end - token[offset].start));
-            strncpy(device->secret_key, buf, sizeof(device->secret_key));
-
+        } else if ((property = c_property_find(device_properties,
+                C_PROPERTY_COUNT(device_properties), name, strlen(name)))
+                != NULL) {
+            offset++; /* the value following the name */
+            if (c_json_parse_property(property, device, js, &token[offset])
+                    != C_JSON_OK) {
+                cos_log(LOG_LEVEL_ERROR, "bad value for %s\n", property->tag);
+                return CANOPY_ERROR_JSON;
+            }
             offset++; /* to the next name tag */
 
         } else {
-            int j;
 
             /*
-             * The tag's not implemented, we need to look at the size of the
-             * tag string, then check the type to handle other objects.
-             *
-             * The increment of offset gets us to the token after the name
-             * string.
+             * The tag's not implemented, skip over its value, whatever it
+             * contains.  The increment of offset gets us to the token after
+             * the name string.
              */
             offset++; /* the thing following the name string */
-            if (token[offset].type == JSMN_STRING) {
-                COS_ASSERT(token[offset].size == 0);
-                offset++; /* to the next name */
+            offset = c_json_skip_token(token, tok_len, offset);
+        }
+
+        if (err != CANOPY_SUCCESS) {
+            break;
+        }
+    } /* for (count) */
+
+    *next_token = offset;
+    return err;
+}
+
+/***************************************************************************
+ *  c_cbor_parse_device(struct canopy_device *device,
+ *      const uint8_t *buf, int len, bool *result_code)
+ *
+ *      CBOR version of c_json_parse_device().  The document is a map with the
+ *  same tags as the JSON one.  Unknown tags are skipped.
+ */
+canopy_error c_cbor_parse_device(struct canopy_device *device,
+        const uint8_t *buf, int len,
+        bool *result_code) {
 
-            } else if (token[offset].type == JSMN_OBJECT) {
+    struct c_cbor_reader reader;
+    struct c_cbor_item top;
+
+    c_cbor_reader_init(&reader, buf, len);
+    if (c_cbor_read(&reader, &top) != C_CBOR_OK) {
+        return CANOPY_ERROR_CBOR;
+    }
+    return c_cbor_parse_device_item(device, &reader, &top, result_code);
+}
 
-                /*
-                 * This isn't right, since OBJECTS an contain other OBJECTS
-                 */
-                for (j = 0; j < token[offset].size; j++) {
+/***************************************************************************
+ *  c_cbor_parse_device_item()
+ *
+ *      Parses the device map <top>, already read from <reader>.  Used for
+ *  the elements of a "devices" array as well as for a lone device.
+ */
+canopy_error c_cbor_parse_device_item(struct canopy_device *device,
+        struct c_cbor_reader *reader,
+        struct c_cbor_item *top,
+        bool *result_code) {
+
+    struct c_cbor_item name;
+    struct c_cbor_item value;
+    const struct c_property *property;
+    canopy_error err = CANOPY_SUCCESS;
+    uint64_t i;
 
+    COS_ASSERT(device != NULL);
+    COS_ASSERT(device->remote != NULL);
 
-                    offset++;
-                }
+    if (top->type != C_CBOR_MAP) {
+        cos_log(LOG_LEVEL_ERROR, "CBOR device is not a map\n");
+        return CANOPY_ERROR_CBOR;
+    }
 
+    for (i = 0; c_cbor_more(reader, top, i); i++) {
+        if (c_cbor_read(reader, &name) != C_CBOR_OK
+                || name.type != C_CBOR_TEXT
+                || c_cbor_read(reader, &value) != C_CBOR_OK) {
+            return CANOPY_ERROR_CBOR;
+        }
 
-            } else if (token[offset].type == JSMN_ARRAY) {
+        if (c_cbor_item_is(&name, TAG_STATUS)) {
+            err = c_cbor_parse_remote_status(device, reader, &value);
 
-                /*
-                 * HACK:  This code assumes that the array is empty.  This is
-                 * currently true, since the TAG related to this is
-                 * "notifs"
-                 */
-                COS_ASSERT(token[offset].size == 0);
-                offset++;
+        } else if (c_cbor_item_is(&name, TAG_VAR_DECLS)) {
+            err = c_cbor_parse_vardcl(device, reader, &value);
 
-            } else if (token[offset].type == JSMN_PRIMITIVE) {
+        } else if (c_cbor_item_is(&name, TAG_VARS)) {
+            err = c_cbor_parse_vars(device, reader, &value);
 
-                COS_ASSERT(token[offset].size == 0);
-                offset++;
+        } else if (c_cbor_item_is(&name, TAG_RESULT)) {
+            if (c_cbor_item_is(&value, "ok")) {
+                *result_code = true;
+            } else if (c_cbor_item_is(&value, "error")) {
+                *result_code = false;
+            } else {
+                cos_log(LOG_LEVEL_FATAL, "result isn't 'ok' or 'error'");
+                return CANOPY_ERROR_FATAL;
+            }
 
+        } else if ((property = c_property_find(device_properties,
+                C_PROPERTY_COUNT(device_properties), name.str, name.str_len))
+                != NULL) {
+            if (c_cbor_parse_property(property, device, &value)
+                    != C_CBOR_OK) {
+                return CANOPY_ERROR_CBOR;
             }
 
+        } else if (c_cbor_skip(reader, &value) != C_CBOR_OK) {
+            return CANOPY_ERROR_CBOR;
         }
 
-    } /* for (count) */
+        if (err != CANOPY_SUCCESS) {
+            return err;
+        }
+    }
 
-    return err;
+    return CANOPY_SUCCESS;
 }
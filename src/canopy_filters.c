@@ -14,13 +14,29 @@
 
 #include	<stdint.h>
 #include	<stdbool.h>
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
 
 #include	<canopy_min.h>
+#include	<canopy_min_internal.h>
+#include	<canopy_os.h>
 
 /*****************************************************************************/
 
 static void append(canopy_filter_root_t *root, canopy_filter_t *ft);
 
+/*
+ * Used while building a query string.
+ */
+struct query_string {
+	char	*buf;
+	size_t	len;		/* size of buf */
+	size_t	offset;		/* where the next character goes */
+};
+
+static bool put(struct query_string *qs, const char *str, bool escape);
+
 
 /*****************************************************************************/
 
@@ -188,3 +204,676 @@ static void append(canopy_filter_root_t *root, canopy_filter_t *ft) {
 }
 
 
+/*****************************************************************************/
+
+static const char *relation_strings[] = {
+	NULL,	/* CANOPY_RELATION_OP_INVALID */
+	"==",	/* CANOPY_EQ */
+	"!=",	/* CANOPY_NEQ */
+	">",	/* CANOPY_GT */
+	">=",	/* CANOPY_GTE */
+	"<",	/* CANOPY_LT */
+	"<=",	/* CANOPY_LTE */
+};
+
+/****************************************************
+ * put()
+ *
+ * 	Appends <str> to the query string, percent-encoding everything but the
+ * 	unreserved characters if <escape> is set.  Returns false if it doesn't
+ * 	fit.
+ */
+static bool put(struct query_string *qs, const char *str, bool escape) {
+	static const char hex[] = "0123456789ABCDEF";
+	for (; *str != '\0'; str++) {
+		unsigned char c = (unsigned char)*str;
+		bool plain = !escape
+				|| (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+				|| (c >= '0' && c <= '9')
+				|| c == '-' || c == '_' || c == '.' || c == '~';
+		if (qs->offset + (plain ? 1 : 3) >= qs->len) {
+			qs->buf[qs->offset] = '\0';
+			return false;
+		}
+		if (plain) {
+			qs->buf[qs->offset++] = c;
+		} else {
+			qs->buf[qs->offset++] = '%';
+			qs->buf[qs->offset++] = hex[c >> 4];
+			qs->buf[qs->offset++] = hex[c & 0xf];
+		}
+	}
+	qs->buf[qs->offset] = '\0';
+	return true;
+}
+
+/****************************************************
+ * put_filter()
+ *
+ * 	Appends the filter as text, e.g.
+ * 		(temperature > 40 && temperature < 80.5) || system.ws_connected == false
+ * 	which put() escapes for the URL.
+ */
+static canopy_error put_filter(struct query_string *qs,
+		const canopy_filter_root_t *root) {
+	const canopy_filter_t *ft;
+	bool space = false;		/* separate from the previous element */
+	bool ok = true;
+
+	for (ft = root->head; ft != NULL && ok; ft = ft->next) {
+		const char *sep = space ? " " : "";
+		switch (ft->type) {
+		case TERM:
+			if (ft->onion.term.relation <= CANOPY_RELATION_OP_INVALID
+					|| ft->onion.term.relation > CANOPY_LTE
+					|| ft->onion.term.variable_name == NULL
+					|| ft->onion.term.value == NULL) {
+				return CANOPY_ERROR_BAD_PARAM;
+			}
+			ok = put(qs, sep, true)
+					&& put(qs, ft->onion.term.variable_name, true)
+					&& put(qs, " ", true)
+					&& put(qs, relation_strings[ft->onion.term.relation], true)
+					&& put(qs, " ", true)
+					&& put(qs, ft->onion.term.value, true);
+			space = true;
+			break;
+		case UNARY:
+			if (ft->onion.unary.type == HAS) {
+				if (ft->onion.unary.variable_name == NULL) {
+					return CANOPY_ERROR_BAD_PARAM;
+				}
+				ok = put(qs, sep, true) && put(qs, "HAS ", true)
+						&& put(qs, ft->onion.unary.variable_name, true);
+				space = true;
+			} else {
+				ok = put(qs, sep, true) && put(qs, "!", true);
+				space = false;
+			}
+			break;
+		case BOOLEAN:
+			ok = put(qs, (ft->onion.boolean.type == AND) ? " && " : " || ",
+					true);
+			space = false;
+			break;
+		case PAREN:
+			if (ft->onion.paren.open) {
+				ok = put(qs, sep, true) && put(qs, "(", true);
+				space = false;
+			} else {
+				ok = put(qs, ")", true);
+				space = true;
+			}
+			break;
+		default:
+			return CANOPY_ERROR_BAD_PARAM;
+		}
+	}
+	return ok ? CANOPY_SUCCESS : CANOPY_ERROR_BUFFER_TOO_SMALL;
+}
+
+/****************************************************
+ * check_filter()
+ *
+ * 	Checks that the filter stack reads as an expression: operands (terms,
+ * 	HAS, or a parenthesized expression, each optionally preceded by NOTs)
+ * 	separated by AND/OR, with balanced parentheses.
+ */
+static canopy_error check_filter(const canopy_filter_root_t *root) {
+	const canopy_filter_t *ft;
+	bool want_operand = true;
+	int depth = 0;
+	int pos = 0;
+
+	for (ft = root->head; ft != NULL; ft = ft->next, pos++) {
+		bool ok;
+		switch (ft->type) {
+		case TERM:
+			ok = want_operand;
+			want_operand = false;
+			break;
+		case UNARY:
+			/* NOT applies to the operand that follows it */
+			ok = want_operand;
+			want_operand = (ft->onion.unary.type == NOT);
+			break;
+		case BOOLEAN:
+			ok = !want_operand;
+			want_operand = true;
+			break;
+		case PAREN:
+			if (ft->onion.paren.open) {
+				ok = want_operand;
+				depth++;
+			} else {
+				ok = !want_operand && depth > 0;
+				depth--;
+			}
+			break;
+		default:
+			ok = false;
+			break;
+		}
+		if (!ok) {
+			cos_log(LOG_LEVEL_ERROR, "filter element %d is out of place\n",
+					pos);
+			return CANOPY_ERROR_BAD_PARAM;
+		}
+	}
+	if (pos > 0 && (want_operand || depth != 0)) {
+		cos_log(LOG_LEVEL_ERROR, "filter is incomplete or has unbalanced "
+				"parentheses\n");
+		return CANOPY_ERROR_BAD_PARAM;
+	}
+	return CANOPY_SUCCESS;
+}
+
+/****************************************************
+ * put_limit()
+ */
+static bool put_limit(struct query_string *qs, uint32_t start,
+		uint32_t count) {
+	char limit[32];
+	snprintf(limit, sizeof(limit), "%climit=%u,%u",
+			(qs->offset == 0) ? '?' : '&', start, count);
+	return put(qs, limit, false);
+}
+
+/****************************************************
+ * canopy_query_compile()
+ *
+ * 	Validates the filter and renders the query, e.g.
+ * 		?filter=...&sort=temperature,!humidity&limit=0,50
+ * 	into query->query_string.  The limit goes last so that it's the only
+ * 	part that needs redoing when paging.
+ */
+canopy_error canopy_query_compile(canopy_query_t *query) {
+	struct query_string qs;
+	canopy_error err;
+	int i;
+
+	if (query == NULL) {
+		return CANOPY_ERROR_BAD_PARAM;
+	}
+	query->compiled = false;
+	qs.buf = query->query_string;
+	qs.len = sizeof(query->query_string);
+	qs.offset = 0;
+	qs.buf[0] = '\0';
+
+	if (query->filter_root != NULL && query->filter_root->head != NULL) {
+		err = check_filter(query->filter_root);
+		if (err != CANOPY_SUCCESS) {
+			return err;
+		}
+		if (!put(&qs, "?filter=", false)) {
+			return CANOPY_ERROR_BUFFER_TOO_SMALL;
+		}
+		err = put_filter(&qs, query->filter_root);
+		if (err != CANOPY_SUCCESS) {
+			return err;
+		}
+	}
+
+	if (query->sort != NULL && query->sort->cnt > 0) {
+		if (!put(&qs, (qs.offset == 0) ? "?sort=" : "&sort=", false)) {
+			return CANOPY_ERROR_BUFFER_TOO_SMALL;
+		}
+		for (i = 0; i < query->sort->cnt; i++) {
+			const canopy_sort_term_t *term = &query->sort->terms[i];
+			if (term->varname == NULL || term->direction == RANDOM) {
+				/* the server has no way to ask for a random order */
+				return CANOPY_ERROR_BAD_PARAM;
+			}
+			if ((i > 0 && !put(&qs, ",", false))
+					|| (term->direction == DESCENDING && !put(&qs, "!", false))
+					|| !put(&qs, term->varname, true)) {
+				return CANOPY_ERROR_BUFFER_TOO_SMALL;
+			}
+		}
+	}
+
+	query->limit_offset = qs.offset;
+	query->compiled_start = 0;
+	query->compiled_count = 0;
+	if (query->limits != NULL) {
+		query->compiled_start = query->limits->start;
+		query->compiled_count = query->limits->count;
+	}
+	if (!put_limit(&qs, query->compiled_start, query->compiled_count)) {
+		return CANOPY_ERROR_BUFFER_TOO_SMALL;
+	}
+	query->query_string_len = qs.offset;
+	query->compiled = true;
+	return CANOPY_SUCCESS;
+}
+
+/****************************************************
+ * c_query_string()
+ *
+ * 	Copies the query string for <query>, asking for <count> results starting
+ * 	at <start>, into <buf>.  The query is compiled the first time it's used,
+ * 	after that only the limit may need to be rendered again.
+ */
+canopy_error c_query_string(canopy_query_t *query, uint32_t start,
+		uint32_t count, char *buf, size_t len) {
+	struct query_string qs;
+	canopy_error err;
+
+	if (buf == NULL || len == 0) {
+		return CANOPY_ERROR_BAD_PARAM;
+	}
+	qs.buf = buf;
+	qs.len = len;
+	qs.offset = 0;
+	buf[0] = '\0';
+
+	if (query == NULL) {
+		return put_limit(&qs, start, count)
+				? CANOPY_SUCCESS : CANOPY_ERROR_BUFFER_TOO_SMALL;
+	}
+	if (!query->compiled) {
+		err = canopy_query_compile(query);
+		if (err != CANOPY_SUCCESS) {
+			return err;
+		}
+	}
+
+	if (start == query->compiled_start && count == query->compiled_count) {
+		if (query->query_string_len >= len) {
+			return CANOPY_ERROR_BUFFER_TOO_SMALL;
+		}
+		memcpy(buf, query->query_string, query->query_string_len + 1);
+		return CANOPY_SUCCESS;
+	}
+
+	if (query->limit_offset >= len) {
+		return CANOPY_ERROR_BUFFER_TOO_SMALL;
+	}
+	memcpy(buf, query->query_string, query->limit_offset);
+	qs.offset = query->limit_offset;
+	buf[qs.offset] = '\0';
+	return put_limit(&qs, start, count)
+			? CANOPY_SUCCESS : CANOPY_ERROR_BUFFER_TOO_SMALL;
+}
+
+
+/*****************************************************************************/
+
+/*
+ * Local filter evaluation.
+ *
+ * canopy_filter_compile() turns the filter stack into postfix with the usual
+ * operator-precedence pass (NOT binds tightest, then AND, then OR), so
+ * 	(temperature > 40 && temperature < 80.5) || system.ws_connected == false
+ * becomes
+ * 	TERM TERM AND TERM OR
+ * which canopy_filter_match() runs over a small stack of bools.
+ */
+
+/* The operators are in order of how tightly they bind */
+enum filter_op_code {
+	FILTER_OP_TERM,
+	FILTER_OP_HAS,
+	FILTER_OP_NOT,
+	FILTER_OP_AND,
+	FILTER_OP_OR,
+	FILTER_OP_OPEN,		/* only ever on the operator stack */
+};
+
+/* How a term's value parsed */
+enum filter_value_kind {
+	FILTER_VALUE_STRING,	/* only comparable with strings */
+	FILTER_VALUE_NUMBER,
+	FILTER_VALUE_BOOL,
+};
+
+/* Slot for "system.ws_connected", which isn't a variable */
+#define FILTER_SLOT_WS_CONNECTED	0xff
+#define FILTER_WS_CONNECTED			"system.ws_connected"
+
+/****************************************************
+ * filter_slot()
+ *
+ * 	Finds or adds the slot for variable <name>.  Returns false if there are
+ * 	too many.
+ */
+static bool filter_slot(canopy_filter_program_t *program, const char *name,
+		uint8_t *slot) {
+	int i;
+
+	if (strcmp(name, FILTER_WS_CONNECTED) == 0) {
+		*slot = FILTER_SLOT_WS_CONNECTED;
+		return true;
+	}
+	for (i = 0; i < program->nslots; i++) {
+		if (strcmp(program->slots[i], name) == 0) {
+			*slot = i;
+			return true;
+		}
+	}
+	if (program->nslots >= CANOPY_FILTER_PROGRAM_MAX_VARS) {
+		return false;
+	}
+	program->slots[program->nslots] = name;
+	*slot = program->nslots++;
+	return true;
+}
+
+/****************************************************
+ * filter_value()
+ *
+ * 	Parses a term's value once, so matching never has to.
+ */
+static void filter_value(struct canopy_filter_op *op, const char *value) {
+	size_t len = strlen(value);
+	char *end;
+
+	op->string = value;
+	op->string_len = len;
+	op->number = 0;
+	op->kind = FILTER_VALUE_STRING;
+
+	if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+		op->string = value + 1;
+		op->string_len = len - 2;
+	} else if (strcmp(value, "true") == 0) {
+		op->kind = FILTER_VALUE_BOOL;
+		op->number = 1;
+	} else if (strcmp(value, "false") == 0) {
+		op->kind = FILTER_VALUE_BOOL;
+	} else if (len > 0) {
+		op->number = strtod(value, &end);
+		if (*end == '\0') {
+			op->kind = FILTER_VALUE_NUMBER;
+		}
+	}
+}
+
+/****************************************************
+ * emit()
+ */
+static bool emit(canopy_filter_program_t *program, uint8_t code) {
+	if (program->nops >= CANOPY_FILTER_PROGRAM_MAX_OPS) {
+		return false;
+	}
+	memset(&program->ops[program->nops], 0, sizeof(program->ops[0]));
+	program->ops[program->nops++].code = code;
+	return true;
+}
+
+/****************************************************
+ * canopy_filter_compile()
+ */
+canopy_error canopy_filter_compile(const canopy_filter_root_t *root,
+		canopy_filter_program_t *program) {
+	uint8_t stack[CANOPY_FILTER_PROGRAM_MAX_OPS];	/* pending operators */
+	const canopy_filter_t *ft;
+	struct canopy_filter_op *op;
+	canopy_error err;
+	int top = 0;
+	uint8_t code;
+
+	if (root == NULL || program == NULL) {
+		return CANOPY_ERROR_BAD_PARAM;
+	}
+	memset(program, 0, sizeof(*program));
+	err = check_filter(root);
+	if (err != CANOPY_SUCCESS) {
+		return err;
+	}
+
+	for (ft = root->head; ft != NULL; ft = ft->next) {
+		switch (ft->type) {
+		case TERM:
+			if (ft->onion.term.relation <= CANOPY_RELATION_OP_INVALID
+					|| ft->onion.term.relation > CANOPY_LTE
+					|| ft->onion.term.variable_name == NULL
+					|| ft->onion.term.value == NULL) {
+				return CANOPY_ERROR_BAD_PARAM;
+			}
+			if (!emit(program, FILTER_OP_TERM)) {
+				return CANOPY_ERROR_BUFFER_TOO_SMALL;
+			}
+			op = &program->ops[program->nops - 1];
+			op->relation = ft->onion.term.relation;
+			if (!filter_slot(program, ft->onion.term.variable_name,
+					&op->slot)) {
+				return CANOPY_ERROR_BUFFER_TOO_SMALL;
+			}
+			filter_value(op, ft->onion.term.value);
+			break;
+
+		case UNARY:
+			if (ft->onion.unary.type == NOT) {
+				stack[top++] = FILTER_OP_NOT;
+				break;
+			}
+			if (ft->onion.unary.variable_name == NULL) {
+				return CANOPY_ERROR_BAD_PARAM;
+			}
+			if (!emit(program, FILTER_OP_HAS)) {
+				return CANOPY_ERROR_BUFFER_TOO_SMALL;
+			}
+			op = &program->ops[program->nops - 1];
+			if (!filter_slot(program, ft->onion.unary.variable_name,
+					&op->slot)) {
+				return CANOPY_ERROR_BUFFER_TOO_SMALL;
+			}
+			break;
+
+		case BOOLEAN:
+			/*
+			 * Everything pending that binds at least as tightly goes first:
+			 * NOTs and ANDs before an AND, anything but a paren before an OR.
+			 */
+			code = (ft->onion.boolean.type == AND)
+					? FILTER_OP_AND : FILTER_OP_OR;
+			while (top > 0 && stack[top - 1] != FILTER_OP_OPEN
+					&& stack[top - 1] <= code) {
+				if (!emit(program, stack[--top])) {
+					return CANOPY_ERROR_BUFFER_TOO_SMALL;
+				}
+			}
+			stack[top++] = code;
+			break;
+
+		case PAREN:
+			if (ft->onion.paren.open) {
+				stack[top++] = FILTER_OP_OPEN;
+				break;
+			}
+			while (stack[top - 1] != FILTER_OP_OPEN) {
+				if (!emit(program, stack[--top])) {
+					return CANOPY_ERROR_BUFFER_TOO_SMALL;
+				}
+			}
+			top--;
+			break;
+
+		default:
+			return CANOPY_ERROR_BAD_PARAM;
+		}
+		if (top >= CANOPY_FILTER_PROGRAM_MAX_OPS) {
+			return CANOPY_ERROR_BUFFER_TOO_SMALL;
+		}
+	}
+	while (top > 0) {
+		if (!emit(program, stack[--top])) {
+			return CANOPY_ERROR_BUFFER_TOO_SMALL;
+		}
+	}
+	return CANOPY_SUCCESS;
+}
+
+/****************************************************
+ * relate()
+ *
+ * 	Applies <relation> to the result of a three-way comparison.
+ */
+static inline bool relate(uint8_t relation, int cmp) {
+	switch (relation) {
+	case CANOPY_EQ:		return cmp == 0;
+	case CANOPY_NEQ:	return cmp != 0;
+	case CANOPY_GT:		return cmp > 0;
+	case CANOPY_GTE:	return cmp >= 0;
+	case CANOPY_LT:		return cmp < 0;
+	case CANOPY_LTE:	return cmp <= 0;
+	default:			return false;
+	}
+}
+
+#define COMPARE(a, b)	(((a) > (b)) - ((a) < (b)))
+
+/****************************************************
+ * term()
+ *
+ * 	Evaluates a term against <var>, which may be NULL.
+ */
+static bool term(const struct canopy_filter_op *op,
+		const struct canopy_var *var) {
+	const struct canopy_var_value *val;
+	double number;
+	int cmp;
+
+	if (var == NULL || !var->set) {
+		return false;
+	}
+	val = &var->val;
+
+	switch (var->type) {
+	case CANOPY_VAR_DATATYPE_STRING:
+		cmp = strncmp(val->value.val_string, op->string, op->string_len);
+		if (cmp == 0 && val->value.val_string[op->string_len] != '\0') {
+			cmp = 1;
+		}
+		return relate(op->relation, cmp);
+	case CANOPY_VAR_DATATYPE_BOOL:
+		if (op->kind != FILTER_VALUE_BOOL) {
+			return false;
+		}
+		return relate(op->relation, COMPARE((double)val->value.val_bool,
+				op->number));
+	case CANOPY_VAR_DATATYPE_FLOAT32:
+		if (op->kind != FILTER_VALUE_NUMBER) {
+			return false;
+		}
+		/* 80.5 is 80.5f, but 21.1 isn't 21.1f */
+		return relate(op->relation, COMPARE(val->value.val_float,
+				(float)op->number));
+	case CANOPY_VAR_DATATYPE_INT8:		number = val->value.val_int8; break;
+	case CANOPY_VAR_DATATYPE_INT16:		number = val->value.val_int16; break;
+	case CANOPY_VAR_DATATYPE_INT32:		number = val->value.val_int32; break;
+	case CANOPY_VAR_DATATYPE_UINT8:		number = val->value.val_uint8; break;
+	case CANOPY_VAR_DATATYPE_UINT16:	number = val->value.val_uint16; break;
+	case CANOPY_VAR_DATATYPE_UINT32:	number = val->value.val_uint32; break;
+	case CANOPY_VAR_DATATYPE_FLOAT64:	number = val->value.val_double; break;
+	case CANOPY_VAR_DATATYPE_DATETIME:	number = val->value.val_time; break;
+	default:
+		return false;
+	}
+	if (op->kind != FILTER_VALUE_NUMBER) {
+		return false;
+	}
+	return relate(op->relation, COMPARE(number, op->number));
+}
+
+/****************************************************
+ * run()
+ *
+ * 	Resolves the program's slots against <device>'s variables, in a single
+ * 	pass over them, then runs the program.
+ */
+static bool run(const canopy_filter_program_t *program,
+		canopy_device_t *device) {
+	const struct canopy_var *vars[CANOPY_FILTER_PROGRAM_MAX_VARS];
+	bool stack[CANOPY_FILTER_PROGRAM_MAX_OPS];
+	const struct canopy_filter_op *op;
+	const struct canopy_var *var;
+	int unresolved = program->nslots;
+	int top = 0;
+	int i;
+
+	if (program->nops == 0) {
+		return true;
+	}
+
+	memset(vars, 0, sizeof(vars));
+	for (var = device->vars; var != NULL && unresolved > 0; var = var->next) {
+		const char *name = canopy_var_name(var);
+		for (i = 0; i < program->nslots; i++) {
+			if (vars[i] == NULL && name[0] == program->slots[i][0]
+					&& strcmp(name, program->slots[i]) == 0) {
+				vars[i] = var;
+				unresolved--;
+				break;
+			}
+		}
+	}
+
+	for (op = program->ops; op < &program->ops[program->nops]; op++) {
+		switch (op->code) {
+		case FILTER_OP_TERM:
+			if (op->slot == FILTER_SLOT_WS_CONNECTED) {
+				stack[top++] = op->kind == FILTER_VALUE_BOOL
+						&& relate(op->relation, COMPARE(
+								(double)device->ws_connected, op->number));
+			} else {
+				stack[top++] = term(op, vars[op->slot]);
+			}
+			break;
+		case FILTER_OP_HAS:
+			stack[top++] = op->slot == FILTER_SLOT_WS_CONNECTED
+					|| vars[op->slot] != NULL;
+			break;
+		case FILTER_OP_NOT:
+			stack[top - 1] = !stack[top - 1];
+			break;
+		case FILTER_OP_AND:
+			top--;
+			stack[top - 1] = stack[top - 1] && stack[top];
+			break;
+		case FILTER_OP_OR:
+			top--;
+			stack[top - 1] = stack[top - 1] || stack[top];
+			break;
+		}
+	}
+	return stack[0];
+}
+
+/****************************************************
+ * canopy_filter_match()
+ */
+canopy_error canopy_filter_match(const canopy_filter_program_t *program,
+		canopy_device_t *device,
+		bool *out_match) {
+	if (program == NULL || device == NULL || out_match == NULL) {
+		return CANOPY_ERROR_BAD_PARAM;
+	}
+	*out_match = run(program, device);
+	return CANOPY_SUCCESS;
+}
+
+/****************************************************
+ * canopy_filter_select()
+ */
+canopy_error canopy_filter_select(const canopy_filter_program_t *program,
+		canopy_device_t **devices,
+		size_t count,
+		canopy_device_t **matches,
+		size_t *out_count) {
+	size_t i;
+
+	if (program == NULL || (count > 0 && (devices == NULL || matches == NULL))
+			|| out_count == NULL) {
+		return CANOPY_ERROR_BAD_PARAM;
+	}
+	*out_count = 0;
+	for (i = 0; i < count; i++) {
+		if (run(program, devices[i])) {
+			matches[(*out_count)++] = devices[i];
+		}
+	}
+	return CANOPY_SUCCESS;
+}
@@ -14,6 +14,8 @@
 
 #include	<stdint.h>
 #include	<stdbool.h>
+#include	<stdarg.h>
+#include	<stdio.h>
 #include	<string.h>
 
 #include	<jsmn/jsmn.h>
@@ -21,6 +23,7 @@
 #include	<canopy_min_internal.h>
 #include	<canopy_min.h>
 #include	<canopy_os.h>
+#include	<canopy_communication.h>
 
 #ifdef DOCUMENTATION
 struct c_json_state {
@@ -47,12 +50,113 @@ static const char *indent_spaces[] = {
 		"            ",
 		"                ", };
 
+#define C_JSON_CHUNK_SIZE	1024	/* text a chain allocates at a time */
+#define C_JSON_CHAIN_NODES	32		/* and segments */
+
+/*
+ * Memory a chain has allocated, chunks of text and blocks of segments.
+ */
+struct c_json_block {
+	struct c_json_block	*next;
+	char	data[];
+};
+
 /*****************************************************************************/
 
 /*		static definitions go here */
 
 /*****************************************************************************/
 
+static void *chain_alloc(struct c_json_chain *chain, size_t size) {
+	struct c_json_block *block;
+
+	block = (struct c_json_block*)cos_alloc(sizeof(struct c_json_block)
+			+ size);
+	if (block == NULL) {
+		return NULL;
+	}
+	block->next = chain->blocks;
+	chain->blocks = block;
+	return block->data;
+}
+
+/******************************************************************************
+ *	Adds <len> characters at <data> to the end of the chain.
+ */
+static int chain_append(struct c_json_chain *chain, const char *data,
+		size_t len) {
+	struct canopy_http_segment *segment;
+
+	if (len == 0) {
+		return C_JSON_OK;
+	}
+	if (chain->nodes_left == 0) {
+		chain->nodes = (struct canopy_http_segment*)chain_alloc(chain,
+				C_JSON_CHAIN_NODES * sizeof(struct canopy_http_segment));
+		if (chain->nodes == NULL) {
+			return C_JSON_BUFFER_OVERFLOW;
+		}
+		chain->nodes_left = C_JSON_CHAIN_NODES;
+	}
+	segment = chain->nodes++;
+	chain->nodes_left--;
+	segment->data = data;
+	segment->len = len;
+	segment->next = NULL;
+	*chain->tail = segment;
+	chain->tail = &segment->next;
+	chain->len += len;
+	return C_JSON_OK;
+}
+
+/******************************************************************************
+ *	Ends the segment that's been emitted into the buffer since the last one.
+ */
+static int chain_cut(struct c_json_state *state) {
+	struct c_json_chain *chain = state->chain;
+	int err;
+
+	err = chain_append(chain, &state->buffer[chain->start],
+			state->offset - chain->start);
+	chain->start = state->offset;
+	return err;
+}
+
+/******************************************************************************
+ *	Moves on to a new chunk with room for at least <n> characters, and the
+ *	\0.
+ */
+static int chain_grow(struct c_json_state *state, int n) {
+	int len = (n < C_JSON_CHUNK_SIZE) ? C_JSON_CHUNK_SIZE : n + 1;
+	char *chunk;
+
+	if (chain_cut(state) != C_JSON_OK) {
+		return C_JSON_BUFFER_OVERFLOW;
+	}
+	chunk = (char*)chain_alloc(state->chain, len);
+	if (chunk == NULL) {
+		cos_log(LOG_LEVEL_DEBUG, "out of memory chain_grow()");
+		return C_JSON_BUFFER_OVERFLOW;
+	}
+	chunk[0] = '\0';
+	state->buffer = chunk;
+	state->buffer_len = len;
+	state->offset = 0;
+	state->chain->start = 0;
+	return C_JSON_OK;
+}
+
+/******************************************************************************
+ *	Makes room for <n> characters, and the \0, if emitting into a chain.
+ *	Fixed buffers are as big as they are.
+ */
+static int reserve(struct c_json_state *state, int n) {
+	if (state->chain == NULL || state->offset + n < state->buffer_len) {
+		return C_JSON_OK;
+	}
+	return chain_grow(state, n);
+}
+
 /*******************************************************
  * Initialize the buffer to use to build json string
  */
@@ -67,6 +171,42 @@ int c_json_buffer_init(struct c_json_state *state, char *buffer, int len) {
 	return C_JSON_OK;
 }
 
+/*******************************************************
+ * Initialize <state> to emit into <chain>
+ */
+int c_json_chain_init(struct c_json_state *state, struct c_json_chain *chain) {
+
+	memset(state, 0, sizeof(struct c_json_state));
+	memset(chain, 0, sizeof(struct c_json_chain));
+	chain->tail = &chain->head;
+	state->chain = chain;
+	return chain_grow(state, 0);
+}
+
+/*******************************************************
+ * Ends the chain <state> has been emitting into
+ */
+int c_json_chain_close(struct c_json_state *state) {
+	return chain_cut(state);
+}
+
+/*******************************************************
+ * Frees what the chain allocated
+ */
+void c_json_chain_free(struct c_json_chain *chain) {
+	struct c_json_block *block;
+
+	while (chain->blocks != NULL) {
+		block = chain->blocks;
+		chain->blocks = block->next;
+		cos_free(block);
+	}
+	chain->head = NULL;
+	chain->tail = &chain->head;
+	chain->len = 0;
+	chain->nodes_left = 0;
+}
+
 /******************************************************************************
  *	Check to see if there's space left in the buffer.
  */
@@ -76,6 +216,9 @@ static int check_buffer_length(struct c_json_state *state) {
 	 * data using snprintf. This makes sure there is no mem corruption in
 	 * json set operations.
 	 */
+	if (reserve(state, 1) != C_JSON_OK) {
+		return -1;
+	}
 	if (state->offset >= (state->buffer_len - 1)) {
 		cos_log(LOG_LEVEL_DEBUG, "buffer out of space check_buffer_length()");
 		return -1;
@@ -83,6 +226,53 @@ static int check_buffer_length(struct c_json_state *state) {
 		return 0;
 }
 
+/******************************************************************************
+ *	Moves past the <n> characters snprintf() said it wrote, or to the end of
+ *	the buffer if they didn't all fit.
+ */
+static void advance(struct c_json_state *state, int n) {
+	state->offset += n;
+	if (state->offset > state->buffer_len - 1) {
+		state->offset = state->buffer_len - 1;
+	}
+}
+
+/******************************************************************************
+ *	snprintf()s into the buffer and moves past what was written.  In a chain,
+ *	if it didn't all fit it's written again into a new chunk.
+ */
+static int vemitf(struct c_json_state *state, const char *format,
+		va_list ap) {
+	va_list again;
+	int n;
+
+	va_copy(again, ap);
+	n = vsnprintf(&state->buffer[state->offset],
+			state->buffer_len - state->offset, format, ap);
+	if (state->chain != NULL && state->offset + n >= state->buffer_len) {
+		state->buffer[state->offset] = '\0';
+		if (chain_grow(state, n) != C_JSON_OK) {
+			va_end(again);
+			return C_JSON_BUFFER_OVERFLOW;
+		}
+		n = vsnprintf(&state->buffer[state->offset],
+				state->buffer_len - state->offset, format, again);
+	}
+	va_end(again);
+	advance(state, n);
+	return C_JSON_OK;
+}
+
+static int emitf(struct c_json_state *state, const char *format, ...) {
+	va_list ap;
+	int err;
+
+	va_start(ap, format);
+	err = vemitf(state, format, ap);
+	va_end(ap);
+	return err;
+}
+
 /*
  * These procedures emit tokens into the buffer supplied above.
  */
@@ -98,11 +288,12 @@ int c_json_emit_open_object(struct c_json_state *state) {
 				"buffer out of space c_json_emit_open_object()");
 		return C_JSON_BUFFER_OVERFLOW;
 	}
-	snprintf(&state->buffer[state->offset], state->buffer_len - state->offset,
-			"%s%s{\n", indent_spaces[state->indent],
-            (state->prepend_separator[state->stack_depth] ? ", " : ""));
+	if (emitf(state, "%s%s{\n", indent_spaces[state->indent],
+				(state->prepend_separator[state->stack_depth] ? ", " : ""))
+			!= C_JSON_OK) {
+		return C_JSON_BUFFER_OVERFLOW;
+	}
 	state->indent++;
-	state->offset = strlen(state->buffer);
 
 	state->stack_depth++;
     COS_ASSERT(state->stack_depth < MAX_JSON_STACK_DEPTH);
@@ -121,9 +312,9 @@ int c_json_emit_close_object(struct c_json_state *state) {
 		return C_JSON_BUFFER_OVERFLOW;
 	}
 	state->indent--;
-	snprintf(&state->buffer[state->offset], state->buffer_len - state->offset,
-			"%s}\n", indent_spaces[state->indent]);
-	state->offset = strlen(state->buffer);
+	if (emitf(state, "%s}\n", indent_spaces[state->indent]) != C_JSON_OK) {
+		return C_JSON_BUFFER_OVERFLOW;
+	}
 
     COS_ASSERT(state->stack_depth > 0);
     state->stack_depth--;
@@ -142,10 +333,10 @@ int c_json_emit_open_array(struct c_json_state *state) {
 				"buffer out of space c_json_emit_open_array()");
 		return C_JSON_BUFFER_OVERFLOW;
 	}
-	snprintf(&state->buffer[state->offset], state->buffer_len - state->offset,
-			"%s[\n", indent_spaces[state->indent]);
+	if (emitf(state, "%s[\n", indent_spaces[state->indent]) != C_JSON_OK) {
+		return C_JSON_BUFFER_OVERFLOW;
+	}
 	state->indent++;
-	state->offset = strlen(state->buffer);
 
 	return C_JSON_OK;
 }
@@ -161,10 +352,10 @@ int c_json_emit_close_array(struct c_json_state *state) {
 		return C_JSON_BUFFER_OVERFLOW;
 	}
 	state->indent--;
-	snprintf(&state->buffer[state->offset], state->buffer_len - state->offset,
-			"%s]\n", indent_spaces[state->indent]);
+	if (emitf(state, "%s]\n", indent_spaces[state->indent]) != C_JSON_OK) {
+		return C_JSON_BUFFER_OVERFLOW;
+	}
 	// snprintf(&state->buffer[state->offset], state->buffer_len - state->offset, "\n    ]\n");
-	state->offset = strlen(state->buffer);
     state->prepend_separator[state->stack_depth] = true;
 	return C_JSON_OK;
 }
@@ -182,15 +373,143 @@ int c_json_emit_name_and_value(struct c_json_state *state, char *name,
 				"buffer out of space c_json_emit_name_and_value()");
 		return C_JSON_BUFFER_OVERFLOW;
 	}
-	snprintf(&state->buffer[state->offset], state->buffer_len - state->offset,
-			"%s%s\"%s\" : %s  \n", indent_spaces[state->indent], 
-            (state->prepend_separator[state->stack_depth] ? ", " : ""),
-            name, value);
-	state->offset = strlen(state->buffer);
+	if (emitf(state, "%s%s\"%s\" : %s  \n", indent_spaces[state->indent], 
+				(state->prepend_separator[state->stack_depth] ? ", " : ""),
+				name, value) != C_JSON_OK) {
+		return C_JSON_BUFFER_OVERFLOW;
+	}
     state->prepend_separator[state->stack_depth] = true;
 	return C_JSON_OK;
 }
 
+/******************************************************************************
+ * Emits the first half of c_json_emit_name_and_value():
+ * 		"name" :
+ * or (if state->prepend_separator[state->stack_depth] is true):
+ * 		, "name" :
+ */
+int c_json_emit_name(struct c_json_state *state, const char *name) {
+	if (check_buffer_length(state) != 0) {
+		cos_log(LOG_LEVEL_DEBUG, "buffer out of space c_json_emit_name()");
+		return C_JSON_BUFFER_OVERFLOW;
+	}
+	return emitf(state, "%s%s\"%s\" : ", indent_spaces[state->indent],
+			(state->prepend_separator[state->stack_depth] ? ", " : ""),
+			name);
+}
+
+/******************************************************************************
+ * Emits the second half, the value as <format> makes it.
+ */
+int c_json_emit_valuef(struct c_json_state *state, const char *format, ...) {
+	va_list ap;
+	int err;
+
+	if (check_buffer_length(state) != 0) {
+		cos_log(LOG_LEVEL_DEBUG, "buffer out of space c_json_emit_valuef()");
+		return C_JSON_BUFFER_OVERFLOW;
+	}
+	va_start(ap, format);
+	err = vemitf(state, format, ap);
+	va_end(ap);
+	if (err != C_JSON_OK || emitf(state, "  \n") != C_JSON_OK) {
+		return C_JSON_BUFFER_OVERFLOW;
+	}
+	state->prepend_separator[state->stack_depth] = true;
+	return C_JSON_OK;
+}
+
+/******************************************************************************
+ * Emits <value> quoted and escaped, preceded by "<name>" : if <name> isn't
+ * NULL.  Nothing is left in the buffer if it doesn't all fit.
+ */
+static int emit_quoted(struct c_json_state *state, const char *name,
+		const char *value) {
+	static const char hex[] = "0123456789abcdef";
+	int offset;
+	int room;
+
+	if (check_buffer_length(state) != 0) {
+		cos_log(LOG_LEVEL_DEBUG,
+				"buffer out of space c_json_emit_string()");
+		return C_JSON_BUFFER_OVERFLOW;
+	}
+	if (state->chain != NULL) {
+		/* enough for every character escaped as \u00XX */
+		room = strlen(indent_spaces[state->indent]) + 2
+				+ (name != NULL ? strlen(name) + 5 : 0)
+				+ 6 * strlen(value) + 4;
+		if (reserve(state, room) != C_JSON_OK) {
+			return C_JSON_BUFFER_OVERFLOW;
+		}
+	}
+	offset = state->offset;
+	offset += snprintf(&state->buffer[offset], state->buffer_len - offset,
+			"%s%s", indent_spaces[state->indent],
+			(state->prepend_separator[state->stack_depth] ? ", " : ""));
+	if (name != NULL && offset < state->buffer_len) {
+		offset += snprintf(&state->buffer[offset], state->buffer_len - offset,
+				"\"%s\" : ", name);
+	}
+	if (offset < state->buffer_len) {
+		state->buffer[offset++] = '"';
+	}
+	for (; offset < state->buffer_len && *value != '\0'; value++) {
+		unsigned char c = (unsigned char)*value;
+		/* room for this character, escaped, and the closing "\n */
+		room = state->buffer_len - offset - 3;
+		if (c == '"' || c == '\\') {
+			if (room < 2) {
+				break;
+			}
+			state->buffer[offset++] = '\\';
+			state->buffer[offset++] = c;
+		} else if (c < 0x20) {
+			if (room < 6) {
+				break;
+			}
+			offset += sprintf(&state->buffer[offset], "\\u00%c%c",
+					hex[c >> 4], hex[c & 0xf]);
+		} else {
+			if (room < 1) {
+				break;
+			}
+			state->buffer[offset++] = c;
+		}
+	}
+	if (*value != '\0' || offset + 3 > state->buffer_len) {
+		state->buffer[state->offset] = '\0';
+		return C_JSON_BUFFER_OVERFLOW;
+	}
+	state->buffer[offset++] = '"';
+	state->buffer[offset++] = '\n';
+	state->buffer[offset] = '\0';
+	state->offset = offset;
+	state->prepend_separator[state->stack_depth] = true;
+	return C_JSON_OK;
+}
+
+/******************************************************************************
+ * Emits a string array element, quoted and escaped:
+ * 		"value"
+ * or (if state->prepend_separator[state->stack_depth] is true):
+ * 		, "value"
+ */
+int c_json_emit_string(struct c_json_state *state, const char *value) {
+	return emit_quoted(state, NULL, value);
+}
+
+/******************************************************************************
+ * Emits:
+ * 		"name" : "value"
+ * or (if state->prepend_separator[state->stack_depth] is true):
+ * 		, "name" : "value"
+ */
+int c_json_emit_name_and_string(struct c_json_state *state, const char *name,
+		const char *value) {
+	return emit_quoted(state, name, value);
+}
+
 /******************************************************************************
  * Emits:
  * 		"name" : {
@@ -203,12 +522,12 @@ int c_json_emit_name_and_object(struct c_json_state *state, char *name) {
 				"buffer out of space c_json_emit_name_and_object()");
 		return C_JSON_BUFFER_OVERFLOW;
 	}
-	snprintf(&state->buffer[state->offset], state->buffer_len - state->offset,
-			"%s%s\"%s\" : {  \n", indent_spaces[state->indent],
-            (state->prepend_separator[state->stack_depth] ? ", " : ""),
-            name);
+	if (emitf(state, "%s%s\"%s\" : {  \n", indent_spaces[state->indent],
+				(state->prepend_separator[state->stack_depth] ? ", " : ""),
+				name) != C_JSON_OK) {
+		return C_JSON_BUFFER_OVERFLOW;
+	}
 	state->indent++;
-	state->offset = strlen(state->buffer);
 
 	state->stack_depth++;
     COS_ASSERT(state->stack_depth < MAX_JSON_STACK_DEPTH);
@@ -228,12 +547,34 @@ int c_json_emit_name_and_array(struct c_json_state *state, char *name) {
 				"buffer out of space c_json_emit_name_and_array()");
 		return C_JSON_BUFFER_OVERFLOW;
 	}
-	snprintf(&state->buffer[state->offset], state->buffer_len - state->offset,
-			"%s%s\"%s\" : [  \n", indent_spaces[state->indent], 
-            (state->prepend_separator[state->stack_depth] ? ", " : ""),
-            name);
+	if (emitf(state, "%s%s\"%s\" : [  \n", indent_spaces[state->indent], 
+				(state->prepend_separator[state->stack_depth] ? ", " : ""),
+				name) != C_JSON_OK) {
+		return C_JSON_BUFFER_OVERFLOW;
+	}
 	state->indent++;
-	state->offset = strlen(state->buffer);
+	return C_JSON_OK;
+}
+
+/******************************************************************************
+ * Emits <len> characters of <text> as they are.  A chain gets <text> itself
+ * rather than a copy.
+ */
+int c_json_emit_text(struct c_json_state *state, const char *text, int len) {
+	if (state->chain != NULL) {
+		if (chain_cut(state) != C_JSON_OK
+				|| chain_append(state->chain, text, len) != C_JSON_OK) {
+			return C_JSON_BUFFER_OVERFLOW;
+		}
+		return C_JSON_OK;
+	}
+	if (state->offset + len >= state->buffer_len) {
+		cos_log(LOG_LEVEL_DEBUG, "buffer out of space c_json_emit_text()");
+		return C_JSON_BUFFER_OVERFLOW;
+	}
+	memcpy(&state->buffer[state->offset], text, len);
+	state->offset += len;
+	state->buffer[state->offset] = '\0';
 	return C_JSON_OK;
 }
 
@@ -314,3 +655,141 @@ int c_json_get_result_key(char* js, int js_len, jsmntok_t *token, int tok_len,
 	return C_JSON_PARSE_ERROR;
 }
 
+/***************************************************************************
+ * Returns the offset of the token following the value at token[offset].
+ *
+ * 	Every token's size is the number of values directly inside it: the names
+ * 	of an object, the single value following a name, the elements of an
+ * 	array.  So the value ends once all of those have been stepped over.
+ */
+int c_json_skip_token(jsmntok_t *token, int tok_len, int offset) {
+	int pending = 1;
+	while (pending > 0 && offset < tok_len) {
+		pending += token[offset].size - 1;
+		offset++;
+	}
+	return offset;
+}
+
+
+/***************************************************************************
+ * Copies the string token into <dest>, undoing the single character escapes.
+ */
+int c_json_copy_string(char *dest, int len, const char *js,
+		const jsmntok_t *token) {
+	const char *src = &js[token->start];
+	const char *end = &js[token->end];
+	int n = 0;
+
+	if (token->type != JSMN_STRING) {
+		return C_JSON_PARSE_ERROR;
+	}
+	for (; src < end; src++) {
+		char c = *src;
+		if (c == '\\' && src + 1 < end && src[1] != 'u') {
+			src++;
+			switch (*src) {
+				case 'b': c = '\b'; break;
+				case 'f': c = '\f'; break;
+				case 'n': c = '\n'; break;
+				case 'r': c = '\r'; break;
+				case 't': c = '\t'; break;
+				default: c = *src; break;
+			}
+		}
+		if (n + 1 >= len) {
+			return C_JSON_PARSE_ERROR;
+		}
+		dest[n++] = c;
+	}
+	dest[n] = '\0';
+	return C_JSON_OK;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+
+/*
+ * Property tables.  See canopy_min_internal.h.
+ */
+
+const struct c_property *c_property_find(const struct c_property *table,
+		int count, const char *name, int name_len) {
+	int i;
+	for (i = 0; i < count; i++) {
+		if (strncmp(table[i].tag, name, name_len) == 0
+				&& table[i].tag[name_len] == '\0') {
+			return &table[i];
+		}
+	}
+	return NULL;
+}
+
+int c_properties_dirty(const struct c_property *table, int count,
+		const void *object) {
+	int i;
+	int n = 0;
+	for (i = 0; i < count; i++) {
+		if (table[i].dirty != C_PROPERTY_NOT_SENT
+				&& *(const bool*)((const char*)object + table[i].dirty)) {
+			n++;
+		}
+	}
+	return n;
+}
+
+void c_properties_clean(const struct c_property *table, int count,
+		void *object) {
+	int i;
+	for (i = 0; i < count; i++) {
+		if (table[i].dirty != C_PROPERTY_NOT_SENT) {
+			*(bool*)((char*)object + table[i].dirty) = false;
+		}
+	}
+}
+
+int c_json_parse_property(const struct c_property *property, void *object,
+		const char *js, const jsmntok_t *value) {
+	char *member = (char*)object + property->offset;
+
+	if (property->type == C_PROPERTY_STRING) {
+		if (c_json_copy_string(member, property->size, js, value)
+				!= C_JSON_OK) {
+			return C_JSON_PARSE_ERROR;
+		}
+	} else {
+		if (value->type != JSMN_PRIMITIVE
+				|| (js[value->start] != 't' && js[value->start] != 'f')) {
+			return C_JSON_PARSE_ERROR;
+		}
+		*(bool*)member = (js[value->start] == 't');
+	}
+	if (property->dirty != C_PROPERTY_NOT_SENT) {
+		*(bool*)((char*)object + property->dirty) = false;
+	}
+	return C_JSON_OK;
+}
+
+int c_json_emit_properties(struct c_json_state *state,
+		const struct c_property *table, int count, const void *object) {
+	int i;
+	int err;
+
+	for (i = 0; i < count; i++) {
+		const char *member = (const char*)object + table[i].offset;
+		if (table[i].dirty == C_PROPERTY_NOT_SENT
+				|| !*(const bool*)((const char*)object + table[i].dirty)) {
+			continue;
+		}
+		if (table[i].type == C_PROPERTY_STRING) {
+			err = c_json_emit_name_and_string(state, table[i].tag, member);
+		} else {
+			err = c_json_emit_name_and_value(state, (char*)table[i].tag,
+					*(const bool*)member ? "true" : "false");
+		}
+		if (err != C_JSON_OK) {
+			return err;
+		}
+	}
+	return C_JSON_OK;
+}
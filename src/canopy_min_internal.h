@@ -16,6 +16,7 @@
 #define CANOPY_MIN_INTERNAL_INCLUDED
 
 #include	<stdbool.h>
+#include	<stddef.h>
 #include	<stdint.h>
 
 #include	<jsmn/jsmn.h>
@@ -28,6 +29,59 @@
  */
 canopy_error canopy_cleanup_remote(struct canopy_remote *remote);
 
+/*
+ * canopy_remote_http_request(), with the retries and circuit breaker of the
+ * remote's params, or, if the remote's a group, routed to its best endpoint.
+ * The library's requests all go through this.
+ */
+struct canopy_http_request;
+struct canopy_http_response;
+canopy_error c_remote_request(struct canopy_remote *remote,
+		const struct canopy_http_request *request,
+		struct canopy_http_response *response,
+		struct canopy_barrier *barrier);
+
+/*
+ * The error for a reply whose status isn't the 200 that was expected.
+ */
+canopy_error c_status_error(int status_code);
+
+/*
+ * The wire format <remote> speaks, and its falling back to JSON for good
+ * when the remote turns CBOR down.  Under the remote's sync_lock.
+ */
+canopy_wire_format c_remote_wire_format(struct canopy_remote *remote);
+void c_remote_fall_back_to_json(struct canopy_remote *remote);
+
+/*
+ * CANOPY_SUCCESS if a call made with <barrier> (which may be NULL) can carry
+ * on, or CANOPY_ERROR_CANCELLED or CANOPY_ERROR_TIMEOUT if it's to give up.
+ */
+canopy_error c_barrier_check(struct canopy_barrier *barrier);
+
+/*
+ * Waits up to <ms> for <event>, but no longer than <barrier> allows, and
+ * not at all if it's cancelled.  Cancelling it signals <event>.  Called
+ * without the remote's sync_lock held.
+ */
+void c_barrier_wait(struct canopy_barrier *barrier, cos_event_t *event,
+		cos_time_t ms);
+
+/*
+ * A caller waiting for the sync in flight for its device to finish, so it
+ * can ride on the next one (see canopy_device_sync_with_remote()).  They're
+ * on device->sync_waiters, then device->sync_riders once that's started,
+ * under remote->sync_lock.
+ */
+struct c_sync_waiter {
+	struct c_sync_waiter	*next;
+	cos_event_t				*wake;
+	bool					pull;		/* wants the response parsed */
+	bool					lead;		/* is to make the next request */
+	bool					finished;	/* and <result> is its result */
+	canopy_error			result;
+};
+
 
 /******************************************************************************/
 
@@ -51,6 +105,8 @@ canopy_error canopy_cleanup_remote(struct canopy_remote *remote);
 #define		TAG_DEVICE_ID			"device_id"
 #define		TAG_UUID				"uuid"
 #define		TAG_SECRET_KEY	        "secret_key"
+#define		TAG_IDS					"ids"
+#define		TAG_DEVICE_SECRET_KEYS	"device_secret_keys"
 
 
 /*					status object tags */
@@ -83,6 +139,24 @@ struct c_json_state {
 	int		indent;
     bool    prepend_separator[MAX_JSON_STACK_DEPTH];
     int     stack_depth;
+	struct c_json_chain	*chain;	/* set when emitting into a chain */
+};
+
+/*
+ * A JSON emit target that isn't one fixed buffer but a chain of segments
+ * (see canopy_http_segment).  What the emitters format goes into chunks
+ * the chain allocates as it needs them, so it never runs out of room, and
+ * text that's already rendered somewhere, like a device's "var_decls", is
+ * put in the chain where it is rather than copied.
+ */
+struct c_json_chain {
+	struct canopy_http_segment	*head;	/* the segments, in order */
+	struct canopy_http_segment	**tail;
+	size_t	len;		/* total length of the segments */
+	int		start;		/* where the open segment starts in the buffer */
+	struct canopy_http_segment	*nodes;	/* unused segments */
+	int		nodes_left;
+	struct c_json_block	*blocks;	/* everything allocated, to free */
 };
 
 #if 0
@@ -108,6 +182,16 @@ typedef enum {
  */
 extern int c_json_buffer_init(struct c_json_state *state, char *buffer, int len);
 
+/***************************************************************************
+ * Initialize <state> to emit into <chain>.  Once the emitting's done,
+ * c_json_chain_close() ends the chain, and c_json_chain_free() frees what
+ * it allocated.
+ */
+extern int c_json_chain_init(struct c_json_state *state,
+		struct c_json_chain *chain);
+extern int c_json_chain_close(struct c_json_state *state);
+extern void c_json_chain_free(struct c_json_chain *chain);
+
 /***************************************************************************
  * These procedures emit tokens into the buffer supplied above.
  */
@@ -141,6 +225,16 @@ int c_json_emit_close_array(struct c_json_state *state);
  */
 int c_json_emit_name_and_value(struct c_json_state *state, char *name, char *value);
 
+/***************************************************************************
+ * c_json_emit_name_and_value() in two halves, for a value that's formatted
+ * in place rather than passed as a string.  c_json_emit_name() emits:
+ * 		"name" :
+ * and c_json_emit_valuef() the value, printf() style, after it.  Names
+ * that are already rendered can go in with c_json_emit_text() instead.
+ */
+int c_json_emit_name(struct c_json_state *state, const char *name);
+int c_json_emit_valuef(struct c_json_state *state, const char *format, ...);
+
 /***************************************************************************
  * emits:
  * 		"name" : {
@@ -153,6 +247,27 @@ int c_json_emit_name_and_object(struct c_json_state *state, char *name);
  */
 int c_json_emit_name_and_array(struct c_json_state *state, char *name);
 
+/***************************************************************************
+ * Emits <len> characters of already rendered JSON.  When emitting into a
+ * chain, <text> is put in the chain where it is, so it must stay put until
+ * the chain's been sent.
+ */
+int c_json_emit_text(struct c_json_state *state, const char *text, int len);
+
+/***************************************************************************
+ * emits a string element of an array, escaped:
+ * 		"value"
+ */
+int c_json_emit_string(struct c_json_state *state, const char *value);
+
+/***************************************************************************
+ * Emits:
+ * 		"name" : "value"
+ * with the value quoted and escaped as for c_json_emit_string().
+ */
+int c_json_emit_name_and_string(struct c_json_state *state, const char *name,
+		const char *value);
+
 
 
 /***************************************************************************/
@@ -186,6 +301,86 @@ int c_json_parse_string(char* js, int js_len, jsmntok_t *token, int tok_len, int
  */
 int c_json_get_result_key(char* js, int js_len, jsmntok_t *token, int tok_len, int active, bool *result);
 
+/***************************************************************************
+ * Returns the offset of the token following the value at token[<offset>],
+ * skipping over everything the value contains.
+ */
+int c_json_skip_token(jsmntok_t *token, int tok_len, int offset);
+
+/***************************************************************************
+ * Copies the string token into <dest> of <len> bytes, undoing the single
+ * character escapes (\uXXXX is left as is).  Returns C_JSON_PARSE_ERROR if
+ * the token isn't a string or doesn't fit.
+ */
+int c_json_copy_string(char *dest, int len, const char *js,
+		const jsmntok_t *token);
+
+/******************************************************************************/
+/******************************************************************************/
+
+/*
+ * Property tables.
+ *
+ * 	The plain properties of an object (a device's friendly_name, a user's
+ * 	email, ...) are described by a table, which drives both parsing the
+ * 	object and emitting its local changes, in JSON or CBOR.  Each entry
+ * 	gives the member's offset and size, and the offset of the bool that says
+ * 	the property was changed locally and must be sent (C_PROPERTY_NOT_SENT
+ * 	for those that only come from the remote).  Parsing a property clears
+ * 	its dirty flag.
+ */
+typedef enum {
+	C_PROPERTY_STRING,
+	C_PROPERTY_BOOL,
+} c_property_type;
+
+#define	C_PROPERTY_NOT_SENT		((size_t)-1)
+
+struct c_property {
+	const char		*tag;
+	c_property_type	type;
+	size_t			offset;
+	size_t			size;		/* of a string's buffer */
+	size_t			dirty;		/* offset of the dirty flag */
+};
+
+#define C_STRING_PROPERTY(tag, type, member, dirty) \
+	{ (tag), C_PROPERTY_STRING, offsetof(type, member), \
+		sizeof(((type*)0)->member), (dirty) }
+#define C_BOOL_PROPERTY(tag, type, member, dirty) \
+	{ (tag), C_PROPERTY_BOOL, offsetof(type, member), sizeof(bool), (dirty) }
+
+#define C_PROPERTY_COUNT(table)		((int)(sizeof(table) / sizeof((table)[0])))
+
+/*
+ * Returns the entry of <table> whose tag is the <name_len> bytes at <name>,
+ * or NULL.
+ */
+const struct c_property *c_property_find(const struct c_property *table,
+		int count, const char *name, int name_len);
+
+/*
+ * Returns how many properties of <object> are to be sent, and clears their
+ * dirty flags once they have been.
+ */
+int c_properties_dirty(const struct c_property *table, int count,
+		const void *object);
+void c_properties_clean(const struct c_property *table, int count,
+		void *object);
+
+/*
+ * Stores the value token (or item) following a property's name into
+ * <object>.
+ */
+int c_json_parse_property(const struct c_property *property, void *object,
+		const char *js, const jsmntok_t *value);
+
+/*
+ * Emits the "tag" : value of each property of <object> that is to be sent.
+ */
+int c_json_emit_properties(struct c_json_state *state,
+		const struct c_property *table, int count, const void *object);
+
 /******************************************************************************/
 /******************************************************************************/
 
@@ -230,6 +425,28 @@ canopy_error c_json_emit_vars(struct canopy_device *device,
 		bool emit_obj,
         bool clear_dirty);
 
+/***************************************************************************
+ * 	c_vars_reported()
+ *
+ * 	Once the request that variables were emitted into with <clear_dirty>
+ * 	has been answered, they're no longer in flight.  If it was <delivered>
+ * 	(a 2xx) the reporting policies of those variables measure from the
+ * 	values sent, if not they're all dirty again.  (in canopy_variables.c)
+ */
+void c_vars_reported(struct canopy_device *device, bool delivered);
+
+/***************************************************************************
+ * 	c_vars_due()
+ *
+ * 	Marks dirty the variables of <device> whose reporting policy has a held
+ * 	back change or a heartbeat due by <now>, and returns whether there were
+ * 	any.  <wait>, if not NULL, is lowered to the ms until the next one
+ * 	falls due, if that comes sooner.  Dirty and in flight variables are
+ * 	left alone; a sync settles them.  (in canopy_variables.c)
+ */
+bool c_vars_due(struct canopy_device *device, cos_time_t now,
+		cos_time_t *wait);
+
 
 /***************************************************************************
  * 	c_json_parse_vars()
@@ -257,6 +474,20 @@ canopy_error c_json_parse_device(struct canopy_device *device,
         bool *result_code,              /* the value of "result : " */
         bool check_obj);                /* expect outer-most object */
 
+/***************************************************************************
+ *  c_json_parse_device_at()
+ *
+ *      Like c_json_parse_device(), for the device object at token[<offset>]
+ *  (e.g. an element of a "devices" array).  <next_token> is set to the token
+ *  after the object. (in canopy_device.c)
+ */
+canopy_error c_json_parse_device_at(struct canopy_device *device,
+        char* js, int js_len,           /* the input JSON and total length  */
+        jsmntok_t *token, int tok_len,  /* token array with length */
+        int offset,                     /* token offset of the device object */
+        int *next_token,                /* the token after the object */
+        bool *result_code);             /* the value of "result : " */
+
 /***************************************************************************
  *  c_json_parse_remote_status()
  *
@@ -270,4 +501,228 @@ canopy_error c_json_parse_remote_status(struct canopy_device *device,
         int *next_token);                /* the token after the decls */
 
 
+/******************************************************************************
+ * 	c_query_string()
+ *
+ * 	Copies the URL query string ("?filter=...&sort=...&limit=start,count")
+ * 	for <query>, asking for <count> results starting at <start>, into <buf>.
+ * 	<query> may be NULL.  Compiles <query> if it hasn't been.  (in
+ * 	canopy_filters.c)
+ */
+canopy_error c_query_string(canopy_query_t *query, uint32_t start,
+		uint32_t count, char *buf, size_t len);
+
+/******************************************************************************
+ * 	c_query_cache_get(), c_query_cache_put()
+ *
+ * 	The remote's cache of device query results, keyed by the API path and
+ * 	query string.  _get() fills in <response> with a copy of the cached
+ * 	body, in a buffer from the remote's pool, to hand back with
+ * 	canopy_http_response_release().  _put() quietly does nothing if the
+ * 	cache is off or the result is too big to keep.  Both may be called from
+ * 	any thread.  (in canopy_queries.c)
+ */
+bool c_query_cache_get(struct canopy_remote *remote, const char *key,
+		struct canopy_http_response *response);
+canopy_error c_query_cache_put(struct canopy_remote *remote, const char *key,
+		canopy_wire_format format, const char *body, size_t body_len);
+
+/******************************************************************************
+ * 	c_query_cache_invalidate()
+ *
+ * 	Drops cached results that a sync of <device> has just made stale: those
+ * 	that might include it, and those whose query names one of its variables
+ * 	that went in the request (the ones still in flight, see
+ * 	c_vars_reported()).  Called once the remote has taken the changes rather
+ * 	than on each local write, as until then the cached results are still
+ * 	what the remote would say.  (in canopy_queries.c)
+ */
+void c_query_cache_invalidate(struct canopy_device *device);
+
+/******************************************************************************
+ * 	c_scheduler_dirty()
+ *
+ * 	Tells the scheduler a variable of <device> is waiting to be sent, so a
+ * 	scheduled device is synced right away.  (in canopy_scheduler.c)
+ */
+void c_scheduler_dirty(struct canopy_device *device);
+
+/******************************************************************************
+ * 	c_json_emit_create_devices(), c_json_parse_create_devices()
+ *
+ * 	The request and reply of one batch of canopy_user_create_devices(): asks
+ * 	for <quantity> devices named <names> (which may be NULL), and fills in
+ * 	<devices> with their IDs, names and secret keys.  (in canopy_users.c)
+ */
+canopy_error c_json_emit_create_devices(char *payload, size_t len,
+		uint32_t quantity, char **names, size_t *out_len);
+canopy_error c_json_parse_create_devices(struct canopy_remote *remote,
+		char *js, int js_len,
+		uint32_t quantity,
+		struct canopy_device **devices);
+
+/******************************************************************************
+ * 	c_json_emit_user(), c_json_parse_user()
+ *
+ * 	The body POSTed to /api/user/self (the local changes to <user>) and the
+ * 	user object the remote answers with.  Neither allocates.
+ * 	(in canopy_users.c)
+ */
+canopy_error c_json_emit_user(struct canopy_user *user, char *payload,
+		size_t len, size_t *out_len);
+canopy_error c_json_parse_user(struct canopy_user *user, char *js, int js_len);
+
+/******************************************************************************
+ * 	c_json_parse_devices(), c_cbor_parse_devices()
+ *
+ * 	Parse a page of devices ({"result" : "ok", "devices" : [...]}) into
+ * 	<devices>, initializing at most <max_count> of them for <remote>.
+ * 	<out_count> is set to how many were.  (in canopy_queries.c)
+ */
+canopy_error c_json_parse_devices(struct canopy_remote *remote,
+		char *js, int js_len,
+		size_t max_count,
+		struct canopy_device **devices,
+		size_t *out_count);
+canopy_error c_cbor_parse_devices(struct canopy_remote *remote,
+		const uint8_t *buf, int len,
+		size_t max_count,
+		struct canopy_device **devices,
+		size_t *out_count);
+
+/******************************************************************************
+ * 	CBOR stuff.  (in canopy_cbor.c)
+ *
+ * 	CBOR (RFC 7049) is the binary alternative to JSON for the
+ * 	/api/device/self exchange, see canopy_wire_format.  The document has the
+ * 	same shape as the JSON one: a map with the same tags.
+ */
+struct c_cbor_state {
+	uint8_t	*buffer;	/* the buffer being built in */
+	int		buffer_len;	/* how big is the raw buffer */
+	int		offset;		/* number of bytes emitted */
+	bool	grows;		/* buffer is ours, and reallocated when full */
+};
+
+struct c_cbor_reader {
+	const uint8_t	*buffer;
+	int				buffer_len;
+	int				offset;		/* next byte to read */
+};
+
+typedef enum {
+	C_CBOR_UINT,
+	C_CBOR_INT,			/* negative integer */
+	C_CBOR_BYTES,
+	C_CBOR_TEXT,
+	C_CBOR_ARRAY,
+	C_CBOR_MAP,
+	C_CBOR_BOOL,
+	C_CBOR_NULL,
+	C_CBOR_FLOAT,
+	C_CBOR_BREAK,
+} c_cbor_type;
+
+struct c_cbor_item {
+	c_cbor_type	type;
+	bool		indefinite;	/* map or array without a count */
+	uint64_t	count;		/* map pairs or array entries */
+	uint64_t	uint;
+	int64_t		sint;
+	double		real;
+	bool		boolean;
+	const char	*str;		/* not NUL terminated */
+	int			str_len;
+};
+
+#define	C_CBOR_OK				0x0000
+#define	C_CBOR_BUFFER_OVERFLOW	0x0001
+#define	C_CBOR_PARSE_ERROR		0x0004
+
+int c_cbor_buffer_init(struct c_cbor_state *state, uint8_t *buffer, int len);
+/*
+ * Like c_cbor_buffer_init(), but with a buffer of <len> bytes to start with
+ * that grows as needed.  Free it with cos_free(state->buffer).
+ */
+int c_cbor_buffer_alloc(struct c_cbor_state *state, int len);
+int c_cbor_emit_map(struct c_cbor_state *state, int count);
+int c_cbor_emit_break(struct c_cbor_state *state);
+int c_cbor_emit_string(struct c_cbor_state *state, const char *str, int len);
+int c_cbor_emit_uint(struct c_cbor_state *state, uint64_t value);
+int c_cbor_emit_int(struct c_cbor_state *state, int64_t value);
+int c_cbor_emit_bool(struct c_cbor_state *state, bool value);
+int c_cbor_emit_float32(struct c_cbor_state *state, float value);
+int c_cbor_emit_float64(struct c_cbor_state *state, double value);
+
+int c_cbor_reader_init(struct c_cbor_reader *reader, const uint8_t *buffer,
+		int len);
+int c_cbor_read(struct c_cbor_reader *reader, struct c_cbor_item *item);
+bool c_cbor_more(struct c_cbor_reader *reader, struct c_cbor_item *container,
+		uint64_t i);
+int c_cbor_skip(struct c_cbor_reader *reader, struct c_cbor_item *item);
+bool c_cbor_item_is(struct c_cbor_item *item, const char *str);
+int c_cbor_item_copy_string(struct c_cbor_item *item, char *buf, int len);
+
+/*
+ * CBOR counterparts of c_json_parse_property() and c_json_emit_properties().
+ * The caller counts the properties (c_properties_dirty()) into its map.
+ */
+int c_cbor_parse_property(const struct c_property *property, void *object,
+		struct c_cbor_item *value);
+int c_cbor_emit_properties(struct c_cbor_state *state,
+		const struct c_property *table, int count, const void *object);
+
+/***************************************************************************
+ * 	c_cbor_emit_vardcl(), c_cbor_emit_vars()
+ *
+ * 	CBOR counterparts of c_json_emit_vardcl() and c_json_emit_vars().  Each
+ * 	emits its tag and map into the enclosing map. (in canopy_variables.c)
+ */
+canopy_error c_cbor_emit_vardcl(struct canopy_device *device,
+		struct c_cbor_state *state);
+canopy_error c_cbor_emit_vars(struct canopy_device *device,
+		struct c_cbor_state *state,
+		bool clear_dirty);
+
+/***************************************************************************
+ * 	c_cbor_parse_vardcl(), c_cbor_parse_vars()
+ *
+ * 	CBOR counterparts of c_json_parse_vardcl() and c_json_parse_vars().
+ * 	<map> is the value that followed the tag, already read from <reader>.
+ * 	(in canopy_variables.c)
+ */
+canopy_error c_cbor_parse_vardcl(struct canopy_device *device,
+		struct c_cbor_reader *reader,
+		struct c_cbor_item *map);
+canopy_error c_cbor_parse_vars(struct canopy_device *device,
+		struct c_cbor_reader *reader,
+		struct c_cbor_item *map);
+
+/***************************************************************************
+ *  c_cbor_parse_remote_status()  (in canopy_remotes.c)
+ */
+canopy_error c_cbor_parse_remote_status(struct canopy_device *device,
+		struct c_cbor_reader *reader,
+		struct c_cbor_item *map);
+
+/***************************************************************************
+ *  c_cbor_parse_device()
+ *
+ *      CBOR counterpart of c_json_parse_device(). (in canopy_device.c)
+ */
+canopy_error c_cbor_parse_device(struct canopy_device *device,
+		const uint8_t *buf, int len,
+		bool *result_code);
+
+/***************************************************************************
+ *  c_cbor_parse_device_item()
+ *
+ *      Parses the device map <top>, already read from <reader>.  (in
+ *      canopy_device.c)
+ */
+canopy_error c_cbor_parse_device_item(struct canopy_device *device,
+		struct c_cbor_reader *reader,
+		struct c_cbor_item *top,
+		bool *result_code);
+
 #endif	/* CANOPY_MIN_INTERNAL_INCLUDED */
@@ -0,0 +1,638 @@
+// Copyright 2015 Canopy Services, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include	<stdint.h>
+#include	<stdbool.h>
+#include	<stdio.h>
+#include	<string.h>
+
+#include	<canopy_min.h>
+#include	<canopy_min_internal.h>
+#include	<canopy_communication.h>
+#include	<canopy_os.h>
+
+/*
+ * Queries for lists of devices.
+ *
+ * Each call fetches one page of results, <limits.start> onwards, straight
+ * into the caller's device objects.  Only one page is ever held in a reply
+ * buffer, so a fleet of any size can be walked by advancing
+ * <limits.start> by the number of devices returned until a short page comes
+ * back.
+ *
+ * If the remote's query_cache_ttl is set, pages are also kept for that long
+ * and the same query (down to the limits) is answered from memory.
+ */
+
+#define QUERY_API_MAX_LENGTH    1024
+
+/*
+ * A cached page of results.  The key and the body follow the entry in the
+ * same allocation.
+ */
+struct canopy_query_cache_entry {
+    struct canopy_query_cache_entry *next;
+    cos_time_t          expires;
+    canopy_wire_format  format;
+    size_t              size;       /* of the whole allocation */
+    size_t              body_len;
+    char                *body;
+    char                key[];
+};
+
+static void _cache_unlink(canopy_remote_t *remote,
+        struct canopy_query_cache_entry **link);
+
+/*
+ * _get_devices
+ *
+ *      GETs <path> with the query string for <query> and parses the devices
+ *      in the response into <devices>.
+ */
+static canopy_error _get_devices(canopy_remote_t *remote,
+        const char *path,
+        canopy_query_t *query,
+        size_t max_count,
+        canopy_device_t **devices,
+        size_t *out_count,
+        canopy_barrier_t *barrier) {
+
+    char api[QUERY_API_MAX_LENGTH];
+    struct canopy_http_request request;
+    struct canopy_http_response response;
+    canopy_error err;
+    uint32_t start = 0;
+    uint32_t count;
+    size_t path_len;
+
+    if (devices == NULL || out_count == NULL || max_count == 0) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    *out_count = 0;
+
+    /*
+     * The page is what's left of the limits, but never more than fits in
+     * the caller's array.
+     */
+    count = (max_count > UINT32_MAX) ? UINT32_MAX : (uint32_t)max_count;
+    if (query != NULL && query->limits != NULL) {
+        start = query->limits->start;
+        if (query->limits->count > 0 && query->limits->count < count) {
+            count = query->limits->count;
+        }
+    }
+
+    path_len = strlen(path);
+    if (path_len >= sizeof(api)) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    memcpy(api, path, path_len);
+    err = c_query_string(query, start, count, &api[path_len],
+            sizeof(api) - path_len);
+    if (err != CANOPY_SUCCESS) {
+        cos_log(LOG_LEVEL_ERROR, "Unable to build query for %s: %s\n", path,
+                canopy_error_string(err));
+        return err;
+    }
+
+    if (c_query_cache_get(remote, api, &response)) {
+        goto parse;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.method = CANOPY_HTTP_GET;
+    request.api = api;
+    request.format = c_remote_wire_format(remote);
+
+    err = c_remote_request(remote, &request, &response, barrier);
+    if (err != CANOPY_SUCCESS) {
+        cos_log(LOG_LEVEL_ERROR, "Error during GET %s: %s\n", path,
+                canopy_error_string(err));
+        return err;
+    }
+    if (response.status_code != 200) {
+        err = c_status_error(response.status_code);
+        canopy_http_response_release(remote, &response);
+        return err;
+    }
+    c_query_cache_put(remote, api, response.format, response.body,
+            response.body_len);
+
+parse:
+
+    if (response.format == CANOPY_WIRE_FORMAT_CBOR) {
+        err = c_cbor_parse_devices(remote, (const uint8_t*)response.body,
+                response.body_len, count, devices, out_count);
+    } else {
+        err = c_json_parse_devices(remote, response.body, response.body_len,
+                count, devices, out_count);
+    }
+    canopy_http_response_release(remote, &response);
+    return err;
+}
+
+/****************************************************************************/
+/****************************************************************************/
+
+/*
+ * The query result cache.
+ *
+ * Entries are kept most recently used first, so when the cache is over
+ * query_cache_size the ones at the end go.  Expired entries are dropped when
+ * they're next looked at.  Queries on other threads, and local writes to
+ * devices, get at the cache at any time, so it's only touched holding the
+ * remote's query_cache_lock, and a hit is copied out rather than parsed
+ * where it is.
+ */
+
+static void _cache_lock(canopy_remote_t *remote) {
+    if (remote->query_cache_lock != NULL) {
+        cos_mutex_lock(remote->query_cache_lock);
+    }
+}
+
+static void _cache_unlock(canopy_remote_t *remote) {
+    if (remote->query_cache_lock != NULL) {
+        cos_mutex_unlock(remote->query_cache_lock);
+    }
+}
+
+/*
+ * _cache_unlink
+ *
+ *      Frees the entry <link> points to.
+ */
+static void _cache_unlink(canopy_remote_t *remote,
+        struct canopy_query_cache_entry **link) {
+    struct canopy_query_cache_entry *entry = *link;
+
+    *link = entry->next;
+    remote->query_cache_bytes -= entry->size;
+    cos_free(entry);
+}
+
+/*
+ * _contains
+ *
+ *      Whether <str> appears in the <len> bytes at <buf>.
+ */
+static bool _contains(const char *buf, size_t len, const char *str) {
+    size_t str_len = strlen(str);
+    const char *p = buf;
+    const char *end = buf + len;
+
+    while (str_len > 0 && (size_t)(end - p) >= str_len) {
+        p = memchr(p, str[0], (end - p) - str_len + 1);
+        if (p == NULL) {
+            return false;
+        }
+        if (memcmp(p, str, str_len) == 0) {
+            return true;
+        }
+        p++;
+    }
+    return false;
+}
+
+/*
+ * c_query_cache_get
+ */
+bool c_query_cache_get(canopy_remote_t *remote, const char *key,
+        struct canopy_http_response *response) {
+
+    struct canopy_query_cache_entry **link;
+    struct canopy_query_cache_entry *entry;
+    /* a group has no buffers of its own */
+    canopy_remote_t *owner = (remote->endpoints != NULL) ? remote->endpoints
+            : remote;
+    cos_time_t now;
+    size_t size;
+    bool hit = false;
+
+    memset(response, 0, sizeof(*response));
+    cos_get_time(&now);
+    _cache_lock(remote);
+    link = &remote->query_cache;
+    while ((entry = *link) != NULL) {
+        if (entry->expires <= now) {
+            _cache_unlink(remote, link);
+            continue;
+        }
+        if (strcmp(entry->key, key) == 0) {
+            response->body = canopy_remote_buffer_get(owner,
+                    entry->body_len + 1, &size);
+            if (response->body == NULL) {
+                break;
+            }
+            memcpy(response->body, entry->body, entry->body_len);
+            response->body[entry->body_len] = '\0';
+            response->body_len = entry->body_len;
+            response->format = entry->format;
+            response->status_code = 200;
+            response->pooled = true;
+            response->owner = owner;
+            hit = true;
+
+            /* move it to the front */
+            *link = entry->next;
+            entry->next = remote->query_cache;
+            remote->query_cache = entry;
+            break;
+        }
+        link = &entry->next;
+    }
+    _cache_unlock(remote);
+    return hit;
+}
+
+/*
+ * c_query_cache_put
+ */
+canopy_error c_query_cache_put(canopy_remote_t *remote, const char *key,
+        canopy_wire_format format, const char *body, size_t body_len) {
+
+    struct canopy_query_cache_entry **link;
+    struct canopy_query_cache_entry *entry;
+    size_t limit = remote->params->query_cache_size;
+    size_t key_len = strlen(key);
+    size_t size;
+
+    if (remote->params->query_cache_ttl == 0) {
+        return CANOPY_SUCCESS;
+    }
+    if (limit == 0) {
+        limit = CANOPY_DEFAULT_QUERY_CACHE_SIZE;
+    }
+    size = sizeof(*entry) + key_len + 1 + body_len;
+    if (size > limit) {
+        return CANOPY_SUCCESS;
+    }
+
+    /* the copy's made before taking the lock */
+    entry = (struct canopy_query_cache_entry*)cos_alloc(size);
+    if (entry == NULL) {
+        return CANOPY_ERROR_OUT_OF_MEMORY;
+    }
+    cos_get_time(&entry->expires);
+    entry->expires += (cos_time_t)remote->params->query_cache_ttl * 1000;
+    entry->format = format;
+    entry->size = size;
+    memcpy(entry->key, key, key_len + 1);
+    entry->body = &entry->key[key_len + 1];
+    entry->body_len = body_len;
+    memcpy(entry->body, body, body_len);
+
+    _cache_lock(remote);
+    /* An older copy of the same results goes first */
+    for (link = &remote->query_cache; *link != NULL; ) {
+        if (strcmp((*link)->key, key) == 0) {
+            _cache_unlink(remote, link);
+        } else {
+            link = &(*link)->next;
+        }
+    }
+
+    /* Then the least recently used, until there's room */
+    while (remote->query_cache_bytes + size > limit) {
+        link = &remote->query_cache;
+        while ((*link)->next != NULL) {
+            link = &(*link)->next;
+        }
+        _cache_unlink(remote, link);
+    }
+
+    entry->next = remote->query_cache;
+    remote->query_cache = entry;
+    remote->query_cache_bytes += size;
+    _cache_unlock(remote);
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * _names
+ *
+ *      Whether the query of <key> might name the variable <var_name>.  One
+ *      that has to be escaped in the query string is assumed to be in every
+ *      query.
+ */
+static bool _names(const char *key, const char *var_name) {
+    const char *c;
+
+    for (c = var_name; *c != '\0'; c++) {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z')
+                || (*c >= '0' && *c <= '9')
+                || *c == '-' || *c == '_' || *c == '.' || *c == '~')) {
+            return true;
+        }
+    }
+    return strstr(key, var_name) != NULL;
+}
+
+/*
+ * c_query_cache_invalidate
+ *
+ *      A result might include the device if its ID appears anywhere in the
+ *      body, which works for CBOR as well as JSON as both carry strings as is.
+ */
+void c_query_cache_invalidate(canopy_device_t *device) {
+    struct canopy_query_cache_entry **link;
+    struct canopy_query_cache_entry *entry;
+    const struct canopy_var *var;
+    canopy_remote_t *remote;
+    bool stale;
+
+    if (device == NULL || device->remote == NULL) {
+        return;
+    }
+    remote = device->remote;
+
+    _cache_lock(remote);
+    for (link = &remote->query_cache; (entry = *link) != NULL; ) {
+        stale = device->device_id[0] != '\0' && _contains(entry->body,
+                entry->body_len, device->device_id);
+        for (var = device->vars; var != NULL && !stale; var = var->next) {
+            stale = var->in_flight && _names(entry->key, canopy_var_name(var));
+        }
+        if (stale) {
+            _cache_unlink(remote, link);
+        } else {
+            link = &entry->next;
+        }
+    }
+    _cache_unlock(remote);
+}
+
+/*
+ * canopy_remote_clear_query_cache
+ */
+canopy_error canopy_remote_clear_query_cache(canopy_remote_t *remote) {
+    if (remote == NULL) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    _cache_lock(remote);
+    while (remote->query_cache != NULL) {
+        _cache_unlink(remote, &remote->query_cache);
+    }
+    _cache_unlock(remote);
+    return CANOPY_SUCCESS;
+}
+
+/****************************************************************************/
+/****************************************************************************/
+
+/*
+ * c_json_parse_devices
+ */
+canopy_error c_json_parse_devices(canopy_remote_t *remote,
+        char *js, int js_len,
+        size_t max_count,
+        canopy_device_t **devices,
+        size_t *out_count) {
+
+    jsmntok_t *token;
+    jsmn_parser parser;
+    canopy_error err = CANOPY_SUCCESS;
+    bool result_code = false;
+    int ntokens;
+    int active;
+    int offset;
+    int count;
+    int i, j;
+
+    *out_count = 0;
+
+    /*
+     * A page holds any number of devices, so count the tokens first and
+     * allocate just enough for this page.
+     */
+    jsmn_init(&parser);
+    ntokens = jsmn_parse(&parser, js, js_len, NULL, 0);
+    if (ntokens <= 0) {
+        cos_log(LOG_LEVEL_ERROR, "Error during tokenization of devices: %d\n",
+                ntokens);
+        return CANOPY_ERROR_JSON;
+    }
+    token = (jsmntok_t*)cos_alloc(ntokens * sizeof(jsmntok_t));
+    if (token == NULL) {
+        return CANOPY_ERROR_OUT_OF_MEMORY;
+    }
+    if (c_json_parse_string(js, js_len, token, ntokens, &active) != C_JSON_OK
+            || token[0].type != JSMN_OBJECT) {
+        err = CANOPY_ERROR_JSON;
+        goto done;
+    }
+
+    count = token[0].size;
+    offset = 1;
+    for (i = 0; i < count && err == CANOPY_SUCCESS; i++) {
+        jsmntok_t *name = &token[offset];
+        int name_len = name->end - name->start;
+
+        if (offset + 1 >= ntokens || name->type != JSMN_STRING) {
+            err = CANOPY_ERROR_JSON;
+            break;
+        }
+        offset++;   /* the value */
+
+        if (name_len == strlen(TAG_DEVICES)
+                && strncmp(&js[name->start], TAG_DEVICES, name_len) == 0
+                && token[offset].type == JSMN_ARRAY) {
+            int n = token[offset].size;
+            offset++;   /* the first device */
+            for (j = 0; j < n; j++) {
+                if (*out_count >= max_count) {
+                    /* more than we asked for, ignore the rest */
+                    offset = c_json_skip_token(token, ntokens, offset);
+                    continue;
+                }
+                if (offset >= ntokens || token[offset].type != JSMN_OBJECT) {
+                    err = CANOPY_ERROR_JSON;
+                    break;
+                }
+                canopy_device_init(devices[*out_count], remote, NULL);
+                err = c_json_parse_device_at(devices[*out_count], js, js_len,
+                        token, ntokens, offset, &offset, &result_code);
+                if (err != CANOPY_SUCCESS) {
+                    break;
+                }
+                (*out_count)++;
+            }
+
+        } else if (name_len == strlen(TAG_RESULT)
+                && strncmp(&js[name->start], TAG_RESULT, name_len) == 0) {
+            if (strncmp(&js[token[offset].start], "ok",
+                    token[offset].end - token[offset].start) != 0) {
+                cos_log(LOG_LEVEL_ERROR, "devices query failed\n");
+                err = CANOPY_ERROR_UNKNOWN;
+            }
+            offset++;
+
+        } else {
+            offset = c_json_skip_token(token, ntokens, offset);
+        }
+    }
+
+done:
+    cos_free(token);
+    return err;
+}
+
+/*
+ * c_cbor_parse_devices
+ */
+canopy_error c_cbor_parse_devices(canopy_remote_t *remote,
+        const uint8_t *buf, int len,
+        size_t max_count,
+        canopy_device_t **devices,
+        size_t *out_count) {
+
+    struct c_cbor_reader reader;
+    struct c_cbor_item top;
+    struct c_cbor_item name;
+    struct c_cbor_item value;
+    struct c_cbor_item element;
+    canopy_error err;
+    bool result_code = false;
+    uint64_t i, j;
+
+    *out_count = 0;
+
+    c_cbor_reader_init(&reader, buf, len);
+    if (c_cbor_read(&reader, &top) != C_CBOR_OK || top.type != C_CBOR_MAP) {
+        return CANOPY_ERROR_CBOR;
+    }
+    for (i = 0; c_cbor_more(&reader, &top, i); i++) {
+        if (c_cbor_read(&reader, &name) != C_CBOR_OK
+                || name.type != C_CBOR_TEXT
+                || c_cbor_read(&reader, &value) != C_CBOR_OK) {
+            return CANOPY_ERROR_CBOR;
+        }
+
+        if (c_cbor_item_is(&name, TAG_DEVICES)
+                && value.type == C_CBOR_ARRAY) {
+            for (j = 0; c_cbor_more(&reader, &value, j); j++) {
+                if (c_cbor_read(&reader, &element) != C_CBOR_OK) {
+                    return CANOPY_ERROR_CBOR;
+                }
+                if (*out_count >= max_count) {
+                    if (c_cbor_skip(&reader, &element) != C_CBOR_OK) {
+                        return CANOPY_ERROR_CBOR;
+                    }
+                    continue;
+                }
+                canopy_device_init(devices[*out_count], remote, NULL);
+                err = c_cbor_parse_device_item(devices[*out_count], &reader,
+                        &element, &result_code);
+                if (err != CANOPY_SUCCESS) {
+                    return err;
+                }
+                (*out_count)++;
+            }
+
+        } else if (c_cbor_item_is(&name, TAG_RESULT)) {
+            if (!c_cbor_item_is(&value, "ok")) {
+                cos_log(LOG_LEVEL_ERROR, "devices query failed\n");
+                return CANOPY_ERROR_UNKNOWN;
+            }
+
+        } else if (c_cbor_skip(&reader, &value) != C_CBOR_OK) {
+            return CANOPY_ERROR_CBOR;
+        }
+    }
+    return CANOPY_SUCCESS;
+}
+
+/****************************************************************************/
+/****************************************************************************/
+
+/*
+ * canopy_remote_get_devices
+ */
+canopy_error canopy_remote_get_devices(canopy_remote_t *remote,
+        struct canopy_query *query,
+        size_t max_count,
+        struct canopy_device **devices,
+        size_t *out_count,
+        struct canopy_barrier *barrier) {
+
+    const char *path;
+
+    COS_ASSERT(remote != NULL);
+
+    switch (remote->params->credential_type) {
+        case CANOPY_DEVICE_CREDENTIALS:
+            path = "/api/device/self/devices";
+            break;
+        case CANOPY_USER_CREDENTIALS:
+            path = "/api/user/self/devices";
+            break;
+        default:
+            return CANOPY_ERROR_BAD_CREDENTIALS;
+    }
+    return _get_devices(remote, path, query, max_count, devices, out_count,
+            barrier);
+}
+
+/*
+ * canopy_device_devices
+ */
+canopy_error canopy_device_devices(
+        canopy_remote_t *remote,
+        canopy_device_t *device,
+        canopy_query_t *query,
+        size_t max_count,
+        canopy_device_t **devices,
+        size_t *out_count,
+        canopy_barrier_t *barrier) {
+
+    char path[64];
+
+    COS_ASSERT(remote != NULL);
+    COS_ASSERT(device != NULL);
+
+    if (device->device_id[0] == '\0') {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    snprintf(path, sizeof(path), "/api/device/%s/devices", device->device_id);
+    return _get_devices(remote, path, query, max_count, devices, out_count,
+            barrier);
+}
+
+/*
+ * canopy_user_devices
+ */
+canopy_error canopy_user_devices(
+        canopy_remote_t *remote,
+        canopy_user_t *user,
+        canopy_query_t *query,
+        size_t max_count,
+        canopy_device_t **devices,
+        size_t *out_count,
+        canopy_barrier_t *barrier) {
+
+    char path[QUERY_API_MAX_LENGTH / 4];
+
+    COS_ASSERT(remote != NULL);
+    COS_ASSERT(user != NULL);
+
+    if (user->name[0] == '\0') {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    if (snprintf(path, sizeof(path), "/api/user/%s/devices", user->name)
+            >= (int)sizeof(path)) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    return _get_devices(remote, path, query, max_count, devices, out_count,
+            barrier);
+}
@@ -20,6 +20,7 @@
 
 #include	<canopy_min.h>
 #include	<canopy_min_internal.h>
+#include	<canopy_communication.h>
 #include	<canopy_os.h>
 
 
@@ -27,6 +28,151 @@
 
 	/* statics go here */
 
+static void lock_remote(canopy_remote_t *remote) {
+	if (remote->sync_lock != NULL) {
+		cos_mutex_lock(remote->sync_lock);
+	}
+}
+
+static void unlock_remote(canopy_remote_t *remote) {
+	if (remote->sync_lock != NULL) {
+		cos_mutex_unlock(remote->sync_lock);
+	}
+}
+
+/*
+ * xorshift, for the jitter in backoffs.  Call it with the remote locked.
+ */
+static uint32_t next_random(canopy_remote_t *remote) {
+	uint32_t x = remote->retry_seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	remote->retry_seed = x;
+	return x;
+}
+
+/*
+ * How long to wait before the <retry>th retry (from 1): the backoff doubles
+ * with each retry up to the maximum, and a random part of its second half is
+ * skipped.
+ */
+static cos_time_t backoff(canopy_remote_t *remote, int retry) {
+	cos_time_t ms = remote->params->retry_backoff_ms;
+	cos_time_t jitter;
+
+	while (--retry > 0 && ms < remote->params->retry_backoff_max_ms) {
+		ms *= 2;
+	}
+	if (ms > remote->params->retry_backoff_max_ms) {
+		ms = remote->params->retry_backoff_max_ms;
+	}
+	lock_remote(remote);
+	jitter = next_random(remote) % (ms / 2 + 1);
+	unlock_remote(remote);
+	return ms - jitter;
+}
+
+/*
+ * Whether a request may go to <remote>.  While the breaker's open it may not
+ * until the cooldown is over, and then only one request at a time tries it.
+ */
+static bool breaker_admits(canopy_remote_t *remote) {
+	cos_time_t now;
+	bool admit = true;
+
+	lock_remote(remote);
+	if (remote->open_until != 0) {
+		cos_get_time(&now);
+		if (remote->probing || now < remote->open_until) {
+			admit = false;
+		} else {
+			remote->probing = true;
+		}
+	}
+	unlock_remote(remote);
+	return admit;
+}
+
+/*
+ * Records how a try went.  Enough failures in a row open the breaker, or
+ * open it again if it was a try after the cooldown, and a success closes it.
+ */
+static void breaker_record(canopy_remote_t *remote, bool failed) {
+	int threshold = remote->params->breaker_threshold;
+	cos_time_t now;
+
+	lock_remote(remote);
+	if (!failed) {
+		if (remote->open_until != 0) {
+			cos_log(LOG_LEVEL_INFO, "remote %s is back\n",
+					remote->params->remote);
+		}
+		remote->failures = 0;
+		remote->open_until = 0;
+	} else {
+		remote->failures++;
+		if (threshold > 0 && (remote->probing
+				|| remote->failures >= threshold)) {
+			if (remote->open_until == 0) {
+				cos_log(LOG_LEVEL_WARN, "remote %s is down, not trying it "
+						"for %u ms\n", remote->params->remote,
+						remote->params->breaker_cooldown_ms);
+			}
+			cos_get_time(&now);
+			remote->open_until = now + remote->params->breaker_cooldown_ms;
+		}
+	}
+	remote->probing = false;
+	unlock_remote(remote);
+}
+
+/*
+ * A try that was cancelled says nothing about the remote.  While the breaker
+ * is open the only try let through is the probe, so if it was that, another
+ * may be made.
+ */
+static void breaker_cancelled(canopy_remote_t *remote) {
+	lock_remote(remote);
+	if (remote->open_until != 0) {
+		remote->probing = false;
+	}
+	unlock_remote(remote);
+}
+
+/*
+ * Waits out a backoff of <ms>, or less if <barrier> runs out or is cancelled
+ * meanwhile.
+ */
+static void back_off(canopy_barrier_t *barrier, cos_time_t ms) {
+	cos_event_t *wake = (barrier != NULL) ? cos_event_create() : NULL;
+
+	if (wake == NULL) {
+		cos_sleep(ms);
+		return;
+	}
+	c_barrier_wait(barrier, wake, ms);
+	cos_event_destroy(wake);
+}
+
+/*
+ * Puts <remote> at the end of <ctx>'s remotes, for the scheduler and
+ * canopy_ctx_shutdown() to find.
+ */
+static void append_remote(canopy_context_t *ctx, canopy_remote_t *remote) {
+	canopy_remote_t *tmp = ctx->remotes;
+
+	if (tmp == NULL) {
+		ctx->remotes = remote;
+		return;
+	}
+	while (tmp->next != NULL) {
+		tmp = tmp->next;
+	}
+	tmp->next = remote;
+}
+
 /*****************************************************************************/
 
 canopy_error canopy_cleanup_remote(canopy_remote_t *remote) {
@@ -35,7 +181,252 @@ canopy_error canopy_cleanup_remote(canopy_remote_t *remote) {
 		return CANOPY_ERROR_BAD_PARAM;
 	}
 
-	return CANOPY_ERROR_NOT_IMPLEMENTED;
+	canopy_comm_remote_shutdown(remote);
+	if (remote->sync_lock != NULL) {
+		cos_mutex_destroy(remote->sync_lock);
+		remote->sync_lock = NULL;
+	}
+	canopy_remote_clear_query_cache(remote);
+	if (remote->query_cache_lock != NULL) {
+		cos_mutex_destroy(remote->query_cache_lock);
+		remote->query_cache_lock = NULL;
+	}
+	return CANOPY_SUCCESS;
+}
+
+/*
+ * Folds the round trip time of a try that started at <start> into <remote>'s
+ * smoothed one.
+ */
+static void record_rtt(canopy_remote_t *remote, cos_time_t start) {
+	cos_time_t now;
+	uint32_t rtt;
+
+	cos_get_time(&now);
+	rtt = (uint32_t)(now - start);
+	lock_remote(remote);
+	if (remote->srtt == 0) {
+		remote->srtt = rtt * 8;
+	} else {
+		remote->srtt += rtt - (remote->srtt >> 3);
+	}
+	unlock_remote(remote);
+}
+
+/*
+ * The endpoint of <group> to try next, leaving out the <tried> ones, or NULL
+ * if they've all been tried.  See canopy_remote_group_init() for the order.
+ */
+static canopy_remote_t * best_endpoint(canopy_remote_t *group,
+		canopy_remote_t **tried, int tried_count) {
+	canopy_remote_t *endpoint;
+	canopy_remote_t *best = NULL;
+	uint64_t rank;
+	uint64_t best_rank = 0;
+	cos_time_t now;
+	bool down;
+	int i;
+
+	cos_get_time(&now);
+	for (endpoint = group->endpoints; endpoint != NULL;
+			endpoint = endpoint->next_endpoint) {
+		for (i = 0; i < tried_count && tried[i] != endpoint; i++) {
+		}
+		if (i < tried_count) {
+			continue;
+		}
+
+		/* most significant first: down, secondary, failing, srtt */
+		lock_remote(endpoint);
+		down = endpoint->open_until != 0
+				&& (endpoint->probing || now < endpoint->open_until);
+		rank = ((uint64_t)down << 34) | ((uint64_t)endpoint->secondary << 33)
+				| ((uint64_t)(endpoint->failures > 0) << 32) | endpoint->srtt;
+		unlock_remote(endpoint);
+		if (best == NULL || rank < best_rank) {
+			best = endpoint;
+			best_rank = rank;
+		}
+	}
+	return best;
+}
+
+/*
+ * endpoint_request
+ *
+ * 		canopy_remote_http_request(), retried and held back by the circuit
+ * 		breaker as the remote's params say, until <barrier> runs out or is
+ * 		cancelled.
+ */
+static canopy_error endpoint_request(canopy_remote_t *remote,
+		const struct canopy_http_request *request,
+		struct canopy_http_response *response,
+		canopy_barrier_t *barrier) {
+	canopy_error err;
+	bool idempotent = request->method != CANOPY_HTTP_POST
+			|| request->idempotent;
+	canopy_error stop;
+	cos_time_t start;
+	bool failed;
+	bool retry;
+	int status;
+	int tries = 0;
+
+	err = c_barrier_check(barrier);
+	if (err == CANOPY_SUCCESS && !breaker_admits(remote)) {
+		err = CANOPY_ERROR_REMOTE_UNAVAILABLE;
+	}
+	if (err != CANOPY_SUCCESS) {
+		memset(response, 0, sizeof(*response));
+		return err;
+	}
+	for (;;) {
+		cos_get_time(&start);
+		err = canopy_remote_http_request(remote, request, response, barrier);
+		tries++;
+		if (err == CANOPY_ERROR_CANCELLED
+				|| (err == CANOPY_ERROR_TIMEOUT && response->unsent)) {
+			/* cut short, or out of time before it started */
+			breaker_cancelled(remote);
+			return err;
+		}
+
+		status = (err == CANOPY_SUCCESS) ? response->status_code : 0;
+		if (err != CANOPY_SUCCESS) {
+			failed = response->transient;
+			retry = idempotent ? response->transient : response->unsent;
+		} else {
+			failed = status == 429 || (status >= 502 && status <= 504);
+			retry = failed && idempotent;
+		}
+		breaker_record(remote, failed);
+		if (err == CANOPY_SUCCESS && !failed) {
+			record_rtt(remote, start);
+		}
+		if (!retry || tries >= remote->params->retry_attempts) {
+			return err;
+		}
+
+		stop = c_barrier_check(barrier);
+		if (stop == CANOPY_SUCCESS) {
+			cos_log(LOG_LEVEL_INFO, "retrying %s%s (%s)\n",
+					remote->params->remote, request->api,
+					(err != CANOPY_SUCCESS) ? canopy_error_string(err) : "busy");
+			back_off(barrier, backoff(remote, tries));
+			stop = c_barrier_check(barrier);
+		}
+		if (stop == CANOPY_SUCCESS && !breaker_admits(remote)) {
+			/* it's gone down meanwhile, so this is as good as it gets */
+			return err;
+		}
+		if (err == CANOPY_SUCCESS) {
+			canopy_http_response_release(remote, response);
+		}
+		if (stop != CANOPY_SUCCESS) {
+			return stop;
+		}
+	}
+}
+
+/*
+ * group_request
+ *
+ * 		endpoint_request() to the best of <group>'s endpoints, failing over
+ * 		to the next best while it fails in a way that may be retried.
+ */
+static canopy_error group_request(canopy_remote_t *group,
+		const struct canopy_http_request *request,
+		struct canopy_http_response *response,
+		canopy_barrier_t *barrier) {
+	canopy_remote_t *tried[CANOPY_MAX_ENDPOINTS];
+	int tried_count = 0;
+	canopy_remote_t *endpoint;
+	canopy_remote_t *next;
+	canopy_error err;
+	bool idempotent = request->method != CANOPY_HTTP_POST
+			|| request->idempotent;
+	bool failover;
+	int status;
+
+	endpoint = best_endpoint(group, tried, tried_count);
+	for (;;) {
+		tried[tried_count++] = endpoint;
+		err = endpoint_request(endpoint, request, response, barrier);
+
+		if (err == CANOPY_ERROR_REMOTE_UNAVAILABLE) {
+			failover = true;
+		} else if (err != CANOPY_SUCCESS) {
+			failover = (idempotent ? response->transient : response->unsent)
+					&& c_barrier_check(barrier) == CANOPY_SUCCESS;
+		} else {
+			status = response->status_code;
+			failover = idempotent && (status == 429
+					|| (status >= 502 && status <= 504));
+		}
+		next = failover ? best_endpoint(group, tried, tried_count) : NULL;
+		if (next == NULL) {
+			return err;
+		}
+
+		cos_log(LOG_LEVEL_INFO, "failing over from %s to %s (%s)\n",
+				endpoint->params->remote, next->params->remote,
+				(err != CANOPY_SUCCESS) ? canopy_error_string(err) : "busy");
+		if (err == CANOPY_SUCCESS) {
+			canopy_http_response_release(group, response);
+		}
+		endpoint = next;
+	}
+}
+
+/*
+ * c_remote_request
+ */
+canopy_error c_remote_request(canopy_remote_t *remote,
+		const struct canopy_http_request *request,
+		struct canopy_http_response *response,
+		canopy_barrier_t *barrier) {
+	if (remote->endpoints != NULL) {
+		return group_request(remote, request, response, barrier);
+	}
+	return endpoint_request(remote, request, response, barrier);
+}
+
+/*
+ * c_status_error
+ */
+canopy_error c_status_error(int status_code) {
+	switch (status_code) {
+	case 400:
+		return CANOPY_ERROR_BAD_PARAM;
+	case 401:
+	case 403:
+		return CANOPY_ERROR_BAD_CREDENTIALS;
+	case 408:
+	case 504:
+		return CANOPY_ERROR_TIMEOUT;
+	case 503:
+		return CANOPY_ERROR_REMOTE_UNAVAILABLE;
+	default:
+		return CANOPY_ERROR_UNKNOWN;
+	}
+}
+
+/*
+ * c_remote_wire_format(), c_remote_fall_back_to_json()
+ */
+canopy_wire_format c_remote_wire_format(canopy_remote_t *remote) {
+	canopy_wire_format format;
+
+	lock_remote(remote);
+	format = remote->wire_format;
+	unlock_remote(remote);
+	return format;
+}
+
+void c_remote_fall_back_to_json(canopy_remote_t *remote) {
+	lock_remote(remote);
+	remote->wire_format = CANOPY_WIRE_FORMAT_JSON;
+	unlock_remote(remote);
 }
 
 /*
@@ -73,15 +464,12 @@ extern canopy_error canopy_remote_init(canopy_context_t *ctx,
 		char *rcv_buffer,
 		size_t rcv_buffer_size,
         canopy_remote_t *remote) {
+	cos_time_t now;
 
 	if (ctx == NULL) {
 		cos_log(LOG_LEVEL_FATAL, "ctx is null in call to canopy_remote_init()");
 		return CANOPY_ERROR_BAD_PARAM;
 	}
-	if (rcv_buffer == NULL) {
-		cos_log(LOG_LEVEL_FATAL, "rcv_buffer is null in call to canopy_remote_init()");
-		return CANOPY_ERROR_BAD_PARAM;
-	}
 	if (remote == NULL) {
 		cos_log(LOG_LEVEL_FATAL, "remote is null in call to canopy_remote_init()");
 		return CANOPY_ERROR_BAD_PARAM;
@@ -111,25 +499,112 @@ extern canopy_error canopy_remote_init(canopy_context_t *ctx,
 	if (params->https_port == 0) {
 		params->https_port = 433;
 	}
+	if (params->max_response_size == 0) {
+		params->max_response_size = CANOPY_DEFAULT_MAX_RESPONSE_SIZE;
+	}
+	if (params->max_connections <= 0) {
+		params->max_connections = CANOPY_DEFAULT_MAX_CONNECTIONS;
+	}
+	if (params->max_streams <= 0) {
+		params->max_streams = CANOPY_DEFAULT_MAX_STREAMS;
+	}
+	if (params->retry_attempts <= 0) {
+		params->retry_attempts = CANOPY_DEFAULT_RETRY_ATTEMPTS;
+	}
+	if (params->retry_backoff_ms == 0) {
+		params->retry_backoff_ms = CANOPY_DEFAULT_RETRY_BACKOFF_MS;
+	}
+	if (params->retry_backoff_max_ms == 0) {
+		params->retry_backoff_max_ms = CANOPY_DEFAULT_RETRY_BACKOFF_MAX_MS;
+	}
+	if (params->breaker_threshold == 0) {
+		params->breaker_threshold = CANOPY_DEFAULT_BREAKER_THRESHOLD;
+	}
+	if (params->breaker_cooldown_ms == 0) {
+		params->breaker_cooldown_ms = CANOPY_DEFAULT_BREAKER_COOLDOWN_MS;
+	}
+	if (params->connect_timeout_ms == 0) {
+		params->connect_timeout_ms = CANOPY_DEFAULT_CONNECT_TIMEOUT_MS;
+	}
+	if (params->request_timeout_ms == 0) {
+		params->request_timeout_ms = CANOPY_DEFAULT_REQUEST_TIMEOUT_MS;
+	}
 	remote->params = params;
 	remote->ctx = ctx;
 	remote->rcv_buffer = rcv_buffer;
 	remote->rcv_buffer_size = rcv_buffer_size;
 	remote->rcv_end = 0;
+	remote->wire_format = params->wire_format;
 
-	if (ctx->remotes == NULL) {
-		ctx->remotes = remote;
-	} else {
-		canopy_remote_t *tmp = ctx->remotes;
-		while (tmp != NULL) {
-			if (tmp->next == NULL) {
-				tmp->next = remote;
-				break;
-			}
-			tmp = tmp->next;
+	if (canopy_comm_remote_init(remote) != CANOPY_SUCCESS) {
+		return CANOPY_ERROR_OUT_OF_MEMORY;
+	}
+	/* without one, concurrent syncs of a device just aren't coalesced */
+	remote->sync_lock = cos_mutex_create();
+	remote->query_cache_lock = cos_mutex_create();
+	cos_get_time(&now);
+	remote->retry_seed = (uint32_t)now ^ (uint32_t)(uintptr_t)remote;
+	if (remote->retry_seed == 0) {
+		remote->retry_seed = 1;
+	}
+
+	append_remote(ctx, remote);
+	return CANOPY_SUCCESS;
+}
+
+/*
+ * Initializes a remote that stands for a group of endpoints.
+ */
+canopy_error canopy_remote_group_init(canopy_context_t *ctx,
+		canopy_remote_t **primaries,
+		int primary_count,
+		canopy_remote_t **secondaries,
+		int secondary_count,
+		canopy_remote_t *group) {
+	canopy_remote_t **tail;
+	canopy_remote_t *endpoint;
+	int i;
+
+	if (primaries == NULL || primary_count < 1 || secondary_count < 0
+			|| (secondaries == NULL && secondary_count > 0)
+			|| primary_count + secondary_count > CANOPY_MAX_ENDPOINTS) {
+		cos_log(LOG_LEVEL_FATAL, "bad endpoints in call to canopy_remote_group_init()");
+		return CANOPY_ERROR_BAD_PARAM;
+	}
+	for (i = 0; i < primary_count + secondary_count; i++) {
+		endpoint = (i < primary_count) ? primaries[i]
+				: secondaries[i - primary_count];
+		if (endpoint == NULL || endpoint->group != NULL
+				|| endpoint->endpoints != NULL) {
+			cos_log(LOG_LEVEL_FATAL, "bad endpoints in call to canopy_remote_group_init()");
+			return CANOPY_ERROR_BAD_PARAM;
 		}
 	}
 
+	/*
+	 * Requests, and the buffers and connections they use, belong to the
+	 * endpoints, so the group only needs what the device and query code
+	 * reads of a remote: the credentials and settings (the first primary's,
+	 * not copied, so the endpoints' defaults are already filled in), and
+	 * its own locks and query cache.
+	 */
+	memset(group, 0, sizeof(canopy_remote_t));
+	group->ctx = ctx;
+	group->params = primaries[0]->params;
+	group->wire_format = primaries[0]->wire_format;
+	group->sync_lock = cos_mutex_create();
+	group->query_cache_lock = cos_mutex_create();
+	tail = &group->endpoints;
+	for (i = 0; i < primary_count + secondary_count; i++) {
+		endpoint = (i < primary_count) ? primaries[i]
+				: secondaries[i - primary_count];
+		endpoint->group = group;
+		endpoint->secondary = (i >= primary_count);
+		endpoint->next_endpoint = NULL;
+		*tail = endpoint;
+		tail = &endpoint->next_endpoint;
+	}
+	append_remote(ctx, group);
 	return CANOPY_SUCCESS;
 }
 
@@ -145,6 +620,18 @@ canopy_error canopy_remote_shutdown(canopy_remote_t *remote) {
 	return CANOPY_ERROR_NOT_IMPLEMENTED;
 }
 
+// Get the state of the remote's connection pool.
+canopy_error canopy_remote_get_connection_stats(canopy_remote_t *remote,
+		canopy_connection_stats_t *stats) {
+	if (remote == NULL || stats == NULL) {
+		cos_log(LOG_LEVEL_FATAL, "remote/stats is null in call to canopy_remote_get_connection_stats()");
+		return CANOPY_ERROR_BAD_PARAM;
+	}
+
+	canopy_comm_connection_stats(remote, stats);
+	return CANOPY_SUCCESS;
+}
+
 // Get the remote's clock in milliseconds.  The returned value has no relation
 // to wall clock time, but is monotonically increasing and is reported
 // consistently by the remote to anyone who asks.
@@ -288,4 +775,62 @@ canopy_error c_json_parse_remote_status(struct canopy_device *device,
     return CANOPY_SUCCESS;
 }
 
+/***************************************************************************
+ *  c_cbor_parse_remote_status(struct canopy_device *device,
+ *      struct c_cbor_reader *reader,
+ *      struct c_cbor_item *map)
+ *
+ *      Parses the CBOR status map from the remote.  <map> has been read,
+ *  its entries have not.
+ *  (in canopy_remote.c)
+ */
+canopy_error c_cbor_parse_remote_status(struct canopy_device *device,
+        struct c_cbor_reader *reader,
+        struct c_cbor_item *map) {
+
+    uint64_t i;
+    char primative[128];
+    struct c_cbor_item name;
+    struct c_cbor_item value;
+    COS_ASSERT(device != NULL);
+    struct canopy_remote *remote = device->remote;
+    COS_ASSERT(remote != NULL);
+
+    if (map->type != C_CBOR_MAP) {
+        return CANOPY_ERROR_CBOR;
+    }
+
+    for (i = 0; c_cbor_more(reader, map, i); i++) {
+        if (c_cbor_read(reader, &name) != C_CBOR_OK
+                || c_cbor_read(reader, &value) != C_CBOR_OK) {
+            return CANOPY_ERROR_CBOR;
+        }
 
+        if (c_cbor_item_is(&name, TAG_WS_CONNECTED)) {
+            if (value.type != C_CBOR_BOOL) {
+                cos_log(LOG_LEVEL_FATAL, "status WS_CONNECTED not a boolean\n");
+                return CANOPY_ERROR_CBOR;
+            }
+            remote->ws_connected = value.boolean;
+
+        } else if (c_cbor_item_is(&name, TAG_ACTIVE_STATUS)) {
+            if (c_cbor_item_copy_string(&value, primative, sizeof(primative))
+                    != C_CBOR_OK) {
+                return CANOPY_ERROR_CBOR;
+            }
+            remote->active_status = activity_status_from_string(primative,
+                    sizeof(primative));
+
+        } else if (c_cbor_item_is(&name, TAG_LAST_ACTIVITY_TIME)) {
+            if (value.type != C_CBOR_UINT) {
+                return CANOPY_ERROR_CBOR;
+            }
+            remote->last_activity = (cos_time_t)value.uint;
+
+        } else if (c_cbor_skip(reader, &value) != C_CBOR_OK) {
+            return CANOPY_ERROR_CBOR;
+        }
+    }
+
+    return CANOPY_SUCCESS;
+}
@@ -0,0 +1,462 @@
+// Copyright 2015 Canopy Services, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include	<stdint.h>
+#include	<stdbool.h>
+#include	<string.h>
+
+#include	<canopy_min.h>
+#include	<canopy_min_internal.h>
+#include	<canopy_os.h>
+
+/*
+ * Background syncing.
+ *
+ * One thread per context keeps a timer for each remote that has scheduled
+ * devices, and when it fires syncs all of them back to back, so they share
+ * the remote's connection.  Each period is jittered, and a remote's first
+ * sync is put at a random point in its first period, so a fleet that powers
+ * up together spreads its traffic out instead of hitting the server at the
+ * same moment every period.
+ *
+ * Setting a variable of a scheduled device signals the thread.  It then
+ * syncs every remote with a dirty device, without waiting for its timer, and
+ * starts that remote's period again.  The same goes for a variable whose
+ * reporting policy has a held back change or a heartbeat come due; the
+ * thread wakes for the first of those as well as for the timers.
+ *
+ * With canopy_ctx_set_adaptive_sync(), the period of each remote follows its
+ * devices: short while something is happening, doubling while nothing is.
+ *
+ * The lock is held to pick the devices of a round and to set the next
+ * timer, and the sync of each device takes it again while its variables are
+ * emitted and the reply is parsed (see _device_sync() in canopy_device.c),
+ * but not while the request is out.  Syncs of the same device are kept
+ * apart by the coalescing there.  A device stays marked sched_syncing until
+ * its round is over, and unscheduling it waits for that, so the devices and
+ * remote of a round stay put while it runs.  Unscheduling from a callback
+ * of the round can't wait for it, so the device is only marked, and
+ * end_round() takes it off the list; until then the round walks past it.
+ */
+
+#define SCHEDULER_JITTER_PCT    10
+
+struct canopy_scheduler {
+    cos_mutex_t     *lock;
+    cos_event_t     *wake;
+    cos_event_t     *idle;      /* a round is over */
+    cos_thread_t    *thread;
+    bool            stopping;
+    uint32_t        seed;
+};
+
+/*
+ * xorshift, good enough to spread timers out.
+ */
+static uint32_t next_random(struct canopy_scheduler *sched) {
+    uint32_t x = sched->seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sched->seed = x;
+    return x;
+}
+
+/*
+ * A period of <ms>, give or take SCHEDULER_JITTER_PCT percent.
+ */
+static cos_time_t jittered(struct canopy_scheduler *sched, cos_time_t ms) {
+    cos_time_t spread = ms * SCHEDULER_JITTER_PCT / 100;
+
+    if (spread == 0) {
+        return ms;
+    }
+    return ms - spread + next_random(sched) % (2 * spread + 1);
+}
+
+static bool device_dirty(const canopy_device_t *device) {
+    const struct canopy_var *var;
+
+    for (var = device->vars; var != NULL; var = var->next) {
+        if (var->dirty) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool remote_dirty(const canopy_remote_t *remote) {
+    const canopy_device_t *device;
+
+    for (device = remote->scheduled; device != NULL;
+            device = device->scheduled_next) {
+        if (device_dirty(device)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Marks dirty the policy variables of <remote>'s devices that are due, and
+ * returns whether there were any.  <wait> comes down to when the next is.
+ */
+static bool remote_due(canopy_remote_t *remote, cos_time_t now,
+        cos_time_t *wait) {
+    canopy_device_t *device;
+    bool due = false;
+
+    for (device = remote->scheduled; device != NULL;
+            device = device->scheduled_next) {
+        if (c_vars_due(device, now, wait)) {
+            due = true;
+        }
+    }
+    return due;
+}
+
+/*
+ * Syncs the devices of <remote>, and returns whether anything happened: a
+ * device had changes to send or got changes to IN variables, or the remote's
+ * view of the device's status changed.
+ *
+ * Called holding the lock, which is let go while each device syncs.  Devices
+ * scheduled meanwhile go on the front of the list, so they aren't part of
+ * this round.  Those that are stay on it, marked, until end_round(), so the
+ * walk down it is safe; those unscheduled since are passed over.
+ */
+static bool sync_remote(struct canopy_scheduler *sched,
+        canopy_remote_t *remote) {
+    canopy_device_t *first = remote->scheduled;
+    canopy_device_t *device;
+    canopy_error err;
+    canopy_active_status active_status = remote->active_status;
+    bool ws_connected = remote->ws_connected;
+    bool busy = remote_dirty(remote);
+
+    for (device = first; device != NULL; device = device->scheduled_next) {
+        device->in_changed = false;
+        device->sched_syncing = true;
+    }
+    for (device = first; device != NULL; device = device->scheduled_next) {
+        if (!device->scheduled) {
+            continue;
+        }
+        cos_mutex_unlock(sched->lock);
+        err = canopy_device_sync_with_remote(remote, device, NULL);
+        if (err != CANOPY_SUCCESS) {
+            cos_log(LOG_LEVEL_WARN, "scheduled sync with %s failed: %s\n",
+                    remote->params->remote, canopy_error_string(err));
+        }
+        cos_mutex_lock(sched->lock);
+        busy = busy || device->in_changed;
+    }
+    return busy || remote->active_status != active_status
+            || remote->ws_connected != ws_connected;
+}
+
+/*
+ * Lets go of the devices of <remote>'s round, and takes those unscheduled
+ * during it off the list.
+ */
+static void end_round(struct canopy_scheduler *sched,
+        canopy_remote_t *remote) {
+    canopy_device_t **link = &remote->scheduled;
+    canopy_device_t *device;
+
+    while (*link != NULL) {
+        device = *link;
+        device->sched_syncing = false;
+        if (!device->scheduled) {
+            *link = device->scheduled_next;
+            device->scheduled_next = NULL;
+        } else {
+            link = &device->scheduled_next;
+        }
+    }
+    cos_event_signal(sched->idle);
+}
+
+/*
+ * The period to wait before syncing <remote> again.
+ */
+static cos_time_t next_period(canopy_context_t *ctx, canopy_remote_t *remote,
+        bool busy) {
+    cos_time_t shortest = (cos_time_t)ctx->sync_min_period * 1000;
+    cos_time_t longest = (cos_time_t)ctx->sync_max_period * 1000;
+
+    if (longest == 0) {
+        return (cos_time_t)ctx->update_period * 1000;
+    }
+    if (remote->sync_interval == 0) {
+        remote->sync_interval = (cos_time_t)ctx->update_period * 1000;
+    } else if (busy) {
+        remote->sync_interval = shortest;
+    } else {
+        remote->sync_interval *= 2;
+    }
+    if (remote->sync_interval < shortest) {
+        remote->sync_interval = shortest;
+    } else if (remote->sync_interval > longest) {
+        remote->sync_interval = longest;
+    }
+    return remote->sync_interval;
+}
+
+static void scheduler_main(void *arg) {
+    canopy_context_t *ctx = (canopy_context_t*)arg;
+    struct canopy_scheduler *sched = ctx->scheduler;
+    cos_time_t period = (cos_time_t)ctx->update_period * 1000;
+    canopy_remote_t *remote;
+    cos_time_t now;
+    cos_time_t wait;
+    bool woken = true;
+    bool synced;
+    bool busy;
+
+    cos_mutex_lock(sched->lock);
+    while (!sched->stopping) {
+        cos_get_time(&now);
+        wait = period;
+        if (wait < (cos_time_t)ctx->sync_max_period * 1000) {
+            wait = (cos_time_t)ctx->sync_max_period * 1000;
+        }
+        synced = false;
+        for (remote = ctx->remotes; remote != NULL; remote = remote->next) {
+            if (remote->scheduled == NULL) {
+                continue;
+            }
+            if (remote->next_sync == 0) {
+                remote->next_sync = now + next_random(sched) % (period + 1);
+            }
+            /*
+             * Dirty remotes are only looked for when signalled, so one whose
+             * sync failed waits for its timer rather than trying again and
+             * again.
+             */
+            if (remote->next_sync <= now || remote_due(remote, now, &wait)
+                    || (woken && remote_dirty(remote))) {
+                busy = sync_remote(sched, remote);
+                cos_get_time(&now);
+                remote->next_sync = now
+                        + jittered(sched, next_period(ctx, remote, busy));
+                end_round(sched, remote);
+                synced = true;
+            }
+            if (remote->next_sync - now < wait) {
+                wait = remote->next_sync - now;
+            }
+        }
+        if (synced) {
+            /* what a round reported moves its policies' due times */
+            wait = 0;
+        }
+        cos_mutex_unlock(sched->lock);
+        woken = cos_event_wait(sched->wake, wait);
+        cos_mutex_lock(sched->lock);
+    }
+    cos_mutex_unlock(sched->lock);
+}
+
+/*
+ * canopy_ctx_start_scheduler()
+ */
+canopy_error canopy_ctx_start_scheduler(canopy_context_t *ctx) {
+    struct canopy_scheduler *sched;
+    cos_time_t now;
+
+    if (ctx == NULL || ctx->update_period <= 0 || ctx->scheduler != NULL) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    sched = (struct canopy_scheduler*)cos_alloc(
+            sizeof(struct canopy_scheduler));
+    if (sched == NULL) {
+        return CANOPY_ERROR_OUT_OF_MEMORY;
+    }
+    memset(sched, 0, sizeof(struct canopy_scheduler));
+    cos_get_time(&now);
+    sched->seed = (uint32_t)now ^ (uint32_t)(uintptr_t)ctx;
+    if (sched->seed == 0) {
+        sched->seed = 1;
+    }
+    sched->lock = cos_mutex_create();
+    sched->wake = cos_event_create();
+    sched->idle = cos_event_create();
+    if (sched->lock == NULL || sched->wake == NULL || sched->idle == NULL) {
+        goto fail;
+    }
+
+    ctx->scheduler = sched;
+    sched->thread = cos_thread_start(scheduler_main, ctx);
+    if (sched->thread == NULL) {
+        ctx->scheduler = NULL;
+        goto fail;
+    }
+    return CANOPY_SUCCESS;
+
+fail:
+    if (sched->lock != NULL) {
+        cos_mutex_destroy(sched->lock);
+    }
+    if (sched->wake != NULL) {
+        cos_event_destroy(sched->wake);
+    }
+    if (sched->idle != NULL) {
+        cos_event_destroy(sched->idle);
+    }
+    cos_free(sched);
+    return CANOPY_ERROR_OUT_OF_MEMORY;
+}
+
+/*
+ * canopy_ctx_stop_scheduler()
+ */
+canopy_error canopy_ctx_stop_scheduler(canopy_context_t *ctx) {
+    struct canopy_scheduler *sched;
+    canopy_remote_t *remote;
+
+    if (ctx == NULL || ctx->scheduler == NULL) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    sched = ctx->scheduler;
+    cos_mutex_lock(sched->lock);
+    sched->stopping = true;
+    cos_mutex_unlock(sched->lock);
+    cos_event_signal(sched->wake);
+    cos_thread_join(sched->thread);
+
+    /* a restarted scheduler picks fresh phases */
+    for (remote = ctx->remotes; remote != NULL; remote = remote->next) {
+        remote->next_sync = 0;
+        remote->sync_interval = 0;
+    }
+    ctx->scheduler = NULL;
+    cos_mutex_destroy(sched->lock);
+    cos_event_destroy(sched->wake);
+    cos_event_destroy(sched->idle);
+    cos_free(sched);
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * canopy_ctx_set_adaptive_sync()
+ */
+canopy_error canopy_ctx_set_adaptive_sync(canopy_context_t *ctx,
+        int min_seconds,
+        int max_seconds) {
+    if (ctx == NULL || min_seconds < 0 || max_seconds < min_seconds
+            || (max_seconds != 0 && min_seconds == 0)) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    canopy_ctx_lock(ctx);
+    ctx->sync_min_period = min_seconds;
+    ctx->sync_max_period = max_seconds;
+    canopy_ctx_unlock(ctx);
+    return CANOPY_SUCCESS;
+}
+
+void canopy_ctx_lock(canopy_context_t *ctx) {
+    if (ctx != NULL && ctx->scheduler != NULL) {
+        cos_mutex_lock(ctx->scheduler->lock);
+    }
+}
+
+void canopy_ctx_unlock(canopy_context_t *ctx) {
+    if (ctx != NULL && ctx->scheduler != NULL) {
+        cos_mutex_unlock(ctx->scheduler->lock);
+    }
+}
+
+/*
+ * canopy_device_schedule_sync(), canopy_device_unschedule_sync()
+ */
+canopy_error canopy_device_schedule_sync(canopy_device_t *device) {
+    canopy_remote_t *remote;
+
+    if (device == NULL || device->remote == NULL) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    remote = device->remote;
+    canopy_ctx_lock(remote->ctx);
+    if (!device->scheduled) {
+        /* if it's still in a round, it's still on the list */
+        if (!device->sched_syncing) {
+            device->scheduled_next = remote->scheduled;
+            remote->scheduled = device;
+        }
+        device->scheduled = true;
+    }
+    canopy_ctx_unlock(remote->ctx);
+    c_scheduler_dirty(device);
+    return CANOPY_SUCCESS;
+}
+
+canopy_error canopy_device_unschedule_sync(canopy_device_t *device) {
+    canopy_remote_t *remote;
+    canopy_device_t **link;
+    struct canopy_scheduler *sched;
+
+    if (device == NULL || device->remote == NULL) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    remote = device->remote;
+    canopy_ctx_lock(remote->ctx);
+    /*
+     * The round it's in finishes first.  If that's who's asking (from an
+     * on_var_change callback, say), the round is left to take it off the
+     * list.  A waiter that's done passes the signal on, for anyone else
+     * waiting on the same round.
+     */
+    sched = remote->ctx->scheduler;
+    if (device->sched_syncing && cos_thread_is_current(sched->thread)) {
+        device->scheduled = false;
+        canopy_ctx_unlock(remote->ctx);
+        return CANOPY_SUCCESS;
+    }
+    if (device->sched_syncing) {
+        while (device->sched_syncing) {
+            canopy_ctx_unlock(remote->ctx);
+            cos_event_wait(sched->idle, 100);
+            canopy_ctx_lock(remote->ctx);
+        }
+        cos_event_signal(sched->idle);
+    }
+    for (link = &remote->scheduled; *link != NULL;
+            link = &(*link)->scheduled_next) {
+        if (*link == device) {
+            *link = device->scheduled_next;
+            break;
+        }
+    }
+    device->scheduled_next = NULL;
+    device->scheduled = false;
+    canopy_ctx_unlock(remote->ctx);
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * c_scheduler_dirty()
+ */
+void c_scheduler_dirty(canopy_device_t *device) {
+    canopy_context_t *ctx;
+
+    if (!device->scheduled) {
+        return;
+    }
+    ctx = device->remote->ctx;
+    if (ctx->scheduler != NULL) {
+        cos_event_signal(ctx->scheduler->wake);
+    }
+}
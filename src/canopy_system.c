@@ -18,12 +18,28 @@
 
 #include	<canopy_min.h>
 #include	<canopy_min_internal.h>
+#include	<canopy_communication.h>
 
 
 /*****************************************************************************/
 
 	/* statics go here */
 
+/*
+ * A barrier's cancelled and wake are under its remote's sync_lock.
+ */
+static void lock_barrier(canopy_barrier_t *barrier) {
+	if (barrier->remote->sync_lock != NULL) {
+		cos_mutex_lock(barrier->remote->sync_lock);
+	}
+}
+
+static void unlock_barrier(canopy_barrier_t *barrier) {
+	if (barrier->remote->sync_lock != NULL) {
+		cos_mutex_unlock(barrier->remote->sync_lock);
+	}
+}
+
 /*****************************************************************************/
 
 
@@ -38,7 +54,8 @@ canopy_error canopy_ctx_init(canopy_context_t *ctx, int update_period) {
 	memset(ctx, 0, sizeof(canopy_context_t));
 	ctx->remotes = NULL;
 	ctx->update_period = update_period;
-	return CANOPY_SUCCESS;
+	ctx->dns_cache_ttl = CANOPY_DEFAULT_DNS_CACHE_TTL;
+	return canopy_comm_ctx_init(ctx);
 }
 
 
@@ -52,16 +69,32 @@ canopy_error canopy_ctx_shutdown(canopy_context_t *ctx) {
 
 	canopy_error error = CANOPY_SUCCESS;
 	canopy_remote_t *remotes = ctx->remotes;
+	if (ctx->scheduler != NULL) {
+		canopy_ctx_stop_scheduler(ctx);
+	}
 	while (remotes != NULL) {
 		error = canopy_cleanup_remote(remotes);
 		if (error != CANOPY_SUCCESS) {
-			return error;
+			break;
 		}
 		remotes = remotes->next;
 	}
+	canopy_comm_ctx_shutdown(ctx);
 	return error;
 }
 
+/********************************************************
+ * canopy_ctx_set_dns_cache_ttl():
+ */
+canopy_error canopy_ctx_set_dns_cache_ttl(canopy_context_t *ctx,
+		int ttl_seconds) {
+	if (ctx == NULL || ttl_seconds < -1) {
+		return CANOPY_ERROR_BAD_PARAM;
+	}
+	ctx->dns_cache_ttl = ttl_seconds;
+	return CANOPY_SUCCESS;
+}
+
 /******************************************************************************/
 
 
@@ -119,6 +152,81 @@ canopy_error canopy_ctx_get_logging(canopy_context_t *ctx,
 // canopy_barrier_wait_for_complete() or canopy_barrier_cancel() before
 // returning from the scope with the barrier.
 
+/*****************************************************************************
+ * canopy_barrier_init()
+ */
+canopy_error canopy_barrier_init(canopy_barrier_t *barrier,
+		canopy_remote_t *remote,
+		uint32_t timeout_ms) {
+	cos_time_t now;
+
+	if (barrier == NULL || remote == NULL) {
+		return CANOPY_ERROR_BAD_PARAM;
+	}
+	memset(barrier, 0, sizeof(canopy_barrier_t));
+	barrier->remote = remote;
+	if (timeout_ms > 0) {
+		cos_get_time(&now);
+		barrier->deadline = now + timeout_ms;
+	}
+	return CANOPY_SUCCESS;
+}
+
+/*
+ * c_barrier_check()
+ */
+canopy_error c_barrier_check(canopy_barrier_t *barrier) {
+	canopy_error err = CANOPY_SUCCESS;
+	cos_time_t now;
+
+	if (barrier == NULL) {
+		return CANOPY_SUCCESS;
+	}
+	lock_barrier(barrier);
+	if (barrier->cancelled) {
+		err = CANOPY_ERROR_CANCELLED;
+	}
+	unlock_barrier(barrier);
+	if (err == CANOPY_SUCCESS && barrier->deadline != 0) {
+		cos_get_time(&now);
+		if (now >= barrier->deadline) {
+			err = CANOPY_ERROR_TIMEOUT;
+		}
+	}
+	return err;
+}
+
+/*
+ * c_barrier_wait()
+ */
+void c_barrier_wait(canopy_barrier_t *barrier, cos_event_t *event,
+		cos_time_t ms) {
+	cos_time_t now;
+	bool cancelled;
+
+	if (barrier == NULL) {
+		cos_event_wait(event, ms);
+		return;
+	}
+	if (barrier->deadline != 0) {
+		cos_get_time(&now);
+		if (now >= barrier->deadline) {
+			return;
+		}
+		ms = LOCAL_MIN(ms, barrier->deadline - now);
+	}
+	lock_barrier(barrier);
+	barrier->wake = event;
+	cancelled = barrier->cancelled;
+	unlock_barrier(barrier);
+	if (!cancelled) {
+		cos_event_wait(event, ms);
+	}
+	lock_barrier(barrier);
+	barrier->wake = NULL;
+	unlock_barrier(barrier);
+}
+
 // Block the current thread until the operation has completed, or timeout
 // occurs.  Returns immediately if the requested operation has already
 // finished.
@@ -142,10 +250,24 @@ canopy_error canopy_barrier_wait_for_complete(canopy_barrier_t *barrier,
 // No further callbacks will be triggered for this barrier.
 // After calling this it is safe to deallocate the barrier.
 canopy_error canopy_barrier_cancel(canopy_barrier_t *barrier) {
-	if (barrier == NULL) {
+	canopy_remote_t *endpoint;
+
+	if (barrier == NULL || barrier->remote == NULL) {
 		return CANOPY_ERROR_BAD_PARAM;
 	}
-	return CANOPY_ERROR_NOT_IMPLEMENTED;
+	lock_barrier(barrier);
+	barrier->cancelled = true;
+	if (barrier->wake != NULL) {
+		cos_event_signal(barrier->wake);
+	}
+	unlock_barrier(barrier);
+	/* and if its request is in flight, that's dropped */
+	canopy_comm_wakeup(barrier->remote);
+	for (endpoint = barrier->remote->endpoints; endpoint != NULL;
+			endpoint = endpoint->next_endpoint) {
+		canopy_comm_wakeup(endpoint);
+	}
+	return CANOPY_SUCCESS;
 }
 
 // Establish a callback that will be triggered when the operation has
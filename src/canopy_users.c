@@ -0,0 +1,699 @@
+// Copyright 2015 Canopy Services, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include	<stddef.h>
+#include	<stdint.h>
+#include	<stdbool.h>
+#include	<stdio.h>
+#include	<string.h>
+
+#include	<canopy_min.h>
+#include	<canopy_min_internal.h>
+#include	<canopy_communication.h>
+#include	<canopy_os.h>
+
+/*
+ * User operations.
+ *
+ * A user is fetched from and synced with /api/user/self, with its plain
+ * properties parsed and emitted from the user_properties table, the same
+ * way as a device's.  The payload and the tokens live on the stack and the
+ * user keeps everything in its own fixed-size storage, so polling a user
+ * allocates nothing.
+ *
+ * canopy_user_create_devices() creates devices in batches of up to
+ * CREATE_DEVICES_BATCH per POST to /api/create_devices.  A batch is also
+ * kept small enough that its reply (IDs, names and secret keys) is within the
+ * remote's max_response_size, so any quantity can be created.
+ */
+
+/*
+ * What the remote tells us about a user, and what may be changed locally.
+ */
+static const struct c_property user_properties[] = {
+    C_STRING_PROPERTY(TAG_USERNAME, canopy_user_t, name,
+            C_PROPERTY_NOT_SENT),
+    C_STRING_PROPERTY(TAG_EMAIL, canopy_user_t, email,
+            offsetof(canopy_user_t, email_dirty)),
+    C_BOOL_PROPERTY(TAG_VALIDATED, canopy_user_t, is_activated,
+            C_PROPERTY_NOT_SENT),
+};
+
+/*
+ * A password change is sent, never received, and takes both passwords.
+ */
+static const struct c_property password_properties[] = {
+    C_STRING_PROPERTY(TAG_OLD_PASSWORD, canopy_user_t, old_password,
+            offsetof(canopy_user_t, password_dirty)),
+    C_STRING_PROPERTY(TAG_PASSWORD, canopy_user_t, new_password,
+            offsetof(canopy_user_t, password_dirty)),
+};
+
+/*
+ * Room for the largest user payload, with every character escaped, and for
+ * the tokens of a user object with some fields we don't know about.
+ */
+#define USER_PAYLOAD_SIZE   (6 * (CANOPY_USERNAME_MAX_LENGTH \
+        + CANOPY_EMAIL_MAX_LENGTH + 2 * CANOPY_PASSWORD_MAX_LENGTH) + 256)
+#define USER_MAX_TOKENS     128
+
+#define CREATE_DEVICES_BATCH        100
+
+/*
+ * What a device adds to the reply, besides its name: the ID, the secret key,
+ * the quotes and commas.
+ */
+#define CREATE_DEVICES_REPLY_BYTES  128
+#define CREATE_DEVICES_REPLY_SLACK  128
+
+/*
+ * _batch_size
+ *
+ *      How many of the <quantity> devices starting at <names> (which may be
+ *      NULL) go in the next request.  At least one, even if the reply may
+ *      not fit, so that the caller finds out.
+ */
+static uint32_t _batch_size(canopy_remote_t *remote, uint32_t quantity,
+        char **names, size_t *payload_len) {
+
+    size_t reply = CREATE_DEVICES_REPLY_SLACK;
+    uint32_t n;
+
+    /* {"friendly_names" : [ ... ], "quantity" : 100} */
+    *payload_len = 64;
+    for (n = 0; n < quantity && n < CREATE_DEVICES_BATCH; n++) {
+        size_t name_len = (names != NULL && names[n] != NULL)
+                ? strlen(names[n]) : 0;
+        reply += CREATE_DEVICES_REPLY_BYTES + name_len;
+        if (n > 0 && reply > remote->params->max_response_size) {
+            break;
+        }
+        /* worst case every character is escaped as \u00XX */
+        *payload_len += 16 + 6 * name_len;
+    }
+    return n;
+}
+
+/*
+ * _token_is
+ *
+ *      Whether the string token is exactly <tag>.
+ */
+static bool _token_is(const char *js, const jsmntok_t *token,
+        const char *tag) {
+    size_t n = token->end - token->start;
+    return n == strlen(tag) && strncmp(&js[token->start], tag, n) == 0;
+}
+
+/****************************************************************************/
+/****************************************************************************/
+
+/*
+ * c_json_emit_create_devices
+ */
+canopy_error c_json_emit_create_devices(char *payload, size_t len,
+        uint32_t quantity, char **names, size_t *out_len) {
+
+    struct c_json_state state;
+    char number[16];
+    uint32_t i;
+
+    c_json_buffer_init(&state, payload, len);
+    if (c_json_emit_open_object(&state) != C_JSON_OK) {
+        return CANOPY_ERROR_BUFFER_TOO_SMALL;
+    }
+    if (names != NULL) {
+        if (c_json_emit_name_and_array(&state, TAG_FRIENDLY_NAMES)
+                != C_JSON_OK) {
+            return CANOPY_ERROR_BUFFER_TOO_SMALL;
+        }
+        for (i = 0; i < quantity; i++) {
+            if (c_json_emit_string(&state, (names[i] != NULL) ? names[i] : "")
+                    != C_JSON_OK) {
+                return CANOPY_ERROR_BUFFER_TOO_SMALL;
+            }
+        }
+        if (c_json_emit_close_array(&state) != C_JSON_OK) {
+            return CANOPY_ERROR_BUFFER_TOO_SMALL;
+        }
+    }
+    snprintf(number, sizeof(number), "%u", quantity);
+    if (c_json_emit_name_and_value(&state, TAG_QUANTITY, number) != C_JSON_OK
+            || c_json_emit_close_object(&state) != C_JSON_OK) {
+        return CANOPY_ERROR_BUFFER_TOO_SMALL;
+    }
+    *out_len = state.offset;
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * c_json_parse_create_devices
+ *
+ *      The reply has the devices as parallel arrays:
+ *
+ *      {
+ *          "result" : "ok",
+ *          "count" : 2,
+ *          "ids" : ["<uuid>", "<uuid>"],
+ *          "friendly_names" : ["a", "b"],
+ *          "device_secret_keys" : ["<key>", "<key>"]
+ *      }
+ */
+canopy_error c_json_parse_create_devices(canopy_remote_t *remote,
+        char *js, int js_len,
+        uint32_t quantity,
+        canopy_device_t **devices) {
+
+    jsmntok_t *token;
+    jsmn_parser parser;
+    canopy_error err = CANOPY_SUCCESS;
+    bool have_ids = false;
+    int ntokens;
+    int active;
+    int offset;
+    int count;
+    int i, j;
+
+    jsmn_init(&parser);
+    ntokens = jsmn_parse(&parser, js, js_len, NULL, 0);
+    if (ntokens <= 0) {
+        cos_log(LOG_LEVEL_ERROR, "Error during tokenization of devices: %d\n",
+                ntokens);
+        return CANOPY_ERROR_JSON;
+    }
+    token = (jsmntok_t*)cos_alloc(ntokens * sizeof(jsmntok_t));
+    if (token == NULL) {
+        return CANOPY_ERROR_OUT_OF_MEMORY;
+    }
+    if (c_json_parse_string(js, js_len, token, ntokens, &active) != C_JSON_OK
+            || token[0].type != JSMN_OBJECT) {
+        err = CANOPY_ERROR_JSON;
+        goto done;
+    }
+
+    for (j = 0; j < quantity; j++) {
+        canopy_device_init(devices[j], remote, NULL);
+    }
+
+    count = token[0].size;
+    offset = 1;
+    for (i = 0; i < count && err == CANOPY_SUCCESS; i++) {
+        jsmntok_t *name = &token[offset];
+        jsmntok_t *value = &token[offset + 1];
+
+        if (offset + 1 >= ntokens || name->type != JSMN_STRING) {
+            err = CANOPY_ERROR_JSON;
+            break;
+        }
+
+        if (_token_is(js, name, TAG_RESULT)) {
+            if (!_token_is(js, value, "ok")) {
+                cos_log(LOG_LEVEL_ERROR, "create devices failed\n");
+                err = CANOPY_ERROR_UNKNOWN;
+            }
+
+        } else if (value->type == JSMN_ARRAY
+                && (_token_is(js, name, TAG_IDS)
+                || _token_is(js, name, TAG_FRIENDLY_NAMES)
+                || _token_is(js, name, TAG_DEVICE_SECRET_KEYS))) {
+            if (value->size != quantity || offset + 1 + quantity >= ntokens) {
+                cos_log(LOG_LEVEL_ERROR, "asked for %u devices, got %d\n",
+                        quantity, value->size);
+                err = CANOPY_ERROR_UNKNOWN;
+                break;
+            }
+            for (j = 0; j < quantity; j++) {
+                const jsmntok_t *t = &value[1 + j];
+                int ierr;
+                if (_token_is(js, name, TAG_IDS)) {
+                    ierr = c_json_copy_string(devices[j]->device_id,
+                            sizeof(devices[j]->device_id), js, t);
+                    have_ids = true;
+                } else if (_token_is(js, name, TAG_FRIENDLY_NAMES)) {
+                    ierr = c_json_copy_string(devices[j]->friendly_name,
+                            sizeof(devices[j]->friendly_name), js, t);
+                } else {
+                    ierr = c_json_copy_string(devices[j]->secret_key,
+                            sizeof(devices[j]->secret_key), js, t);
+                }
+                if (ierr != C_JSON_OK) {
+                    err = CANOPY_ERROR_JSON;
+                    break;
+                }
+            }
+        }
+        offset = c_json_skip_token(token, ntokens, offset + 1);
+    }
+    if (err == CANOPY_SUCCESS && !have_ids) {
+        cos_log(LOG_LEVEL_ERROR, "create devices reply has no device IDs\n");
+        err = CANOPY_ERROR_JSON;
+    }
+
+done:
+    cos_free(token);
+    return err;
+}
+
+/****************************************************************************/
+/****************************************************************************/
+
+/*
+ * canopy_user_create_devices
+ */
+canopy_error canopy_user_create_devices(canopy_user_t *user,
+        uint32_t quantity,
+        char **names,
+        canopy_device_t **out_devices,
+        uint32_t *out_count,
+        canopy_barrier_t *barrier) {
+
+    struct canopy_http_request request;
+    struct canopy_http_response response;
+    canopy_remote_t *remote;
+    canopy_error err = CANOPY_SUCCESS;
+    char *payload = NULL;
+    size_t payload_size = 0;
+    size_t len;
+    uint32_t done;
+    uint32_t n;
+
+    if (out_count != NULL) {
+        *out_count = 0;
+    }
+    if (user == NULL || user->remote == NULL || out_devices == NULL
+            || out_count == NULL || quantity == 0) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    remote = user->remote;
+    if (remote->params->credential_type != CANOPY_USER_CREDENTIALS) {
+        return CANOPY_ERROR_BAD_CREDENTIALS;
+    }
+
+    for (done = 0; done < quantity && err == CANOPY_SUCCESS; done += n) {
+        char **batch_names = (names != NULL) ? &names[done] : NULL;
+
+        n = _batch_size(remote, quantity - done, batch_names, &len);
+        if (len > payload_size) {
+            cos_free(payload);
+            payload = (char*)cos_alloc(len);
+            if (payload == NULL) {
+                return CANOPY_ERROR_OUT_OF_MEMORY;
+            }
+            payload_size = len;
+        }
+
+        memset(&request, 0, sizeof(request));
+        request.method = CANOPY_HTTP_POST;
+        request.api = "/api/create_devices";
+        request.format = CANOPY_WIRE_FORMAT_JSON;
+        request.payload = payload;
+        err = c_json_emit_create_devices(payload, payload_size, n,
+                batch_names, &request.payload_len);
+        if (err != CANOPY_SUCCESS) {
+            break;
+        }
+
+        err = c_remote_request(remote, &request, &response,
+                barrier);
+        if (err != CANOPY_SUCCESS) {
+            cos_log(LOG_LEVEL_ERROR, "Error during POST %s: %s\n",
+                    request.api, canopy_error_string(err));
+            break;
+        }
+        if (response.status_code != 200) {
+            err = c_status_error(response.status_code);
+        } else {
+            err = c_json_parse_create_devices(remote, response.body,
+                    response.body_len, n, &out_devices[done]);
+        }
+        canopy_http_response_release(remote, &response);
+        if (err == CANOPY_SUCCESS) {
+            *out_count = done + n;
+        }
+    }
+
+    cos_free(payload);
+    return err;
+}
+
+/****************************************************************************/
+/****************************************************************************/
+
+/*
+ * _forget_password
+ *
+ *      Once a password change has been sent, or given up on, there's no
+ *      reason to keep either password around.
+ */
+static void _forget_password(canopy_user_t *user) {
+    memset(user->old_password, 0, sizeof(user->old_password));
+    memset(user->new_password, 0, sizeof(user->new_password));
+    user->password_dirty = false;
+}
+
+/*
+ * _user_request
+ *
+ *      Sends <payload> (a GET if NULL) to <api>, and parses the user object
+ *      of the reply into <user>.
+ */
+static canopy_error _user_request(canopy_remote_t *remote,
+        canopy_user_t *user, const char *api, char *payload,
+        size_t payload_len, canopy_barrier_t *barrier) {
+
+    struct canopy_http_request request;
+    struct canopy_http_response response;
+    canopy_error err;
+
+    memset(&request, 0, sizeof(request));
+    request.method = (payload == NULL) ? CANOPY_HTTP_GET : CANOPY_HTTP_POST;
+    request.api = api;
+    request.format = CANOPY_WIRE_FORMAT_JSON;
+    request.payload = payload;
+    request.payload_len = payload_len;
+
+    err = c_remote_request(remote, &request, &response, barrier);
+    if (err != CANOPY_SUCCESS) {
+        cos_log(LOG_LEVEL_ERROR, "Error during %s %s: %s\n",
+                (payload == NULL) ? "GET" : "POST", api,
+                canopy_error_string(err));
+        return err;
+    }
+    if (response.status_code != 200) {
+        err = c_status_error(response.status_code);
+    } else {
+        err = c_json_parse_user(user, response.body, response.body_len);
+    }
+    canopy_http_response_release(remote, &response);
+    return err;
+}
+
+/****************************************************************************/
+/****************************************************************************/
+
+/*
+ * c_json_emit_user
+ */
+canopy_error c_json_emit_user(canopy_user_t *user, char *payload, size_t len,
+        size_t *out_len) {
+
+    struct c_json_state state;
+
+    c_json_buffer_init(&state, payload, len);
+    if (c_json_emit_open_object(&state) != C_JSON_OK
+            || c_json_emit_properties(&state, user_properties,
+                    C_PROPERTY_COUNT(user_properties), user) != C_JSON_OK
+            || c_json_emit_properties(&state, password_properties,
+                    C_PROPERTY_COUNT(password_properties), user) != C_JSON_OK
+            || c_json_emit_close_object(&state) != C_JSON_OK) {
+        return CANOPY_ERROR_BUFFER_TOO_SMALL;
+    }
+    *out_len = state.offset;
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * c_json_parse_user
+ *
+ *      {
+ *          "result" : "ok",
+ *          "username" : "greg",
+ *          "email" : "greg@example.com",
+ *          "validated" : true
+ *      }
+ *
+ *      Fields not in user_properties are skipped.
+ */
+canopy_error c_json_parse_user(canopy_user_t *user, char *js, int js_len) {
+
+    jsmntok_t token[USER_MAX_TOKENS];
+    const struct c_property *property;
+    int active;
+    int offset;
+    int count;
+    int i;
+
+    if (c_json_parse_string(js, js_len, token, USER_MAX_TOKENS, &active)
+            != C_JSON_OK || active <= 0 || token[0].type != JSMN_OBJECT) {
+        cos_log(LOG_LEVEL_ERROR, "Error during tokenization of user\n");
+        return CANOPY_ERROR_JSON;
+    }
+
+    count = token[0].size;
+    offset = 1;
+    for (i = 0; i < count; i++) {
+        jsmntok_t *name = &token[offset];
+        jsmntok_t *value = &token[offset + 1];
+
+        if (offset + 1 >= active || name->type != JSMN_STRING) {
+            return CANOPY_ERROR_JSON;
+        }
+
+        if (_token_is(js, name, TAG_RESULT)) {
+            if (!_token_is(js, value, "ok")) {
+                cos_log(LOG_LEVEL_ERROR, "user request failed\n");
+                return CANOPY_ERROR_UNKNOWN;
+            }
+        } else if ((property = c_property_find(user_properties,
+                C_PROPERTY_COUNT(user_properties), &js[name->start],
+                name->end - name->start)) != NULL) {
+            if (c_json_parse_property(property, user, js, value)
+                    != C_JSON_OK) {
+                cos_log(LOG_LEVEL_ERROR, "bad value for %s\n",
+                        property->tag);
+                return CANOPY_ERROR_JSON;
+            }
+        }
+        offset = c_json_skip_token(token, active, offset + 1);
+    }
+    return CANOPY_SUCCESS;
+}
+
+/****************************************************************************/
+/****************************************************************************/
+
+/*
+ * canopy_user_init
+ */
+canopy_error canopy_user_init(canopy_user_t *user, canopy_remote_t *remote) {
+    COS_ASSERT(user != NULL);
+    memset(user, 0, sizeof(*user));
+    user->remote = remote;
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * canopy_create_user
+ *
+ *      POST /api/create_user
+ */
+canopy_error canopy_create_user(canopy_remote_t *remote,
+        const char *username,
+        const char *password,
+        const char *email,
+        bool skip_email,
+        canopy_user_t *out_user,
+        canopy_barrier_t *barrier) {
+
+    struct c_json_state state;
+    char payload[USER_PAYLOAD_SIZE];
+    canopy_error err;
+
+    COS_ASSERT(remote != NULL);
+    if (username == NULL || password == NULL || email == NULL
+            || out_user == NULL
+            || strlen(username) >= CANOPY_USERNAME_MAX_LENGTH
+            || strlen(password) >= CANOPY_PASSWORD_MAX_LENGTH
+            || strlen(email) >= CANOPY_EMAIL_MAX_LENGTH) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+
+    c_json_buffer_init(&state, payload, sizeof(payload));
+    if (c_json_emit_open_object(&state) != C_JSON_OK
+            || c_json_emit_name_and_string(&state, TAG_USERNAME, username)
+                    != C_JSON_OK
+            || c_json_emit_name_and_string(&state, TAG_EMAIL, email)
+                    != C_JSON_OK
+            || c_json_emit_name_and_string(&state, TAG_PASSWORD, password)
+                    != C_JSON_OK
+            || c_json_emit_name_and_value(&state, TAG_SKIP_EMAIL,
+                    skip_email ? "true" : "false") != C_JSON_OK
+            || c_json_emit_close_object(&state) != C_JSON_OK) {
+        return CANOPY_ERROR_BUFFER_TOO_SMALL;
+    }
+
+    canopy_user_init(out_user, remote);
+    err = _user_request(remote, out_user, "/api/create_user", payload,
+            state.offset, barrier);
+    if (err == CANOPY_SUCCESS && out_user->name[0] == '\0') {
+        // The reply may leave the name out; it's the one we asked for.
+        strcpy(out_user->name, username);
+    }
+    return err;
+}
+
+/*
+ * canopy_get_self_user
+ *
+ *      GET /api/user/self
+ */
+canopy_error canopy_get_self_user(canopy_remote_t *remote,
+        canopy_user_t *user, canopy_barrier_t *barrier) {
+
+    COS_ASSERT(remote != NULL);
+    COS_ASSERT(user != NULL);
+
+    // verify that user credentials are in use
+    if (remote->params->credential_type != CANOPY_USER_CREDENTIALS) {
+        return CANOPY_ERROR_BAD_CREDENTIALS;
+    }
+
+    canopy_user_init(user, remote);
+    return _user_request(remote, user, "/api/user/self", NULL, 0, barrier);
+}
+
+/*
+ * canopy_user_update_from_remote
+ *
+ *      GET /api/user/self.  Local changes not yet sent are overwritten,
+ *      except for a password change.
+ */
+canopy_error canopy_user_update_from_remote(canopy_remote_t *remote,
+        canopy_user_t *user, canopy_barrier_t *barrier) {
+
+    COS_ASSERT(remote != NULL);
+    COS_ASSERT(user != NULL);
+
+    if (remote->params->credential_type != CANOPY_USER_CREDENTIALS) {
+        return CANOPY_ERROR_BAD_CREDENTIALS;
+    }
+
+    user->remote = remote;
+    return _user_request(remote, user, "/api/user/self", NULL, 0, barrier);
+}
+
+/*
+ * canopy_user_update_to_remote
+ *
+ *      POST /api/user/self with the local changes.  The reply is the whole
+ *      user, so this syncs both ways in one request.
+ */
+canopy_error canopy_user_update_to_remote(canopy_remote_t *remote,
+        canopy_user_t *user, canopy_barrier_t *barrier) {
+
+    char payload[USER_PAYLOAD_SIZE];
+    size_t payload_len;
+    canopy_error err;
+
+    COS_ASSERT(remote != NULL);
+    COS_ASSERT(user != NULL);
+
+    if (remote->params->credential_type != CANOPY_USER_CREDENTIALS) {
+        return CANOPY_ERROR_BAD_CREDENTIALS;
+    }
+
+    err = c_json_emit_user(user, payload, sizeof(payload), &payload_len);
+    if (err != CANOPY_SUCCESS) {
+        return err;
+    }
+
+    user->remote = remote;
+    err = _user_request(remote, user, "/api/user/self", payload, payload_len,
+            barrier);
+    if (err != CANOPY_SUCCESS) {
+        return err;
+    }
+
+    c_properties_clean(user_properties, C_PROPERTY_COUNT(user_properties),
+            user);
+    _forget_password(user);
+    memset(payload, 0, sizeof(payload));
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * canopy_user_sync_with_remote
+ */
+canopy_error canopy_user_sync_with_remote(canopy_user_t *user,
+        canopy_remote_t *remote, canopy_barrier_t *barrier) {
+    return canopy_user_update_to_remote(remote, user, barrier);
+}
+
+/*
+ * canopy_user_get_email
+ */
+canopy_error canopy_user_get_email(canopy_user_t *user, char **email) {
+    COS_ASSERT(user != NULL);
+    COS_ASSERT(email != NULL);
+    *email = user->email;
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * canopy_user_get_username
+ */
+canopy_error canopy_user_get_username(canopy_user_t *user, char **username) {
+    COS_ASSERT(user != NULL);
+    COS_ASSERT(username != NULL);
+    *username = user->name;
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * canopy_user_is_validated
+ */
+canopy_error canopy_user_is_validated(canopy_user_t *user, bool *validated) {
+    COS_ASSERT(user != NULL);
+    COS_ASSERT(validated != NULL);
+    *validated = user->is_activated;
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * canopy_user_set_email
+ */
+canopy_error canopy_user_set_email(canopy_user_t *user, const char *email) {
+    COS_ASSERT(user != NULL);
+    COS_ASSERT(email != NULL);
+
+    if (strnlen(email, CANOPY_EMAIL_MAX_LENGTH) >= CANOPY_EMAIL_MAX_LENGTH) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    strcpy(user->email, email);
+    user->email_dirty = true;
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * canopy_user_set_password
+ */
+canopy_error canopy_user_set_password(canopy_user_t *user,
+        const char *old_password,
+        const char *new_password) {
+    COS_ASSERT(user != NULL);
+    COS_ASSERT(old_password != NULL);
+    COS_ASSERT(new_password != NULL);
+
+    if (strnlen(old_password, CANOPY_PASSWORD_MAX_LENGTH)
+                >= CANOPY_PASSWORD_MAX_LENGTH
+            || strnlen(new_password, CANOPY_PASSWORD_MAX_LENGTH)
+                >= CANOPY_PASSWORD_MAX_LENGTH
+            || new_password[0] == '\0') {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    strcpy(user->old_password, old_password);
+    strcpy(user->new_password, new_password);
+    user->password_dirty = true;
+    return CANOPY_SUCCESS;
+}
@@ -57,8 +57,6 @@
  */
 
 
-static char buffer[1024];
-
 static struct canopy_var* find_name(canopy_device_t *device, const char* name);
 
 static struct canopy_var * create_variable(canopy_device_t *device,
@@ -66,6 +64,9 @@ static struct canopy_var * create_variable(canopy_device_t *device,
         canopy_var_datatype type,
         const char *name);
 
+static void var_sent(struct canopy_var *var);
+static void decls_changed(canopy_device_t *device);
+
 
 #ifdef DOCUMENT
 typedef enum {
@@ -125,6 +126,49 @@ typedef struct canopy_var {
 
 #endif
 
+/***************************************************************************
+ * A variable declared on its own, allocated together with its declaration.
+ * Only as much of the declaration as its text needs is allocated.
+ */
+struct lone_var {
+    struct canopy_var       var;
+    struct canopy_var_decl  decl;
+};
+
+/***************************************************************************
+ * Fills in <decl>, rendering the "<direction> <datatype> <name>" that is
+ * sent in var_decls.  Overlong names are truncated.
+ */
+static void init_decl(struct canopy_var_decl *decl,
+        canopy_var_direction direction,
+        canopy_var_datatype type,
+        const char *name) {
+
+    memset(decl, 0, sizeof(*decl));
+    decl->direction = direction;
+    decl->type = type;
+    decl->name_offset = snprintf(decl->decl, sizeof(decl->decl), "%s %s ",
+            canopy_var_direction_string(direction),
+            canopy_var_datatype_string(type));
+    strncpy(&decl->decl[decl->name_offset], name,
+            sizeof(decl->decl) - decl->name_offset - 1);
+}
+
+/***************************************************************************
+ * Sets up <var> of <device> for the declaration <decl>.
+ */
+static void init_var(struct canopy_var *var, canopy_device_t *device,
+        const struct canopy_var_decl *decl) {
+    memset(var, 0, sizeof(struct canopy_var));
+    var->next = NULL;
+    var->device = device;
+    var->decl = decl;
+    var->type = decl->type;
+    var->dirty = false;
+    var->set = false;
+    var->val.type = decl->type;
+}
+
 /***************************************************************************
  * Allocates a variable, initializes it and hangs it on the device...
  *
@@ -141,7 +185,9 @@ static struct canopy_var * create_variable(canopy_device_t *device,
         canopy_var_datatype type,
         const char *name) {
 
-    struct canopy_var *var;
+    struct lone_var *lone;
+    struct canopy_var_decl decl;
+    size_t len;
 
     if (device == NULL) {
         cos_log(LOG_LEVEL_FATAL, "device is null in call to create_variable()");
@@ -152,8 +198,10 @@ static struct canopy_var * create_variable(canopy_device_t *device,
         return NULL;
     }
 
-    var = (struct canopy_var*)cos_alloc(sizeof(struct canopy_var));
-    if (var == NULL) {
+    init_decl(&decl, direction, type, name);
+    len = offsetof(struct canopy_var_decl, decl) + strlen(decl.decl) + 1;
+    lone = (struct lone_var*)cos_alloc(offsetof(struct lone_var, decl) + len);
+    if (lone == NULL) {
         cos_log(LOG_LEVEL_FATAL, "could not allocate memory create_variable()");
         return NULL;
     }
@@ -161,18 +209,10 @@ static struct canopy_var * create_variable(canopy_device_t *device,
     /*
      * Setup the variable
      */
-    memset(var, 0, sizeof(struct canopy_var));
-    var->next = NULL;
-    var->device = device;
-    strncpy(var->name, name, CANOPY_VAR_NAME_MAX_LENGTH - 2);
-    var->name[CANOPY_VAR_NAME_MAX_LENGTH - 1] = '\0';
-    var->direction = direction;
-    var->type = type;
-    var->dirty = false;
-    var->set = false;
-    var->val.type = type;
+    memcpy(&lone->decl, &decl, len);
+    init_var(&lone->var, device, &lone->decl);
 
-    return var;
+    return &lone->var;
 }
 
 
@@ -192,8 +232,8 @@ canopy_error canopy_device_var_declare(canopy_device_t *device,
         /*
          * We found the variable, check to see if something's different
          */
-        if (tmp->direction != direction) {
-            cos_log(LOG_LEVEL_DEBUG, "dir %d doesn't match: %d\n", direction, tmp->direction);
+        if (tmp->decl->direction != direction) {
+            cos_log(LOG_LEVEL_DEBUG, "dir %d doesn't match: %d\n", direction, tmp->decl->direction);
         }
         if (tmp->type != type) {
             cos_log(LOG_LEVEL_DEBUG, "type %d doesn't match: %d\n", type, tmp->type);
@@ -221,11 +261,92 @@ canopy_error canopy_device_var_declare(canopy_device_t *device,
     var->next = device->vars;
     device->vars = var;
 #endif
+    decls_changed(device);
 
     *out_var = var;
     return CANOPY_SUCCESS;
 }
 
+/*****************************************************
+ * canopy_device_class_init()
+ */
+canopy_error canopy_device_class_init(canopy_device_class_t *cls,
+        struct canopy_var_decl *decls,
+        int max_count) {
+    if (cls == NULL || (decls == NULL && max_count > 0) || max_count < 0) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    cls->decls = decls;
+    cls->count = 0;
+    cls->max_count = max_count;
+    return CANOPY_SUCCESS;
+}
+
+/*****************************************************
+ * canopy_device_class_var_declare()
+ */
+canopy_error canopy_device_class_var_declare(canopy_device_class_t *cls,
+        canopy_var_direction direction,
+        canopy_var_datatype type,
+        const char *name,
+        int *out_slot) {
+    int i;
+
+    if (cls == NULL || name == NULL || out_slot == NULL) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    for (i = 0; i < cls->count; i++) {
+        const struct canopy_var_decl *decl = &cls->decls[i];
+        if (strncmp(&decl->decl[decl->name_offset], name,
+                CANOPY_VAR_NAME_MAX_LENGTH - 1) == 0) {
+            return CANOPY_ERROR_VAR_IN_USE;
+        }
+    }
+    if (cls->count >= cls->max_count) {
+        return CANOPY_ERROR_BUFFER_TOO_SMALL;
+    }
+    init_decl(&cls->decls[cls->count], direction, type, name);
+    *out_slot = cls->count++;
+    return CANOPY_SUCCESS;
+}
+
+/*****************************************************
+ * canopy_device_instantiate()
+ *
+ *     The class's variables go at the front of the device's list, in slot
+ *     order, ahead of any declared on their own.
+ */
+canopy_error canopy_device_instantiate(canopy_device_t *device,
+        const canopy_device_class_t *cls,
+        struct canopy_var *vars,
+        int count) {
+    int i;
+
+    if (device == NULL || cls == NULL || (vars == NULL && cls->count > 0)
+            || count < cls->count || device->class_vars != NULL) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    for (i = 0; i < cls->count; i++) {
+        const struct canopy_var_decl *decl = &cls->decls[i];
+        if (find_name(device, &decl->decl[decl->name_offset]) != NULL) {
+            return CANOPY_ERROR_VAR_IN_USE;
+        }
+    }
+    if (cls->count == 0) {
+        return CANOPY_SUCCESS;
+    }
+
+    for (i = 0; i < cls->count; i++) {
+        init_var(&vars[i], device, &cls->decls[i]);
+        vars[i].next = (i + 1 < cls->count) ? &vars[i + 1] : device->vars;
+    }
+    device->vars = &vars[0];
+    device->class_vars = vars;
+    device->class_var_count = cls->count;
+    decls_changed(device);
+    return CANOPY_SUCCESS;
+}
+
 /*****************************************************
  * find_name()
  */
@@ -237,7 +358,7 @@ static struct canopy_var* find_name(canopy_device_t *device, const char* name) {
 #else
     struct canopy_var *var = device->vars;
     while (var != NULL) {
-        if (strncmp(var->name, name, CANOPY_VAR_NAME_MAX_LENGTH - 1) == 0) {
+        if (strncmp(canopy_var_name(var), name, CANOPY_VAR_NAME_MAX_LENGTH - 1) == 0) {
             return var;
         }
         var = (struct canopy_var *)var->next; /* I have no idea why this is needed */
@@ -246,6 +367,19 @@ static struct canopy_var* find_name(canopy_device_t *device, const char* name) {
 #endif
 }
 
+/*****************************************************
+ * canopy_device_var_handle()
+ */
+canopy_error canopy_device_var_handle(canopy_device_t *device,
+        const char *var_name,
+        struct canopy_var **var) {
+    if (device == NULL || var_name == NULL || var == NULL) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    *var = find_name(device, var_name);
+    return (*var != NULL) ? CANOPY_SUCCESS : CANOPY_ERROR_VAR_NOT_FOUND;
+}
+
 /*****************************************************
  * canopy_device_get_var_by_name()
  */
@@ -289,31 +423,159 @@ canopy_error canopy_device_get_var_by_name(canopy_device_t *device,
 }
 
 /***************************************************************************
- * 	c_json_emit_vardcl(struct canopy_device *device, struct c_json_state *state,
- * 	bool emit_obj)
- *
- * 		creates the JSON  request to register the variables that are registered
- * 	with the remote. (in canopy_variables.c) "emit_obj" sends the opening
- * 	and closing object keys.
+ * Parses a "<direction> <datatype> <name>" declaration, as found in the
+ * var_decls tag, of <len> bytes.  Returns false if it's malformed.
  */
-canopy_error c_json_emit_vardcl(struct canopy_device *device,
-        struct c_json_state *state,
-        bool emit_obj) {
-    int err = CANOPY_SUCCESS;
-    struct canopy_var *var;
-    if (emit_obj) {
-        err = c_json_emit_open_object(state);
-        if (err != C_JSON_OK) {
-            cos_log(LOG_LEVEL_DEBUG, "unable to emit opening object err: %d\n",
-                    err);
-            return CANOPY_ERROR_JSON;
+static bool parse_decl_string(const char *decl, int len,
+        canopy_var_direction *v_dir,
+        canopy_var_datatype *v_type,
+        char *name, int name_len) {
+    char buffer[256];
+    char dir[32];
+    char type[32];
+    char var_name[128];
+
+    memset(&dir, 0, sizeof(dir));
+    memset(&type, 0, sizeof(type));
+    memset(&var_name, 0, sizeof(var_name));
+    len = LOCAL_MIN(len, (int)sizeof(buffer) - 1);
+    strncpy(buffer, decl, len);
+    buffer[len] = '\0';
+
+    sscanf(buffer, "%31s %31s %127s", (char*)&dir, (char*)&type,
+            (char*)&var_name);
+    *v_dir = direction_from_string((const char*)dir, sizeof(dir));
+    *v_type = datatype_from_string((const char*)type, sizeof(type));
+    if (*v_dir == CANOPY_VAR_DIRECTION_INVALID) {
+        cos_log(LOG_LEVEL_DEBUG, "v_dir in string is invalid: %s\n", dir);
+        return false;
+    }
+    if (*v_type == CANOPY_VAR_DATATYPE_INVALID) {
+        cos_log(LOG_LEVEL_DEBUG, "v_type in string is invalid: %s\n", type);
+        return false;
+    }
+    strncpy(name, var_name, name_len - 1);
+    name[name_len - 1] = '\0';
+    return true;
+}
+
+/***************************************************************************
+ * Declares a variable that the remote told us about.  If it has already been
+ * declared we're done, but log any difference in direction or type.
+ */
+static canopy_error declare_remote_var(canopy_device_t *device,
+        canopy_var_direction v_dir,
+        canopy_var_datatype v_type,
+        const char *name) {
+    struct canopy_var* var = find_name(device, name);
+    if (var != NULL) {
+
+        /*
+         * We found the variable, check to see if something's different
+         */
+        if (var->decl->direction != v_dir) {
+            cos_log(LOG_LEVEL_DEBUG, "v_dir %d doesn't match: %d\n", v_dir, var->decl->direction);
         }
+        if (var->type != v_type) {
+            cos_log(LOG_LEVEL_DEBUG, "v_type %d doesn't match: %d\n", v_type, var->type);
+        }
+        return CANOPY_SUCCESS;
+    }
+
+    /*
+     * We need to create a new variable, and hang it on the device.
+     */
+    var = create_variable(device, v_dir, v_type, name);
+    if (var == NULL) {
+        return CANOPY_ERROR_OUT_OF_MEMORY;
+    }
+#ifdef HAVE_MEMORY
+    /*
+     * TODO, write code to store this into the hash table on the device.....
+     */
+#else
+    /*
+     * Tack the new variable onto the front of the list
+     */
+    var->next = device->vars;
+    device->vars = var;
+#endif
+    decls_changed(device);
+    return CANOPY_SUCCESS;
+}
+
+/***************************************************************************
+ * The "var_decls" object only changes when variables are declared, but goes
+ * in every sync.  Once rendered it's kept on the device, with the indent and
+ * separator it was rendered after, and copied into later payloads whole (or
+ * just pointed at, when they're chains).
+ *
+ * "vars" only holds the dirty variables, so it isn't the same from one sync
+ * to the next, but each variable's line in it is, up to the value.  Those
+ * names are rendered once into a template of literal segments, each with and
+ * without the separator before it, and a sync puts in the segments of the
+ * variables it sends and formats just their values into the slots between.
+ * Declaring a variable drops both.
+ */
+
+/* the largest reply buffer class; bigger than this, it's emitted in place */
+#define VAR_DECLS_MAX_SIZE (1024 * 1024)
+
+struct c_json_var_decls {
+    int     indent;
+    bool    separator;
+    int     len;
+    char    text[];
+};
+
+struct c_json_vars_template {
+    int     indent;
+    char    *text;
+    int     marks[];    /* for each variable, where its name starts without
+                         * and with the separator, then where it ends */
+};
+
+static void var_decls_dropped(canopy_device_t *device) {
+    if (device->json_var_decls != NULL) {
+        cos_free(device->json_var_decls);
+        device->json_var_decls = NULL;
     }
+}
+
+static void decls_changed(canopy_device_t *device) {
+    var_decls_dropped(device);
+    if (device->json_vars != NULL) {
+        cos_free(device->json_vars);
+        device->json_vars = NULL;
+    }
+}
+
+static bool var_decls_fit(const struct c_json_var_decls *rendered,
+        const struct c_json_state *state) {
+    return rendered != NULL
+            && rendered->indent == state->indent
+            && rendered->separator
+                == state->prepend_separator[state->stack_depth];
+}
+
+/*
+ * Emits the "var_decls" object itself.  Running out of room in <state> is
+ * CANOPY_ERROR_BUFFER_TOO_SMALL, anything else CANOPY_ERROR_JSON.
+ */
+static canopy_error decls_error(int err) {
+    return (err == C_JSON_BUFFER_OVERFLOW)
+            ? CANOPY_ERROR_BUFFER_TOO_SMALL : CANOPY_ERROR_JSON;
+}
+
+static canopy_error emit_decls_object(struct canopy_device *device,
+        struct c_json_state *state) {
+    int err;
+    struct canopy_var *var;
 
     err = c_json_emit_name_and_object(state, TAG_VAR_DECLS);
     if (err != C_JSON_OK) {
         cos_log(LOG_LEVEL_DEBUG, "unable to emit var_decls err: %d\n", err);
-        return CANOPY_ERROR_JSON;
+        return decls_error(err);
     }
     /*
      *
@@ -332,22 +594,19 @@ canopy_error c_json_emit_vardcl(struct canopy_device *device,
 
     var = device->vars;
     while (var != NULL) {
-        char * name = var->name;
-        snprintf(buffer, sizeof(buffer), "%s %s %s",
-                canopy_var_direction_string(var->direction),
-                canopy_var_datatype_string(var->type), name);
-        err = c_json_emit_name_and_object(state, buffer);
+        const char *name = canopy_var_name(var);
+        err = c_json_emit_name_and_object(state, (char*)var->decl->decl);
         if (err != C_JSON_OK) {
             cos_log(LOG_LEVEL_DEBUG, "unable to emit variable: %s err: %d\n",
                     name, err);
-            return CANOPY_ERROR_JSON;
+            return decls_error(err);
         }
         err = c_json_emit_close_object(state);
         if (err != C_JSON_OK) {
             cos_log(LOG_LEVEL_DEBUG,
                     "unable to emit variable %s closing object err: %d\n", name,
                     err);
-            return CANOPY_ERROR_JSON;
+            return decls_error(err);
         }
         var = var->next;
     }
@@ -356,7 +615,102 @@ canopy_error c_json_emit_vardcl(struct canopy_device *device,
     if (err != C_JSON_OK) {
         cos_log(LOG_LEVEL_DEBUG,
                 "unable to emit var_decls closing object err: %d\n", err);
-        return CANOPY_ERROR_JSON;
+        return decls_error(err);
+    }
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * Renders "var_decls" as it would go at this point in <state>, and keeps it.
+ * Returns NULL if there's no memory to keep it in, it won't fit in
+ * VAR_DECLS_MAX_SIZE, or it can't be emitted at all.
+ */
+static struct c_json_var_decls *render_var_decls(struct canopy_device *device,
+        const struct c_json_state *state) {
+    struct c_json_var_decls *rendered;
+    struct c_json_state text;
+    struct canopy_var *var;
+    int size = 128;
+
+    /* each declaration with its indent, quotes and braces fits in this */
+    for (var = device->vars; var != NULL; var = var->next) {
+        size += strlen(var->decl->decl) + 64;
+    }
+    for (;;) {
+        canopy_error err;
+
+        if (size > VAR_DECLS_MAX_SIZE) {
+            size = VAR_DECLS_MAX_SIZE;
+        }
+        rendered = (struct c_json_var_decls*)cos_alloc(
+                sizeof(struct c_json_var_decls) + size);
+        if (rendered == NULL) {
+            return NULL;
+        }
+        /* same indent and separators, but its own buffer */
+        text = *state;
+        text.chain = NULL;
+        text.buffer = rendered->text;
+        text.buffer_len = size;
+        text.offset = 0;
+        text.buffer[0] = '\0';
+        err = emit_decls_object(device, &text);
+        if (err == CANOPY_SUCCESS && text.offset < size - 1) {
+            break;
+        }
+        cos_free(rendered);
+        if ((err != CANOPY_SUCCESS && err != CANOPY_ERROR_BUFFER_TOO_SMALL)
+                || size == VAR_DECLS_MAX_SIZE) {
+            return NULL;
+        }
+        size *= 2;
+    }
+    rendered->indent = state->indent;
+    rendered->separator = state->prepend_separator[state->stack_depth];
+    rendered->len = text.offset;
+    var_decls_dropped(device);
+    device->json_var_decls = rendered;
+    return rendered;
+}
+
+/***************************************************************************
+ * 	c_json_emit_vardcl(struct canopy_device *device, struct c_json_state *state,
+ * 	bool emit_obj)
+ *
+ * 		creates the JSON  request to register the variables that are registered
+ * 	with the remote. (in canopy_variables.c) "emit_obj" sends the opening
+ * 	and closing object keys.
+ */
+canopy_error c_json_emit_vardcl(struct canopy_device *device,
+        struct c_json_state *state,
+        bool emit_obj) {
+    int err = CANOPY_SUCCESS;
+    struct c_json_var_decls *rendered;
+
+    if (emit_obj) {
+        err = c_json_emit_open_object(state);
+        if (err != C_JSON_OK) {
+            cos_log(LOG_LEVEL_DEBUG, "unable to emit opening object err: %d\n",
+                    err);
+            return CANOPY_ERROR_JSON;
+        }
+    }
+
+    rendered = device->json_var_decls;
+    if (!var_decls_fit(rendered, state)) {
+        rendered = render_var_decls(device, state);
+    }
+    if (rendered != NULL) {
+        if (c_json_emit_text(state, rendered->text, rendered->len)
+                != C_JSON_OK) {
+            cos_log(LOG_LEVEL_DEBUG, "no room for var_decls\n");
+            return CANOPY_ERROR_JSON;
+        }
+        state->prepend_separator[state->stack_depth] = true;
+    } else {
+        if (emit_decls_object(device, state) != CANOPY_SUCCESS) {
+            return CANOPY_ERROR_JSON;
+        }
     }
 
     if (emit_obj) {
@@ -367,7 +721,7 @@ canopy_error c_json_emit_vardcl(struct canopy_device *device,
             return CANOPY_ERROR_JSON;
         }
     }
-    return err;
+    return CANOPY_SUCCESS;
 }
 
 /***************************************************************************
@@ -388,6 +742,7 @@ canopy_error c_json_parse_vardcl(struct canopy_device *device,
         bool check_obj) {               /* expect outer-most object */
     int err = CANOPY_SUCCESS;
     int i;
+    int len;
 
     COS_ASSERT(device != NULL);
     COS_ASSERT(device->remote != NULL);
@@ -449,68 +804,24 @@ canopy_error c_json_parse_vardcl(struct canopy_device *device,
     }
     offset++;
     for (i = 0; i < (n_decls); i++) {
-        char dir[32];
-        char type[32];
         char name[128];
-        memset(&dir, 0, sizeof(dir));
-        memset(&type, 0, sizeof(type));
-        memset(&name, 0, sizeof(name));
-        memset(&buffer, 0, sizeof(buffer));
+        canopy_var_direction v_dir;
+        canopy_var_datatype v_type;
 
         /*
          * the token at offset should be the string we need to parse,
          */
         COS_ASSERT(token[offset].type == JSMN_STRING);
         COS_ASSERT(token[offset].size == 1);
-        strncpy(buffer, &js[token[offset].start], (token[offset].end - token[offset].start));
-        buffer[(token[offset].start - token[offset].end)] = '\0';
-
-        sscanf(buffer, "%s %s %s", (char*)&dir, (char*)&type, (char*)&name);
-        canopy_var_direction v_dir = direction_from_string((const char*)dir, sizeof(dir));
-        canopy_var_datatype v_type = datatype_from_string((const char*)type, sizeof(type));
-        if (v_dir == CANOPY_VAR_DIRECTION_INVALID) {
-            cos_log(LOG_LEVEL_DEBUG, "v_dir in string is invalid: %s\n", dir);
-            return CANOPY_ERROR_JSON;
-        }
-        if (v_type == CANOPY_VAR_DATATYPE_INVALID) {
-            cos_log(LOG_LEVEL_DEBUG, "v_dir in string is invalid: %s\n", type);
+        len = token[offset].end - token[offset].start;
+        if (!parse_decl_string(&js[token[offset].start], len, &v_dir, &v_type,
+                name, sizeof(name))) {
             return CANOPY_ERROR_JSON;
         }
 
-        /*
-         * We've got the name, so we need to look to see if this variable has
-         * already been defined.  If it has, we're done, but log any
-         * Difference in direction or type.
-         */
-        struct canopy_var* var = find_name(device, (const char*)name);
-        if (var != NULL) {
-
-            /*
-             * We found the variable, check to see if something's different
-             */
-            if (var->direction != v_dir) {
-                cos_log(LOG_LEVEL_DEBUG, "v_dir %d doesn't match: %d\n", v_dir, var->direction);
-            }
-            if (var->type != v_type) {
-                cos_log(LOG_LEVEL_DEBUG, "v_type %d doesn't match: %d\n", v_type, var->type);
-            }
-        } else {
-
-            /*
-             * We need to create a new variable, and hang it on the device.
-             */
-            var = create_variable(device, v_dir, v_type, name);
-#ifdef HAVE_MEMORY
-            /*
-             * TODO, write code to store this into the hash table on the device.....
-             */
-#else
-            /*
-             * Tack the new variable onto the front of the list
-             */
-            var->next = device->vars;
-            device->vars = var;
-#endif
+        err = declare_remote_var(device, v_dir, v_type, name);
+        if (err != CANOPY_SUCCESS) {
+            return err;
         }
 
         /*
@@ -531,6 +842,96 @@ canopy_error c_json_parse_vardcl(struct canopy_device *device,
     return err;
 } /* c_json_parse_vardcl */
 
+/*
+ * Renders the names of the variables of <device> as they'd go in "vars" at
+ * this point in <state>, and keeps them.  Returns NULL if there's no memory
+ * to keep them in.
+ */
+static struct c_json_vars_template *render_vars_template(
+        struct canopy_device *device, const struct c_json_state *state) {
+    struct c_json_vars_template *tmpl;
+    struct c_json_state text;
+    struct canopy_var *var;
+    int count = 0;
+    int size = 1;
+    int i = 0;
+    int sep;
+
+    /* the name, its quotes, " : ", ", " and the indent fit in this */
+    for (var = device->vars; var != NULL; var = var->next) {
+        count++;
+        size += 2 * (strlen(canopy_var_name(var)) + 32);
+    }
+    tmpl = (struct c_json_vars_template*)cos_alloc(
+            sizeof(struct c_json_vars_template)
+            + (2 * count + 1) * sizeof(int) + size);
+    if (tmpl == NULL) {
+        return NULL;
+    }
+    tmpl->indent = state->indent;
+    tmpl->text = (char*)&tmpl->marks[2 * count + 1];
+
+    text = *state;
+    text.chain = NULL;
+    text.buffer = tmpl->text;
+    text.buffer_len = size;
+    text.offset = 0;
+    text.buffer[0] = '\0';
+    for (var = device->vars; var != NULL; var = var->next) {
+        for (sep = 0; sep < 2; sep++) {
+            tmpl->marks[i++] = text.offset;
+            text.prepend_separator[text.stack_depth] = sep;
+            if (c_json_emit_name(&text, canopy_var_name(var)) != C_JSON_OK) {
+                cos_free(tmpl);
+                return NULL;
+            }
+        }
+    }
+    tmpl->marks[i] = text.offset;
+    if (device->json_vars != NULL) {
+        cos_free(device->json_vars);
+    }
+    device->json_vars = tmpl;
+    return tmpl;
+}
+
+/*
+ * Emits the value of <var> into its slot.
+ */
+static int emit_value(struct c_json_state *state,
+        const struct canopy_var *var) {
+    const struct canopy_var_value *val = &var->val;
+
+    switch (var->type) {
+    case CANOPY_VAR_DATATYPE_STRING:
+        return c_json_emit_valuef(state, "\"%s\"", val->value.val_string);
+    case CANOPY_VAR_DATATYPE_BOOL:
+        return c_json_emit_valuef(state, "%s",
+                (val->value.val_bool ? "true" : "false"));
+    case CANOPY_VAR_DATATYPE_INT8:
+        return c_json_emit_valuef(state, "%d", val->value.val_int8);
+    case CANOPY_VAR_DATATYPE_INT16:
+        return c_json_emit_valuef(state, "%d", val->value.val_int16);
+    case CANOPY_VAR_DATATYPE_INT32:
+        return c_json_emit_valuef(state, "%d", val->value.val_int32);
+    case CANOPY_VAR_DATATYPE_UINT8:
+        return c_json_emit_valuef(state, "%u", val->value.val_uint8);
+    case CANOPY_VAR_DATATYPE_UINT16:
+        return c_json_emit_valuef(state, "%u", val->value.val_uint16);
+    case CANOPY_VAR_DATATYPE_UINT32:
+        return c_json_emit_valuef(state, "%u", val->value.val_uint32);
+    case CANOPY_VAR_DATATYPE_FLOAT32:
+        return c_json_emit_valuef(state, "%e", val->value.val_float);
+    case CANOPY_VAR_DATATYPE_FLOAT64:
+        return c_json_emit_valuef(state, "%e", val->value.val_double);
+    case CANOPY_VAR_DATATYPE_DATETIME:
+        return c_json_emit_valuef(state, "%llu",
+                (unsigned long long)val->value.val_time);
+    default:
+        return C_JSON_PARSE_ERROR;
+    }
+}
+
 /***************************************************************************
  * 	c_json_emit_vars(struct canopy_device *device, struct c_json_state *state)
  *
@@ -544,6 +945,10 @@ canopy_error c_json_emit_vars(struct canopy_device *device,
 
     int err = CANOPY_SUCCESS;
     struct canopy_var *var;
+    struct c_json_vars_template *tmpl;
+    const int *mark;
+    int i;
+
     if (emit_obj) {
         err = c_json_emit_open_object(state);
         if (err != C_JSON_OK) {
@@ -558,18 +963,19 @@ canopy_error c_json_emit_vars(struct canopy_device *device,
         return CANOPY_ERROR_JSON;
     }
 
-    var = device->vars;
-    while (var != NULL) {
-        char * name = var->name;
-        canopy_var_datatype type = var->type;
-        memset(&buffer, 0, sizeof(buffer));
+    tmpl = device->json_vars;
+    if (tmpl == NULL || tmpl->indent != state->indent) {
+        tmpl = render_vars_template(device, state);
+    }
+
+    for (var = device->vars, i = 0; var != NULL; var = var->next, i++) {
+        const char *name = canopy_var_name(var);
 
         /*
          * Check to see if the variable has been set.  If it hasn't
          * we need to skip this one
          */
         if (!var->set) {
-            var = var->next;
             continue;
         }
 
@@ -578,79 +984,38 @@ canopy_error c_json_emit_vars(struct canopy_device *device,
          * variables).
          */
         if (!var->dirty) {
-            var = var->next;
             continue;
         }
 
-        if (clear_dirty) {
-            var->dirty = false;
+        if (var->type == CANOPY_VAR_DATATYPE_VOID
+                || var->type == CANOPY_VAR_DATATYPE_STRUCT
+                || var->type == CANOPY_VAR_DATATYPE_ARRAY
+                || var->type == CANOPY_VAR_DATATYPE_INVALID) {
+            cos_log(LOG_LEVEL_FATAL, "invalid type code %d\n", var->type);
+            return CANOPY_ERROR_FATAL;
         }
 
-        switch (type) {
-        case CANOPY_VAR_DATATYPE_STRING:
-            snprintf(buffer, sizeof(buffer), "\"%s\"",
-                    var->val.value.val_string);
-            break;
+        if (clear_dirty) {
+            var_sent(var);
+        }
 
-        case CANOPY_VAR_DATATYPE_BOOL:
-            snprintf(buffer, sizeof(buffer), "%s",
-                    (var->val.value.val_bool ? "true" : "false"));
-            break;
-
-        case CANOPY_VAR_DATATYPE_INT8:
-            snprintf(buffer, sizeof(buffer), "%d", var->val.value.val_int8);
-            break;
-
-        case CANOPY_VAR_DATATYPE_INT16:
-            snprintf(buffer, sizeof(buffer), "%d", var->val.value.val_int16);
-            break;
-
-        case CANOPY_VAR_DATATYPE_INT32:
-            snprintf(buffer, sizeof(buffer), "%d", var->val.value.val_int32);
-            break;
-
-        case CANOPY_VAR_DATATYPE_UINT8:
-            snprintf(buffer, sizeof(buffer), "%u", var->val.value.val_uint8);
-            break;
-
-        case CANOPY_VAR_DATATYPE_UINT16:
-            snprintf(buffer, sizeof(buffer), "%u", var->val.value.val_uint16);
-            break;
-
-        case CANOPY_VAR_DATATYPE_UINT32:
-            snprintf(buffer, sizeof(buffer), "%u", var->val.value.val_uint32);
-            break;
-
-        case CANOPY_VAR_DATATYPE_FLOAT32:
-            snprintf(buffer, sizeof(buffer), "%e", var->val.value.val_float);
-            break;
-
-        case CANOPY_VAR_DATATYPE_FLOAT64:
-            snprintf(buffer, sizeof(buffer), "%e", var->val.value.val_double);
-            break;
-
-        case CANOPY_VAR_DATATYPE_DATETIME:
-            snprintf(buffer, sizeof(buffer), "%llu",
-                    (unsigned long long)var->val.value.val_time);
-            break;
-
-        case CANOPY_VAR_DATATYPE_VOID:
-        case CANOPY_VAR_DATATYPE_STRUCT:
-        case CANOPY_VAR_DATATYPE_ARRAY:
-        case CANOPY_VAR_DATATYPE_INVALID:
-        default:
-            cos_log(LOG_LEVEL_FATAL, "invalid type code %d\n", type);
-            return CANOPY_ERROR_FATAL;
-        } /* switch(type) */
-
-        err = c_json_emit_name_and_value(state, name, buffer);
-        if (err != C_JSON_OK) {
-            cos_log(LOG_LEVEL_DEBUG, "unable to emit variable: %s err: %d\n",
-                    name, err);
-            return CANOPY_ERROR_JSON;
-        }
-        var = var->next;
-    } /* while (var != NULL) */
+        if (tmpl != NULL) {
+            mark = &tmpl->marks[2 * i
+                    + state->prepend_separator[state->stack_depth]];
+            err = c_json_emit_text(state, &tmpl->text[mark[0]],
+                    mark[1] - mark[0]);
+        } else {
+            err = c_json_emit_name(state, name);
+        }
+        if (err == C_JSON_OK) {
+            err = emit_value(state, var);
+        }
+        if (err != C_JSON_OK) {
+            cos_log(LOG_LEVEL_DEBUG, "unable to emit variable: %s err: %d\n",
+                    name, err);
+            return CANOPY_ERROR_JSON;
+        }
+    } /* for each variable */
 
     err = c_json_emit_close_object(state);
     if (err != C_JSON_OK) {
@@ -668,6 +1033,79 @@ canopy_error c_json_emit_vars(struct canopy_device *device,
     return err;
 } /* c_json_emit_vars */
 
+/***************************************************************************
+ * Change notification.  A value from the remote only replaces the one held
+ * if its time is newer, so the application never sees a change it wasn't
+ * told about and times never go backwards.  Before a variable is updated,
+ * what it was is saved if anyone is to be told about changes to it:
+ * callbacks, or the scheduler, which syncs more often while a device is
+ * busy.
+ */
+struct var_snapshot {
+    bool                    set;
+    struct canopy_var_value val;
+};
+
+static bool stale(const struct canopy_var *var, cos_time_t remote_time) {
+    return var->set && remote_time <= var->last;
+}
+
+static bool watched(const struct canopy_var *var) {
+    return var->decl->direction != CANOPY_VAR_OUT
+            && (var->on_change != NULL || var->device->on_var_change != NULL
+                || var->device->scheduled);
+}
+
+static bool same_value(canopy_var_datatype type,
+        const struct canopy_var_value *a, const struct canopy_var_value *b) {
+    switch (type) {
+    case CANOPY_VAR_DATATYPE_STRING:
+        return strncmp(a->value.val_string, b->value.val_string,
+                sizeof(a->value.val_string)) == 0;
+    case CANOPY_VAR_DATATYPE_BOOL:
+        return a->value.val_bool == b->value.val_bool;
+    case CANOPY_VAR_DATATYPE_INT8:
+        return a->value.val_int8 == b->value.val_int8;
+    case CANOPY_VAR_DATATYPE_INT16:
+        return a->value.val_int16 == b->value.val_int16;
+    case CANOPY_VAR_DATATYPE_INT32:
+        return a->value.val_int32 == b->value.val_int32;
+    case CANOPY_VAR_DATATYPE_UINT8:
+        return a->value.val_uint8 == b->value.val_uint8;
+    case CANOPY_VAR_DATATYPE_UINT16:
+        return a->value.val_uint16 == b->value.val_uint16;
+    case CANOPY_VAR_DATATYPE_UINT32:
+        return a->value.val_uint32 == b->value.val_uint32;
+    case CANOPY_VAR_DATATYPE_FLOAT32:
+        return a->value.val_float == b->value.val_float;
+    case CANOPY_VAR_DATATYPE_FLOAT64:
+        return a->value.val_double == b->value.val_double;
+    case CANOPY_VAR_DATATYPE_DATETIME:
+        return a->value.val_time == b->value.val_time;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Calls the callbacks if <var> was given a different value than <before>.
+ */
+static void notify_change(struct canopy_var *var,
+        const struct var_snapshot *before) {
+    canopy_device_t *device = var->device;
+
+    if (before->set && same_value(var->type, &var->val, &before->val)) {
+        return;
+    }
+    device->in_changed = true;
+    if (var->on_change != NULL) {
+        var->on_change(var, var->on_change_userdata);
+    }
+    if (device->on_var_change != NULL) {
+        device->on_var_change(var, device->on_var_change_userdata);
+    }
+}
+
 /***************************************************************************
  * 	c_json_parse_vars(struct canopy_device *device,
  *		char* js, int js_len, jsmntok_t *token, int tok_len,
@@ -684,6 +1122,7 @@ canopy_error c_json_parse_vars(struct canopy_device *device, char* js,
         bool check_obj) { /* expect outer-most object */
 
     int i;
+    int len;
     char name[128];
     char primative[128];
     char time[128];
@@ -792,9 +1231,10 @@ canopy_error c_json_parse_vars(struct canopy_device *device, char* js,
          */
         COS_ASSERT(token[offset].type == JSMN_STRING);
         COS_ASSERT(token[offset].size == 1);
-        strncpy(name, &js[token[offset].start],
-                (token[offset].end - token[offset].start));
-        name[(token[offset].start - token[offset].end)] = '\0';
+        len = LOCAL_MIN(token[offset].end - token[offset].start,
+                (int)sizeof(name) - 1);
+        strncpy(name, &js[token[offset].start], len);
+        name[len] = '\0';
         offset++;
 
         COS_ASSERT(token[offset].type == JSMN_OBJECT);
@@ -809,9 +1249,10 @@ canopy_error c_json_parse_vars(struct canopy_device *device, char* js,
 
         COS_ASSERT(token[offset].type == JSMN_PRIMITIVE);
         COS_ASSERT(token[offset].size == 0);
-        strncpy(time, &js[token[offset].start],
-                (token[offset].end - token[offset].start));
-        time[(token[offset].start - token[offset].end)] = '\0';
+        len = LOCAL_MIN(token[offset].end - token[offset].start,
+                (int)sizeof(time) - 1);
+        strncpy(time, &js[token[offset].start], len);
+        time[len] = '\0';
         remote_time = atoll(time);
         offset++;
 
@@ -829,9 +1270,10 @@ canopy_error c_json_parse_vars(struct canopy_device *device, char* js,
             COS_ASSERT("type wrong in parse vars" == NULL);
         }
         COS_ASSERT(token[offset].size == 0);
-        strncpy(primative, &js[token[offset].start],
-                (token[offset].end - token[offset].start));
-        primative[(token[offset].start - token[offset].end)] = '\0';
+        len = LOCAL_MIN(token[offset].end - token[offset].start,
+                (int)sizeof(primative) - 1);
+        strncpy(primative, &js[token[offset].start], len);
+        primative[len] = '\0';
         offset++;
 
         /*
@@ -843,6 +1285,17 @@ canopy_error c_json_parse_vars(struct canopy_device *device, char* js,
             int v;
             double dv;
             unsigned long long ull;
+            struct var_snapshot before;
+            bool notify;
+
+            if (stale(var, remote_time)) {
+                continue;
+            }
+            notify = watched(var);
+            if (notify) {
+                before.set = var->set;
+                before.val = var->val;
+            }
 
             /*
              * We found the variable, get the value based on the var we find, but
@@ -924,6 +1377,9 @@ canopy_error c_json_parse_vars(struct canopy_device *device, char* js,
             } /* switch(type) */
 
             var->set = true;
+            if (notify) {
+                notify_change(var, &before);
+            }
         } else {
 
             /*
@@ -939,9 +1395,647 @@ canopy_error c_json_parse_vars(struct canopy_device *device, char* js,
     return CANOPY_SUCCESS;
 } /* c_json_parse_vars */
 
+/***************************************************************************
+ * 	c_cbor_emit_vardcl(struct canopy_device *device, struct c_cbor_state *state)
+ *
+ * 	CBOR version of c_json_emit_vardcl().  Emits the var_decls tag followed
+ * 	by a map of "<direction> <datatype> <name>" to empty maps.
+ */
+canopy_error c_cbor_emit_vardcl(struct canopy_device *device,
+        struct c_cbor_state *state) {
+    struct canopy_var *var;
+    int count = 0;
+
+    for (var = device->vars; var != NULL; var = var->next) {
+        count++;
+    }
+
+    if (c_cbor_emit_string(state, TAG_VAR_DECLS, -1) != C_CBOR_OK
+            || c_cbor_emit_map(state, count) != C_CBOR_OK) {
+        cos_log(LOG_LEVEL_DEBUG, "unable to emit var_decls\n");
+        return CANOPY_ERROR_CBOR;
+    }
+
+    for (var = device->vars; var != NULL; var = var->next) {
+        if (c_cbor_emit_string(state, var->decl->decl, -1) != C_CBOR_OK
+                || c_cbor_emit_map(state, 0) != C_CBOR_OK) {
+            cos_log(LOG_LEVEL_DEBUG, "unable to emit variable: %s\n",
+                    canopy_var_name(var));
+            return CANOPY_ERROR_CBOR;
+        }
+    }
+    return CANOPY_SUCCESS;
+} /* c_cbor_emit_vardcl */
+
+/***************************************************************************
+ * 	c_cbor_emit_vars(struct canopy_device *device, struct c_cbor_state *state,
+ * 	bool clear_dirty)
+ *
+ * 	CBOR version of c_json_emit_vars().  Emits the vars tag followed by a map
+ * 	of name to value, using the native CBOR type for each datatype.
+ */
+canopy_error c_cbor_emit_vars(struct canopy_device *device,
+        struct c_cbor_state *state,
+        bool clear_dirty) {
+    struct canopy_var *var;
+    int err;
+
+    /*
+     * Which variables are dirty isn't known up front, so use an indefinite
+     * length map.
+     */
+    if (c_cbor_emit_string(state, TAG_VARS, -1) != C_CBOR_OK
+            || c_cbor_emit_map(state, -1) != C_CBOR_OK) {
+        cos_log(LOG_LEVEL_DEBUG, "unable to emit vars\n");
+        return CANOPY_ERROR_CBOR;
+    }
+
+    for (var = device->vars; var != NULL; var = var->next) {
+        if (!var->set || !var->dirty) {
+            continue;
+        }
+
+        err = c_cbor_emit_string(state, canopy_var_name(var), -1);
+        if (err != C_CBOR_OK) {
+            cos_log(LOG_LEVEL_DEBUG, "unable to emit variable: %s\n",
+                    canopy_var_name(var));
+            return CANOPY_ERROR_CBOR;
+        }
+
+        switch (var->type) {
+        case CANOPY_VAR_DATATYPE_STRING:
+            err = c_cbor_emit_string(state, var->val.value.val_string, -1);
+            break;
+        case CANOPY_VAR_DATATYPE_BOOL:
+            err = c_cbor_emit_bool(state, var->val.value.val_bool);
+            break;
+        case CANOPY_VAR_DATATYPE_INT8:
+            err = c_cbor_emit_int(state, var->val.value.val_int8);
+            break;
+        case CANOPY_VAR_DATATYPE_INT16:
+            err = c_cbor_emit_int(state, var->val.value.val_int16);
+            break;
+        case CANOPY_VAR_DATATYPE_INT32:
+            err = c_cbor_emit_int(state, var->val.value.val_int32);
+            break;
+        case CANOPY_VAR_DATATYPE_UINT8:
+            err = c_cbor_emit_uint(state, var->val.value.val_uint8);
+            break;
+        case CANOPY_VAR_DATATYPE_UINT16:
+            err = c_cbor_emit_uint(state, var->val.value.val_uint16);
+            break;
+        case CANOPY_VAR_DATATYPE_UINT32:
+            err = c_cbor_emit_uint(state, var->val.value.val_uint32);
+            break;
+        case CANOPY_VAR_DATATYPE_FLOAT32:
+            err = c_cbor_emit_float32(state, var->val.value.val_float);
+            break;
+        case CANOPY_VAR_DATATYPE_FLOAT64:
+            err = c_cbor_emit_float64(state, var->val.value.val_double);
+            break;
+        case CANOPY_VAR_DATATYPE_DATETIME:
+            err = c_cbor_emit_uint(state, var->val.value.val_time);
+            break;
+        case CANOPY_VAR_DATATYPE_VOID:
+        case CANOPY_VAR_DATATYPE_STRUCT:
+        case CANOPY_VAR_DATATYPE_ARRAY:
+        case CANOPY_VAR_DATATYPE_INVALID:
+        default:
+            cos_log(LOG_LEVEL_FATAL, "invalid type code %d\n", var->type);
+            return CANOPY_ERROR_FATAL;
+        } /* switch(type) */
+        if (err != C_CBOR_OK) {
+            cos_log(LOG_LEVEL_DEBUG, "unable to emit variable: %s\n",
+                    canopy_var_name(var));
+            return CANOPY_ERROR_CBOR;
+        }
+
+        if (clear_dirty) {
+            var_sent(var);
+        }
+    }
+
+    if (c_cbor_emit_break(state) != C_CBOR_OK) {
+        return CANOPY_ERROR_CBOR;
+    }
+    return CANOPY_SUCCESS;
+} /* c_cbor_emit_vars */
+
+/***************************************************************************
+ * 	c_cbor_parse_vardcl(struct canopy_device *device,
+ * 	    struct c_cbor_reader *reader, struct c_cbor_item *map)
+ *
+ * 	CBOR version of c_json_parse_vardcl().
+ */
+canopy_error c_cbor_parse_vardcl(struct canopy_device *device,
+        struct c_cbor_reader *reader,
+        struct c_cbor_item *map) {
+    struct c_cbor_item decl;
+    struct c_cbor_item body;
+    canopy_var_direction v_dir;
+    canopy_var_datatype v_type;
+    char name[128];
+    canopy_error err;
+    uint64_t i;
+
+    COS_ASSERT(device != NULL);
+    COS_ASSERT(device->remote != NULL);
+
+    if (map->type != C_CBOR_MAP) {
+        return CANOPY_ERROR_CBOR;
+    }
+    for (i = 0; c_cbor_more(reader, map, i); i++) {
+        if (c_cbor_read(reader, &decl) != C_CBOR_OK
+                || decl.type != C_CBOR_TEXT) {
+            return CANOPY_ERROR_CBOR;
+        }
+        if (!parse_decl_string(decl.str, decl.str_len, &v_dir, &v_type,
+                name, sizeof(name))) {
+            return CANOPY_ERROR_CBOR;
+        }
+
+        /*
+         * The declaration's (currently empty) map of properties.
+         */
+        if (c_cbor_read(reader, &body) != C_CBOR_OK
+                || c_cbor_skip(reader, &body) != C_CBOR_OK) {
+            return CANOPY_ERROR_CBOR;
+        }
+
+        err = declare_remote_var(device, v_dir, v_type, name);
+        if (err != CANOPY_SUCCESS) {
+            return err;
+        }
+    }
+    return CANOPY_SUCCESS;
+} /* c_cbor_parse_vardcl */
+
+/***************************************************************************
+ * Stores the CBOR <value> in <var>, converting it to the variable's
+ * datatype.
+ */
+static canopy_error cbor_store_value(struct canopy_var *var,
+        struct c_cbor_item *value) {
+    int64_t iv;
+    double dv;
+
+    switch (value->type) {
+    case C_CBOR_UINT:
+        iv = (int64_t)value->uint;
+        dv = (double)value->uint;
+        break;
+    case C_CBOR_INT:
+        iv = value->sint;
+        dv = (double)value->sint;
+        break;
+    case C_CBOR_FLOAT:
+        iv = (int64_t)value->real;
+        dv = value->real;
+        break;
+    default:
+        iv = 0;
+        dv = 0.0;
+        break;
+    }
+
+    switch (var->type) {
+    case CANOPY_VAR_DATATYPE_STRING:
+        if (c_cbor_item_copy_string(value, var->val.value.val_string,
+                sizeof(var->val.value.val_string)) != C_CBOR_OK) {
+            return CANOPY_ERROR_CBOR;
+        }
+        break;
+
+    case CANOPY_VAR_DATATYPE_BOOL:
+        if (value->type != C_CBOR_BOOL) {
+            return CANOPY_ERROR_CBOR;
+        }
+        var->val.value.val_bool = value->boolean;
+        break;
+
+    case CANOPY_VAR_DATATYPE_FLOAT32:
+    case CANOPY_VAR_DATATYPE_FLOAT64:
+        if (value->type != C_CBOR_UINT && value->type != C_CBOR_INT
+                && value->type != C_CBOR_FLOAT) {
+            return CANOPY_ERROR_CBOR;
+        }
+        if (var->type == CANOPY_VAR_DATATYPE_FLOAT32) {
+            var->val.value.val_float = (float)dv;
+        } else {
+            var->val.value.val_double = dv;
+        }
+        break;
+
+    case CANOPY_VAR_DATATYPE_INT8:
+    case CANOPY_VAR_DATATYPE_INT16:
+    case CANOPY_VAR_DATATYPE_INT32:
+    case CANOPY_VAR_DATATYPE_UINT8:
+    case CANOPY_VAR_DATATYPE_UINT16:
+    case CANOPY_VAR_DATATYPE_UINT32:
+    case CANOPY_VAR_DATATYPE_DATETIME:
+        if (value->type != C_CBOR_UINT && value->type != C_CBOR_INT) {
+            return CANOPY_ERROR_CBOR;
+        }
+        switch (var->type) {
+        case CANOPY_VAR_DATATYPE_INT8:
+            var->val.value.val_int8 = (int8_t)iv;
+            break;
+        case CANOPY_VAR_DATATYPE_INT16:
+            var->val.value.val_int16 = (int16_t)iv;
+            break;
+        case CANOPY_VAR_DATATYPE_INT32:
+            var->val.value.val_int32 = (int32_t)iv;
+            break;
+        case CANOPY_VAR_DATATYPE_UINT8:
+            var->val.value.val_uint8 = (uint8_t)iv;
+            break;
+        case CANOPY_VAR_DATATYPE_UINT16:
+            var->val.value.val_uint16 = (uint16_t)iv;
+            break;
+        case CANOPY_VAR_DATATYPE_UINT32:
+            var->val.value.val_uint32 = (uint32_t)iv;
+            break;
+        default:
+            var->val.value.val_time = (cos_time_t)iv;
+            break;
+        }
+        break;
+
+    case CANOPY_VAR_DATATYPE_VOID:
+    case CANOPY_VAR_DATATYPE_STRUCT:
+    case CANOPY_VAR_DATATYPE_ARRAY:
+    case CANOPY_VAR_DATATYPE_INVALID:
+    default:
+        cos_log(LOG_LEVEL_FATAL, "invalid type code %d\n", var->type);
+        return CANOPY_ERROR_FATAL;
+    }
+    return CANOPY_SUCCESS;
+}
+
+/***************************************************************************
+ * 	c_cbor_parse_vars(struct canopy_device *device,
+ * 	    struct c_cbor_reader *reader, struct c_cbor_item *map)
+ *
+ * 	CBOR version of c_json_parse_vars().  Each entry maps a variable name to
+ * 	a map holding "t" (time, unsigned) and "v" (value).
+ */
+canopy_error c_cbor_parse_vars(struct canopy_device *device,
+        struct c_cbor_reader *reader,
+        struct c_cbor_item *map) {
+    struct c_cbor_item name_item;
+    struct c_cbor_item sample;
+    struct c_cbor_item tag;
+    struct c_cbor_item value;
+    struct c_cbor_item v;
+    char name[128];
+    uint64_t i, j;
+    canopy_error err;
+
+    COS_ASSERT(device != NULL);
+    COS_ASSERT(device->remote != NULL);
+
+    if (map->type != C_CBOR_MAP) {
+        return CANOPY_ERROR_CBOR;
+    }
+    for (i = 0; c_cbor_more(reader, map, i); i++) {
+        cos_time_t remote_time = 0;
+        bool have_value = false;
+
+        if (c_cbor_read(reader, &name_item) != C_CBOR_OK
+                || c_cbor_item_copy_string(&name_item, name, sizeof(name))
+                        != C_CBOR_OK) {
+            return CANOPY_ERROR_CBOR;
+        }
+        if (c_cbor_read(reader, &sample) != C_CBOR_OK
+                || sample.type != C_CBOR_MAP) {
+            return CANOPY_ERROR_CBOR;
+        }
+        for (j = 0; c_cbor_more(reader, &sample, j); j++) {
+            if (c_cbor_read(reader, &tag) != C_CBOR_OK
+                    || c_cbor_read(reader, &value) != C_CBOR_OK) {
+                return CANOPY_ERROR_CBOR;
+            }
+            if (c_cbor_item_is(&tag, TAG_T) && value.type == C_CBOR_UINT) {
+                remote_time = (cos_time_t)value.uint;
+            } else if (c_cbor_item_is(&tag, TAG_V)) {
+                v = value;
+                have_value = true;
+            }
+            if (c_cbor_skip(reader, &value) != C_CBOR_OK) {
+                return CANOPY_ERROR_CBOR;
+            }
+        }
+        if (!have_value) {
+            return CANOPY_ERROR_CBOR;
+        }
+
+        struct canopy_var* var = find_name(device, (const char*)name);
+        if (var == NULL) {
+            return CANOPY_ERROR_VAR_NOT_FOUND;
+        }
+        if (stale(var, remote_time)) {
+            continue;
+        }
+        struct var_snapshot before;
+        bool notify = watched(var);
+        if (notify) {
+            before.set = var->set;
+            before.val = var->val;
+        }
+        var->last = remote_time;
+        err = cbor_store_value(var, &v);
+        if (err != CANOPY_SUCCESS) {
+            return err;
+        }
+        var->set = true;
+        if (notify) {
+            notify_change(var, &before);
+        }
+    } /* var loop */
+
+    return CANOPY_SUCCESS;
+} /* c_cbor_parse_vars */
+
 /*****************************************************************************/
 /*****************************************************************************/
 
+/*
+ * Reporting policy.
+ *
+ *     A variable's value as a double, to measure a change against its
+ *     deadband.  Strings have no number; their reports keep copies instead
+ *     (see report_string()).
+ */
+static double var_number(const struct canopy_var *var) {
+    const struct canopy_var_value *val = &var->val;
+
+    switch (var->type) {
+    case CANOPY_VAR_DATATYPE_BOOL:
+        return val->value.val_bool;
+    case CANOPY_VAR_DATATYPE_INT8:
+        return val->value.val_int8;
+    case CANOPY_VAR_DATATYPE_INT16:
+        return val->value.val_int16;
+    case CANOPY_VAR_DATATYPE_INT32:
+        return val->value.val_int32;
+    case CANOPY_VAR_DATATYPE_UINT8:
+        return val->value.val_uint8;
+    case CANOPY_VAR_DATATYPE_UINT16:
+        return val->value.val_uint16;
+    case CANOPY_VAR_DATATYPE_UINT32:
+        return val->value.val_uint32;
+    case CANOPY_VAR_DATATYPE_FLOAT32:
+        return val->value.val_float;
+    case CANOPY_VAR_DATATYPE_FLOAT64:
+        return val->value.val_double;
+    case CANOPY_VAR_DATATYPE_DATETIME:
+        return (double)val->value.val_time;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * The copy of a string variable's value that <var>'s report keeps: the one
+ * last reported, or the one in flight if <sent>.
+ */
+static char *report_string(const struct canopy_var *var, bool sent) {
+    return var->report->strings
+            + (sent ? CANOPY_VAR_VALUE_MAX_LENGTH : 0);
+}
+
+/*
+ * Whether the number held by <var> is far enough from the one last reported
+ * to be sent.
+ */
+static bool beyond_deadband(const struct canopy_var *var) {
+    const struct canopy_var_policy *policy = var->report->policy;
+    double delta = var_number(var) - var->report->reported;
+    double last = var->report->reported;
+
+    if (var->type == CANOPY_VAR_DATATYPE_STRING) {
+        return strncmp(var->val.value.val_string, report_string(var, false),
+                CANOPY_VAR_VALUE_MAX_LENGTH) != 0;
+    }
+    if (delta < 0) {
+        delta = -delta;
+    }
+    if (last < 0) {
+        last = -last;
+    }
+    if (delta == 0) {
+        return false;
+    }
+    if (var->type == CANOPY_VAR_DATATYPE_BOOL) {
+        return true;
+    }
+    if (policy->deadband > 0 && delta <= policy->deadband) {
+        return false;
+    }
+    if (policy->deadband_pct > 0
+            && delta <= last * policy->deadband_pct / 100) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Marks <var>, which has a policy, dirty if it's time to report it.
+ * <significant> is whether the value just set is a change worth sending.
+ */
+static void apply_policy(struct canopy_var *var, bool significant) {
+    const struct canopy_var_policy *policy = var->report->policy;
+    cos_time_t now;
+    cos_time_t since;
+
+    var->set = true;
+    if (var->dirty) {
+        /* it's going anyway, with whatever value it has by then */
+        return;
+    }
+    /* back within the deadband of what was reported, nothing's pending */
+    var->pending = significant;
+
+    cos_get_time(&now);
+    since = now - var->report->reported_at;
+    if ((var->pending && since >= policy->min_interval)
+            || (policy->heartbeat != 0 && since >= policy->heartbeat)) {
+        var->dirty = true;
+        c_scheduler_dirty(var->device);
+    }
+}
+
+/*
+ * Called as a dirty variable goes into a request.  Its policy measures from
+ * what was sent once c_vars_reported() hears that it got there.  Until then
+ * a change is pending only if it's made after this.
+ */
+static void var_sent(struct canopy_var *var) {
+    var->dirty = false;
+    var->in_flight = true;
+    if (var->report != NULL) {
+        var->pending = false;
+        var->report->sent = var_number(var);
+        if (var->type == CANOPY_VAR_DATATYPE_STRING) {
+            memcpy(report_string(var, true), var->val.value.val_string,
+                    CANOPY_VAR_VALUE_MAX_LENGTH);
+        }
+    }
+}
+
+/*
+ * c_vars_reported()
+ *
+ *     A request that didn't get there (or that's to be sent again in another
+ *     format) leaves every variable it carried dirty, policy or not, so the
+ *     next request carries them too.
+ */
+void c_vars_reported(struct canopy_device *device, bool delivered) {
+    struct canopy_var *var;
+    cos_time_t now;
+
+    cos_get_time(&now);
+    for (var = device->vars; var != NULL; var = var->next) {
+        if (!var->in_flight) {
+            continue;
+        }
+        var->in_flight = false;
+        if (!delivered) {
+            var->dirty = true;
+            if (var->report != NULL) {
+                var->pending = true;
+            }
+        } else if (var->report != NULL) {
+            var->report->reported = var->report->sent;
+            var->report->reported_at = now;
+            if (var->type == CANOPY_VAR_DATATYPE_STRING) {
+                memcpy(report_string(var, false), report_string(var, true),
+                        CANOPY_VAR_VALUE_MAX_LENGTH);
+            }
+        }
+    }
+}
+
+/*
+ * c_vars_due()
+ *
+ *     What apply_policy() does on a set, for the variables that haven't been
+ *     set since their time came.
+ */
+bool c_vars_due(struct canopy_device *device, cos_time_t now,
+        cos_time_t *wait) {
+    const struct canopy_var_policy *policy;
+    struct canopy_var *var;
+    cos_time_t due;
+    bool marked = false;
+
+    for (var = device->vars; var != NULL; var = var->next) {
+        if (var->report == NULL || !var->set || var->dirty
+                || var->in_flight) {
+            continue;
+        }
+        policy = var->report->policy;
+        if (var->pending) {
+            due = var->report->reported_at + policy->min_interval;
+        } else if (policy->heartbeat != 0) {
+            due = var->report->reported_at + policy->heartbeat;
+        } else {
+            continue;
+        }
+        if (policy->heartbeat != 0
+                && var->report->reported_at + policy->heartbeat < due) {
+            due = var->report->reported_at + policy->heartbeat;
+        }
+        if (due <= now) {
+            var->dirty = true;
+            marked = true;
+        } else if (wait != NULL && due - now < *wait) {
+            *wait = due - now;
+        }
+    }
+    return marked;
+}
+
+/*
+ * canopy_var_set_policy()
+ *
+ *     A change of policy keeps what was reported under the last one.
+ */
+canopy_error canopy_var_set_policy(struct canopy_var *var,
+        const struct canopy_var_policy *policy) {
+    size_t size;
+
+    if (var == NULL) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    if (policy == NULL) {
+        if (var->report != NULL) {
+            cos_free(var->report);
+            var->report = NULL;
+            var->pending = false;
+        }
+        return CANOPY_SUCCESS;
+    }
+    if (var->report == NULL) {
+        size = sizeof(struct canopy_var_report);
+        if (var->type == CANOPY_VAR_DATATYPE_STRING) {
+            size += 2 * CANOPY_VAR_VALUE_MAX_LENGTH;
+        }
+        var->report = (struct canopy_var_report*)cos_alloc(size);
+        if (var->report == NULL) {
+            return CANOPY_ERROR_OUT_OF_MEMORY;
+        }
+        memset(var->report, 0, size);
+    }
+    var->report->policy = policy;
+    return CANOPY_SUCCESS;
+}
+
+/*
+ * canopy_var_changed()
+ *
+ *     Marks a variable set locally as needing to go to the remote.  This is
+ *     on the path of every typed put, so the query cache is left to the sync
+ *     (see c_query_cache_invalidate()) and the scheduler is only told once.
+ */
+void canopy_var_changed(struct canopy_var *var) {
+    if (var->report != NULL) {
+        apply_policy(var, var->report->reported_at == 0
+                || beyond_deadband(var));
+        return;
+    }
+    var->set = true;
+    if (!var->dirty) {
+        var->dirty = true;
+        c_scheduler_dirty(var->device);
+    }
+}
+
+/*
+ * canopy_var_on_change(), canopy_device_on_var_change()
+ */
+canopy_error canopy_var_on_change(struct canopy_var *var,
+        canopy_var_callback_t callback,
+        void *userdata) {
+    if (var == NULL) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    var->on_change = callback;
+    var->on_change_userdata = userdata;
+    return CANOPY_SUCCESS;
+}
+
+canopy_error canopy_device_on_var_change(canopy_device_t *device,
+        canopy_var_callback_t callback,
+        void *userdata) {
+    if (device == NULL) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+    device->on_var_change = callback;
+    device->on_var_change_userdata = userdata;
+    return CANOPY_SUCCESS;
+}
+
 canopy_error canopy_var_set_bool(struct canopy_var *var, bool value) {
     struct canopy_var_value *var_val = &var->val;
     if (var->type != CANOPY_VAR_DATATYPE_BOOL) {
@@ -949,8 +2043,7 @@ canopy_error canopy_var_set_bool(struct canopy_var *var, bool value) {
     }
     var_val->type = CANOPY_VAR_DATATYPE_BOOL;
     var_val->value.val_bool = value;
-    var->set = true;
-    var->dirty = true;
+    canopy_var_changed(var);
     return CANOPY_SUCCESS;
 }
 
@@ -961,8 +2054,7 @@ canopy_error canopy_var_set_int8(struct canopy_var *var, int8_t value) {
     }
     var_val->type = CANOPY_VAR_DATATYPE_INT8;
     var_val->value.val_int8 = value;
-    var->set = true;
-    var->dirty = true;
+    canopy_var_changed(var);
     return CANOPY_SUCCESS;
 }
 
@@ -973,8 +2065,7 @@ canopy_error canopy_var_set_int16(struct canopy_var *var, int16_t value) {
     }
     var_val->type = CANOPY_VAR_DATATYPE_INT16;
     var_val->value.val_int16 = value;
-    var->set = true;
-    var->dirty = true;
+    canopy_var_changed(var);
     return CANOPY_SUCCESS;
 }
 
@@ -985,8 +2076,7 @@ canopy_error canopy_var_set_int32(struct canopy_var *var, int32_t value) {
     }
     var_val->type = CANOPY_VAR_DATATYPE_INT32;
     var_val->value.val_int32 = value;
-    var->set = true;
-    var->dirty = true;
+    canopy_var_changed(var);
     return CANOPY_SUCCESS;
 }
 
@@ -995,10 +2085,9 @@ canopy_error canopy_var_set_uint8(struct canopy_var *var, uint8_t value) {
     if (var->type != CANOPY_VAR_DATATYPE_UINT8) {
         return CANOPY_ERROR_BAD_PARAM;
     }
-    var_val->type = CANOPY_VAR_DATATYPE_BOOL;
+    var_val->type = CANOPY_VAR_DATATYPE_UINT8;
     var_val->value.val_uint8 = value;
-    var->set = true;
-    var->dirty = true;
+    canopy_var_changed(var);
     return CANOPY_SUCCESS;
 }
 
@@ -1009,8 +2098,7 @@ canopy_error canopy_var_set_uint16(struct canopy_var *var, uint16_t value) {
     }
     var_val->type = CANOPY_VAR_DATATYPE_UINT16;
     var_val->value.val_uint16 = value;
-    var->set = true;
-    var->dirty = true;
+    canopy_var_changed(var);
     return CANOPY_SUCCESS;
 }
 
@@ -1020,9 +2108,8 @@ canopy_error canopy_var_set_uint32(struct canopy_var *var, uint32_t value) {
         return CANOPY_ERROR_BAD_PARAM;
     }
     var_val->type = CANOPY_VAR_DATATYPE_UINT32;
-    var_val->value.val_bool = value;
-    var->set = true;
-    var->dirty = true;
+    var_val->value.val_uint32 = value;
+    canopy_var_changed(var);
     return CANOPY_SUCCESS;
 }
 
@@ -1033,8 +2120,7 @@ canopy_error canopy_var_set_datetime(struct canopy_var *var, cos_time_t value) {
     }
     var_val->type = CANOPY_VAR_DATATYPE_DATETIME;
     var_val->value.val_time = value;
-    var->set = true;
-    var->dirty = true;
+    canopy_var_changed(var);
     return CANOPY_SUCCESS;
 }
 
@@ -1045,8 +2131,7 @@ canopy_error canopy_var_set_float32(struct canopy_var *var, float value) {
     }
     var_val->type = CANOPY_VAR_DATATYPE_FLOAT32;
     var_val->value.val_float = value;
-    var->set = true;
-    var->dirty = true;
+    canopy_var_changed(var);
     return CANOPY_SUCCESS;
 }
 
@@ -1057,8 +2142,7 @@ canopy_error canopy_var_set_float64(struct canopy_var *var, double value) {
     }
     var_val->type = CANOPY_VAR_DATATYPE_FLOAT64;
     var_val->value.val_double = value;
-    var->set = true;
-    var->dirty = true;
+    canopy_var_changed(var);
     return CANOPY_SUCCESS;
 }
 
@@ -1071,8 +2155,7 @@ canopy_error canopy_var_set_string(struct canopy_var *var, const char *value,
     var_val->type = CANOPY_VAR_DATATYPE_STRING;
     strncpy(var_val->value.val_string, value,
             sizeof(var_val->value.val_string));
-    var->set = true;
-    var->dirty = true;
+    canopy_var_changed(var);
     return CANOPY_SUCCESS;
 }
 
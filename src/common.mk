@@ -23,7 +23,11 @@ OBJ_FILES := \
 		canopy_remotes.o	\
 		canopy_variables.o	\
 		canopy_device.o		\
-		canopy_json.o
+		canopy_json.o		\
+		canopy_cbor.o		\
+		canopy_queries.o	\
+		canopy_users.o		\
+		canopy_scheduler.o
 
 
 SO_TARGET := libcanopy.so
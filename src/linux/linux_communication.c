@@ -13,19 +13,570 @@
 // limitations under the License.
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <curl/curl.h>
+#include <zlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <canopy_min.h>
 #include <canopy_os.h>
 #include <canopy_communication.h>
 
 
+/*
+ * What ctx->comm points at.  The curl share handle lets the short lived easy
+ * handle of each request pick up the TLS sessions and DNS lookups of earlier
+ * ones, so a reconnect resumes the TLS session instead of doing a full
+ * handshake, and doesn't go back to the resolver every time.
+ */
+struct comm_ctx {
+    CURLSH          *share;
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+};
+
+static void _share_lock(CURL *handle, curl_lock_data data,
+        curl_lock_access access, void *userptr) {
+    struct comm_ctx *comm = (struct comm_ctx*) userptr;
+    pthread_mutex_lock(&comm->locks[data]);
+}
+
+static void _share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    struct comm_ctx *comm = (struct comm_ctx*) userptr;
+    pthread_mutex_unlock(&comm->locks[data]);
+}
+
+/*****************************************************************************
+ * canopy_comm_ctx_init
+ */
+canopy_error canopy_comm_ctx_init(struct canopy_context *ctx) {
+    struct comm_ctx *comm;
+    int i;
+
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        cos_log(LOG_LEVEL_WARN, "Initialization of curl failed");
+        return CANOPY_ERROR_NETWORK;
+    }
+    comm = (struct comm_ctx*)cos_alloc(sizeof(struct comm_ctx));
+    if (comm == NULL) {
+        curl_global_cleanup();
+        return CANOPY_ERROR_OUT_OF_MEMORY;
+    }
+    comm->share = curl_share_init();
+    if (comm->share == NULL) {
+        cos_free(comm);
+        curl_global_cleanup();
+        return CANOPY_ERROR_OUT_OF_MEMORY;
+    }
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&comm->locks[i], NULL);
+    }
+    curl_share_setopt(comm->share, CURLSHOPT_LOCKFUNC, _share_lock);
+    curl_share_setopt(comm->share, CURLSHOPT_UNLOCKFUNC, _share_unlock);
+    curl_share_setopt(comm->share, CURLSHOPT_USERDATA, comm);
+    curl_share_setopt(comm->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(comm->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    ctx->comm = comm;
+    return CANOPY_SUCCESS;
+}
+
+/*****************************************************************************
+ * canopy_comm_ctx_shutdown
+ */
+void canopy_comm_ctx_shutdown(struct canopy_context *ctx) {
+    struct comm_ctx *comm = (struct comm_ctx*) ctx->comm;
+    int i;
+
+    if (comm == NULL) {
+        return;
+    }
+    curl_share_cleanup(comm->share);
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&comm->locks[i]);
+    }
+    cos_free(comm);
+    ctx->comm = NULL;
+    curl_global_cleanup();
+}
+
+/*
+ * What remote->pool points at.  Reply buffers come in size classes, 1KB, 4KB
+ * and so on up to 1MB, and a few of each class are kept once they're handed
+ * back.  Bigger ones (if max_response_size allows them) are freed when
+ * they're done with.
+ */
+#define POOL_CLASSES        6
+#define POOL_SMALLEST       1024
+#define POOL_KEEP           4       /* free buffers kept per class */
+
+struct pooled_buffer {
+    struct pooled_buffer    *next;          /* while it's in the pool */
+    size_t                  size;
+    int                     size_class;     /* -1 if it's not kept */
+    char                    data[];
+};
+
+struct canopy_buffer_pool {
+    cos_mutex_t             *lock;
+    struct pooled_buffer    *free[POOL_CLASSES];
+    int                     free_count[POOL_CLASSES];
+};
+
+static size_t _class_size(int size_class) {
+    return (size_t)POOL_SMALLEST << (2 * size_class);
+}
+
+/*
+ * remote->rcv_end, the length of the last reply, which requests on other
+ * threads read and write too.
+ */
+static size_t _last_reply_len(struct canopy_remote *remote) {
+    size_t len;
+
+    cos_mutex_lock(remote->pool->lock);
+    len = (size_t)remote->rcv_end;
+    cos_mutex_unlock(remote->pool->lock);
+    return len;
+}
+
+static void _set_last_reply_len(struct canopy_remote *remote, size_t len) {
+    cos_mutex_lock(remote->pool->lock);
+    remote->rcv_end = (int)len;
+    cos_mutex_unlock(remote->pool->lock);
+}
+
+/*
+ * What remote->connections points at.  A remote's requests all go through
+ * one curl multi handle, whose connection cache keeps connections open
+ * between requests, and which multiplexes requests over HTTP/2 connections.
+ * A multi handle can only be used by one thread at a time, so the thread
+ * that's <driving> runs every transfer in flight, not just its own.  The
+ * others wait to be woken, and then find theirs done or take over.  New
+ * transfers are handed over through <pending>, and curl_multi_wakeup() gets
+ * the thread running the multi handle to pick them up.
+ */
+struct transfer {
+    CURL                    *curl;
+    CURLcode                result;
+    bool                    done;
+    cos_event_t             *wake;      /* when it's done, or to take over */
+    struct canopy_barrier   *barrier;   /* if it can be cancelled */
+    struct transfer         *next;      /* while it's pending or active */
+};
+
+struct canopy_connection_pool {
+    CURLM                           *multi;
+    cos_mutex_t                     *lock;      /* for all but <multi> */
+    bool                            driving;    /* someone's running <multi> */
+    struct transfer                 *pending;   /* not yet in <multi> */
+    struct transfer                 *active;    /* in <multi> */
+    struct canopy_connection_stats  stats;
+};
+
+static void _connection_pool_destroy(struct canopy_connection_pool *pool) {
+    if (pool->multi != NULL) {
+        curl_multi_cleanup(pool->multi);
+    }
+    if (pool->lock != NULL) {
+        cos_mutex_destroy(pool->lock);
+    }
+    cos_free(pool);
+}
+
+static struct canopy_connection_pool * _connection_pool_create(
+        const struct canopy_remote_params *params) {
+    struct canopy_connection_pool *pool;
+
+    pool = (struct canopy_connection_pool*)cos_calloc(1,
+            sizeof(struct canopy_connection_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->multi = curl_multi_init();
+    pool->lock = cos_mutex_create();
+    if (pool->multi == NULL || pool->lock == NULL) {
+        _connection_pool_destroy(pool);
+        return NULL;
+    }
+    curl_multi_setopt(pool->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(pool->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+            (long)params->max_connections);
+    curl_multi_setopt(pool->multi, CURLMOPT_MAXCONNECTS,
+            (long)params->max_connections);
+    curl_multi_setopt(pool->multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+            (long)params->max_streams);
+    pool->stats.max_connections = params->max_connections;
+    pool->stats.max_streams = params->max_streams;
+    return pool;
+}
+
+//
+// Whether <barrier> has been cancelled, which is kept under the sync_lock
+// of its remote.
+static bool _cancelled(struct canopy_barrier *barrier) {
+    cos_mutex_t *lock = barrier->remote->sync_lock;
+    bool cancelled;
+
+    if (lock != NULL) {
+        cos_mutex_lock(lock);
+    }
+    cancelled = barrier->cancelled;
+    if (lock != NULL) {
+        cos_mutex_unlock(lock);
+    }
+    return cancelled;
+}
+
+//
+// Takes <done> out of <pool>'s multi handle with <result>, and wakes whoever
+// is waiting for it.  Called holding <pool>'s lock.
+static void _transfer_done(struct canopy_connection_pool *pool,
+        struct transfer *done, CURLcode result) {
+
+    struct transfer **link;
+
+    for (link = &pool->active; *link != NULL; link = &(*link)->next) {
+        if (*link == done) {
+            *link = done->next;
+            break;
+        }
+    }
+    curl_multi_remove_handle(pool->multi, done->curl);
+    done->result = result;
+    done->done = true;
+    cos_event_signal(done->wake);
+}
+
+//
+// Runs <pool>'s multi handle until <own> is done.
+static void _pool_drive(struct canopy_connection_pool *pool,
+        struct transfer *own) {
+
+    struct transfer *pending;
+    struct transfer *next;
+    struct transfer *done;
+    struct transfer *active;
+    CURLMsg *msg;
+    int running;
+    int left;
+
+    cos_mutex_lock(pool->lock);
+    while (!own->done) {
+        pending = pool->pending;
+        pool->pending = NULL;
+        for (; pending != NULL; pending = next) {
+            next = pending->next;
+            if (curl_multi_add_handle(pool->multi, pending->curl)
+                    != CURLM_OK) {
+                pending->result = CURLE_OUT_OF_MEMORY;
+                pending->done = true;
+                cos_event_signal(pending->wake);
+            } else {
+                pending->next = pool->active;
+                pool->active = pending;
+            }
+        }
+        cos_mutex_unlock(pool->lock);
+
+        curl_multi_perform(pool->multi, &running);
+
+        cos_mutex_lock(pool->lock);
+        while ((msg = curl_multi_info_read(pool->multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+                    (char**)&done);
+            _transfer_done(pool, done, msg->data.result);
+        }
+        for (active = pool->active; active != NULL; active = next) {
+            next = active->next;
+            if (active->barrier != NULL && _cancelled(active->barrier)) {
+                _transfer_done(pool, active, CURLE_ABORTED_BY_CALLBACK);
+            }
+        }
+        if (!own->done) {
+            cos_mutex_unlock(pool->lock);
+            curl_multi_poll(pool->multi, NULL, 0, 1000, NULL);
+            cos_mutex_lock(pool->lock);
+        }
+    }
+    cos_mutex_unlock(pool->lock);
+}
+
+//
+// Runs the transfer <curl> through <pool>, running everyone else's that are
+// in flight while it's at it.  If <barrier> is cancelled the transfer is
+// dropped with CURLE_ABORTED_BY_CALLBACK.  Returns what curl_easy_perform()
+// would.
+static CURLcode _pool_perform(struct canopy_connection_pool *pool,
+        CURL *curl, struct canopy_barrier *barrier) {
+
+    struct transfer transfer;
+    long connects = 0;
+    long version = 0;
+
+    transfer.curl = curl;
+    transfer.result = CURLE_OK;
+    transfer.done = false;
+    transfer.barrier = barrier;
+    transfer.wake = cos_event_create();
+    if (transfer.wake == NULL) {
+        return CURLE_OUT_OF_MEMORY;
+    }
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, &transfer);
+
+    cos_mutex_lock(pool->lock);
+    transfer.next = pool->pending;
+    pool->pending = &transfer;
+    pool->stats.in_flight++;
+    if (pool->stats.in_flight > pool->stats.peak_in_flight) {
+        pool->stats.peak_in_flight = pool->stats.in_flight;
+    }
+    curl_multi_wakeup(pool->multi);
+    while (!transfer.done) {
+        if (pool->driving) {
+            cos_mutex_unlock(pool->lock);
+            cos_event_wait(transfer.wake, 1000);
+            cos_mutex_lock(pool->lock);
+            continue;
+        }
+        pool->driving = true;
+        cos_mutex_unlock(pool->lock);
+        _pool_drive(pool, &transfer);
+        cos_mutex_lock(pool->lock);
+        pool->driving = false;
+        /* someone else's still going, so they're to take over */
+        if (pool->active != NULL) {
+            cos_event_signal(pool->active->wake);
+        } else if (pool->pending != NULL) {
+            cos_event_signal(pool->pending->wake);
+        }
+    }
+    cos_mutex_unlock(pool->lock);
+    cos_event_destroy(transfer.wake);
+
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+    cos_mutex_lock(pool->lock);
+    pool->stats.in_flight--;
+    pool->stats.requests++;
+    if (connects > 0) {
+        pool->stats.connects++;
+    }
+    if (version == CURL_HTTP_VERSION_2_0) {
+        pool->stats.multiplexed++;
+    }
+    cos_mutex_unlock(pool->lock);
+    return transfer.result;
+}
+
+/*****************************************************************************
+ * canopy_comm_wakeup
+ */
+void canopy_comm_wakeup(struct canopy_remote *remote) {
+    if (remote->connections != NULL) {
+        curl_multi_wakeup(remote->connections->multi);
+    }
+}
+
+/*****************************************************************************
+ * canopy_comm_remote_init
+ */
+canopy_error canopy_comm_remote_init(struct canopy_remote *remote) {
+    struct canopy_buffer_pool *pool;
+
+    pool = (struct canopy_buffer_pool*)cos_calloc(1,
+            sizeof(struct canopy_buffer_pool));
+    if (pool == NULL) {
+        return CANOPY_ERROR_OUT_OF_MEMORY;
+    }
+    pool->lock = cos_mutex_create();
+    if (pool->lock == NULL) {
+        cos_free(pool);
+        return CANOPY_ERROR_OUT_OF_MEMORY;
+    }
+    remote->connections = _connection_pool_create(remote->params);
+    if (remote->connections == NULL) {
+        cos_mutex_destroy(pool->lock);
+        cos_free(pool);
+        return CANOPY_ERROR_OUT_OF_MEMORY;
+    }
+    remote->pool = pool;
+    return CANOPY_SUCCESS;
+}
+
+/*****************************************************************************
+ * canopy_comm_remote_shutdown
+ */
+void canopy_comm_remote_shutdown(struct canopy_remote *remote) {
+    struct canopy_buffer_pool *pool = remote->pool;
+    struct pooled_buffer *buffer;
+    int i;
+
+    if (remote->connections != NULL) {
+        _connection_pool_destroy(remote->connections);
+        remote->connections = NULL;
+    }
+    if (pool == NULL) {
+        return;
+    }
+    for (i = 0; i < POOL_CLASSES; i++) {
+        while (pool->free[i] != NULL) {
+            buffer = pool->free[i];
+            pool->free[i] = buffer->next;
+            cos_free(buffer);
+        }
+    }
+    cos_mutex_destroy(pool->lock);
+    cos_free(pool);
+    remote->pool = NULL;
+}
+
+/*****************************************************************************
+ * canopy_comm_connection_stats
+ */
+void canopy_comm_connection_stats(struct canopy_remote *remote,
+        struct canopy_connection_stats *stats) {
+    struct canopy_connection_pool *pool = remote->connections;
+
+    if (pool == NULL) {
+        /* a group's requests are counted by its endpoints */
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    cos_mutex_lock(pool->lock);
+    *stats = pool->stats;
+    cos_mutex_unlock(pool->lock);
+}
+
+/*****************************************************************************
+ * canopy_remote_buffer_get
+ */
+char * canopy_remote_buffer_get(struct canopy_remote *remote, size_t min_size,
+        size_t *size) {
+    struct canopy_buffer_pool *pool = remote->pool;
+    struct pooled_buffer *buffer = NULL;
+    size_t max_size = remote->params->max_response_size + 1; /* and the \0 */
+    int size_class = 0;
+
+    if (min_size > max_size) {
+        return NULL;
+    }
+    while (size_class < POOL_CLASSES && _class_size(size_class) < min_size) {
+        size_class++;
+    }
+
+    if (size_class < POOL_CLASSES) {
+        cos_mutex_lock(pool->lock);
+        buffer = pool->free[size_class];
+        if (buffer != NULL) {
+            pool->free[size_class] = buffer->next;
+            pool->free_count[size_class]--;
+        }
+        cos_mutex_unlock(pool->lock);
+    }
+
+    if (buffer == NULL) {
+        *size = (size_class < POOL_CLASSES) ? _class_size(size_class) : min_size;
+        if (*size > max_size) {
+            /* only as big as it can need to be, so not one to keep */
+            *size = max_size;
+            size_class = -1;
+        }
+        buffer = (struct pooled_buffer*)cos_alloc(sizeof(struct pooled_buffer)
+                + *size);
+        if (buffer == NULL) {
+            return NULL;
+        }
+        buffer->size = *size;
+        buffer->size_class = (size_class < POOL_CLASSES) ? size_class : -1;
+    }
+    buffer->next = NULL;
+    *size = buffer->size;
+    return buffer->data;
+}
+
+/*****************************************************************************
+ * canopy_remote_buffer_put
+ */
+void canopy_remote_buffer_put(struct canopy_remote *remote, char *data) {
+    struct canopy_buffer_pool *pool = remote->pool;
+    struct pooled_buffer *buffer;
+    int size_class;
+
+    if (data == NULL) {
+        return;
+    }
+    buffer = (struct pooled_buffer*)(data - offsetof(struct pooled_buffer,
+            data));
+    size_class = buffer->size_class;
+    if (size_class >= 0) {
+        cos_mutex_lock(pool->lock);
+        if (pool->free_count[size_class] < POOL_KEEP) {
+            buffer->next = pool->free[size_class];
+            pool->free[size_class] = buffer;
+            pool->free_count[size_class]++;
+            buffer = NULL;
+        }
+        cos_mutex_unlock(pool->lock);
+    }
+    if (buffer != NULL) {
+        cos_free(buffer);
+    }
+}
+
+/*****************************************************************************
+ * canopy_http_response_release
+ */
+void canopy_http_response_release(struct canopy_remote *remote,
+        struct canopy_http_response *response) {
+    if (response->pooled) {
+        canopy_remote_buffer_put((response->owner != NULL) ? response->owner
+                : remote, response->body);
+    }
+    response->pooled = false;
+    response->owner = NULL;
+    response->body = NULL;
+    response->body_len = 0;
+}
+
 struct private {
     char *buffer;     /* the buffr being built in */
     int  buffer_len;  /* how big is the raw buffer */
     int  offset;      /* offset is where writting should start from in buffer*/
+    struct canopy_remote *remote; /* if set, buffer is from its pool */
 };
+
+//
+// Moves what's been received so far into a buffer from the remote's pool
+// with room for <min_size> bytes.  If there isn't one, the buffer stays as
+// it is, and the reply doesn't fit.  Past the biggest size class the pool
+// hands out exactly what's asked for, so ask for at least twice as much
+// each time, or a big reply is copied over again with every chunk.
+static void _grow_buffer(struct private *http, size_t min_size) {
+
+    size_t max_size = http->remote->params->max_response_size + 1;
+    size_t size;
+    char *buffer;
+
+    if (min_size > _class_size(POOL_CLASSES - 1) && min_size <= max_size) {
+        if (min_size < 2 * (size_t)http->buffer_len) {
+            min_size = LOCAL_MIN(2 * (size_t)http->buffer_len, max_size);
+        }
+    }
+    buffer = canopy_remote_buffer_get(http->remote, min_size, &size);
+
+    if (buffer == NULL) {
+        return;
+    }
+    memcpy(buffer, http->buffer, http->offset + 1);
+    canopy_remote_buffer_put(http->remote, http->buffer);
+    http->buffer = buffer;
+    http->buffer_len = size;
+}
+
 //
 // Handler for CURL write callback.  Concatenates chunks of data into the
 // provided buffer.
@@ -35,63 +586,249 @@ static size_t _curl_write_handler(void *ptr, size_t size, size_t nmemb,
     struct private* http = (struct private*) userdata;
     size_t chunk_size = size * nmemb;
 
-    // buffer_remaining is amount of space left in buffer (not leaving room for
-    // NULL terminator).  When http->buffer_len == http->offset we have
-    // overfilled our buffer.
-    size_t buffer_remaining = http->buffer_len - http->offset;
+    if (http->remote != NULL
+            && chunk_size > (size_t)(http->buffer_len - 1 - http->offset)) {
+        _grow_buffer(http, http->offset + chunk_size + 1);
+    }
+
+    // buffer_remaining is amount of space left in buffer, leaving room for
+    // the NULL terminator.  When http->buffer_len - 1 == http->offset we have
+    // filled our buffer.
+    size_t buffer_remaining = http->buffer_len - 1 - http->offset;
 
     // len is number of bytes to copy
     size_t len = LOCAL_MIN(chunk_size, buffer_remaining);
 
     /*
      * Note..  There's no NULL character at the end of the transfered data.
-     * If the payload fits in the provided buffer, we append a NULL character.
-     * If the provided buffer is too small, then we fill the buffer (without
-     * adding a NULL character) and signal an error.
+     * We always append a NULL character, so that a short response never
+     * picks up the tail of an earlier, longer one.  If the provided buffer is
+     * too small, then we fill the buffer and signal an error by returning
+     * less than chunk_size.
      */
     memcpy((void*)&http->buffer[http->offset], ptr, len);
     http->offset += len;
 
-    COS_ASSERT(http->buffer_len >= http->offset);
-    if (http->buffer_len > http->offset) {
-        // There's more room in our buffer.  We're good.
-        http->buffer[http->offset + 1] = '\0';
-    }
+    COS_ASSERT(http->buffer_len > http->offset);
+    http->buffer[http->offset] = '\0';
     return len;
 }
 
+/*
+ * Where _curl_read_handler() is up to in a chain of segments.
+ */
+struct segment_reader {
+    const struct canopy_http_segment *head;
+    const struct canopy_http_segment *segment;  /* NULL when all read */
+    size_t offset;                              /* into <segment> */
+};
+
+//
+// Handler for CURL read callback.  Hands curl the next piece of the chain
+// of segments, straight from where the segments are.
+static size_t _curl_read_handler(char *ptr, size_t size, size_t nmemb,
+                                 void *userdata) {
+
+    struct segment_reader *reader = (struct segment_reader*) userdata;
+    size_t room = size * nmemb;
+    size_t copied = 0;
+
+    while (reader->segment != NULL && copied < room) {
+        size_t len = LOCAL_MIN(reader->segment->len - reader->offset,
+                room - copied);
+        memcpy(&ptr[copied], &reader->segment->data[reader->offset], len);
+        copied += len;
+        reader->offset += len;
+        if (reader->offset == reader->segment->len) {
+            reader->segment = reader->segment->next;
+            reader->offset = 0;
+        }
+    }
+    return copied;
+}
+
+//
+// Handler for CURL seek callback.  curl only seeks to rewind the payload
+// when it has to send it again.
+static int _curl_seek_handler(void *userdata, curl_off_t offset, int origin) {
+
+    struct segment_reader *reader = (struct segment_reader*) userdata;
+
+    if (origin != SEEK_SET || offset < 0) {
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+    reader->segment = reader->head;
+    reader->offset = 0;
+    while (reader->segment != NULL
+            && (curl_off_t)reader->segment->len <= offset) {
+        offset -= reader->segment->len;
+        reader->segment = reader->segment->next;
+    }
+    if (reader->segment == NULL && offset > 0) {
+        return CURL_SEEKFUNC_FAIL;
+    }
+    reader->offset = (size_t)offset;
+    return CURL_SEEKFUNC_OK;
+}
+
 /*****************************************************************************
- * canopy_remote_http_perform
+ * _gzip_payload
+ *
+ *      Compresses the <len> bytes of <segments> into a newly allocated
+ *      buffer, which the caller frees with cos_free().  Returns false,
+ *      leaving <*out> NULL, if compression fails or doesn't make the payload
+ *      smaller, in which case the payload should be sent as is.
  */
-canopy_error canopy_http_perform(
-        canopy_http_method      method,
-        bool                    use_http,
-        bool                    skip_cert_check,
-        const char              *name,
-        const char              *password,
-        char                    *rcv_buffer,
-        size_t                  rcv_buffer_size,
-        int                     *rcv_end,
-        int                     *status_code,
-        const char              *remote_name,
-        const char              *api,
-        const char              *payload,
-        struct canopy_barrier   *barrier)
+static bool _gzip_payload(const struct canopy_http_segment *segments,
+        size_t len, char **out, size_t *out_len) {
+    z_stream zs;
+    uLong bound;
+    int zerr = Z_OK;
+    int window_bits = 9;
+
+    /*
+     * Sync payloads are a few KB, so size the window (and hash table) to
+     * the payload rather than using zlib's 32KB/256KB of state per call.
+     * A window covering the whole payload compresses just as well.
+     */
+    while (window_bits < 15 && ((size_t)1 << window_bits) < len) {
+        window_bits++;
+    }
+
+    *out = NULL;
+    memset(&zs, 0, sizeof(zs));
+    /* +16 asks for a gzip rather than a zlib wrapper */
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits + 16,
+            window_bits - 7, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    bound = deflateBound(&zs, len);
+    *out = (char*)cos_alloc(bound);
+    if (*out == NULL) {
+        deflateEnd(&zs);
+        return false;
+    }
+    zs.next_out = (Bytef*)*out;
+    zs.avail_out = bound;
+    /* <bound> covers all of it, so each segment goes in in one go */
+    for (; segments != NULL && zerr == Z_OK; segments = segments->next) {
+        zs.next_in = (Bytef*)segments->data;
+        zs.avail_in = segments->len;
+        zerr = deflate(&zs, Z_NO_FLUSH);
+    }
+    if (zerr == Z_OK) {
+        zerr = deflate(&zs, Z_FINISH);
+    }
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    if (zerr != Z_STREAM_END || *out_len >= len) {
+        cos_free(*out);
+        *out = NULL;
+        return false;
+    }
+    return true;
+}
+
+//
+// Sets <response>'s transient and unsent for a transfer that failed with
+// <res>.  Failures to look up or connect to the remote happen before
+// anything is sent.
+static void _classify_failure(CURLcode res,
+        struct canopy_http_response *response) {
+    switch (res) {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+            response->unsent = true;
+            response->transient = true;
+            break;
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+            response->transient = true;
+            break;
+        default:
+            break;
+    }
+}
+
+/*****************************************************************************
+ * _http_perform
+ *
+ *      Common code for canopy_http_perform() and canopy_remote_http_request().
+ *      The response body is put into <rcv>'s buffer, which (if it's from a
+ *      remote's pool) is swapped for bigger ones as needed.  Payloads of at least
+ *      <compress_threshold> bytes are sent gzipped (0 turns this off), and
+ *      <accept_compressed> lets the remote compress its response.  If
+ *      <comm> isn't NULL, TLS sessions and DNS lookups are shared through it
+ *      and lookups are cached for <dns_cache_ttl> seconds.  A payload given
+ *      as segments is streamed to curl from where the segments are.  If
+ *      <connections> isn't NULL the request goes over one of its
+ *      connections, otherwise over one of its own, and then cancelling
+ *      <barrier> (if there is one) drops it.  It's given <timeout_ms> in
+ *      all and <connect_timeout_ms> to connect (0 for no limit).
+ */
+static canopy_error _http_perform(
+        const struct canopy_http_request    *request,
+        bool                                use_http,
+        bool                                skip_cert_check,
+        const char                          *name,
+        const char                          *password,
+        const char                          *remote_name,
+        struct private                      *rcv,
+        size_t                              compress_threshold,
+        bool                                accept_compressed,
+        struct comm_ctx                     *comm,
+        int                                 dns_cache_ttl,
+        struct canopy_connection_pool       *connections,
+        struct canopy_barrier               *barrier,
+        long                                timeout_ms,
+        long                                connect_timeout_ms,
+        struct canopy_http_response         *response)
 {
     canopy_error err = CANOPY_SUCCESS;
     CURL *curl = NULL;
     CURLcode res;
+    struct curl_slist *headers = NULL;
+    char *content_type = NULL;
+    char *compressed = NULL;
+    size_t compressed_len = 0;
+    struct canopy_http_segment whole;   /* <payload> as a chain of one */
+    const struct canopy_http_segment *segments = request->segments;
+    struct segment_reader reader;
+    const struct canopy_http_segment *segment;
     char local_buf[256]; // TODO: big enough?
-    char url[256]; // TODO: big enough?
-    struct private private;
-    private.buffer = rcv_buffer;
-    private.buffer_len = rcv_buffer_size;
-    private.offset = 0;
+    char url_buf[256];
+    char *url = url_buf;
+    int url_len;
 
-    if (barrier != NULL) {
-        return CANOPY_ERROR_NOT_IMPLEMENTED;
+    rcv->offset = 0;
+    rcv->buffer[0] = '\0';
+
+    if (segments == NULL && request->payload != NULL) {
+        whole.data = request->payload;
+        whole.len = request->payload_len;
+        whole.next = NULL;
+        segments = &whole;
+    }
+
+    if (request->format == CANOPY_WIRE_FORMAT_JSON && segments != &whole) {
+        cos_log(LOG_LEVEL_DEBUG, "Sending payload to %s%s:\n",
+                remote_name, request->api);
+        for (segment = segments; segment != NULL; segment = segment->next) {
+            cos_log(LOG_LEVEL_DEBUG, "%.*s", (int)segment->len, segment->data);
+        }
+        cos_log(LOG_LEVEL_DEBUG, "%s\n\n", (segments ? "" : "(null)"));
+    } else if (request->format == CANOPY_WIRE_FORMAT_JSON) {
+        cos_log(LOG_LEVEL_DEBUG, "Sending payload to %s%s:\n%s\n\n",
+                remote_name, request->api, request->payload);
+    } else {
+        cos_log(LOG_LEVEL_DEBUG, "Sending %d byte CBOR payload to %s%s\n",
+                (int)request->payload_len, remote_name, request->api);
     }
-    cos_log(LOG_LEVEL_DEBUG, "Sending payload to %s%s:\n%s\n\n", remote_name, api, payload);
 
     curl = curl_easy_init();
     if (!curl) {
@@ -101,18 +838,79 @@ canopy_error canopy_http_perform(
     }
 
     snprintf(local_buf, sizeof(local_buf), "%s:%s", name, password);
-    snprintf(url, sizeof(url), "%s://%s%s", 
-            (use_http ? "http" : "https"), remote_name, api);
+    /*
+     * Query strings can make for long URLs, curl copies the URL so a
+     * long one only needs to live until it's set.
+     */
+    url_len = snprintf(url_buf, sizeof(url_buf), "%s://%s%s",
+            (use_http ? "http" : "https"), remote_name, request->api);
+    if (url_len >= (int)sizeof(url_buf)) {
+        url = (char*)cos_alloc(url_len + 1);
+        if (url == NULL) {
+            err = CANOPY_ERROR_OUT_OF_MEMORY;
+            goto cleanup;
+        }
+        snprintf(url, url_len + 1, "%s://%s%s",
+                (use_http ? "http" : "https"), remote_name, request->api);
+    }
 
     curl_easy_setopt(curl, CURLOPT_URL, url);
-    if (payload == NULL || strlen(payload) == 0) {
+    if (url != url_buf) {
+        cos_free(url);
+    }
+    if (comm != NULL) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, comm->share);
+        curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, (long)dns_cache_ttl);
+    }
+    if (connections != NULL) {
+        /* HTTP/2 if TLS negotiates it, and wait to share a connection */
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+                (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    }
+    if (compress_threshold > 0 && segments != NULL
+            && request->payload_len >= compress_threshold
+            && _gzip_payload(segments, request->payload_len,
+                    &compressed, &compressed_len)) {
+        cos_log(LOG_LEVEL_DEBUG, "Compressed payload from %d to %d bytes\n",
+                (int)request->payload_len, (int)compressed_len);
+        headers = curl_slist_append(headers, "Content-Encoding: gzip");
+        if (headers == NULL) {
+            err = CANOPY_ERROR_OUT_OF_MEMORY;
+            goto cleanup;
+        }
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, compressed);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)compressed_len);
+    } else if (segments == NULL || request->payload_len == 0) {
         curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, 0);
+    } else if (segments != &whole) {
+        reader.head = segments;
+        reader.segment = segments;
+        reader.offset = 0;
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                (curl_off_t)request->payload_len);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, _curl_read_handler);
+        curl_easy_setopt(curl, CURLOPT_READDATA, &reader);
+        curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, _curl_seek_handler);
+        curl_easy_setopt(curl, CURLOPT_SEEKDATA, &reader);
+        /* the default 64KB staging buffer is far more than a sync needs */
+        curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, 16 * 1024L);
+        /*
+         * curl holds back streamed bodies waiting for "100 Continue", the
+         * remote answers as soon as it has the request, so don't ask.
+         */
+        headers = curl_slist_append(headers, "Expect:");
+        if (headers == NULL) {
+            err = CANOPY_ERROR_OUT_OF_MEMORY;
+            goto cleanup;
+        }
     } else {
-        int len = strlen(payload);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, len);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request->payload);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE,
+                (long)request->payload_len);
     }
-    switch (method) {
+    switch (request->method) {
         case CANOPY_HTTP_GET:
             curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
             break;
@@ -125,42 +923,226 @@ canopy_error canopy_http_perform(
         default:
             COS_ASSERT(!"Unsupported HTTP method");
     }
+
+    /*
+     * JSON requests are sent as they always have been.  For CBOR, say what
+     * we're sending, and that we'd prefer CBOR back but can take JSON.
+     */
+    if (request->format == CANOPY_WIRE_FORMAT_CBOR) {
+        if (request->payload_len > 0) {
+            headers = curl_slist_append(headers, "Content-Type: "
+                    CANOPY_CONTENT_TYPE_CBOR);
+        }
+        headers = curl_slist_append(headers, "Accept: "
+                CANOPY_CONTENT_TYPE_CBOR ", " CANOPY_CONTENT_TYPE_JSON ";q=0.5");
+        if (headers == NULL) {
+            err = CANOPY_ERROR_OUT_OF_MEMORY;
+            goto cleanup;
+        }
+    }
+    if (headers != NULL) {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    }
+
+    /*
+     * curl inflates compressed responses as they arrive, so what reaches
+     * _curl_write_handler() (and <rcv>) is always the decoded body.
+     */
+    if (accept_compressed) {
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip, deflate");
+    }
+
     if (skip_cert_check) {
         curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
         curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
     }
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, _curl_write_handler);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &private);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, rcv);
     curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
     /* set user name and password for the authentication */
     curl_easy_setopt(curl, CURLOPT_USERPWD, local_buf);
 
-    res = curl_easy_perform(curl);
+    /* timeouts mustn't use signals, there may be other threads */
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    if (timeout_ms > 0) {
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+    }
+    if (connect_timeout_ms > 0) {
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, connect_timeout_ms);
+    }
+
+    if (connections != NULL) {
+        res = _pool_perform(connections, curl, barrier);
+    } else {
+        res = curl_easy_perform(curl);
+    }
     if (res == CURLE_WRITE_ERROR) {
         cos_log(LOG_LEVEL_WARN, "Buffer too small for payload\n");
         err = CANOPY_ERROR_OUT_OF_MEMORY;
         goto cleanup;
+    } else if (res == CURLE_ABORTED_BY_CALLBACK) {
+        cos_log(LOG_LEVEL_INFO, "Transfer cancelled\n");
+        err = CANOPY_ERROR_CANCELLED;
+        goto cleanup;
+    } else if (res == CURLE_OPERATION_TIMEDOUT) {
+        cos_log(LOG_LEVEL_WARN, "Transfer timed out\n");
+        _classify_failure(res, response);
+        err = CANOPY_ERROR_TIMEOUT;
+        goto cleanup;
     } else if (res != CURLE_OK) {
         cos_log(LOG_LEVEL_WARN, "Transfer failed, res: %d\n", res);
+        _classify_failure(res, response);
         err = CANOPY_ERROR_NETWORK;
         goto cleanup;
     }
 
-    cos_log(LOG_LEVEL_DEBUG, "Returned from: %s%s:\n%s\n\n", remote_name, api, rcv_buffer);
+    response->format = CANOPY_WIRE_FORMAT_JSON;
+    if (curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type)
+            == CURLE_OK && content_type != NULL
+            && strncasecmp(content_type, CANOPY_CONTENT_TYPE_CBOR,
+                    strlen(CANOPY_CONTENT_TYPE_CBOR)) == 0) {
+        response->format = CANOPY_WIRE_FORMAT_CBOR;
+    }
 
+    if (response->format == CANOPY_WIRE_FORMAT_JSON) {
+        cos_log(LOG_LEVEL_DEBUG, "Returned from: %s%s:\n%s\n\n", remote_name,
+                request->api, rcv->buffer);
+    } else {
+        cos_log(LOG_LEVEL_DEBUG, "Returned %d bytes of CBOR from: %s%s\n",
+                rcv->offset, remote_name, request->api);
+    }
 
-    *rcv_end = private.offset;
-    if (status_code != NULL) {
+    response->body = rcv->buffer;
+    response->body_len = rcv->offset;
+    {
         long status_code_long;
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code_long);
-        *status_code = (int)(status_code_long);
+        response->status_code = (int)(status_code_long);
     }
 
 cleanup:
+    curl_slist_free_all(headers);
     curl_easy_cleanup(curl);
+    if (compressed != NULL) {
+        cos_free(compressed);
+    }
     return err;
 }
 
+/*****************************************************************************
+ * canopy_remote_http_perform
+ */
+canopy_error canopy_http_perform(
+        canopy_http_method      method,
+        bool                    use_http,
+        bool                    skip_cert_check,
+        const char              *name,
+        const char              *password,
+        char                    *rcv_buffer,
+        size_t                  rcv_buffer_size,
+        int                     *rcv_end,
+        int                     *status_code,
+        const char              *remote_name,
+        const char              *api,
+        const char              *payload,
+        struct canopy_barrier   *barrier)
+{
+    canopy_error err;
+    struct canopy_http_request request;
+    struct canopy_http_response response;
+    struct private rcv;
+
+    if (barrier != NULL) {
+        return CANOPY_ERROR_NOT_IMPLEMENTED;
+    }
+    if (rcv_buffer == NULL || rcv_buffer_size == 0) {
+        return CANOPY_ERROR_BAD_PARAM;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.method = method;
+    request.api = api;
+    request.payload = payload;
+    request.payload_len = (payload == NULL) ? 0 : strlen(payload);
+    request.format = CANOPY_WIRE_FORMAT_JSON;
+
+    memset(&response, 0, sizeof(response));
+    memset(&rcv, 0, sizeof(rcv));
+    rcv.buffer = rcv_buffer;
+    rcv.buffer_len = rcv_buffer_size;
+    err = _http_perform(&request, use_http, skip_cert_check, name, password,
+            remote_name, &rcv, 0, false, NULL, 0, NULL, NULL, 0, 0, &response);
+    if (err != CANOPY_SUCCESS) {
+        return err;
+    }
+
+    *rcv_end = response.body_len;
+    if (status_code != NULL) {
+        *status_code = response.status_code;
+    }
+    return CANOPY_SUCCESS;
+}
+
+/*****************************************************************************
+ * canopy_remote_http_request
+ */
+canopy_error canopy_remote_http_request(
+        struct canopy_remote                *remote,
+        const struct canopy_http_request    *request,
+        struct canopy_http_response         *response,
+        struct canopy_barrier               *barrier)
+{
+    canopy_error err;
+    struct private rcv;
+    size_t size;
+    cos_time_t timeout = remote->params->request_timeout_ms;
+    cos_time_t now;
+
+    memset(response, 0, sizeof(*response));
+    if (barrier != NULL && barrier->deadline != 0) {
+        cos_get_time(&now);
+        if (now >= barrier->deadline) {
+            response->unsent = true;
+            return CANOPY_ERROR_TIMEOUT;
+        }
+        timeout = LOCAL_MIN(timeout, barrier->deadline - now);
+    }
+
+    /* start with a buffer that would have held the last reply */
+    memset(&rcv, 0, sizeof(rcv));
+    rcv.remote = remote;
+    rcv.buffer = canopy_remote_buffer_get(remote, _last_reply_len(remote) + 1,
+            &size);
+    if (rcv.buffer == NULL) {
+        return CANOPY_ERROR_OUT_OF_MEMORY;
+    }
+    rcv.buffer_len = size;
+    err = _http_perform(request,
+            remote->params->use_http,
+            remote->params->skip_cert_check,
+            remote->params->name,
+            remote->params->password,
+            remote->params->remote,
+            &rcv,
+            remote->params->compress_threshold,
+            remote->params->accept_compressed,
+            (struct comm_ctx*) remote->ctx->comm,
+            remote->ctx->dns_cache_ttl,
+            remote->connections,
+            barrier,
+            (long)timeout,
+            (long)LOCAL_MIN(timeout, remote->params->connect_timeout_ms),
+            response);
+    if (err != CANOPY_SUCCESS) {
+        canopy_remote_buffer_put(remote, rcv.buffer);
+        return err;
+    }
+    response->pooled = true;
+    response->owner = remote;
+    _set_last_reply_len(remote, response->body_len);
+    return CANOPY_SUCCESS;
+}
+
 /*****************************************************************************
  * canopy_remote_http_get
  */
@@ -21,6 +21,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 
 void * cos_alloc(size_t size) {
@@ -52,27 +55,154 @@ char * cos_strdup(const char *src) {
 
 
 int cos_get_time(cos_time_t *time) {
-	int err = 0;
+	struct timespec ts;
+
 	/*
-	 *  struct timeval {
-     *          time_t      tv_sec;     /* seconds
-     *          suseconds_t tv_usec;    /* microseconds
-     *      };
-	 *
+	 * The monotonic clock doesn't jump when the wall clock is set, and the
+	 * sum is done in 64 bits, so it doesn't wrap where long is 32 bits.
 	 */
-	struct timeval tv;
-    err = gettimeofday(&tv, NULL);
-    if (err != 0) {
-    	return -1;
-    }
-    /*
-     * chop off the high order bits of the seconds, so we can add the minutes
-     * and msec.  minutes will probably overflow, but it's not an error
-     * the way we use cos_time_t.
-     */
-    unsigned long minutes = tv.tv_sec * 1000;
-    unsigned long msec = tv.tv_usec / 1000;
-    unsigned long ret = minutes + msec;
-    *time = ret;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		return -1;
+	}
+	*time = (cos_time_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 	return 0;
 }
+
+void cos_sleep(cos_time_t ms) {
+    struct timespec delay;
+
+    delay.tv_sec = ms / 1000;
+    delay.tv_nsec = (ms % 1000) * 1000000;
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+    }
+}
+
+
+/*
+ * Threads, locks and events.
+ */
+struct cos_mutex {
+    pthread_mutex_t mutex;
+};
+
+cos_mutex_t * cos_mutex_create(void) {
+    cos_mutex_t *mutex = (cos_mutex_t*)cos_alloc(sizeof(cos_mutex_t));
+    pthread_mutexattr_t attr;
+
+    if (mutex == NULL) {
+        return NULL;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mutex->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return mutex;
+}
+
+void cos_mutex_destroy(cos_mutex_t *mutex) {
+    pthread_mutex_destroy(&mutex->mutex);
+    cos_free(mutex);
+}
+
+void cos_mutex_lock(cos_mutex_t *mutex) {
+    pthread_mutex_lock(&mutex->mutex);
+}
+
+void cos_mutex_unlock(cos_mutex_t *mutex) {
+    pthread_mutex_unlock(&mutex->mutex);
+}
+
+struct cos_event {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    int             signalled;
+};
+
+cos_event_t * cos_event_create(void) {
+    cos_event_t *event = (cos_event_t*)cos_alloc(sizeof(cos_event_t));
+    pthread_condattr_t attr;
+
+    if (event == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&event->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&event->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    event->signalled = 0;
+    return event;
+}
+
+void cos_event_destroy(cos_event_t *event) {
+    pthread_cond_destroy(&event->cond);
+    pthread_mutex_destroy(&event->mutex);
+    cos_free(event);
+}
+
+void cos_event_signal(cos_event_t *event) {
+    pthread_mutex_lock(&event->mutex);
+    event->signalled = 1;
+    pthread_cond_signal(&event->cond);
+    pthread_mutex_unlock(&event->mutex);
+}
+
+int cos_event_wait(cos_event_t *event, cos_time_t timeout) {
+    struct timespec until;
+    int signalled;
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += timeout / 1000;
+    until.tv_nsec += (timeout % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&event->mutex);
+    while (!event->signalled) {
+        if (pthread_cond_timedwait(&event->cond, &event->mutex, &until)
+                == ETIMEDOUT) {
+            break;
+        }
+    }
+    signalled = event->signalled;
+    event->signalled = 0;
+    pthread_mutex_unlock(&event->mutex);
+    return signalled;
+}
+
+struct cos_thread {
+    pthread_t   thread;
+    void        (*func)(void *arg);
+    void        *arg;
+};
+
+static void * thread_main(void *arg) {
+    cos_thread_t *thread = (cos_thread_t*)arg;
+    thread->func(thread->arg);
+    return NULL;
+}
+
+cos_thread_t * cos_thread_start(void (*func)(void *arg), void *arg) {
+    cos_thread_t *thread = (cos_thread_t*)cos_alloc(sizeof(cos_thread_t));
+    if (thread == NULL) {
+        return NULL;
+    }
+    thread->func = func;
+    thread->arg = arg;
+    if (pthread_create(&thread->thread, NULL, thread_main, thread) != 0) {
+        cos_free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void cos_thread_join(cos_thread_t *thread) {
+    pthread_join(thread->thread, NULL);
+    cos_free(thread);
+}
+
+int cos_thread_is_current(cos_thread_t *thread) {
+    return pthread_equal(thread->thread, pthread_self()) != 0;
+}
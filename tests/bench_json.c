@@ -0,0 +1,691 @@
+// Copyright 2015 Canopy Services, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+ * bench_json.c
+ *
+ *      Microbenchmark of the JSON emit and parse paths.  No network is used;
+ *      devices with 10, 100 and 1000 variables of mixed types are generated
+ *      in memory and each of the following is timed:
+ *
+ *          c_json_emit_vardcl()    c_json_parse_string()
+ *          c_json_emit_vars()      c_json_parse_vardcl()
+ *                                  c_json_parse_vars()
+ *                                  c_json_parse_device()
+ *
+ *      The CBOR counterparts c_cbor_emit_vardcl(), c_cbor_emit_vars() and
+ *      c_cbor_parse_device() are run over the same devices for comparison.
+ *
+ *      For each it reports ns/op, bytes/op (emitted or consumed),
+ *      tokens/op, and heap allocations (count and bytes) per op.
+ *
+ *      usage:  bench_json [-n ops] [-v vars[,vars...]]
+ *
+ *      <ops> is the work budget in variable-operations per benchmark; the
+ *      number of iterations is ops / vars (but at least 10).
+ */
+
+#include     <stdio.h>
+#include     <stdlib.h>
+#include     <errno.h>
+#include     <stdarg.h>
+#include     <unistd.h>
+#include     <time.h>
+
+#include    <stdint.h>
+#include    <stdbool.h>
+#include    <string.h>
+
+#include    <jsmn/jsmn.h>
+
+#include    <canopy_min_internal.h>
+#include    <canopy_min.h>
+#include    <canopy_os.h>
+
+#define TOASTER_UUID "e43eb410-48da-421a-b07d-1cd751412fd5"
+#define TOASTER_SECRET_KEY "wYI0G+HQN9fj76fpyxwiHKJDQags0dpM"
+#define REMOTE_ADDR "127.0.0.1:18089"
+
+/*
+ * Allocation accounting.  These wrap the glibc allocator, see bench_sync.c.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long long alloc_count = 0;
+static unsigned long long alloc_bytes = 0;
+
+void *malloc(size_t size) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, count * size, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+/*
+ * Monotonic clock in nanoseconds.
+ */
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((unsigned long long)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * The mix of datatypes the generated variables cycle through.
+ */
+static const canopy_var_datatype mixed_types[] = {
+    CANOPY_VAR_DATATYPE_FLOAT32,
+    CANOPY_VAR_DATATYPE_INT32,
+    CANOPY_VAR_DATATYPE_BOOL,
+    CANOPY_VAR_DATATYPE_FLOAT64,
+    CANOPY_VAR_DATATYPE_STRING,
+    CANOPY_VAR_DATATYPE_UINT16,
+    CANOPY_VAR_DATATYPE_INT8,
+    CANOPY_VAR_DATATYPE_UINT32,
+    CANOPY_VAR_DATATYPE_DATETIME,
+};
+#define N_MIXED_TYPES (sizeof(mixed_types) / sizeof(mixed_types[0]))
+
+/*
+ * Everything one benchmark run needs.
+ */
+struct bench_case {
+    int                 nvars;
+    int                 iterations;
+    canopy_device_t     emit_device;    /* OUT vars, all set and dirty */
+    canopy_device_t     parse_device;   /* IN vars, declared by the parser */
+    char                *emit_buffer;
+    int                 emit_buffer_len;
+    char                *doc;           /* generated /api/device/self body */
+    int                 doc_len;
+    jsmntok_t           *tokens;
+    int                 tok_len;
+    int                 active;         /* tokens produced for doc */
+    int                 vardcl_offset;  /* token of "var_decls" in doc */
+    int                 vars_offset;    /* token of "vars" in doc */
+    uint8_t             *cbor_doc;      /* CBOR version of doc */
+    int                 cbor_doc_len;
+};
+
+struct bench_result {
+    unsigned long long  ns;
+    unsigned long long  bytes;
+    unsigned long long  tokens;
+    unsigned long long  allocs;
+    unsigned long long  alloc_bytes;
+    int                 errors;
+};
+
+typedef int (*bench_op)(struct bench_case *bc, struct bench_result *res);
+
+/*
+ * Appends to the generated document, growing it as needed.
+ */
+static int doc_cap = 0;
+static void doc_append(struct bench_case *bc, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+static void doc_append(struct bench_case *bc, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(&bc->doc[bc->doc_len], doc_cap - bc->doc_len, fmt, ap);
+        va_end(ap);
+        if (n < doc_cap - bc->doc_len) {
+            break;
+        }
+        doc_cap *= 2;
+        bc->doc = (char*)realloc(bc->doc, doc_cap);
+        COS_ASSERT(bc->doc != NULL);
+    }
+    bc->doc_len += n;
+}
+
+/*
+ * Writes the JSON value for variable <i> of type <type>.
+ */
+static void doc_append_value(struct bench_case *bc, int i,
+        canopy_var_datatype type) {
+    switch (type) {
+    case CANOPY_VAR_DATATYPE_STRING:
+        doc_append(bc, "\"value %d\"", i);
+        break;
+    case CANOPY_VAR_DATATYPE_BOOL:
+        doc_append(bc, "%s", (i & 1) ? "true" : "false");
+        break;
+    case CANOPY_VAR_DATATYPE_FLOAT32:
+    case CANOPY_VAR_DATATYPE_FLOAT64:
+        doc_append(bc, "%d.%d", i, i % 10);
+        break;
+    case CANOPY_VAR_DATATYPE_DATETIME:
+        doc_append(bc, "%llu", 1426803897000000ULL + i);
+        break;
+    default:
+        doc_append(bc, "%d", i % 100);
+        break;
+    }
+}
+
+/*
+ * Sets variable <var> to a value that depends on <i>.
+ */
+static void set_value(struct canopy_var *var, int i, canopy_var_datatype type) {
+    char str[32];
+
+    switch (type) {
+    case CANOPY_VAR_DATATYPE_STRING:
+        snprintf(str, sizeof(str), "value %d", i);
+        canopy_var_set_string(var, str, strlen(str));
+        break;
+    case CANOPY_VAR_DATATYPE_BOOL:
+        canopy_var_set_bool(var, (i & 1));
+        break;
+    case CANOPY_VAR_DATATYPE_FLOAT32:
+        canopy_var_set_float32(var, i + 0.5f);
+        break;
+    case CANOPY_VAR_DATATYPE_FLOAT64:
+        canopy_var_set_float64(var, i + 0.25);
+        break;
+    case CANOPY_VAR_DATATYPE_INT8:
+        canopy_var_set_int8(var, (int8_t)(i % 100));
+        break;
+    case CANOPY_VAR_DATATYPE_INT32:
+        canopy_var_set_int32(var, i);
+        break;
+    case CANOPY_VAR_DATATYPE_UINT16:
+        canopy_var_set_uint16(var, (uint16_t)i);
+        break;
+    case CANOPY_VAR_DATATYPE_UINT32:
+        canopy_var_set_uint32(var, (uint32_t)i);
+        break;
+    case CANOPY_VAR_DATATYPE_DATETIME:
+        canopy_var_set_datetime(var, (cos_time_t)i);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Builds the devices, the emit buffer and the document to parse for a case
+ * with <nvars> variables.
+ */
+static int setup_case(struct bench_case *bc, canopy_remote_t *remote,
+        int nvars, int budget) {
+    canopy_error err;
+    int i;
+    int next_token;
+
+    memset(bc, 0, sizeof(*bc));
+    bc->nvars = nvars;
+    bc->iterations = budget / nvars;
+    if (bc->iterations < 10) {
+        bc->iterations = 10;
+    }
+
+    canopy_device_init(&bc->emit_device, remote, NULL);
+    canopy_device_init(&bc->parse_device, remote, NULL);
+
+    for (i = 0; i < nvars; i++) {
+        char name[32];
+        struct canopy_var *var;
+        canopy_var_datatype type = mixed_types[i % N_MIXED_TYPES];
+
+        snprintf(name, sizeof(name), "var%04d", i);
+        err = canopy_device_var_declare(&bc->emit_device, CANOPY_VAR_OUT,
+                type, name, &var);
+        if (err != CANOPY_SUCCESS) {
+            return -1;
+        }
+        set_value(var, i, type);
+    }
+
+    /*
+     * Roughly 100 bytes per variable for the decl and value, generously.
+     */
+    bc->emit_buffer_len = 4096 + nvars * 256;
+    bc->emit_buffer = (char*)cos_alloc(bc->emit_buffer_len);
+    if (bc->emit_buffer == NULL) {
+        return -1;
+    }
+
+    /*
+     * Generate a /api/device/self response.  The variables are declared as
+     * IN, so that the parse side declares them on parse_device.
+     */
+    doc_cap = 4096;
+    bc->doc = (char*)malloc(doc_cap);
+    if (bc->doc == NULL) {
+        return -1;
+    }
+    bc->doc_len = 0;
+    doc_append(bc, "{\n    \"result\" : \"ok\",\n"
+            "    \"device_id\" : \"%s\",\n"
+            "    \"friendly_name\" : \"bench device\",\n"
+            "    \"location_note\" : \"bench\",\n"
+            "    \"var_decls\" : {\n", TOASTER_UUID);
+    for (i = 0; i < nvars; i++) {
+        doc_append(bc, "        %s\"in %s var%04d\" : { }\n",
+                (i ? ", " : ""),
+                canopy_var_datatype_string(mixed_types[i % N_MIXED_TYPES]), i);
+    }
+    doc_append(bc, "    },\n    \"vars\" : {\n");
+    for (i = 0; i < nvars; i++) {
+        doc_append(bc, "        %s\"var%04d\" : { \"t\" : %llu, \"v\" : ",
+                (i ? ", " : ""), i, 1426803897000000ULL + i);
+        doc_append_value(bc, i, mixed_types[i % N_MIXED_TYPES]);
+        doc_append(bc, " }\n");
+    }
+    doc_append(bc, "    }\n}\n");
+
+    bc->tok_len = 64 + nvars * 8;
+    bc->tokens = (jsmntok_t*)cos_alloc(bc->tok_len * sizeof(jsmntok_t));
+    if (bc->tokens == NULL) {
+        return -1;
+    }
+    if (c_json_parse_string(bc->doc, bc->doc_len, bc->tokens, bc->tok_len,
+            &bc->active) != C_JSON_OK) {
+        fprintf(stderr, "generated document does not tokenize\n");
+        return -1;
+    }
+
+    /*
+     * Locate the top level "var_decls" and "vars" tags.
+     */
+    bc->vardcl_offset = -1;
+    bc->vars_offset = -1;
+    for (i = 1; i < bc->active; i++) {
+        jsmntok_t *t = &bc->tokens[i];
+        if (t->type != JSMN_STRING || t->size != 1) {
+            continue;
+        }
+        if (bc->vardcl_offset < 0 && t->end - t->start == strlen(TAG_VAR_DECLS)
+                && CHECK_TOKEN_STRING(bc->doc, *t, TAG_VAR_DECLS)) {
+            bc->vardcl_offset = i;
+        } else if (bc->vars_offset < 0 && t->end - t->start == strlen(TAG_VARS)
+                && CHECK_TOKEN_STRING(bc->doc, *t, TAG_VARS)) {
+            bc->vars_offset = i;
+        }
+    }
+    if (bc->vardcl_offset < 0 || bc->vars_offset < 0) {
+        fprintf(stderr, "generated document is missing var_decls or vars\n");
+        return -1;
+    }
+
+    /*
+     * The same document in CBOR.
+     */
+    {
+        struct c_cbor_state cs;
+        char decl[64];
+        int cbor_len = 4096 + nvars * 64;
+
+        bc->cbor_doc = (uint8_t*)cos_alloc(cbor_len);
+        if (bc->cbor_doc == NULL) {
+            return -1;
+        }
+        c_cbor_buffer_init(&cs, bc->cbor_doc, cbor_len);
+        c_cbor_emit_map(&cs, 6);
+        c_cbor_emit_string(&cs, TAG_RESULT, -1);
+        c_cbor_emit_string(&cs, "ok", -1);
+        c_cbor_emit_string(&cs, TAG_DEVICE_ID, -1);
+        c_cbor_emit_string(&cs, TOASTER_UUID, -1);
+        c_cbor_emit_string(&cs, TAG_FRIENDLY_NAME, -1);
+        c_cbor_emit_string(&cs, "bench device", -1);
+        c_cbor_emit_string(&cs, TAG_LOCATION_NOTE, -1);
+        c_cbor_emit_string(&cs, "bench", -1);
+        c_cbor_emit_string(&cs, TAG_VAR_DECLS, -1);
+        c_cbor_emit_map(&cs, nvars);
+        for (i = 0; i < nvars; i++) {
+            snprintf(decl, sizeof(decl), "in %s var%04d",
+                    canopy_var_datatype_string(mixed_types[i % N_MIXED_TYPES]),
+                    i);
+            c_cbor_emit_string(&cs, decl, -1);
+            c_cbor_emit_map(&cs, 0);
+        }
+        c_cbor_emit_string(&cs, TAG_VARS, -1);
+        c_cbor_emit_map(&cs, nvars);
+        for (i = 0; i < nvars; i++) {
+            canopy_var_datatype type = mixed_types[i % N_MIXED_TYPES];
+            snprintf(decl, sizeof(decl), "var%04d", i);
+            c_cbor_emit_string(&cs, decl, -1);
+            c_cbor_emit_map(&cs, 2);
+            c_cbor_emit_string(&cs, TAG_T, -1);
+            c_cbor_emit_uint(&cs, 1426803897000000ULL + i);
+            c_cbor_emit_string(&cs, TAG_V, -1);
+            switch (type) {
+            case CANOPY_VAR_DATATYPE_STRING:
+                snprintf(decl, sizeof(decl), "value %d", i);
+                c_cbor_emit_string(&cs, decl, -1);
+                break;
+            case CANOPY_VAR_DATATYPE_BOOL:
+                c_cbor_emit_bool(&cs, (i & 1));
+                break;
+            case CANOPY_VAR_DATATYPE_FLOAT32:
+                c_cbor_emit_float32(&cs, i + 0.5f);
+                break;
+            case CANOPY_VAR_DATATYPE_FLOAT64:
+                c_cbor_emit_float64(&cs, i + 0.25);
+                break;
+            case CANOPY_VAR_DATATYPE_DATETIME:
+                c_cbor_emit_uint(&cs, 1426803897000000ULL + i);
+                break;
+            default:
+                c_cbor_emit_uint(&cs, i % 100);
+                break;
+            }
+        }
+        if (cs.offset >= cbor_len) {
+            return -1;
+        }
+        bc->cbor_doc_len = cs.offset;
+    }
+
+    /*
+     * Declare the parse side variables once, so that the timed parses see a
+     * steady state device.
+     */
+    err = c_json_parse_vardcl(&bc->parse_device, bc->doc, bc->doc_len,
+            bc->tokens, bc->tok_len, bc->vardcl_offset, &next_token, false);
+    if (err != CANOPY_SUCCESS) {
+        return -1;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ * The operations being measured.  Each performs one op and accounts for the
+ * bytes and tokens it handled.
+ */
+static int op_emit_vardcl(struct bench_case *bc, struct bench_result *res) {
+    struct c_json_state state;
+
+    c_json_buffer_init(&state, bc->emit_buffer, bc->emit_buffer_len);
+    if (c_json_emit_vardcl(&bc->emit_device, &state, true) != CANOPY_SUCCESS) {
+        return -1;
+    }
+    res->bytes += state.offset;
+    return 0;
+}
+
+static int op_emit_vars(struct bench_case *bc, struct bench_result *res) {
+    struct c_json_state state;
+
+    /*
+     * Don't clear the dirty flags, so that every iteration emits every
+     * variable.
+     */
+    c_json_buffer_init(&state, bc->emit_buffer, bc->emit_buffer_len);
+    if (c_json_emit_vars(&bc->emit_device, &state, true, false)
+            != CANOPY_SUCCESS) {
+        return -1;
+    }
+    res->bytes += state.offset;
+    return 0;
+}
+
+static int op_parse_string(struct bench_case *bc, struct bench_result *res) {
+    int active = 0;
+
+    if (c_json_parse_string(bc->doc, bc->doc_len, bc->tokens, bc->tok_len,
+            &active) != C_JSON_OK) {
+        return -1;
+    }
+    res->bytes += bc->doc_len;
+    res->tokens += active;
+    return 0;
+}
+
+static int op_parse_vardcl(struct bench_case *bc, struct bench_result *res) {
+    int next_token;
+
+    if (c_json_parse_vardcl(&bc->parse_device, bc->doc, bc->doc_len,
+            bc->tokens, bc->tok_len, bc->vardcl_offset, &next_token, false)
+            != CANOPY_SUCCESS) {
+        return -1;
+    }
+    res->bytes += bc->tokens[bc->vardcl_offset + 1].end
+            - bc->tokens[bc->vardcl_offset].start;
+    res->tokens += next_token - bc->vardcl_offset;
+    return 0;
+}
+
+static int op_parse_vars(struct bench_case *bc, struct bench_result *res) {
+    int next_token;
+
+    if (c_json_parse_vars(&bc->parse_device, bc->doc, bc->doc_len,
+            bc->tokens, bc->tok_len, bc->vars_offset, &next_token, false)
+            != CANOPY_SUCCESS) {
+        return -1;
+    }
+    res->bytes += bc->tokens[bc->vars_offset + 1].end
+            - bc->tokens[bc->vars_offset].start;
+    res->tokens += next_token - bc->vars_offset;
+    return 0;
+}
+
+static int op_parse_device(struct bench_case *bc, struct bench_result *res) {
+    bool result_code;
+
+    if (c_json_parse_device(&bc->parse_device, bc->doc, bc->doc_len,
+            bc->tokens, bc->tok_len, &result_code, false) != CANOPY_SUCCESS) {
+        return -1;
+    }
+    res->bytes += bc->doc_len;
+    res->tokens += bc->active;
+    return 0;
+}
+
+static int op_cbor_emit_vardcl(struct bench_case *bc, struct bench_result *res) {
+    struct c_cbor_state state;
+
+    c_cbor_buffer_init(&state, (uint8_t*)bc->emit_buffer, bc->emit_buffer_len);
+    if (c_cbor_emit_map(&state, 1) != C_CBOR_OK
+            || c_cbor_emit_vardcl(&bc->emit_device, &state) != CANOPY_SUCCESS) {
+        return -1;
+    }
+    res->bytes += state.offset;
+    return 0;
+}
+
+static int op_cbor_emit_vars(struct bench_case *bc, struct bench_result *res) {
+    struct c_cbor_state state;
+
+    c_cbor_buffer_init(&state, (uint8_t*)bc->emit_buffer, bc->emit_buffer_len);
+    if (c_cbor_emit_map(&state, 1) != C_CBOR_OK
+            || c_cbor_emit_vars(&bc->emit_device, &state, false)
+                    != CANOPY_SUCCESS) {
+        return -1;
+    }
+    res->bytes += state.offset;
+    return 0;
+}
+
+static int op_cbor_parse_device(struct bench_case *bc,
+        struct bench_result *res) {
+    bool result_code;
+
+    if (c_cbor_parse_device(&bc->parse_device, bc->cbor_doc, bc->cbor_doc_len,
+            &result_code) != CANOPY_SUCCESS) {
+        return -1;
+    }
+    res->bytes += bc->cbor_doc_len;
+    return 0;
+}
+
+/*
+ * Runs one operation <bc->iterations> times and prints a line of results.
+ */
+static int run(const char *name, bench_op op, struct bench_case *bc) {
+    struct bench_result res;
+    unsigned long long allocs, bytes;
+    int i;
+
+    memset(&res, 0, sizeof(res));
+
+    /* warm up */
+    op(bc, &res);
+    memset(&res, 0, sizeof(res));
+
+    allocs = alloc_count;
+    bytes = alloc_bytes;
+    res.ns = now_ns();
+    for (i = 0; i < bc->iterations; i++) {
+        if (op(bc, &res) != 0) {
+            res.errors++;
+        }
+    }
+    res.ns = now_ns() - res.ns;
+    res.allocs = alloc_count - allocs;
+    res.alloc_bytes = alloc_bytes - bytes;
+
+    printf("%-18s %6d %8d %12.1f %10.1f %10.1f %8.1f %10.1f %6d\n",
+            name, bc->nvars, bc->iterations,
+            (double)res.ns / bc->iterations,
+            (double)res.bytes / bc->iterations,
+            (double)res.tokens / bc->iterations,
+            (double)res.allocs / bc->iterations,
+            (double)res.alloc_bytes / bc->iterations,
+            res.errors);
+    return res.errors;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n ops] [-v vars[,vars...]]\n", prog);
+    exit(-1);
+}
+
+/*******************************************************************************
+ *     main() start of program.
+ */
+int main(int argc, char *argv[]) {
+    char *buffer;
+    size_t buffer_size = 4096;
+    int sizes[16] = { 10, 100, 1000 };
+    int n_sizes = 3;
+    int budget = 100000;
+    canopy_error err;
+    canopy_context_t ctx;
+    canopy_remote_t remote;
+    canopy_remote_params_t params;
+    int opt;
+    int i;
+    int errors = 0;
+
+    while ((opt = getopt(argc, argv, "n:v:")) != -1) {
+        switch (opt) {
+        case 'n':
+            budget = atoi(optarg);
+            break;
+        case 'v': {
+            char *p = optarg;
+            n_sizes = 0;
+            while (*p != '\0' && n_sizes < (int)(sizeof(sizes) / sizeof(sizes[0]))) {
+                sizes[n_sizes] = strtol(p, &p, 10);
+                if (sizes[n_sizes] <= 0) {
+                    usage(argv[0]);
+                }
+                n_sizes++;
+                if (*p == ',') {
+                    p++;
+                }
+            }
+            break;
+        }
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (budget <= 0 || n_sizes == 0) {
+        usage(argv[0]);
+    }
+
+    err = canopy_ctx_init(&ctx, 0);
+    if (err != CANOPY_SUCCESS) {
+        cos_log(LOG_LEVEL_ERROR, "Error initializing ctx: %s\n", canopy_error_string(err));
+        exit(-1);
+    }
+
+    buffer = (char *)cos_alloc(buffer_size);
+    if (buffer == NULL) {
+        cos_log(LOG_LEVEL_ERROR, "Unable to allocate buffer\n");
+        exit(-1);
+    }
+    memset(buffer, 0, buffer_size);
+
+    /*
+     * The remote is never contacted, the devices just need one.
+     */
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_DEVICE_CREDENTIALS;
+    params.name = TOASTER_UUID;
+    params.password = TOASTER_SECRET_KEY;
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = REMOTE_ADDR;
+    params.use_http = true;
+    params.use_ws = false;
+    params.persistent = false;
+    err = canopy_remote_init(&ctx, &params, buffer, buffer_size, &remote);
+    if (err != CANOPY_SUCCESS) {
+        cos_log(LOG_LEVEL_ERROR, "Error initializing remote: %s\n", canopy_error_string(err));
+        exit(-1);
+    }
+
+    printf("%-18s %6s %8s %12s %10s %10s %8s %10s %6s\n", "op", "vars",
+            "iters", "ns/op", "bytes/op", "tokens/op", "allocs", "alloc B",
+            "errors");
+    for (i = 0; i < n_sizes; i++) {
+        struct bench_case bc;
+
+        if (setup_case(&bc, &remote, sizes[i], budget) != 0) {
+            cos_log(LOG_LEVEL_ERROR, "Unable to set up %d variables\n",
+                    sizes[i]);
+            exit(-1);
+        }
+        errors += run("emit_vardcl", op_emit_vardcl, &bc);
+        errors += run("emit_vars", op_emit_vars, &bc);
+        errors += run("parse_string", op_parse_string, &bc);
+        errors += run("parse_vardcl", op_parse_vardcl, &bc);
+        errors += run("parse_vars", op_parse_vars, &bc);
+        errors += run("parse_device", op_parse_device, &bc);
+        errors += run("cbor_emit_vardcl", op_cbor_emit_vardcl, &bc);
+        errors += run("cbor_emit_vars", op_cbor_emit_vars, &bc);
+        errors += run("cbor_parse_device", op_cbor_parse_device, &bc);
+
+        /*
+         * The devices' variables are leaked, there is no API to free them.
+         */
+        cos_free(bc.cbor_doc);
+        cos_free(bc.tokens);
+        cos_free(bc.emit_buffer);
+        free(bc.doc);
+    }
+
+    canopy_ctx_shutdown(&ctx);
+    return (errors == 0) ? 0 : -1;
+}
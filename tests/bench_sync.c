@@ -0,0 +1,297 @@
+// Copyright 2015 Canopy Services, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+ * bench_sync.c
+ *
+ *      End-to-end benchmark of the device sync APIs.  Meant to be run against
+ *      mock_server (see "make bench"), but any remote speaking the Canopy
+ *      protocol over plain HTTP will do.
+ *
+ *      For each of canopy_device_update_from_remote(),
+ *      canopy_device_update_to_remote() and canopy_device_sync_with_remote()
+ *      it reports the number of calls per second, the p50/p99 latency and
+ *      the number of heap allocations (and bytes) per call.
+ *
+ *      usage:  bench_sync [-r host:port] [-i iterations] [-o out_vars]
+ *                         [-b rcv_buffer_size] [-f json|cbor]
+ *                         [-z compress_threshold] [-a]
+ *
+ *      -f selects the wire format (see canopy_wire_format).  The average
+ *      response size is reported so the formats can be compared.  -z gzips
+ *      request bodies of at least that many bytes and -a accepts compressed
+ *      responses (see compress_threshold and accept_compressed in
+ *      canopy_remote_params).
+ */
+
+#include     <stdio.h>
+#include     <stdlib.h>
+#include     <errno.h>
+#include     <unistd.h>
+#include     <time.h>
+
+#include    <stdint.h>
+#include    <stdbool.h>
+#include    <string.h>
+
+#include    <canopy_min.h>
+#include    <canopy_os.h>
+
+#define TOASTER_UUID "e43eb410-48da-421a-b07d-1cd751412fd5"
+#define TOASTER_SECRET_KEY "wYI0G+HQN9fj76fpyxwiHKJDQags0dpM"
+#define REMOTE_ADDR "127.0.0.1:18089"
+
+/*
+ * Allocation accounting.  These wrap the glibc allocator so that allocations
+ * made by libcurl are counted along with the ones made by the library.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long long alloc_count = 0;
+static unsigned long long alloc_bytes = 0;
+
+void *malloc(size_t size) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, count * size, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+/*
+ * Monotonic clock in nanoseconds.
+ */
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((unsigned long long)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int compare_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return (x > y) - (x < y);
+}
+
+typedef canopy_error (*sync_func)(canopy_remote_t *remote,
+        canopy_device_t *device, canopy_barrier_t *barrier);
+
+static int iterations = 1000;
+static int out_vars = 4;
+static struct canopy_var *vars[64];
+
+/*
+ * Runs one benchmark and prints a line of results.
+ */
+static int run(const char *name, sync_func func, canopy_remote_t *remote,
+        canopy_device_t *device) {
+    unsigned long long *latency;
+    unsigned long long start, total;
+    unsigned long long allocs, bytes;
+    unsigned long long rsp_bytes = 0;
+    int i, j;
+    int errors = 0;
+
+    latency = (unsigned long long*)cos_alloc(iterations * sizeof(*latency));
+    if (latency == NULL) {
+        return -1;
+    }
+
+    allocs = alloc_count;
+    bytes = alloc_bytes;
+    total = now_ns();
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < out_vars; j++) {
+            canopy_var_set_float32(vars[j], (float)(i + j));
+        }
+        start = now_ns();
+        if (func(remote, device, NULL) != CANOPY_SUCCESS) {
+            errors++;
+        }
+        latency[i] = now_ns() - start;
+        rsp_bytes += remote->rcv_end;
+    }
+    total = now_ns() - total;
+    allocs = alloc_count - allocs;
+    bytes = alloc_bytes - bytes;
+
+    qsort(latency, iterations, sizeof(*latency), compare_ull);
+    printf("%-26s %10.1f %10.1f %10.1f %10.1f %12.1f %8.1f %6d\n",
+            name,
+            iterations / (total / 1e9),
+            latency[iterations / 2] / 1e3,
+            latency[(iterations * 99) / 100] / 1e3,
+            (double)allocs / iterations,
+            (double)bytes / iterations,
+            (double)rsp_bytes / iterations,
+            errors);
+
+    cos_free(latency);
+    return errors;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-r host:port] [-i iterations] [-o out_vars] "
+            "[-b rcv_buffer_size] [-f json|cbor] [-z compress_threshold] "
+            "[-a]\n", prog);
+    exit(-1);
+}
+
+/*******************************************************************************
+ *     main() start of program.
+ */
+int main(int argc, char *argv[]) {
+    char *buffer;
+    size_t buffer_size = 64 * 1024;
+    char *remote_addr = REMOTE_ADDR;
+    canopy_error err;
+    canopy_context_t ctx;
+    canopy_remote_t remote;
+    canopy_remote_params_t params;
+    canopy_device_t device;
+    canopy_wire_format format = CANOPY_WIRE_FORMAT_JSON;
+    size_t compress_threshold = 0;
+    bool accept_compressed = false;
+    int opt;
+    int i;
+    int errors = 0;
+
+    while ((opt = getopt(argc, argv, "r:i:o:b:f:z:a")) != -1) {
+        switch (opt) {
+        case 'r':
+            remote_addr = optarg;
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        case 'o':
+            out_vars = atoi(optarg);
+            break;
+        case 'b':
+            buffer_size = atoi(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "cbor") == 0) {
+                format = CANOPY_WIRE_FORMAT_CBOR;
+            } else if (strcmp(optarg, "json") != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'z':
+            compress_threshold = atoi(optarg);
+            break;
+        case 'a':
+            accept_compressed = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (iterations <= 0 || out_vars < 0 ||
+            out_vars > (int)(sizeof(vars) / sizeof(vars[0]))) {
+        usage(argv[0]);
+    }
+
+    err = canopy_ctx_init(&ctx, 0);
+    if (err != CANOPY_SUCCESS) {
+        cos_log(LOG_LEVEL_ERROR, "Error initializing ctx: %s\n", canopy_error_string(err));
+        exit(-1);
+    }
+
+    buffer = (char *)cos_alloc(buffer_size);
+    if (buffer == NULL) {
+        cos_log(LOG_LEVEL_ERROR, "Unable to allocate buffer\n");
+        exit(-1);
+    }
+    memset(buffer, 0, buffer_size);
+
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_DEVICE_CREDENTIALS;
+    params.name = TOASTER_UUID;
+    params.password = TOASTER_SECRET_KEY;
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = remote_addr;
+    params.use_http = true;
+    params.use_ws = false;
+    params.persistent = false;
+    params.wire_format = format;
+    params.compress_threshold = compress_threshold;
+    params.accept_compressed = accept_compressed;
+    err = canopy_remote_init(&ctx, &params, buffer, buffer_size, &remote);
+    if (err != CANOPY_SUCCESS) {
+        cos_log(LOG_LEVEL_ERROR, "Error initializing remote: %s\n", canopy_error_string(err));
+        exit(-1);
+    }
+
+    /*
+     * The mock server may still be starting up, give it a moment.
+     */
+    for (i = 0; i < 50; i++) {
+        err = canopy_get_self_device(&remote, &device, NULL);
+        if (err != CANOPY_ERROR_NETWORK) {
+            break;
+        }
+        usleep(100 * 1000);
+    }
+    if (err != CANOPY_SUCCESS) {
+        cos_log(LOG_LEVEL_ERROR, "Error fetching self device: %s\n", canopy_error_string(err));
+        exit(-1);
+    }
+
+    for (i = 0; i < out_vars; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "sensor%02d", i);
+        err = canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+                CANOPY_VAR_DATATYPE_FLOAT32, name, &vars[i]);
+        if (err != CANOPY_SUCCESS) {
+            cos_log(LOG_LEVEL_ERROR, "Error declaring %s: %s\n", name,
+                    canopy_error_string(err));
+            exit(-1);
+        }
+    }
+
+    printf("remote %s, %d iterations, %d out vars, %s", remote_addr,
+            iterations, out_vars,
+            (remote.wire_format == CANOPY_WIRE_FORMAT_CBOR) ? "cbor" : "json");
+    if (compress_threshold > 0) {
+        printf(", gzip requests >= %d B", (int)compress_threshold);
+    }
+    if (accept_compressed) {
+        printf(", compressed responses");
+    }
+    printf("\n");
+    printf("%-26s %10s %10s %10s %10s %12s %8s %6s\n", "api", "calls/s",
+            "p50 us", "p99 us", "allocs", "bytes", "rsp B", "errors");
+    errors += run("update_from_remote", canopy_device_update_from_remote,
+            &remote, &device);
+    errors += run("update_to_remote", canopy_device_update_to_remote,
+            &remote, &device);
+    errors += run("sync_with_remote", canopy_device_sync_with_remote,
+            &remote, &device);
+
+    canopy_ctx_shutdown(&ctx);
+    return (errors == 0) ? 0 : -1;
+}
@@ -0,0 +1,921 @@
+// Copyright 2015 Canopy Services, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+ * mock_server.c
+ *
+ *      A small, self-contained stand-in for the Canopy server.  It speaks just
+ *      enough HTTP/1.1 (with keep-alive) to answer:
+ *
+ *          GET  /api/info
+ *          GET  /api/device/self
+ *          POST /api/device/self
+ *          GET  /api/device/<id>/devices
+ *          GET  /api/user/<name>/devices
+ *          POST /api/create_devices
+ *          GET  /api/user/self
+ *          POST /api/user/self
+ *          POST /api/create_user
+ *
+ *      The device returned has a configurable number of variables of mixed
+ *      types, the response can be padded to a configurable size and every
+ *      response can be delayed by a fixed latency.  Credentials are accepted
+ *      without being checked.
+ *
+ *      If the request's Accept header lists application/cbor, the device is
+ *      returned as CBOR.  With -j the server behaves like one that only
+ *      speaks JSON: CBOR request bodies get a 415.
+ *
+ *      Request bodies sent with Content-Encoding: gzip are inflated (and
+ *      answered with a 400 if they don't inflate), and responses are
+ *      gzipped for clients whose Accept-Encoding lists gzip.
+ *
+ *      The device lists hold a fleet of -d devices (default 100), paged
+ *      according to the limit=start,count query parameter.  Filters and sort
+ *      order are ignored.
+ *
+ *      There is one user, whose email can be changed by POST /api/user/self.
+ *      Created users are echoed back without being stored.
+ *
+ *      usage:  mock_server [-p port] [-n nvars] [-l latency_ms] [-s pad_bytes]
+ *                          [-d ndevices] [-j] [-v]
+ */
+
+#include     <stdio.h>
+#include     <stdlib.h>
+#include     <errno.h>
+#include     <stdarg.h>
+#include     <unistd.h>
+#include     <signal.h>
+#include     <pthread.h>
+
+#include     <stdint.h>
+#include     <stdbool.h>
+#include     <string.h>
+
+#include     <sys/types.h>
+#include     <sys/socket.h>
+#include     <netinet/in.h>
+#include     <netinet/tcp.h>
+#include     <arpa/inet.h>
+
+#include     <zlib.h>
+
+#define MOCK_DEVICE_ID "e43eb410-48da-421a-b07d-1cd751412fd5"
+#define MOCK_SECRET_KEY "wYI0G+HQN9fj76fpyxwiHKJDQags0dpM"
+
+#define MAX_HEADER_LENGTH   8192
+
+static int port = 18089;
+static int n_vars = 8;
+static int latency_ms = 0;
+static int pad_bytes = 0;
+static int n_devices = 100;
+static bool verbose = false;
+static bool json_only = false;
+
+static unsigned long long request_count = 0;
+static pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The variables served by the mock device cycle through these declarations.
+ */
+struct mock_var_type {
+    const char *type;
+    const char *fmt;
+};
+static const struct mock_var_type var_types[] = {
+        {"float32", "%d.5"},
+        {"int32", "%d"},
+        {"bool", NULL},
+        {"float64", "%d.25"},
+        {"string", "\"value %d\""},
+        {"uint16", "%d"},
+        {"datetime", "14268038970%d"},
+};
+#define N_VAR_TYPES ((int)(sizeof(var_types) / sizeof(var_types[0])))
+
+/*
+ * Growable output buffer used to build a response.
+ */
+struct out_buf {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+static void out_printf(struct out_buf *out, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(&out->buf[out->len], out->cap - out->len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t)n < out->cap - out->len) {
+            out->len += n;
+            return;
+        }
+        out->cap = (out->cap * 2) + n;
+        out->buf = realloc(out->buf, out->cap);
+        if (out->buf == NULL) {
+            fprintf(stderr, "mock_server: out of memory\n");
+            exit(-1);
+        }
+    }
+}
+
+static void out_bytes(struct out_buf *out, const void *bytes, size_t len) {
+    if (out->cap - out->len < len) {
+        out->cap = (out->cap * 2) + len;
+        out->buf = realloc(out->buf, out->cap);
+        if (out->buf == NULL) {
+            fprintf(stderr, "mock_server: out of memory\n");
+            exit(-1);
+        }
+    }
+    memcpy(&out->buf[out->len], bytes, len);
+    out->len += len;
+}
+
+/*
+ * Just enough of a CBOR encoder to build the device.
+ */
+static void cbor_head(struct out_buf *out, int major, unsigned long long val) {
+    unsigned char b[9];
+    int n, i;
+
+    if (val < 24) {
+        b[0] = (major << 5) | val;
+        n = 1;
+    } else if (val <= 0xff) {
+        b[0] = (major << 5) | 24;
+        n = 2;
+    } else if (val <= 0xffff) {
+        b[0] = (major << 5) | 25;
+        n = 3;
+    } else if (val <= 0xffffffffULL) {
+        b[0] = (major << 5) | 26;
+        n = 5;
+    } else {
+        b[0] = (major << 5) | 27;
+        n = 9;
+    }
+    for (i = 1; i < n; i++) {
+        b[i] = (unsigned char)(val >> (8 * (n - 1 - i)));
+    }
+    out_bytes(out, b, n);
+}
+
+static void cbor_text(struct out_buf *out, const char *str) {
+    cbor_head(out, 3, strlen(str));
+    out_bytes(out, str, strlen(str));
+}
+
+static void cbor_float64(struct out_buf *out, double val) {
+    unsigned char b[9];
+    unsigned long long bits;
+    int i;
+
+    memcpy(&bits, &val, sizeof(bits));
+    b[0] = 0xfb;
+    for (i = 0; i < 8; i++) {
+        b[1 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    out_bytes(out, b, sizeof(b));
+}
+
+static void cbor_bool(struct out_buf *out, bool val) {
+    unsigned char b = val ? 0xf5 : 0xf4;
+    out_bytes(out, &b, 1);
+}
+
+/*
+ * Builds the device object returned by GET and POST /api/device/self.  The
+ * values change with every request so that clients see fresh samples.
+ */
+static void build_device(struct out_buf *out, const char *device_id,
+        unsigned long long seq) {
+    int i;
+    unsigned long long t = 1426803897000000ULL + seq;
+
+    out_printf(out, "{\"result\" : \"ok\", ");
+    out_printf(out, "\"device_id\" : \"%s\", ", device_id);
+    out_printf(out, "\"friendly_name\" : \"mock device\", ");
+    out_printf(out, "\"location_note\" : \"localhost\", ");
+    out_printf(out, "\"secret_key\" : \"%s\", ", MOCK_SECRET_KEY);
+    out_printf(out, "\"status\" : {\"ws_connected\" : false, "
+            "\"active_status\" : \"active\", "
+            "\"last_activity_time\" : %llu}, ", t);
+
+    out_printf(out, "\"var_decls\" : {");
+    for (i = 0; i < n_vars; i++) {
+        out_printf(out, "%s\"in %s var%04d\" : {}", (i ? ", " : ""),
+                var_types[i % N_VAR_TYPES].type, i);
+    }
+    out_printf(out, "}, ");
+
+    out_printf(out, "\"vars\" : {");
+    for (i = 0; i < n_vars; i++) {
+        const struct mock_var_type *vt = &var_types[i % N_VAR_TYPES];
+        out_printf(out, "%s\"var%04d\" : {\"t\" : %llu, \"v\" : ",
+                (i ? ", " : ""), i, t);
+        if (vt->fmt == NULL) {
+            out_printf(out, "%s}", ((seq + i) & 1) ? "true" : "false");
+        } else {
+            out_printf(out, vt->fmt, (int)((seq + i) % 100));
+            out_printf(out, "}");
+        }
+    }
+    out_printf(out, "}");
+
+    if (pad_bytes > 0) {
+        out_printf(out, ", \"padding\" : \"");
+        for (i = 0; i < pad_bytes; i++) {
+            out_printf(out, "x");
+        }
+        out_printf(out, "\"");
+    }
+    out_printf(out, "}");
+}
+
+/*
+ * CBOR version of build_device().
+ */
+static void build_device_cbor(struct out_buf *out, const char *device_id,
+        unsigned long long seq) {
+    char name[64];
+    int i;
+    int v;
+    unsigned long long t = 1426803897000000ULL + seq;
+
+    cbor_head(out, 5, 8 + (pad_bytes > 0));
+    cbor_text(out, "result");
+    cbor_text(out, "ok");
+    cbor_text(out, "device_id");
+    cbor_text(out, device_id);
+    cbor_text(out, "friendly_name");
+    cbor_text(out, "mock device");
+    cbor_text(out, "location_note");
+    cbor_text(out, "localhost");
+    cbor_text(out, "secret_key");
+    cbor_text(out, MOCK_SECRET_KEY);
+    cbor_text(out, "status");
+    cbor_head(out, 5, 3);
+    cbor_text(out, "ws_connected");
+    cbor_bool(out, false);
+    cbor_text(out, "active_status");
+    cbor_text(out, "active");
+    cbor_text(out, "last_activity_time");
+    cbor_head(out, 0, t);
+
+    cbor_text(out, "var_decls");
+    cbor_head(out, 5, n_vars);
+    for (i = 0; i < n_vars; i++) {
+        snprintf(name, sizeof(name), "in %s var%04d",
+                var_types[i % N_VAR_TYPES].type, i);
+        cbor_text(out, name);
+        cbor_head(out, 5, 0);
+    }
+
+    cbor_text(out, "vars");
+    cbor_head(out, 5, n_vars);
+    for (i = 0; i < n_vars; i++) {
+        const char *type = var_types[i % N_VAR_TYPES].type;
+        v = (int)((seq + i) % 100);
+        snprintf(name, sizeof(name), "var%04d", i);
+        cbor_text(out, name);
+        cbor_head(out, 5, 2);
+        cbor_text(out, "t");
+        cbor_head(out, 0, t);
+        cbor_text(out, "v");
+        if (strcmp(type, "bool") == 0) {
+            cbor_bool(out, ((seq + i) & 1));
+        } else if (strcmp(type, "float32") == 0) {
+            cbor_float64(out, v + 0.5);
+        } else if (strcmp(type, "float64") == 0) {
+            cbor_float64(out, v + 0.25);
+        } else if (strcmp(type, "string") == 0) {
+            snprintf(name, sizeof(name), "value %d", v);
+            cbor_text(out, name);
+        } else if (strcmp(type, "datetime") == 0) {
+            cbor_head(out, 0, 142680389700ULL + v);
+        } else {
+            cbor_head(out, 0, v);
+        }
+    }
+
+    if (pad_bytes > 0) {
+        cbor_text(out, "padding");
+        cbor_head(out, 3, pad_bytes);
+        for (i = 0; i < pad_bytes; i++) {
+            out_bytes(out, "x", 1);
+        }
+    }
+}
+
+/*
+ * Gzips <in> into <out>, replacing its contents.
+ */
+static bool gzip_buf(const struct out_buf *in, struct out_buf *out) {
+    z_stream zs;
+    bool ok;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    out->len = 0;
+    if (out->cap < deflateBound(&zs, in->len)) {
+        out->cap = deflateBound(&zs, in->len);
+        out->buf = realloc(out->buf, out->cap);
+        if (out->buf == NULL) {
+            fprintf(stderr, "mock_server: out of memory\n");
+            exit(-1);
+        }
+    }
+    zs.next_in = (Bytef*)in->buf;
+    zs.avail_in = in->len;
+    zs.next_out = (Bytef*)out->buf;
+    zs.avail_out = out->cap;
+    ok = (deflate(&zs, Z_FINISH) == Z_STREAM_END);
+    out->len = zs.total_out;
+    deflateEnd(&zs);
+    return ok;
+}
+
+/*
+ * Returns the inflated size of a gzipped body, or -1 if it's corrupt.  The
+ * inflated body is appended to <into> unless it's NULL.
+ */
+static long gunzip(const char *body, size_t len, struct out_buf *into) {
+    unsigned char scratch[4096];
+    z_stream zs;
+    int zerr;
+    long total;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        return -1;
+    }
+    zs.next_in = (Bytef*)body;
+    zs.avail_in = len;
+    do {
+        zs.next_out = scratch;
+        zs.avail_out = sizeof(scratch);
+        zerr = inflate(&zs, Z_NO_FLUSH);
+        if (into != NULL) {
+            out_bytes(into, scratch, sizeof(scratch) - zs.avail_out);
+        }
+    } while (zerr == Z_OK);
+    total = zs.total_out;
+    inflateEnd(&zs);
+    return (zerr == Z_STREAM_END) ? total : -1;
+}
+
+/*
+ * Builds a page of the fleet, as returned by GET .../devices.  Device <i>
+ * has an ID ending in <i>.
+ */
+static void build_device_list(struct out_buf *out, bool cbor, int start,
+        int count, unsigned long long seq) {
+    char device_id[40];
+    int i;
+    int end = start + count;
+
+    if (end > n_devices || count < 0) {
+        end = n_devices;
+    }
+    if (start > end) {
+        start = end;
+    }
+    if (cbor) {
+        cbor_head(out, 5, 2);
+        cbor_text(out, "result");
+        cbor_text(out, "ok");
+        cbor_text(out, "devices");
+        cbor_head(out, 4, end - start);
+    } else {
+        out_printf(out, "{\"result\" : \"ok\", \"devices\" : [");
+    }
+    for (i = start; i < end; i++) {
+        snprintf(device_id, sizeof(device_id),
+                "00000000-0000-4000-8000-%012d", i);
+        if (cbor) {
+            build_device_cbor(out, device_id, seq);
+        } else {
+            out_printf(out, "%s", (i > start) ? ", " : "");
+            build_device(out, device_id, seq);
+        }
+    }
+    if (!cbor) {
+        out_printf(out, "]}");
+    }
+}
+
+/*
+ * Answers POST /api/create_devices: makes up "quantity" devices, named from
+ * the "friendly_names" list if there is one.  Names are echoed back as sent.
+ */
+static void build_created_devices(struct out_buf *out, const char *body,
+        size_t len) {
+    static unsigned long long next_id = 0;
+    static pthread_mutex_t id_lock = PTHREAD_MUTEX_INITIALIZER;
+    char *req = malloc(len + 1);
+    const char *p;
+    const char *names = NULL;
+    unsigned long long first;
+    int quantity = 0;
+    int i;
+
+    memcpy(req, body, len);
+    req[len] = '\0';
+    p = strstr(req, "\"quantity\"");
+    if (p != NULL) {
+        sscanf(strchr(p, ':') + 1, "%d", &quantity);
+    }
+    p = strstr(req, "\"friendly_names\"");
+    if (p != NULL) {
+        names = strchr(p, '[');
+    }
+    if (quantity <= 0) {
+        out_printf(out, "{\"result\" : \"error\", \"error_msg\" : "
+                "\"bad quantity\"}");
+        free(req);
+        return;
+    }
+
+    pthread_mutex_lock(&id_lock);
+    first = next_id;
+    next_id += quantity;
+    pthread_mutex_unlock(&id_lock);
+
+    out_printf(out, "{\"result\" : \"ok\", \"count\" : %d, \"ids\" : [",
+            quantity);
+    for (i = 0; i < quantity; i++) {
+        out_printf(out, "%s\"00000000-0000-4000-9000-%012llu\"",
+                (i > 0) ? ", " : "", first + i);
+    }
+    out_printf(out, "], \"friendly_names\" : [");
+    for (i = 0; i < quantity; i++) {
+        const char *start = NULL;
+        const char *q;
+        if (names != NULL && (start = strchr(names, '"')) != NULL) {
+            for (q = start + 1; *q != '\0' && *q != '"'; q++) {
+                if (*q == '\\' && q[1] != '\0') {
+                    q++;
+                }
+            }
+            names = (*q != '\0') ? q + 1 : NULL;
+        }
+        if (start != NULL && names != NULL) {
+            out_printf(out, "%s%.*s", (i > 0) ? ", " : "",
+                    (int)(names - start), start);
+        } else {
+            out_printf(out, "%s\"device %llu\"", (i > 0) ? ", " : "",
+                    first + i);
+        }
+    }
+    out_printf(out, "], \"device_secret_keys\" : [");
+    for (i = 0; i < quantity; i++) {
+        out_printf(out, "%s\"secret%026llu\"", (i > 0) ? ", " : "",
+                first + i);
+    }
+    out_printf(out, "]}");
+    free(req);
+}
+
+/*
+ * Copies the string value of "<tag>" in the JSON <req> into <into>, escapes
+ * and all.  Returns false if there is none.
+ */
+static bool find_string(const char *req, const char *tag, char *into,
+        size_t size) {
+    char quoted[64];
+    const char *p;
+    size_t n = 0;
+
+    snprintf(quoted, sizeof(quoted), "\"%s\"", tag);
+    p = strstr(req, quoted);
+    if (p == NULL || (p = strchr(p + strlen(quoted), '"')) == NULL) {
+        return false;
+    }
+    for (p++; *p != '\0' && *p != '"' && n + 2 < size; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            into[n++] = *p++;
+        }
+        into[n++] = *p;
+    }
+    into[n] = '\0';
+    return true;
+}
+
+/*
+ * Answers /api/user/self and POST /api/create_user.
+ */
+static void build_user(struct out_buf *out, const char *path,
+        const char *body, size_t len) {
+    static char email[512] = "mock@example.com";
+    static pthread_mutex_t user_lock = PTHREAD_MUTEX_INITIALIZER;
+    char username[256] = "mock_user";
+    char *req = malloc(len + 1);
+
+    if (len > 0) {
+        memcpy(req, body, len);
+    }
+    req[len] = '\0';
+    if (strcmp(path, "/api/create_user") == 0) {
+        char new_email[512] = "";
+        find_string(req, "username", username, sizeof(username));
+        find_string(req, "email", new_email, sizeof(new_email));
+        out_printf(out, "{\"result\" : \"ok\", \"username\" : \"%s\", "
+                "\"email\" : \"%s\", \"validated\" : false}", username,
+                new_email);
+    } else {
+        pthread_mutex_lock(&user_lock);
+        find_string(req, "email", email, sizeof(email));
+        out_printf(out, "{\"result\" : \"ok\", \"username\" : \"%s\", "
+                "\"email\" : \"%s\", \"validated\" : true}", username,
+                email);
+        pthread_mutex_unlock(&user_lock);
+    }
+    free(req);
+}
+
+/*
+ * Case-insensitive lookup of a header value.  Returns NULL if not present.
+ */
+static const char *find_header(const char *headers, const char *name) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(headers, "\r\n");
+    while (line != NULL && line[2] != '\r') {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *value = line + name_len + 1;
+            while (*value == ' ') {
+                value++;
+            }
+            return value;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+static bool send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void send_response(int fd, int status, const char *reason,
+        const char *content_type, bool gzipped, const char *body,
+        size_t body_len, bool keep_alive) {
+    char header[256];
+    int n = snprintf(header, sizeof(header),
+            "HTTP/1.1 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "%s"
+            "Content-Length: %zu\r\n"
+            "Connection: %s\r\n"
+            "\r\n",
+            status, reason, content_type,
+            (gzipped ? "Content-Encoding: gzip\r\n" : ""), body_len,
+            (keep_alive ? "keep-alive" : "close"));
+    send_all(fd, header, n);
+    send_all(fd, body, body_len);
+}
+
+/*
+ * Serves requests on one connection until the client closes it.
+ */
+static void *connection_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char *in = malloc(MAX_HEADER_LENGTH + 1);
+    size_t in_len = 0;
+    struct out_buf out = {NULL, 0, 0};
+    struct out_buf body = {NULL, 0, 0};
+    struct out_buf zout = {NULL, 0, 0};
+
+    out.cap = 4096 + (n_vars * 96) + pad_bytes;
+    out.buf = malloc(out.cap);
+    if (in == NULL || out.buf == NULL) {
+        goto done;
+    }
+
+    for (;;) {
+        char method[16];
+        char path[256];
+        char *end;
+        const char *hdr;
+        size_t header_len;
+        long content_length = 0;
+        bool keep_alive = true;
+        bool accept_cbor = false;
+        bool cbor_body = false;
+        bool gzip_body = false;
+        bool gzip_ok = false;
+        long inflated_length = -1;
+        const char *content_type;
+        int status;
+        const char *reason;
+        unsigned long long seq;
+        char *query;
+        const char *limit;
+        int start = 0;
+        int count = -1;
+
+        /*
+         * Read until the end of the request headers.
+         */
+        in[in_len] = '\0';
+        while ((end = strstr(in, "\r\n\r\n")) == NULL) {
+            ssize_t n;
+            if (in_len >= MAX_HEADER_LENGTH) {
+                goto done;
+            }
+            n = recv(fd, &in[in_len], MAX_HEADER_LENGTH - in_len, 0);
+            if (n <= 0) {
+                goto done;
+            }
+            in_len += n;
+            in[in_len] = '\0';
+        }
+        header_len = (end - in) + 4;
+        end[2] = '\0';  /* terminate the headers after the last line */
+
+        if (sscanf(in, "%15s %255s", method, path) != 2) {
+            goto done;
+        }
+        query = strchr(path, '?');
+        if (query != NULL) {
+            *query++ = '\0';
+            limit = strstr(query, "limit=");
+            if (limit != NULL) {
+                sscanf(limit, "limit=%d,%d", &start, &count);
+            }
+        }
+        hdr = find_header(in, "Content-Length");
+        if (hdr != NULL) {
+            content_length = atol(hdr);
+        }
+        hdr = find_header(in, "Connection");
+        if (hdr != NULL && strncasecmp(hdr, "close", 5) == 0) {
+            keep_alive = false;
+        }
+        hdr = find_header(in, "Accept");
+        if (hdr != NULL && strstr(hdr, "application/cbor") != NULL) {
+            accept_cbor = !json_only;
+        }
+        hdr = find_header(in, "Content-Type");
+        if (hdr != NULL && strncasecmp(hdr, "application/cbor", 16) == 0) {
+            cbor_body = true;
+        }
+        hdr = find_header(in, "Content-Encoding");
+        if (hdr != NULL && strncasecmp(hdr, "gzip", 4) == 0) {
+            gzip_body = true;
+        }
+        hdr = find_header(in, "Accept-Encoding");
+        if (hdr != NULL && strstr(hdr, "gzip") != NULL) {
+            gzip_ok = true;
+        }
+        hdr = find_header(in, "Expect");
+        if (hdr != NULL && strncasecmp(hdr, "100-continue", 12) == 0) {
+            send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+        }
+
+        /*
+         * Collect the request body.  The mock doesn't care what the client
+         * reports, but checks that compressed bodies inflate.
+         */
+        body.len = 0;
+        if (in_len - header_len >= (size_t)content_length) {
+            size_t consumed = header_len + content_length;
+            out_bytes(&body, &in[header_len], content_length);
+            memmove(in, &in[consumed], in_len - consumed);
+            in_len -= consumed;
+        } else {
+            long remaining = content_length - (in_len - header_len);
+            out_bytes(&body, &in[header_len], in_len - header_len);
+            while (remaining > 0) {
+                ssize_t n = recv(fd, in,
+                        (remaining < MAX_HEADER_LENGTH ? remaining : MAX_HEADER_LENGTH), 0);
+                if (n <= 0) {
+                    goto done;
+                }
+                out_bytes(&body, in, n);
+                remaining -= n;
+            }
+            in_len = 0;
+        }
+        if (gzip_body) {
+            inflated_length = gunzip(body.buf, body.len, NULL);
+        }
+
+        pthread_mutex_lock(&count_lock);
+        seq = ++request_count;
+        pthread_mutex_unlock(&count_lock);
+
+        if (verbose) {
+            fprintf(stderr, "mock_server: %s %s (%ld byte body", method, path,
+                    content_length);
+            if (gzip_body) {
+                fprintf(stderr, ", %ld inflated", inflated_length);
+            }
+            fprintf(stderr, ")\n");
+        }
+
+        if (latency_ms > 0) {
+            usleep(latency_ms * 1000);
+        }
+
+        out.len = 0;
+        status = 200;
+        reason = "OK";
+        content_type = "application/json";
+        if (gzip_body && inflated_length < 0) {
+            out_printf(&out, "{\"result\" : \"error\", \"error_msg\" : "
+                    "\"corrupt gzip body\"}");
+            status = 400;
+            reason = "Bad Request";
+        } else if (cbor_body && json_only) {
+            out_printf(&out, "{\"result\" : \"error\", \"error_msg\" : "
+                    "\"unsupported media type\"}");
+            status = 415;
+            reason = "Unsupported Media Type";
+        } else if (strcmp(path, "/api/device/self") == 0 &&
+                (strcmp(method, "GET") == 0 || strcmp(method, "POST") == 0)) {
+            if (accept_cbor) {
+                build_device_cbor(&out, MOCK_DEVICE_ID, seq);
+                content_type = "application/cbor";
+            } else {
+                build_device(&out, MOCK_DEVICE_ID, seq);
+            }
+        } else if ((strncmp(path, "/api/device/", 12) == 0 ||
+                    strncmp(path, "/api/user/", 10) == 0) &&
+                strlen(path) > 8 &&
+                strcmp(&path[strlen(path) - 8], "/devices") == 0 &&
+                strcmp(method, "GET") == 0) {
+            build_device_list(&out, accept_cbor, start, count, seq);
+            if (accept_cbor) {
+                content_type = "application/cbor";
+            }
+        } else if (strcmp(path, "/api/create_devices") == 0 &&
+                strcmp(method, "POST") == 0) {
+            if (gzip_body) {
+                zout.len = 0;
+                gunzip(body.buf, body.len, &zout);
+                build_created_devices(&out, zout.buf, zout.len);
+            } else {
+                build_created_devices(&out, body.buf, body.len);
+            }
+        } else if ((strcmp(path, "/api/user/self") == 0 &&
+                    (strcmp(method, "GET") == 0 ||
+                     strcmp(method, "POST") == 0)) ||
+                (strcmp(path, "/api/create_user") == 0 &&
+                    strcmp(method, "POST") == 0)) {
+            if (gzip_body) {
+                zout.len = 0;
+                gunzip(body.buf, body.len, &zout);
+                build_user(&out, path, zout.buf, zout.len);
+            } else {
+                build_user(&out, path, body.buf, body.len);
+            }
+        } else if (strcmp(path, "/api/info") == 0) {
+            out_printf(&out, "{\"result\" : \"ok\", \"service-name\" : "
+                    "\"Canopy mock server\"}");
+        } else {
+            out_printf(&out, "{\"result\" : \"error\", \"error_msg\" : "
+                    "\"not found\"}");
+            status = 404;
+            reason = "Not Found";
+        }
+        if (gzip_ok && gzip_buf(&out, &zout)) {
+            send_response(fd, status, reason, content_type, true, zout.buf,
+                    zout.len, keep_alive);
+        } else {
+            send_response(fd, status, reason, content_type, false, out.buf,
+                    out.len, keep_alive);
+        }
+
+        if (!keep_alive) {
+            break;
+        }
+    }
+
+done:
+    free(in);
+    free(out.buf);
+    free(body.buf);
+    free(zout.buf);
+    close(fd);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-p port] [-n nvars] [-l latency_ms] "
+            "[-s pad_bytes] [-d ndevices] [-j] [-v]\n", prog);
+    exit(-1);
+}
+
+/*******************************************************************************
+ *     main() start of program.
+ */
+int main(int argc, char *argv[]) {
+    int opt;
+    int listen_fd;
+    int one = 1;
+    struct sockaddr_in addr;
+
+    while ((opt = getopt(argc, argv, "p:n:l:s:d:jv")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            n_vars = atoi(optarg);
+            break;
+        case 'l':
+            latency_ms = atoi(optarg);
+            break;
+        case 's':
+            pad_bytes = atoi(optarg);
+            break;
+        case 'd':
+            n_devices = atoi(optarg);
+            break;
+        case 'j':
+            json_only = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        exit(-1);
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("bind");
+        exit(-1);
+    }
+    if (listen(listen_fd, 64) != 0) {
+        perror("listen");
+        exit(-1);
+    }
+    fprintf(stderr, "mock_server: listening on 127.0.0.1:%d, %d vars, "
+            "%d ms latency, %d pad bytes\n", port, n_vars, latency_ms, pad_bytes);
+
+    for (;;) {
+        pthread_t thread;
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (pthread_create(&thread, NULL, connection_thread,
+                (void*)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(listen_fd);
+    return 0;
+}
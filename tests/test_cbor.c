@@ -0,0 +1,495 @@
+// Copyright 2015 Canopy Services, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include     <stdio.h>
+#include     <stdlib.h>
+#include     <errno.h>
+
+#include    <stdint.h>
+#include    <stdbool.h>
+#include    <string.h>
+
+#include    <jsmn/jsmn.h>
+
+#include    <canopy_min_internal.h>
+#include    <canopy_min.h>
+#include    <canopy_os.h>
+
+#define TOASTER_UUID "e43eb410-48da-421a-b07d-1cd751412fd5"
+#define TOASTER_SECRET_KEY "wYI0G+HQN9fj76fpyxwiHKJDQags0dpM"
+#define REMOTE_ADDR "dev02.canopy.link"
+
+
+static int test_passed = 0;
+static int test_failed = 0;
+
+/* Test runner */
+static void test(int (*func)(void), const char *name) {
+    int r = func();
+    if (r == 0) {
+        test_passed++;
+    } else {
+        test_failed++;
+        printf("FAILED: %s (at line %d)\n", name, r);
+    }
+}
+
+static canopy_context_t ctx;
+static canopy_remote_params_t params;
+static canopy_remote_t remote;
+static char rcv_buffer[4096];
+
+/*
+ * Sets up the remote the test devices hang off of.  It's never contacted.
+ */
+static int setup_remote(void) {
+    canopy_error err = canopy_ctx_init(&ctx, 0);
+    if (err != CANOPY_SUCCESS) {
+        return -1;
+    }
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_DEVICE_CREDENTIALS;
+    params.name = TOASTER_UUID;
+    params.password = TOASTER_SECRET_KEY;
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = REMOTE_ADDR;
+    params.wire_format = CANOPY_WIRE_FORMAT_CBOR;
+    err = canopy_remote_init(&ctx, &params, rcv_buffer, sizeof(rcv_buffer),
+            &remote);
+    return (err == CANOPY_SUCCESS) ? 0 : -1;
+}
+
+/*****************************************************************************
+ *         test_primitives
+ *
+ *  Checks the encoder against known encodings from RFC 7049, appendix A, and
+ *  that the decoder reads them back.
+ */
+static int test_primitives() {
+    uint8_t buf[64];
+    struct c_cbor_state state;
+    struct c_cbor_reader reader;
+    struct c_cbor_item item;
+    static const uint8_t expected[] = {
+        0x17,                               /* 23 */
+        0x18, 0x18,                         /* 24 */
+        0x19, 0x03, 0xe8,                   /* 1000 */
+        0x38, 0x63,                         /* -100 */
+        0xf5,                               /* true */
+        0x64, 0x49, 0x45, 0x54, 0x46,       /* "IETF" */
+        0xfb, 0x3f, 0xf1, 0x99, 0x99, 0x99, 0x99, 0x99, 0x9a, /* 1.1 */
+    };
+
+    c_cbor_buffer_init(&state, buf, sizeof(buf));
+    c_cbor_emit_uint(&state, 23);
+    c_cbor_emit_uint(&state, 24);
+    c_cbor_emit_int(&state, 1000);
+    c_cbor_emit_int(&state, -100);
+    c_cbor_emit_bool(&state, true);
+    c_cbor_emit_string(&state, "IETF", -1);
+    c_cbor_emit_float64(&state, 1.1);
+    if (state.offset != sizeof(expected)) {
+        return __LINE__;
+    }
+    if (memcmp(buf, expected, sizeof(expected)) != 0) {
+        return __LINE__;
+    }
+
+    c_cbor_reader_init(&reader, buf, state.offset);
+    if (c_cbor_read(&reader, &item) != C_CBOR_OK
+            || item.type != C_CBOR_UINT || item.uint != 23) {
+        return __LINE__;
+    }
+    if (c_cbor_read(&reader, &item) != C_CBOR_OK || item.uint != 24) {
+        return __LINE__;
+    }
+    if (c_cbor_read(&reader, &item) != C_CBOR_OK || item.uint != 1000) {
+        return __LINE__;
+    }
+    if (c_cbor_read(&reader, &item) != C_CBOR_OK
+            || item.type != C_CBOR_INT || item.sint != -100) {
+        return __LINE__;
+    }
+    if (c_cbor_read(&reader, &item) != C_CBOR_OK
+            || item.type != C_CBOR_BOOL || !item.boolean) {
+        return __LINE__;
+    }
+    if (c_cbor_read(&reader, &item) != C_CBOR_OK
+            || !c_cbor_item_is(&item, "IETF")) {
+        return __LINE__;
+    }
+    if (c_cbor_read(&reader, &item) != C_CBOR_OK
+            || item.type != C_CBOR_FLOAT || item.real != 1.1) {
+        return __LINE__;
+    }
+
+    /* Running off the end is an error, not a crash */
+    if (c_cbor_read(&reader, &item) == C_CBOR_OK) {
+        return __LINE__;
+    }
+
+    /* Overflowing the output buffer is reported */
+    c_cbor_buffer_init(&state, buf, 4);
+    if (c_cbor_emit_string(&state, "too long", -1) != C_CBOR_BUFFER_OVERFLOW) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_parse_device
+ *
+ *  Builds a device document (with some tags the library doesn't know about,
+ *  in the shapes a server might send) and parses it.
+ */
+static int test_parse_device() {
+    uint8_t buf[1024];
+    struct c_cbor_state state;
+    canopy_device_t device;
+    struct canopy_var *var;
+    bool result_code = false;
+    float f;
+    int32_t i32;
+    bool b;
+    char str[32];
+    cos_time_t t;
+    cos_time_t last;
+    static const uint8_t half_one_point_five[] = { 0xf9, 0x3e, 0x00 };
+
+    if (canopy_device_init(&device, &remote, NULL) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+
+    c_cbor_buffer_init(&state, buf, sizeof(buf));
+    c_cbor_emit_map(&state, -1);
+    c_cbor_emit_string(&state, TAG_RESULT, -1);
+    c_cbor_emit_string(&state, "ok", -1);
+    c_cbor_emit_string(&state, TAG_DEVICE_ID, -1);
+    c_cbor_emit_string(&state, TOASTER_UUID, -1);
+    c_cbor_emit_string(&state, TAG_FRIENDLY_NAME, -1);
+    c_cbor_emit_string(&state, "My Toaster 17", -1);
+
+    /* unknown tag holding nested containers */
+    c_cbor_emit_string(&state, "notifs", -1);
+    c_cbor_emit_map(&state, 1);
+    c_cbor_emit_string(&state, "nested", -1);
+    c_cbor_emit_map(&state, -1);
+    c_cbor_emit_string(&state, "deeper", -1);
+    c_cbor_emit_int(&state, -7);
+    c_cbor_emit_break(&state);
+
+    c_cbor_emit_string(&state, TAG_STATUS, -1);
+    c_cbor_emit_map(&state, 2);
+    c_cbor_emit_string(&state, TAG_WS_CONNECTED, -1);
+    c_cbor_emit_bool(&state, true);
+    c_cbor_emit_string(&state, TAG_LAST_ACTIVITY_TIME, -1);
+    c_cbor_emit_uint(&state, 1426803897000000ULL);
+
+    c_cbor_emit_string(&state, TAG_VAR_DECLS, -1);
+    c_cbor_emit_map(&state, 5);
+    c_cbor_emit_string(&state, "in float32 temperature", -1);
+    c_cbor_emit_map(&state, 0);
+    c_cbor_emit_string(&state, "in int32 count", -1);
+    c_cbor_emit_map(&state, 0);
+    c_cbor_emit_string(&state, "in bool reboot_now", -1);
+    c_cbor_emit_map(&state, 0);
+    c_cbor_emit_string(&state, "in string motd", -1);
+    c_cbor_emit_map(&state, 0);
+    c_cbor_emit_string(&state, "in datetime when", -1);
+    c_cbor_emit_map(&state, 0);
+
+    c_cbor_emit_string(&state, TAG_VARS, -1);
+    c_cbor_emit_map(&state, 5);
+    c_cbor_emit_string(&state, "temperature", -1);
+    c_cbor_emit_map(&state, 2);
+    c_cbor_emit_string(&state, TAG_T, -1);
+    c_cbor_emit_uint(&state, 1426803897000000ULL);
+    c_cbor_emit_string(&state, TAG_V, -1);
+    memcpy(&state.buffer[state.offset], half_one_point_five, 3);
+    state.offset += 3;
+    c_cbor_emit_string(&state, "count", -1);
+    c_cbor_emit_map(&state, 2);
+    c_cbor_emit_string(&state, TAG_V, -1);    /* v before t is fine */
+    c_cbor_emit_int(&state, -42);
+    c_cbor_emit_string(&state, TAG_T, -1);
+    c_cbor_emit_uint(&state, 1426803897000001ULL);
+    c_cbor_emit_string(&state, "reboot_now", -1);
+    c_cbor_emit_map(&state, 2);
+    c_cbor_emit_string(&state, TAG_T, -1);
+    c_cbor_emit_uint(&state, 1426803897000000ULL);
+    c_cbor_emit_string(&state, TAG_V, -1);
+    c_cbor_emit_bool(&state, true);
+    c_cbor_emit_string(&state, "motd", -1);
+    c_cbor_emit_map(&state, 2);
+    c_cbor_emit_string(&state, TAG_T, -1);
+    c_cbor_emit_uint(&state, 1426803897000000ULL);
+    c_cbor_emit_string(&state, TAG_V, -1);
+    c_cbor_emit_string(&state, "hello", -1);
+    c_cbor_emit_string(&state, "when", -1);
+    c_cbor_emit_map(&state, 2);
+    c_cbor_emit_string(&state, TAG_T, -1);
+    c_cbor_emit_uint(&state, 1426803897000000ULL);
+    c_cbor_emit_string(&state, TAG_V, -1);
+    c_cbor_emit_uint(&state, 1234567890123ULL);
+    c_cbor_emit_break(&state);
+
+    if (c_cbor_parse_device(&device, buf, state.offset, &result_code)
+            != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    if (!result_code) {
+        return __LINE__;
+    }
+    if (strcmp(device.device_id, TOASTER_UUID) != 0) {
+        return __LINE__;
+    }
+    if (strcmp(device.friendly_name, "My Toaster 17") != 0) {
+        return __LINE__;
+    }
+    if (!remote.ws_connected || remote.last_activity != 1426803897000000ULL) {
+        return __LINE__;
+    }
+
+    if (canopy_device_var_declare(&device, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_FLOAT32, "temperature", &var) != CANOPY_SUCCESS
+            || canopy_var_get_float32(var, &f, &last) != CANOPY_SUCCESS
+            || f != 1.5f) {
+        return __LINE__;
+    }
+    if (canopy_device_var_declare(&device, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_INT32, "count", &var) != CANOPY_SUCCESS
+            || canopy_var_get_int32(var, (uint32_t*)&i32, &last)
+                    != CANOPY_SUCCESS
+            || i32 != -42 || var->last != 1426803897000001ULL) {
+        return __LINE__;
+    }
+    if (canopy_device_var_declare(&device, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_BOOL, "reboot_now", &var) != CANOPY_SUCCESS
+            || canopy_var_get_bool(var, &b, &last) != CANOPY_SUCCESS || !b) {
+        return __LINE__;
+    }
+    if (canopy_device_var_declare(&device, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_STRING, "motd", &var) != CANOPY_SUCCESS
+            || canopy_var_get_string(var, str, sizeof(str), &last)
+                    != CANOPY_SUCCESS
+            || strcmp(str, "hello") != 0) {
+        return __LINE__;
+    }
+    if (canopy_device_var_declare(&device, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_DATETIME, "when", &var) != CANOPY_SUCCESS
+            || canopy_var_get_datetime(var, &t, &last) != CANOPY_SUCCESS
+            || t != 1234567890123ULL) {
+        return __LINE__;
+    }
+
+    /* An older value than the one held is ignored */
+    {
+        uint8_t stale[64];
+        struct c_cbor_state out;
+        struct c_cbor_reader reader;
+        struct c_cbor_item map;
+
+        c_cbor_buffer_init(&out, stale, sizeof(stale));
+        c_cbor_emit_map(&out, 1);
+        c_cbor_emit_string(&out, "count", -1);
+        c_cbor_emit_map(&out, 2);
+        c_cbor_emit_string(&out, TAG_T, -1);
+        c_cbor_emit_uint(&out, 1426803897000000ULL);
+        c_cbor_emit_string(&out, TAG_V, -1);
+        c_cbor_emit_int(&out, 7);
+        c_cbor_reader_init(&reader, stale, out.offset);
+        if (c_cbor_read(&reader, &map) != C_CBOR_OK
+                || c_cbor_parse_vars(&device, &reader, &map)
+                    != CANOPY_SUCCESS) {
+            return __LINE__;
+        }
+        canopy_device_var_handle(&device, "count", &var);
+        if (canopy_var_int32(var) != -42
+                || var->last != 1426803897000001ULL) {
+            return __LINE__;
+        }
+    }
+
+    /* A truncated document is an error, not a crash */
+    if (c_cbor_parse_device(&device, buf, state.offset / 2, &result_code)
+            == CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_emit_round_trip
+ *
+ *  What c_cbor_emit_vardcl()/c_cbor_emit_vars() produce for one device is
+ *  declared on and read back by another.
+ */
+static int test_emit_round_trip() {
+    uint8_t buf[1024];
+    struct c_cbor_state state;
+    struct c_cbor_reader reader;
+    struct c_cbor_item top, name, value;
+    canopy_device_t out_device;
+    canopy_device_t in_device;
+    struct canopy_var *var;
+    int16_t i16;
+    double d;
+
+    canopy_device_init(&out_device, &remote, NULL);
+    canopy_device_init(&in_device, &remote, NULL);
+
+    canopy_device_var_declare(&out_device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_INT16, "level", &var);
+    canopy_var_set_int16(var, -300);
+    canopy_device_var_declare(&out_device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_FLOAT64, "pressure", &var);
+    canopy_var_set_float64(var, 1013.25);
+    canopy_device_var_declare(&out_device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_UINT8, "unset", &var);
+
+    c_cbor_buffer_init(&state, buf, sizeof(buf));
+    c_cbor_emit_map(&state, 2);
+    if (c_cbor_emit_vardcl(&out_device, &state) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    if (c_cbor_emit_vars(&out_device, &state, true) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+
+    /* dirty flags were cleared, so a second emit has no values */
+    {
+        uint8_t buf2[64];
+        struct c_cbor_state state2;
+        c_cbor_buffer_init(&state2, buf2, sizeof(buf2));
+        c_cbor_emit_vars(&out_device, &state2, false);
+        /* "vars" (5 bytes), indefinite map, break */
+        if (state2.offset != 7) {
+            return __LINE__;
+        }
+
+        /* until the request fails: then they all go again */
+        c_vars_reported(&out_device, false);
+        c_cbor_buffer_init(&state2, buf2, sizeof(buf2));
+        c_cbor_emit_vars(&out_device, &state2, false);
+        if (state2.offset <= 7) {
+            return __LINE__;
+        }
+    }
+
+    c_cbor_reader_init(&reader, buf, state.offset);
+    if (c_cbor_read(&reader, &top) != C_CBOR_OK || top.count != 2) {
+        return __LINE__;
+    }
+    if (c_cbor_read(&reader, &name) != C_CBOR_OK
+            || !c_cbor_item_is(&name, TAG_VAR_DECLS)
+            || c_cbor_read(&reader, &value) != C_CBOR_OK
+            || value.count != 3) {
+        return __LINE__;
+    }
+    if (c_cbor_parse_vardcl(&in_device, &reader, &value) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    if (c_cbor_read(&reader, &name) != C_CBOR_OK
+            || !c_cbor_item_is(&name, TAG_VARS)
+            || c_cbor_read(&reader, &value) != C_CBOR_OK
+            || !value.indefinite) {
+        return __LINE__;
+    }
+
+    /*
+     * Outgoing vars are bare values, so check them by hand.
+     */
+    while (c_cbor_more(&reader, &value, 0)) {
+        struct c_cbor_item v;
+        if (c_cbor_read(&reader, &name) != C_CBOR_OK
+                || c_cbor_read(&reader, &v) != C_CBOR_OK) {
+            return __LINE__;
+        }
+        if (c_cbor_item_is(&name, "level")) {
+            i16 = (int16_t)v.sint;
+            if (v.type != C_CBOR_INT || i16 != -300) {
+                return __LINE__;
+            }
+        } else if (c_cbor_item_is(&name, "pressure")) {
+            d = v.real;
+            if (v.type != C_CBOR_FLOAT || d != 1013.25) {
+                return __LINE__;
+            }
+        } else {
+            /* "unset" was never set, so must not be sent */
+            return __LINE__;
+        }
+    }
+
+    /* the declarations arrived with their direction and type */
+    if (canopy_device_var_declare(&in_device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_FLOAT64, "pressure", &var) != CANOPY_SUCCESS
+            || var->decl->direction != CANOPY_VAR_OUT
+            || var->type != CANOPY_VAR_DATATYPE_FLOAT64) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_growing_buffer
+ *
+ *  A buffer from c_cbor_buffer_alloc() makes room for whatever's emitted.
+ */
+static int test_growing_buffer() {
+    struct c_cbor_state state;
+    struct c_cbor_reader reader;
+    struct c_cbor_item item;
+    char text[300];
+    int i;
+
+    memset(text, 'x', sizeof(text) - 1);
+    text[sizeof(text) - 1] = '\0';
+    if (c_cbor_buffer_alloc(&state, 4) != C_CBOR_OK) {
+        return __LINE__;
+    }
+    for (i = 0; i < 10; i++) {
+        if (c_cbor_emit_string(&state, text, -1) != C_CBOR_OK) {
+            cos_free(state.buffer);
+            return __LINE__;
+        }
+    }
+    if (state.offset != 10 * (3 + 299) || state.buffer_len < state.offset) {
+        cos_free(state.buffer);
+        return __LINE__;
+    }
+    c_cbor_reader_init(&reader, state.buffer, state.offset);
+    for (i = 0; i < 10; i++) {
+        if (c_cbor_read(&reader, &item) != C_CBOR_OK
+                || !c_cbor_item_is(&item, text)) {
+            cos_free(state.buffer);
+            return __LINE__;
+        }
+    }
+    cos_free(state.buffer);
+    return 0;
+}
+
+int main() {
+    if (setup_remote() != 0) {
+        printf("unable to set up remote\n");
+        return -1;
+    }
+    test(test_primitives, "CBOR primitive encoding and decoding");
+    test(test_parse_device, "tests parsing of CBOR device objects");
+    test(test_emit_round_trip, "tests CBOR emit of var_decls and vars");
+    test(test_growing_buffer, "CBOR buffers that grow");
+    printf("%d passed, %d failed\n", test_passed, test_failed);
+    return (test_failed == 0) ? 0 : -1;
+}
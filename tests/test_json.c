@@ -25,6 +25,7 @@
 #include    <canopy_min_internal.h>
 #include    <canopy_min.h>
 #include    <canopy_os.h>
+#include    <canopy_communication.h>
 
 #define TOASTER_UUID "e43eb410-48da-421a-b07d-1cd751412fd5"
 #define TOASTER_SECRET_KEY "wYI0G+HQN9fj76fpyxwiHKJDQags0dpM"
@@ -644,6 +645,687 @@ int test_device_object_input() {
 
 
 
+/*****************************************************************************
+ *         test_device_class
+ *
+ *  Two devices made from one class share the declarations but not the
+ *  values, and a variable declared on its own still works alongside.
+ */
+int test_device_class() {
+    canopy_context_t ctx;
+    canopy_remote_params_t params;
+    canopy_remote_t remote;
+    static char rcv_buffer[1024];
+    char buffer[1024];
+    struct c_json_state state;
+    struct canopy_var_decl decls[2];
+    canopy_device_class_t cls;
+    struct canopy_var vars[2][2];
+    canopy_device_t device[2];
+    struct canopy_var *var;
+    int temperature, reboot, slot;
+    float value;
+    cos_time_t last;
+
+    canopy_ctx_init(&ctx, 0);
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_DEVICE_CREDENTIALS;
+    params.name = TOASTER_UUID;
+    params.password = TOASTER_SECRET_KEY;
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = REMOTE_ADDR;
+    if (canopy_remote_init(&ctx, &params, rcv_buffer, sizeof(rcv_buffer),
+            &remote) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+
+    canopy_device_class_init(&cls, decls, 2);
+    if (canopy_device_class_var_declare(&cls, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_FLOAT32, "temperature", &temperature)
+                != CANOPY_SUCCESS
+            || canopy_device_class_var_declare(&cls, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_BOOL, "reboot_now", &reboot)
+                != CANOPY_SUCCESS
+            || temperature != 0 || reboot != 1) {
+        return __LINE__;
+    }
+    if (canopy_device_class_var_declare(&cls, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_BOOL, "reboot_now", &slot)
+                != CANOPY_ERROR_VAR_IN_USE
+            || canopy_device_class_var_declare(&cls, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_BOOL, "one_too_many", &slot)
+                != CANOPY_ERROR_BUFFER_TOO_SMALL) {
+        return __LINE__;
+    }
+
+    canopy_device_init(&device[0], &remote, NULL);
+    canopy_device_init(&device[1], &remote, NULL);
+    if (canopy_device_instantiate(&device[0], &cls, vars[0], 1)
+            != CANOPY_ERROR_BAD_PARAM
+            || canopy_device_instantiate(&device[0], &cls, vars[0], 2)
+                != CANOPY_SUCCESS
+            || canopy_device_instantiate(&device[1], &cls, vars[1], 2)
+                != CANOPY_SUCCESS
+            || canopy_device_instantiate(&device[1], &cls, vars[1], 2)
+                != CANOPY_ERROR_BAD_PARAM) {
+        return __LINE__;
+    }
+    if (vars[0][1].decl != vars[1][1].decl
+            || strcmp(canopy_var_name(&vars[1][1]), "reboot_now") != 0
+            || canopy_device_var_at(&device[0], 2) != NULL) {
+        return __LINE__;
+    }
+
+    canopy_var_set_float32(canopy_device_var_at(&device[0], temperature),
+            21.5);
+    if (canopy_var_get_float32(canopy_device_var_at(&device[1], temperature),
+            &value, &last) != CANOPY_ERROR_VAR_NOT_SET) {
+        return __LINE__;
+    }
+    if (canopy_device_var_declare(&device[0], CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_INT32, "extra", &var) != CANOPY_SUCCESS
+            || canopy_device_var_declare(&device[0], CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_FLOAT32, "temperature", &var)
+                != CANOPY_SUCCESS
+            || var != canopy_device_var_at(&device[0], temperature)) {
+        return __LINE__;
+    }
+
+    c_json_buffer_init(&state, buffer, sizeof(buffer));
+    c_json_emit_open_object(&state);
+    if (c_json_emit_vardcl(&device[0], &state, false) != CANOPY_SUCCESS
+            || c_json_emit_vars(&device[0], &state, false, true)
+                != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    c_json_emit_close_object(&state);
+    if (strstr(buffer, "\"out float32 temperature\"") == NULL
+            || strstr(buffer, "\"in bool reboot_now\"") == NULL
+            || strstr(buffer, "\"out int32 extra\"") == NULL
+            || strstr(buffer, "\"temperature\" : 2.15") == NULL) {
+        printf("%s\n", buffer);
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_var_handles
+ *
+ *  The accessors work on the declared variable itself, and agree with the
+ *  checked getters and setters.
+ */
+int test_var_handles() {
+    canopy_context_t ctx;
+    canopy_remote_params_t params;
+    canopy_remote_t remote;
+    static char rcv_buffer[1024];
+    canopy_device_t device;
+    struct canopy_var *temp, *count, *found;
+    uint32_t u32;
+    cos_time_t last;
+
+    canopy_ctx_init(&ctx, 0);
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_DEVICE_CREDENTIALS;
+    params.name = TOASTER_UUID;
+    params.password = TOASTER_SECRET_KEY;
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = REMOTE_ADDR;
+    if (canopy_remote_init(&ctx, &params, rcv_buffer, sizeof(rcv_buffer),
+            &remote) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    canopy_device_init(&device, &remote, NULL);
+    canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_FLOAT32, "temperature", &temp);
+    canopy_device_var_declare(&device, CANOPY_VAR_INOUT,
+            CANOPY_VAR_DATATYPE_UINT32, "count", &count);
+
+    if (canopy_device_var_handle(&device, "count", &found) != CANOPY_SUCCESS
+            || found != count
+            || canopy_device_var_handle(&device, "nope", &found)
+                != CANOPY_ERROR_VAR_NOT_FOUND) {
+        return __LINE__;
+    }
+
+    if (canopy_var_is_set(temp)) {
+        return __LINE__;
+    }
+    canopy_var_put_float32(temp, 21.5);
+    if (!canopy_var_is_set(temp) || !temp->dirty
+            || canopy_var_float32(temp) != 21.5) {
+        return __LINE__;
+    }
+
+    /* the checked setter and the accessor see the same value */
+    canopy_var_set_uint32(count, 70000);
+    if (canopy_var_uint32(count) != 70000) {
+        return __LINE__;
+    }
+    canopy_var_put_uint32(count, 70001);
+    if (canopy_var_get_uint32(count, &u32, &last) != CANOPY_SUCCESS
+            || u32 != 70001) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_var_callbacks
+ *
+ *  Change callbacks fire for newer, different values of IN and INOUT
+ *  variables, and not for echoes, stale updates or OUT variables.
+ */
+static int var_calls = 0;
+static int device_calls = 0;
+static struct canopy_var *last_changed = NULL;
+
+static void on_var(struct canopy_var *var, void *userdata) {
+    var_calls++;
+    last_changed = var;
+}
+
+static void on_device_var(struct canopy_var *var, void *userdata) {
+    /* the variable's own callback has run first */
+    if (last_changed == var) {
+        device_calls += *(int*)userdata;
+    }
+}
+
+static int parse_vars_update(canopy_device_t *device, const char *js) {
+    jsmntok_t tokens[64];
+    int active = 0;
+    int next_token;
+
+    memset(tokens, 0, sizeof(tokens));
+    c_json_parse_string((char*)js, strlen(js), tokens, 64, &active);
+    return c_json_parse_vars(device, (char*)js, strlen(js), tokens, 64,
+            0, &next_token, false);
+}
+
+int test_var_callbacks() {
+    canopy_context_t ctx;
+    canopy_remote_params_t params;
+    canopy_remote_t remote;
+    static char rcv_buffer[1024];
+    canopy_device_t device;
+    struct canopy_var *dimmer, *temp;
+    int weight = 1;
+
+    canopy_ctx_init(&ctx, 0);
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_DEVICE_CREDENTIALS;
+    params.name = TOASTER_UUID;
+    params.password = TOASTER_SECRET_KEY;
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = REMOTE_ADDR;
+    if (canopy_remote_init(&ctx, &params, rcv_buffer, sizeof(rcv_buffer),
+            &remote) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    canopy_device_init(&device, &remote, NULL);
+    canopy_device_var_declare(&device, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_INT32, "dimmer", &dimmer);
+    canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_FLOAT32, "temperature", &temp);
+
+    if (canopy_var_on_change(NULL, on_var, NULL) != CANOPY_ERROR_BAD_PARAM
+            || canopy_var_on_change(dimmer, on_var, NULL) != CANOPY_SUCCESS
+            || canopy_var_on_change(temp, on_var, NULL) != CANOPY_SUCCESS
+            || canopy_device_on_var_change(&device, on_device_var, &weight)
+                != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+
+    /* the first value always counts as a change */
+    if (parse_vars_update(&device, "\"vars\" : { "
+            "\"dimmer\" : { \"t\" : 1000, \"v\" : 5 }, "
+            "\"temperature\" : { \"t\" : 1000, \"v\" : 20.5 } }")
+                != CANOPY_SUCCESS
+            || var_calls != 1 || device_calls != 1 || last_changed != dimmer
+            || canopy_var_int32(dimmer) != 5) {
+        return __LINE__;
+    }
+
+    /* an echo of the same value, even with a newer time, is not */
+    if (parse_vars_update(&device, "\"vars\" : { "
+            "\"dimmer\" : { \"t\" : 2000, \"v\" : 5 } }") != CANOPY_SUCCESS
+            || var_calls != 1 || device_calls != 1) {
+        return __LINE__;
+    }
+
+    /* a different value that is no newer isn't even stored */
+    if (parse_vars_update(&device, "\"vars\" : { "
+            "\"dimmer\" : { \"t\" : 2000, \"v\" : 6 } }") != CANOPY_SUCCESS
+            || var_calls != 1 || device_calls != 1
+            || canopy_var_int32(dimmer) != 5) {
+        return __LINE__;
+    }
+    if (parse_vars_update(&device, "\"vars\" : { "
+            "\"dimmer\" : { \"t\" : 1500, \"v\" : 6 } }") != CANOPY_SUCCESS
+            || var_calls != 1 || canopy_var_int32(dimmer) != 5
+            || dimmer->last != 2000) {
+        return __LINE__;
+    }
+
+    if (parse_vars_update(&device, "\"vars\" : { "
+            "\"dimmer\" : { \"t\" : 3000, \"v\" : 7 } }") != CANOPY_SUCCESS
+            || var_calls != 2 || device_calls != 2) {
+        return __LINE__;
+    }
+
+    /* unregistering the variable leaves the device callback */
+    canopy_var_on_change(dimmer, NULL, NULL);
+    last_changed = dimmer;
+    if (parse_vars_update(&device, "\"vars\" : { "
+            "\"dimmer\" : { \"t\" : 4000, \"v\" : 8 } }") != CANOPY_SUCCESS
+            || var_calls != 2 || device_calls != 3) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_var_policy
+ *
+ *  Only changes beyond the deadbands are sent, no sooner than the minimum
+ *  interval, and unchanged values are sent on the heartbeat.
+ */
+static void report_vars(canopy_device_t *device, bool delivered) {
+    char buffer[1024];
+    struct c_json_state state;
+
+    c_json_buffer_init(&state, buffer, sizeof(buffer));
+    c_json_emit_open_object(&state);
+    c_json_emit_vars(device, &state, false, true);
+    c_json_emit_close_object(&state);
+    c_vars_reported(device, delivered);
+}
+
+int test_var_policy() {
+    canopy_context_t ctx;
+    canopy_remote_params_t params;
+    canopy_remote_t remote;
+    static char rcv_buffer[1024];
+    canopy_device_t device;
+    struct canopy_var *temp, *mode, *plain;
+    struct canopy_var_policy deadband = { 0.5, 10, 0, 0 };
+    struct canopy_var_policy interval = { 0, 0, 60000, 0 };
+    struct canopy_var_policy heartbeat = { 0, 0, 0, 30000 };
+    cos_time_t now;
+    cos_time_t wait = 600000;
+
+    canopy_ctx_init(&ctx, 0);
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_DEVICE_CREDENTIALS;
+    params.name = TOASTER_UUID;
+    params.password = TOASTER_SECRET_KEY;
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = REMOTE_ADDR;
+    if (canopy_remote_init(&ctx, &params, rcv_buffer, sizeof(rcv_buffer),
+            &remote) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    canopy_device_init(&device, &remote, NULL);
+    canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_FLOAT32, "temperature", &temp);
+    canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_STRING, "mode", &mode);
+    canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_INT32, "plain", &plain);
+    if (canopy_var_set_policy(NULL, &deadband) != CANOPY_ERROR_BAD_PARAM
+            || canopy_var_set_policy(temp, &deadband) != CANOPY_SUCCESS
+            || canopy_var_set_policy(mode, &heartbeat) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+
+    /* the first value is always sent */
+    canopy_var_set_float32(temp, 20.0);
+    if (!temp->dirty) {
+        return __LINE__;
+    }
+    report_vars(&device, true);
+
+    /* inside the absolute deadband, then inside the relative one */
+    canopy_var_set_float32(temp, 20.25);
+    if (temp->dirty) {
+        return __LINE__;
+    }
+    canopy_var_put_float32(temp, 21.5);
+    if (temp->dirty) {
+        return __LINE__;
+    }
+    canopy_var_set_float32(temp, 23.0);
+    if (!temp->dirty) {
+        return __LINE__;
+    }
+    report_vars(&device, true);
+
+    /* a change waits out the minimum interval, then goes */
+    canopy_var_set_policy(temp, &interval);
+    canopy_var_set_float32(temp, 24.0);
+    if (temp->dirty || !temp->pending) {
+        return __LINE__;
+    }
+    temp->report->reported_at -= 60000;
+    canopy_var_set_float32(temp, 24.0);
+    if (!temp->dirty || canopy_var_float32(temp) != 24.0) {
+        return __LINE__;
+    }
+    report_vars(&device, true);
+
+    /* strings change when they differ, and beat when they don't */
+    canopy_var_set_string(mode, "heat", 4);
+    report_vars(&device, true);
+    canopy_var_set_string(mode, "heat", 4);
+    if (mode->dirty) {
+        return __LINE__;
+    }
+    mode->report->reported_at -= 30000;
+    canopy_var_set_string(mode, "heat", 4);
+    if (!mode->dirty) {
+        return __LINE__;
+    }
+    report_vars(&device, true);
+    canopy_var_set_string(mode, "cool", 4);
+    if (!mode->dirty) {
+        return __LINE__;
+    }
+
+    /* going back to the one reported before a change goes is no change */
+    report_vars(&device, true);
+    canopy_var_set_policy(mode, &interval);
+    canopy_var_set_string(mode, "heat", 4);
+    if (mode->dirty || !mode->pending) {
+        return __LINE__;
+    }
+    canopy_var_set_string(mode, "cool", 4);
+    if (mode->dirty || mode->pending) {
+        return __LINE__;
+    }
+
+    /* a held back change and a heartbeat fall due without another set */
+    canopy_var_set_string(mode, "heat", 4);
+    cos_get_time(&now);
+    if (c_vars_due(&device, now, &wait) || mode->dirty
+            || wait == 0 || wait > 60000) {
+        return __LINE__;
+    }
+    if (!c_vars_due(&device, now + 60000, NULL) || !mode->dirty) {
+        return __LINE__;
+    }
+    report_vars(&device, true);
+    canopy_var_set_policy(mode, &heartbeat);
+    if (c_vars_due(&device, now, NULL)
+            || !c_vars_due(&device, now + 90000, NULL) || !mode->dirty) {
+        return __LINE__;
+    }
+    report_vars(&device, true);
+
+    /* a report the remote didn't take goes again */
+    canopy_var_set_policy(temp, &deadband);
+    canopy_var_set_float32(temp, 30.0);
+    report_vars(&device, false);
+    if (!temp->dirty || !temp->pending || temp->report->reported != 24.0) {
+        return __LINE__;
+    }
+    report_vars(&device, true);
+    if (temp->dirty || temp->pending || temp->report->reported != 30.0) {
+        return __LINE__;
+    }
+
+    /* without a policy, every set is sent */
+    canopy_var_set_int32(plain, 1);
+    report_vars(&device, true);
+    canopy_var_set_int32(plain, 1);
+    if (!plain->dirty) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_vardcl_reuse
+ *
+ *  The rendered "var_decls" is reused until a variable is declared, and
+ *  comes out the same either way.
+ */
+static int emit_decls(canopy_device_t *device, char *buffer, int len) {
+    struct c_json_state state;
+
+    c_json_buffer_init(&state, buffer, len);
+    c_json_emit_open_object(&state);
+    if (c_json_emit_vardcl(device, &state, false) != CANOPY_SUCCESS) {
+        return -1;
+    }
+    c_json_emit_close_object(&state);
+    return state.offset;
+}
+
+int test_vardcl_reuse() {
+    canopy_context_t ctx;
+    canopy_remote_params_t params;
+    canopy_remote_t remote;
+    static char rcv_buffer[1024];
+    canopy_device_t device;
+    struct canopy_var *var;
+    char first[1024];
+    char second[1024];
+    int len;
+
+    canopy_ctx_init(&ctx, 0);
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_DEVICE_CREDENTIALS;
+    params.name = TOASTER_UUID;
+    params.password = TOASTER_SECRET_KEY;
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = REMOTE_ADDR;
+    if (canopy_remote_init(&ctx, &params, rcv_buffer, sizeof(rcv_buffer),
+            &remote) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    canopy_device_init(&device, &remote, NULL);
+    canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_FLOAT32, "temperature", &var);
+    canopy_device_var_declare(&device, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_BOOL, "reboot_now", &var);
+
+    len = emit_decls(&device, first, sizeof(first));
+    if (len <= 0 || device.json_var_decls == NULL) {
+        return __LINE__;
+    }
+    if (emit_decls(&device, second, sizeof(second)) != len
+            || strcmp(first, second) != 0) {
+        return __LINE__;
+    }
+
+    /* too small for the copy */
+    if (emit_decls(&device, second, 40) != -1) {
+        return __LINE__;
+    }
+
+    canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_INT32, "count", &var);
+    if (device.json_var_decls != NULL
+            || emit_decls(&device, second, sizeof(second)) <= len
+            || strstr(second, "\"out int32 count\"") == NULL
+            || device.json_var_decls == NULL) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*
+ * Emits a sync of <device>, var_decls and vars, into <state>.
+ */
+static int emit_sync(canopy_device_t *device, struct c_json_state *state) {
+    if (c_json_emit_open_object(state) != C_JSON_OK
+            || c_json_emit_vardcl(device, state, false) != CANOPY_SUCCESS
+            || c_json_emit_vars(device, state, false, false) != CANOPY_SUCCESS
+            || c_json_emit_close_object(state) != C_JSON_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+int test_json_chain() {
+    canopy_context_t ctx;
+    canopy_remote_params_t params;
+    canopy_remote_t remote;
+    static char rcv_buffer[1024];
+    canopy_device_t device;
+    struct canopy_var *var;
+    struct c_json_state state;
+    struct c_json_chain chain;
+    struct canopy_http_segment *segment;
+    static char flat[32 * 1024];
+    static char gathered[32 * 1024];
+    size_t len = 0;
+    int segments = 0;
+    char name[32];
+    int i;
+
+    canopy_ctx_init(&ctx, 0);
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_DEVICE_CREDENTIALS;
+    params.name = TOASTER_UUID;
+    params.password = TOASTER_SECRET_KEY;
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = REMOTE_ADDR;
+    if (canopy_remote_init(&ctx, &params, rcv_buffer, sizeof(rcv_buffer),
+            &remote) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    canopy_device_init(&device, &remote, NULL);
+    for (i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "sensor%03d", i);
+        canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+                CANOPY_VAR_DATATYPE_STRING, name, &var);
+        canopy_var_set_string(var, "warming up", 10);
+    }
+
+    c_json_buffer_init(&state, flat, sizeof(flat));
+    if (emit_sync(&device, &state) != 0 || state.offset < 4096) {
+        return __LINE__;
+    }
+
+    /* a chain has no size limit, and ends up the same as the flat payload */
+    if (c_json_chain_init(&state, &chain) != C_JSON_OK
+            || emit_sync(&device, &state) != 0
+            || c_json_chain_close(&state) != C_JSON_OK) {
+        c_json_chain_free(&chain);
+        return __LINE__;
+    }
+    for (segment = chain.head; segment != NULL; segment = segment->next) {
+        if (len + segment->len > sizeof(gathered)) {
+            c_json_chain_free(&chain);
+            return __LINE__;
+        }
+        memcpy(&gathered[len], segment->data, segment->len);
+        len += segment->len;
+        segments++;
+    }
+    if (len != chain.len || len != strlen(flat)
+            || memcmp(gathered, flat, len) != 0 || segments < 3) {
+        c_json_chain_free(&chain);
+        return __LINE__;
+    }
+    c_json_chain_free(&chain);
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_vars_template
+ *
+ *  "vars" built from the rendered names and formatted values reads the same
+ *  as one built a token at a time, whichever variables are dirty.
+ */
+static int expect_vars(canopy_device_t *device, char *buffer, int len) {
+    struct c_json_state state;
+    struct canopy_var *var;
+    char value[16];
+
+    c_json_buffer_init(&state, buffer, len);
+    c_json_emit_open_object(&state);
+    c_json_emit_name_and_object(&state, TAG_VARS);
+    for (var = device->vars; var != NULL; var = var->next) {
+        if (var->dirty) {
+            snprintf(value, sizeof(value), "%d", var->val.value.val_int32);
+            c_json_emit_name_and_value(&state, (char*)canopy_var_name(var),
+                    value);
+        }
+    }
+    c_json_emit_close_object(&state);
+    c_json_emit_close_object(&state);
+    return state.offset;
+}
+
+int test_vars_template() {
+    canopy_context_t ctx;
+    canopy_remote_params_t params;
+    canopy_remote_t remote;
+    static char rcv_buffer[1024];
+    canopy_device_t device;
+    struct canopy_var *var;
+    struct c_json_state state;
+    char expected[1024];
+    char buffer[1024];
+    char name[8];
+    int i;
+
+    canopy_ctx_init(&ctx, 0);
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_DEVICE_CREDENTIALS;
+    params.name = TOASTER_UUID;
+    params.password = TOASTER_SECRET_KEY;
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = REMOTE_ADDR;
+    if (canopy_remote_init(&ctx, &params, rcv_buffer, sizeof(rcv_buffer),
+            &remote) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    canopy_device_init(&device, &remote, NULL);
+    for (i = 0; i < 3; i++) {
+        snprintf(name, sizeof(name), "v%d", i);
+        canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+                CANOPY_VAR_DATATYPE_INT32, name, &var);
+        canopy_var_set_int32(var, i - 1);
+    }
+
+    expect_vars(&device, expected, sizeof(expected));
+    c_json_buffer_init(&state, buffer, sizeof(buffer));
+    if (c_json_emit_vars(&device, &state, true, false) != CANOPY_SUCCESS
+            || device.json_vars == NULL || strcmp(buffer, expected) != 0) {
+        return __LINE__;
+    }
+
+    /* the first one sent goes without a separator, wherever it is */
+    device.vars->dirty = false;
+    expect_vars(&device, expected, sizeof(expected));
+    c_json_buffer_init(&state, buffer, sizeof(buffer));
+    if (c_json_emit_vars(&device, &state, true, false) != CANOPY_SUCCESS
+            || strcmp(buffer, expected) != 0) {
+        return __LINE__;
+    }
+
+    /* declaring a variable drops the template, and the next sync has it */
+    canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_INT32, "v3", &var);
+    canopy_var_set_int32(var, 42);
+    if (device.json_vars != NULL) {
+        return __LINE__;
+    }
+    expect_vars(&device, expected, sizeof(expected));
+    c_json_buffer_init(&state, buffer, sizeof(buffer));
+    if (c_json_emit_vars(&device, &state, true, false) != CANOPY_SUCCESS
+            || strcmp(buffer, expected) != 0
+            || strstr(buffer, "\"v3\" : 42") == NULL) {
+        return __LINE__;
+    }
+    return 0;
+}
+
 /*******************************************************************************
  *     main() start of program.
  */
@@ -655,6 +1337,13 @@ int main() {
     test(test_vardecl_3_input, "tests parsing of three var_dcls");
     test(test_var_input, "tests parsing of vars");
     test(test_device_object_input, "tests parsing of device objects");
+    test(test_device_class, "device class templates");
+    test(test_var_handles, "variable handles");
+    test(test_var_callbacks, "variable change callbacks");
+    test(test_var_policy, "variable reporting policies");
+    test(test_vardcl_reuse, "cached var_decls");
+    test(test_json_chain, "emitting into a chain of segments");
+    test(test_vars_template, "vars from rendered names and value slots");
 }
 
 
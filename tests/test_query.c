@@ -0,0 +1,728 @@
+// Copyright 2015 Canopy Services, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include     <stdio.h>
+#include     <stdlib.h>
+#include     <errno.h>
+
+#include    <stdint.h>
+#include    <stdbool.h>
+#include    <string.h>
+
+#include    <jsmn/jsmn.h>
+
+#include    <canopy_min_internal.h>
+#include    <canopy_min.h>
+#include    <canopy_communication.h>
+#include    <canopy_os.h>
+
+#define TOASTER_UUID "e43eb410-48da-421a-b07d-1cd751412fd5"
+#define TOASTER_SECRET_KEY "wYI0G+HQN9fj76fpyxwiHKJDQags0dpM"
+#define REMOTE_ADDR "dev02.canopy.link"
+
+
+static int test_passed = 0;
+static int test_failed = 0;
+
+/* Test runner */
+static void test(int (*func)(void), const char *name) {
+    int r = func();
+    if (r == 0) {
+        test_passed++;
+    } else {
+        test_failed++;
+        printf("FAILED: %s (at line %d)\n", name, r);
+    }
+}
+
+static canopy_context_t ctx;
+static canopy_remote_params_t params;
+static canopy_remote_t remote;
+static char rcv_buffer[4096];
+
+/*
+ * Sets up the remote the test devices hang off of.  It's never contacted.
+ */
+static int setup_remote(void) {
+    canopy_error err = canopy_ctx_init(&ctx, 0);
+    if (err != CANOPY_SUCCESS) {
+        return -1;
+    }
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_USER_CREDENTIALS;
+    params.name = "greg";
+    params.password = "password";
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = REMOTE_ADDR;
+    params.query_cache_ttl = 60;
+    err = canopy_remote_init(&ctx, &params, rcv_buffer, sizeof(rcv_buffer),
+            &remote);
+    return (err == CANOPY_SUCCESS) ? 0 : -1;
+}
+
+/*****************************************************************************
+ *         test_query_string
+ *
+ *  The pre-encoded example from canopy_min.h, sorted and limited.
+ */
+static int test_query_string() {
+    char buf[512];
+    canopy_filter_root_t root;
+    canopy_filter_t filters[7];
+    canopy_sort_term_t terms[2];
+    canopy_sort_t sort;
+    canopy_limits_t limits;
+    canopy_query_t query;
+
+    /* No query at all still asks for a page */
+    if (c_query_string(NULL, 0, 50, buf, sizeof(buf)) != CANOPY_SUCCESS
+            || strcmp(buf, "?limit=0,50") != 0) {
+        return __LINE__;
+    }
+
+    memset(&root, 0, sizeof(root));
+    append_open_paren_filter(&root, &filters[0]);
+    append_term_filter(&root, &filters[1], "temperature", "40", CANOPY_GT);
+    append_boolean_filter(&root, &filters[2], AND);
+    append_term_filter(&root, &filters[3], "temperature", "80.5", CANOPY_LT);
+    append_close_paren_filter(&root, &filters[4]);
+    append_boolean_filter(&root, &filters[5], OR);
+    append_term_filter(&root, &filters[6], "system.ws_connected", "false",
+            CANOPY_EQ);
+
+    terms[0].varname = "temperature";
+    terms[0].direction = ASCENDING;
+    terms[1].varname = "humidity";
+    terms[1].direction = DESCENDING;
+    sort.cnt = 2;
+    sort.terms = terms;
+
+    limits.start = 5;
+    limits.count = 30;
+
+    memset(&query, 0, sizeof(query));
+    query.filter_root = &root;
+    query.sort = &sort;
+    query.limits = &limits;
+
+    if (c_query_string(&query, limits.start, limits.count, buf, sizeof(buf))
+            != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    if (strcmp(buf, "?filter=%28temperature%20%3E%2040%20%26%26%20"
+            "temperature%20%3C%2080.5%29%20%7C%7C%20"
+            "system.ws_connected%20%3D%3D%20false"
+            "&sort=temperature,!humidity&limit=5,30") != 0) {
+        printf("%s\n", buf);
+        return __LINE__;
+    }
+
+    /* Paging only changes the limit */
+    if (c_query_string(&query, 35, 30, buf, sizeof(buf)) != CANOPY_SUCCESS
+            || strstr(buf, "false&sort=temperature,!humidity&limit=35,30")
+            == NULL) {
+        return __LINE__;
+    }
+
+    /* Too small a buffer is reported, not overrun */
+    if (c_query_string(&query, 0, 30, buf, 40)
+            != CANOPY_ERROR_BUFFER_TOO_SMALL || strlen(buf) >= 40) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_query_compile
+ *
+ *  Badly formed filters are rejected, and the compiled string is reused
+ *  until the query is compiled again.
+ */
+static int test_query_compile() {
+    char buf[512];
+    canopy_filter_root_t root;
+    canopy_filter_t filters[6];
+    canopy_query_t query;
+
+    memset(&query, 0, sizeof(query));
+    query.filter_root = &root;
+
+    /* a && */
+    memset(&root, 0, sizeof(root));
+    append_term_filter(&root, &filters[0], "a", "1", CANOPY_EQ);
+    append_boolean_filter(&root, &filters[1], AND);
+    if (canopy_query_compile(&query) != CANOPY_ERROR_BAD_PARAM) {
+        return __LINE__;
+    }
+
+    /* (a == 1)) */
+    memset(&root, 0, sizeof(root));
+    append_open_paren_filter(&root, &filters[0]);
+    append_term_filter(&root, &filters[1], "a", "1", CANOPY_EQ);
+    append_close_paren_filter(&root, &filters[2]);
+    append_close_paren_filter(&root, &filters[3]);
+    if (canopy_query_compile(&query) != CANOPY_ERROR_BAD_PARAM) {
+        return __LINE__;
+    }
+
+    /* a == 1 HAS b */
+    memset(&root, 0, sizeof(root));
+    append_term_filter(&root, &filters[0], "a", "1", CANOPY_EQ);
+    append_unary_filter(&root, &filters[1], HAS, "b");
+    if (canopy_query_compile(&query) != CANOPY_ERROR_BAD_PARAM) {
+        return __LINE__;
+    }
+
+    /* ! (HAS b || a != 1) */
+    memset(&root, 0, sizeof(root));
+    append_unary_filter(&root, &filters[0], NOT, NULL);
+    append_open_paren_filter(&root, &filters[1]);
+    append_unary_filter(&root, &filters[2], HAS, "b");
+    append_boolean_filter(&root, &filters[3], OR);
+    append_term_filter(&root, &filters[4], "a", "1", CANOPY_NEQ);
+    append_close_paren_filter(&root, &filters[5]);
+    if (canopy_query_compile(&query) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    if (strcmp(query.query_string, "?filter=%21%28HAS%20b%20%7C%7C%20"
+            "a%20%21%3D%201%29&limit=0,0") != 0) {
+        printf("%s\n", query.query_string);
+        return __LINE__;
+    }
+
+    /* The filter is not looked at again until the next compile */
+    filters[4].onion.term.value = "2";
+    if (c_query_string(&query, 0, 0, buf, sizeof(buf)) != CANOPY_SUCCESS
+            || strstr(buf, "%201%29") == NULL) {
+        return __LINE__;
+    }
+    canopy_query_compile(&query);
+    if (c_query_string(&query, 0, 0, buf, sizeof(buf)) != CANOPY_SUCCESS
+            || strstr(buf, "%202%29") == NULL) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_filter_match
+ *
+ *  The header example run locally over a few devices, plus precedence, NOT,
+ *  HAS and strings.
+ */
+static canopy_device_t filter_devices[4];
+
+static int add_device(int i, float temperature, bool ws_connected,
+        const char *mode) {
+    canopy_device_t *device = &filter_devices[i];
+    struct canopy_var *var;
+
+    if (canopy_device_init(device, &remote, NULL) != CANOPY_SUCCESS) {
+        return -1;
+    }
+    device->ws_connected = ws_connected;
+    if (canopy_device_var_declare(device, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_FLOAT32, "temperature", &var) != CANOPY_SUCCESS
+            || canopy_var_set_float32(var, temperature) != CANOPY_SUCCESS) {
+        return -1;
+    }
+    if (mode != NULL && (canopy_device_var_declare(device, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_STRING, "mode", &var) != CANOPY_SUCCESS
+            || canopy_var_set_string(var, mode, strlen(mode))
+                != CANOPY_SUCCESS)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int test_filter_match() {
+    canopy_filter_root_t root;
+    canopy_filter_t filters[7];
+    canopy_filter_program_t program;
+    canopy_device_t *devices[4];
+    canopy_device_t *matches[4];
+    size_t count;
+    bool match;
+    int i;
+
+    if (add_device(0, 50.0f, true, "auto") != 0
+            || add_device(1, 90.0f, true, NULL) != 0
+            || add_device(2, 90.0f, false, "manual") != 0
+            || add_device(3, 21.1f, true, "autumn") != 0) {
+        return __LINE__;
+    }
+    for (i = 0; i < 4; i++) {
+        devices[i] = &filter_devices[i];
+    }
+
+    /* (temperature > 40 && temperature < 80.5) || system.ws_connected == false */
+    memset(&root, 0, sizeof(root));
+    append_open_paren_filter(&root, &filters[0]);
+    append_term_filter(&root, &filters[1], "temperature", "40", CANOPY_GT);
+    append_boolean_filter(&root, &filters[2], AND);
+    append_term_filter(&root, &filters[3], "temperature", "80.5", CANOPY_LT);
+    append_close_paren_filter(&root, &filters[4]);
+    append_boolean_filter(&root, &filters[5], OR);
+    append_term_filter(&root, &filters[6], "system.ws_connected", "false",
+            CANOPY_EQ);
+    if (canopy_filter_compile(&root, &program) != CANOPY_SUCCESS
+            || program.nops != 5 || program.nslots != 1) {
+        return __LINE__;
+    }
+    if (canopy_filter_select(&program, devices, 4, matches, &count)
+            != CANOPY_SUCCESS || count != 2
+            || matches[0] != devices[0] || matches[1] != devices[2]) {
+        return __LINE__;
+    }
+
+    /* temperature == 21.1 matches a float32 21.1 */
+    memset(&root, 0, sizeof(root));
+    append_term_filter(&root, &filters[0], "temperature", "21.1", CANOPY_EQ);
+    canopy_filter_compile(&root, &program);
+    if (canopy_filter_match(&program, devices[3], &match) != CANOPY_SUCCESS
+            || !match) {
+        return __LINE__;
+    }
+
+    /* AND binds tighter: mode == auto || temperature > 80 && HAS mode */
+    memset(&root, 0, sizeof(root));
+    append_term_filter(&root, &filters[0], "mode", "auto", CANOPY_EQ);
+    append_boolean_filter(&root, &filters[1], OR);
+    append_term_filter(&root, &filters[2], "temperature", "80", CANOPY_GT);
+    append_boolean_filter(&root, &filters[3], AND);
+    append_unary_filter(&root, &filters[4], HAS, "mode");
+    canopy_filter_compile(&root, &program);
+    canopy_filter_select(&program, devices, 4, matches, &count);
+    if (count != 2 || matches[0] != devices[0] || matches[1] != devices[2]) {
+        return __LINE__;
+    }
+
+    /* ! HAS mode || mode >= "b" (strings compare like strcmp) */
+    memset(&root, 0, sizeof(root));
+    append_unary_filter(&root, &filters[0], NOT, NULL);
+    append_unary_filter(&root, &filters[1], HAS, "mode");
+    append_boolean_filter(&root, &filters[2], OR);
+    append_term_filter(&root, &filters[3], "mode", "\"b\"", CANOPY_GTE);
+    canopy_filter_compile(&root, &program);
+    canopy_filter_select(&program, devices, 4, devices, &count);
+    if (count != 2 || devices[0] != &filter_devices[1]
+            || devices[1] != &filter_devices[2]) {
+        return __LINE__;
+    }
+
+    /* A number doesn't compare with a string, and an empty filter is true */
+    memset(&root, 0, sizeof(root));
+    append_term_filter(&root, &filters[0], "temperature", "hot", CANOPY_NEQ);
+    canopy_filter_compile(&root, &program);
+    canopy_filter_match(&program, &filter_devices[0], &match);
+    if (match) {
+        return __LINE__;
+    }
+    memset(&root, 0, sizeof(root));
+    canopy_filter_compile(&root, &program);
+    canopy_filter_match(&program, &filter_devices[0], &match);
+    if (!match) {
+        return __LINE__;
+    }
+
+    /* Badly formed filters don't compile */
+    append_term_filter(&root, &filters[0], "temperature", "1", CANOPY_EQ);
+    append_unary_filter(&root, &filters[1], NOT, NULL);
+    if (canopy_filter_compile(&root, &program) != CANOPY_ERROR_BAD_PARAM) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_parse_devices
+ *
+ *  A page of devices is parsed into the caller's devices, and anything past
+ *  <max_count> is skipped.
+ */
+static int test_parse_devices() {
+    char js[] = "{\"result\" : \"ok\", \"devices\" : ["
+            "{\"device_id\" : \"00000000-0000-4000-8000-000000000000\", "
+            "\"friendly_name\" : \"first\", \"notifs\" : [{\"a\" : [1, 2]}], "
+            "\"var_decls\" : {\"in float32 temperature\" : {}}, "
+            "\"vars\" : {\"temperature\" : {\"t\" : 1426803897000000, "
+            "\"v\" : 21.5}}}, "
+            "{\"device_id\" : \"00000000-0000-4000-8000-000000000001\", "
+            "\"friendly_name\" : \"second\"}, "
+            "{\"device_id\" : \"00000000-0000-4000-8000-000000000002\", "
+            "\"friendly_name\" : \"third\"}"
+            "], \"next\" : {\"start\" : 3}}";
+    canopy_device_t storage[2];
+    canopy_device_t *devices[2] = { &storage[0], &storage[1] };
+    struct canopy_var *var;
+    size_t count;
+    float f;
+    cos_time_t last;
+
+    if (c_json_parse_devices(&remote, js, strlen(js), 2, devices, &count)
+            != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    if (count != 2) {
+        return __LINE__;
+    }
+    if (strcmp(storage[0].device_id, "00000000-0000-4000-8000-000000000000")
+            != 0 || strcmp(storage[0].friendly_name, "first") != 0) {
+        return __LINE__;
+    }
+    if (strcmp(storage[1].friendly_name, "second") != 0
+            || storage[1].remote != &remote) {
+        return __LINE__;
+    }
+    if (canopy_device_var_declare(&storage[0], CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_FLOAT32, "temperature", &var) != CANOPY_SUCCESS
+            || canopy_var_get_float32(var, &f, &last) != CANOPY_SUCCESS
+            || f != 21.5f) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_parse_devices_cbor
+ */
+static int test_parse_devices_cbor() {
+    uint8_t buf[512];
+    struct c_cbor_state state;
+    canopy_device_t storage[4];
+    canopy_device_t *devices[4];
+    size_t count;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        devices[i] = &storage[i];
+    }
+
+    c_cbor_buffer_init(&state, buf, sizeof(buf));
+    c_cbor_emit_map(&state, 2);
+    c_cbor_emit_string(&state, TAG_RESULT, -1);
+    c_cbor_emit_string(&state, "ok", -1);
+    c_cbor_emit_string(&state, TAG_DEVICES, -1);
+    c_cbor_emit_map(&state, 0);     /* not an array, ignored */
+    if (c_cbor_parse_devices(&remote, buf, state.offset, 4, devices, &count)
+            != CANOPY_SUCCESS || count != 0) {
+        return __LINE__;
+    }
+
+    c_cbor_buffer_init(&state, buf, sizeof(buf));
+    c_cbor_emit_map(&state, 2);
+    c_cbor_emit_string(&state, TAG_RESULT, -1);
+    c_cbor_emit_string(&state, "ok", -1);
+    c_cbor_emit_string(&state, TAG_DEVICES, -1);
+    buf[state.offset++] = 0x83;     /* array of 3 */
+    for (i = 0; i < 3; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "device %d", i);
+        c_cbor_emit_map(&state, 1);
+        c_cbor_emit_string(&state, TAG_FRIENDLY_NAME, -1);
+        c_cbor_emit_string(&state, name, -1);
+    }
+    if (c_cbor_parse_devices(&remote, buf, state.offset, 4, devices, &count)
+            != CANOPY_SUCCESS || count != 3) {
+        return __LINE__;
+    }
+    if (strcmp(storage[2].friendly_name, "device 2") != 0) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*
+ * Whether the cache has <key>, holding <page>.  The copy it hands out goes
+ * back to the pool.
+ */
+static bool cached(const char *key, const char *page) {
+    struct canopy_http_response response;
+    bool same;
+
+    if (!c_query_cache_get(&remote, key, &response)) {
+        return false;
+    }
+    same = response.body_len == strlen(page)
+            && memcmp(response.body, page, response.body_len) == 0
+            && response.body[response.body_len] == '\0';
+    canopy_http_response_release(&remote, &response);
+    return same;
+}
+
+/*
+ * What a sync of <device> that the remote took does to the cache: its dirty
+ * variables go in the request, and the cache hears about it once it's done.
+ */
+static void synced(canopy_device_t *device) {
+    char buffer[1024];
+    struct c_json_state state;
+
+    c_json_buffer_init(&state, buffer, sizeof(buffer));
+    c_json_emit_vars(device, &state, true, true);
+    c_query_cache_invalidate(device);
+    c_vars_reported(device, true);
+}
+
+/*****************************************************************************
+ *         test_query_cache
+ *
+ *  A cached page is served without going to the server, and is dropped once
+ *  changes to a device it holds, or to a variable its query names, are
+ *  synced, or when the cache is full.
+ */
+static int test_query_cache() {
+    char page[] = "{\"result\" : \"ok\", \"devices\" : ["
+            "{\"device_id\" : \"00000000-0000-4000-8000-000000000000\"}, "
+            "{\"device_id\" : \"00000000-0000-4000-8000-000000000001\"}]}";
+    const char *key = "/api/user/greg/devices?limit=0,4";
+    const char *filtered = "/api/user/greg/devices?filter=mode%20%3D%3D%20a"
+            "&limit=0,4";
+    canopy_user_t user;
+    canopy_device_t storage[4];
+    canopy_device_t *devices[4];
+    canopy_device_t other;
+    struct canopy_var *var;
+    size_t count;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        devices[i] = &storage[i];
+    }
+    canopy_user_init(&user, &remote);
+    strcpy(user.name, "greg");
+
+    if (c_query_cache_put(&remote, key, CANOPY_WIRE_FORMAT_JSON, page,
+            strlen(page)) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    /* remote is never contacted, so this has to come from the cache */
+    if (canopy_user_devices(&remote, &user, NULL, 4, devices, &count, NULL)
+            != CANOPY_SUCCESS || count != 2
+            || strcmp(storage[1].device_id,
+                "00000000-0000-4000-8000-000000000001") != 0) {
+        return __LINE__;
+    }
+
+    /* Renaming a device in the page drops it, once the rename is synced */
+    canopy_device_set_friendly_name(&storage[1], "renamed");
+    if (!cached(key, page)) {
+        return __LINE__;
+    }
+    synced(&storage[1]);
+    if (cached(key, page)) {
+        return __LINE__;
+    }
+
+    /* A device that isn't in it only matters for variables the query uses */
+    c_query_cache_put(&remote, key, CANOPY_WIRE_FORMAT_JSON, page,
+            strlen(page));
+    c_query_cache_put(&remote, filtered, CANOPY_WIRE_FORMAT_JSON, page,
+            strlen(page));
+    canopy_device_init(&other, &remote, NULL);
+    canopy_device_var_declare(&other, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_STRING, "mode", &var);
+    canopy_var_set_string(var, "b", 1);
+    if (!cached(filtered, page)) {
+        return __LINE__;
+    }
+    synced(&other);
+    if (!cached(key, page) || cached(filtered, page) || var->in_flight) {
+        return __LINE__;
+    }
+
+    /* Only so much is kept, least recently used goes first */
+    canopy_remote_clear_query_cache(&remote);
+    params.query_cache_size = 2 * (strlen(page) + 200);
+    c_query_cache_put(&remote, key, CANOPY_WIRE_FORMAT_JSON, page,
+            strlen(page));
+    c_query_cache_put(&remote, filtered, CANOPY_WIRE_FORMAT_JSON, page,
+            strlen(page));
+    cached(key, page);
+    c_query_cache_put(&remote, "/api/user/greg/devices?limit=4,4",
+            CANOPY_WIRE_FORMAT_JSON, page, strlen(page));
+    if (!cached(key, page) || cached(filtered, page)
+            || remote.query_cache_bytes > params.query_cache_size) {
+        return __LINE__;
+    }
+    params.query_cache_size = 0;
+    canopy_remote_clear_query_cache(&remote);
+    if (remote.query_cache != NULL || remote.query_cache_bytes != 0) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_query_cache_threads
+ *
+ *  Pages read from the cache stay whole while other threads replace them and
+ *  local writes drop them.
+ */
+struct cache_call {
+    canopy_device_t *device;
+    int             bad;
+};
+
+static void cache_thread(void *arg) {
+    struct cache_call *call = (struct cache_call*)arg;
+    char pages[2][64];
+    struct canopy_http_response response;
+    int i;
+
+    strcpy(pages[0], "{\"result\" : \"ok\", \"devices\" : []}");
+    strcpy(pages[1], "{\"result\" : \"ok\", \"devices\" : [], \"x\" : 1}");
+    for (i = 0; i < 2000; i++) {
+        c_query_cache_put(&remote, "/api/devices?filter=mode",
+                CANOPY_WIRE_FORMAT_JSON, pages[i % 2], strlen(pages[i % 2]));
+        if (c_query_cache_get(&remote, "/api/devices?filter=mode",
+                &response)) {
+            if (strcmp(response.body, pages[0]) != 0
+                    && strcmp(response.body, pages[1]) != 0) {
+                call->bad++;
+            }
+            canopy_http_response_release(&remote, &response);
+        }
+        if (call->device != NULL) {
+            c_query_cache_invalidate(call->device);
+        }
+    }
+}
+
+static int test_query_cache_threads() {
+    struct cache_call calls[4];
+    cos_thread_t *threads[4];
+    canopy_device_t device;
+    int i;
+
+    canopy_device_init(&device, &remote, NULL);
+    memset(calls, 0, sizeof(calls));
+    for (i = 0; i < 4; i++) {
+        calls[i].device = (i == 3) ? &device : NULL;
+        threads[i] = cos_thread_start(cache_thread, &calls[i]);
+        if (threads[i] == NULL) {
+            return __LINE__;
+        }
+    }
+    for (i = 0; i < 4; i++) {
+        cos_thread_join(threads[i]);
+        if (calls[i].bad != 0) {
+            return __LINE__;
+        }
+    }
+    canopy_remote_clear_query_cache(&remote);
+    if (remote.query_cache_bytes != 0) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_buffer_pool
+ *
+ *  Reply buffers are sized up to a class, reused once they're handed back,
+ *  and never bigger than max_response_size allows.
+ */
+static int test_buffer_pool() {
+    struct canopy_http_response response;
+    size_t max_size = params.max_response_size;
+    size_t size;
+    char *first;
+    char *second;
+    char *big;
+
+    first = canopy_remote_buffer_get(&remote, 100, &size);
+    if (first == NULL || size < 100) {
+        return __LINE__;
+    }
+    memset(first, 'x', size);
+    second = canopy_remote_buffer_get(&remote, 100, &size);
+    if (second == NULL || second == first) {
+        return __LINE__;
+    }
+    canopy_remote_buffer_put(&remote, first);
+    if (canopy_remote_buffer_get(&remote, 50, &size) != first) {
+        return __LINE__;
+    }
+
+    /* A reply bigger than the remote takes doesn't get a buffer */
+    if (canopy_remote_buffer_get(&remote, max_size + 2, &size) != NULL) {
+        return __LINE__;
+    }
+    params.max_response_size = 10000;
+    big = canopy_remote_buffer_get(&remote, 9000, &size);
+    if (big == NULL || size != 10001) {
+        return __LINE__;
+    }
+    canopy_remote_buffer_put(&remote, big);
+    params.max_response_size = max_size;
+
+    response.body = first;
+    response.body_len = 0;
+    response.pooled = true;
+    canopy_http_response_release(&remote, &response);
+    canopy_remote_buffer_put(&remote, second);
+    if (response.body != NULL || response.pooled) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_connection_stats
+ *
+ *  The pool starts out empty, sized by the params' defaults.
+ */
+static int test_connection_stats() {
+    canopy_connection_stats_t stats;
+
+    if (canopy_remote_get_connection_stats(&remote, NULL)
+            != CANOPY_ERROR_BAD_PARAM) {
+        return __LINE__;
+    }
+    memset(&stats, 0xff, sizeof(stats));
+    if (canopy_remote_get_connection_stats(&remote, &stats)
+            != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    if (stats.max_connections != CANOPY_DEFAULT_MAX_CONNECTIONS
+            || stats.max_streams != CANOPY_DEFAULT_MAX_STREAMS
+            || params.max_connections != CANOPY_DEFAULT_MAX_CONNECTIONS) {
+        return __LINE__;
+    }
+    if (stats.in_flight != 0 || stats.peak_in_flight != 0
+            || stats.requests != 0 || stats.connects != 0
+            || stats.multiplexed != 0) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+int main() {
+    if (setup_remote() != 0) {
+        printf("unable to set up remote\n");
+        return -1;
+    }
+    test(test_query_string, "query string encoding");
+    test(test_query_compile, "query compile and validation");
+    test(test_filter_match, "local filter evaluation");
+    test(test_parse_devices, "tests parsing of a JSON page of devices");
+    test(test_parse_devices_cbor, "tests parsing of a CBOR page of devices");
+    test(test_query_cache, "query result cache");
+    test(test_query_cache_threads, "query result cache across threads");
+    test(test_buffer_pool, "pooled reply buffers");
+    test(test_connection_stats, "connection pool stats");
+    printf("%d passed, %d failed\n", test_passed, test_failed);
+    return (test_failed == 0) ? 0 : -1;
+}
@@ -0,0 +1,1087 @@
+// Copyright 2015 Canopy Services, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include     <stdio.h>
+#include     <stdlib.h>
+#include     <unistd.h>
+#include     <poll.h>
+#include     <sys/socket.h>
+#include     <netinet/in.h>
+#include     <arpa/inet.h>
+
+#include    <stdint.h>
+#include    <stdbool.h>
+#include    <string.h>
+
+#include    <canopy_min_internal.h>
+#include    <canopy_min.h>
+#include    <canopy_os.h>
+
+/* nothing listens here, so syncs fail straight away */
+#define REMOTE_ADDR "127.0.0.1:1"
+
+#define TOASTER_UUID "9dfe2a00-efe2-45f9-a84c-8afc69caf4e7"
+#define TOASTER_SECRET_KEY "wYI0G+HQN9fj76fpyxwiHKJDQags0dpM"
+
+
+static int test_passed = 0;
+static int test_failed = 0;
+
+/* Test runner */
+static void test(int (*func)(void), const char *name) {
+    int r = func();
+    if (r == 0) {
+        test_passed++;
+    } else {
+        test_failed++;
+        printf("FAILED: %s (at line %d)\n", name, r);
+    }
+}
+
+static canopy_context_t ctx;
+static canopy_remote_params_t params;
+static canopy_remote_t remote;
+static char rcv_buffer[4096];
+static canopy_device_t devices[2];
+
+static int setup_remote(void) {
+    canopy_error err = canopy_ctx_init(&ctx, 3600);
+    if (err != CANOPY_SUCCESS) {
+        return -1;
+    }
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_DEVICE_CREDENTIALS;
+    params.name = TOASTER_UUID;
+    params.password = TOASTER_SECRET_KEY;
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = REMOTE_ADDR;
+    params.use_http = true;
+    err = canopy_remote_init(&ctx, &params, rcv_buffer, sizeof(rcv_buffer),
+            &remote);
+    if (err != CANOPY_SUCCESS) {
+        return -1;
+    }
+    canopy_device_init(&devices[0], &remote, TOASTER_UUID);
+    canopy_device_init(&devices[1], &remote, NULL);
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_scheduler_params
+ */
+int test_scheduler_params() {
+    canopy_context_t idle;
+
+    canopy_ctx_init(&idle, 0);
+    if (canopy_ctx_start_scheduler(&idle) != CANOPY_ERROR_BAD_PARAM
+            || canopy_ctx_start_scheduler(NULL) != CANOPY_ERROR_BAD_PARAM
+            || canopy_ctx_stop_scheduler(&idle) != CANOPY_ERROR_BAD_PARAM
+            || canopy_device_schedule_sync(NULL) != CANOPY_ERROR_BAD_PARAM
+            || canopy_device_unschedule_sync(NULL)
+                != CANOPY_ERROR_BAD_PARAM) {
+        return __LINE__;
+    }
+    /* without a scheduler the lock does nothing */
+    canopy_ctx_lock(&idle);
+    canopy_ctx_unlock(&idle);
+    canopy_ctx_shutdown(&idle);
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_schedule_devices
+ *
+ *  Devices of a remote are kept on one list, once each.
+ */
+int test_schedule_devices() {
+    if (canopy_device_schedule_sync(&devices[0]) != CANOPY_SUCCESS
+            || canopy_device_schedule_sync(&devices[1]) != CANOPY_SUCCESS
+            || canopy_device_schedule_sync(&devices[1]) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    if (remote.scheduled != &devices[1]
+            || devices[1].scheduled_next != &devices[0]
+            || devices[0].scheduled_next != NULL) {
+        return __LINE__;
+    }
+    if (canopy_device_unschedule_sync(&devices[1]) != CANOPY_SUCCESS
+            || remote.scheduled != &devices[0] || devices[1].scheduled) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_dirty_wakes_scheduler
+ *
+ *  Setting a variable of a scheduled device gets it synced long before the
+ *  hour long period is up.  The sync fails, but the variable has been sent
+ *  by then.
+ */
+int test_dirty_wakes_scheduler() {
+    struct canopy_var *var;
+    int i;
+
+    if (canopy_device_var_declare(&devices[0], CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_INT32, "count", &var) != CANOPY_SUCCESS
+            || canopy_ctx_start_scheduler(&ctx) != CANOPY_SUCCESS
+            || canopy_ctx_start_scheduler(&ctx) != CANOPY_ERROR_BAD_PARAM) {
+        return __LINE__;
+    }
+    usleep(100000);
+
+    canopy_ctx_lock(&ctx);
+    canopy_ctx_lock(&ctx);
+    canopy_var_set_int32(var, 42);
+    canopy_ctx_unlock(&ctx);
+    if (!var->dirty) {
+        return __LINE__;
+    }
+    canopy_ctx_unlock(&ctx);
+
+    for (i = 0; i < 50; i++) {
+        usleep(100000);
+        canopy_ctx_lock(&ctx);
+        if (!var->dirty) {
+            canopy_ctx_unlock(&ctx);
+            break;
+        }
+        canopy_ctx_unlock(&ctx);
+    }
+    if (i == 50 || remote.next_sync == 0) {
+        return __LINE__;
+    }
+
+    if (canopy_ctx_stop_scheduler(&ctx) != CANOPY_SUCCESS
+            || ctx.scheduler != NULL || remote.next_sync != 0) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_adaptive_sync
+ *
+ *  The period doubles while nothing happens, and drops to the minimum once
+ *  a variable is set.
+ */
+static bool wait_for_interval(canopy_context_t *c, canopy_remote_t *r,
+        cos_time_t interval, int tenths) {
+    bool reached = false;
+
+    while (!reached && tenths-- > 0) {
+        usleep(100000);
+        canopy_ctx_lock(c);
+        reached = r->sync_interval == interval;
+        canopy_ctx_unlock(c);
+    }
+    return reached;
+}
+
+int test_adaptive_sync() {
+    canopy_context_t actx;
+    canopy_remote_t aremote;
+    static char abuffer[4096];
+    canopy_device_t device;
+    struct canopy_var *var;
+
+    if (activity_status_from_string("active", sizeof("active"))
+                != CANOPY_ACTIVE
+            || activity_status_from_string("status_inactive",
+                sizeof("status_inactive")) != CANOPY_INACTIVE) {
+        return __LINE__;
+    }
+
+    canopy_ctx_init(&actx, 1);
+    if (canopy_ctx_set_adaptive_sync(&actx, 2, 1) != CANOPY_ERROR_BAD_PARAM
+            || canopy_ctx_set_adaptive_sync(&actx, 0, 8)
+                != CANOPY_ERROR_BAD_PARAM
+            || canopy_ctx_set_adaptive_sync(&actx, 1, 8) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    canopy_remote_init(&actx, &params, abuffer, sizeof(abuffer), &aremote);
+    canopy_device_init(&device, &aremote, NULL);
+    canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_INT32, "count", &var);
+    canopy_device_schedule_sync(&device);
+    if (canopy_ctx_start_scheduler(&actx) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+
+    /* update_period first, then twice that */
+    if (!wait_for_interval(&actx, &aremote, 2000, 40)) {
+        return __LINE__;
+    }
+    canopy_ctx_lock(&actx);
+    canopy_var_set_int32(var, 1);
+    canopy_ctx_unlock(&actx);
+    if (!wait_for_interval(&actx, &aremote, 1000, 20)) {
+        return __LINE__;
+    }
+
+    canopy_device_unschedule_sync(&device);
+    canopy_ctx_shutdown(&actx);
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_coalesced_sync
+ *
+ *  Syncs of a device that turn up while one is in flight all ride on one
+ *  follow-up request.  The remote here takes each connection and then drops
+ *  it, once the test has seen everyone waiting.
+ */
+struct sync_call {
+    canopy_remote_t *remote;
+    canopy_device_t *device;
+    bool            pull;
+    canopy_error    err;
+};
+
+static void sync_thread(void *arg) {
+    struct sync_call *call = (struct sync_call*)arg;
+    if (call->pull) {
+        call->err = canopy_device_sync_with_remote(call->remote, call->device,
+                NULL);
+    } else {
+        call->err = canopy_device_update_to_remote(call->remote,
+                call->device, NULL);
+    }
+}
+
+/* A loopback socket for a test to play the remote on. */
+static int listen_local(char *remote_addr, size_t len) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int listen_fd;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+            || listen(listen_fd, 4) != 0
+            || getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len)
+                != 0) {
+        close(listen_fd);
+        return -1;
+    }
+    snprintf(remote_addr, len, "127.0.0.1:%d", ntohs(addr.sin_port));
+    return listen_fd;
+}
+
+static int waiting(canopy_remote_t *r, canopy_device_t *device) {
+    struct c_sync_waiter *waiter;
+    int count = 0;
+
+    cos_mutex_lock(r->sync_lock);
+    for (waiter = device->sync_waiters; waiter != NULL;
+            waiter = waiter->next) {
+        count++;
+    }
+    cos_mutex_unlock(r->sync_lock);
+    return count;
+}
+
+int test_coalesced_sync() {
+    canopy_context_t cctx;
+    canopy_remote_params_t cparams;
+    canopy_remote_t cremote;
+    canopy_device_t device;
+    canopy_connection_stats_t stats;
+    struct canopy_var *var;
+    struct sync_call calls[4];
+    cos_thread_t *threads[4];
+    char remote_addr[32];
+    int listen_fd;
+    int fd;
+    int i;
+
+    listen_fd = listen_local(remote_addr, sizeof(remote_addr));
+    if (listen_fd < 0) {
+        return __LINE__;
+    }
+
+    canopy_ctx_init(&cctx, 0);
+    cparams = params;
+    cparams.remote = remote_addr;
+    cparams.retry_attempts = 1;
+    canopy_remote_init(&cctx, &cparams, NULL, 0, &cremote);
+    canopy_device_init(&device, &cremote, TOASTER_UUID);
+    canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_INT32, "count", &var);
+    canopy_var_set_int32(var, 1);
+
+    for (i = 0; i < 4; i++) {
+        calls[i].remote = &cremote;
+        calls[i].device = &device;
+        calls[i].pull = (i != 2);
+        calls[i].err = CANOPY_SUCCESS;
+    }
+
+    /* the first one's request is in flight once it's connected */
+    threads[0] = cos_thread_start(sync_thread, &calls[0]);
+    fd = accept(listen_fd, NULL, NULL);
+    for (i = 1; i < 4; i++) {
+        threads[i] = cos_thread_start(sync_thread, &calls[i]);
+    }
+    for (i = 0; i < 50 && waiting(&cremote, &device) < 3; i++) {
+        usleep(100000);
+    }
+    if (i == 50) {
+        return __LINE__;
+    }
+    close(fd);
+
+    /* and the other three share the next one */
+    fd = accept(listen_fd, NULL, NULL);
+    close(fd);
+    for (i = 0; i < 4; i++) {
+        cos_thread_join(threads[i]);
+        if (calls[i].err != CANOPY_ERROR_NETWORK) {
+            return __LINE__;
+        }
+    }
+    canopy_remote_get_connection_stats(&cremote, &stats);
+    if (stats.requests != 2 || device.sync_in_flight
+            || device.sync_waiters != NULL) {
+        return __LINE__;
+    }
+
+    canopy_ctx_shutdown(&cctx);
+    close(listen_fd);
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_retry_and_breaker
+ *
+ *  Dropped connections are retried up to retry_attempts, and once enough
+ *  of them have failed in a row the breaker turns requests away without
+ *  trying until the cooldown is over.
+ */
+/* Answers the next connection to <listen_fd> with <body>. */
+static int serve_reply(int listen_fd, const char *body) {
+    char header[256];
+    char buf[512];
+    size_t len = strlen(body);
+    int header_len;
+    int fd;
+
+    header_len = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Content-Length: %d\r\n"
+            "Connection: close\r\n\r\n", (int)len);
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0 || write(fd, header, header_len) != header_len
+            || write(fd, body, len) != (ssize_t)len) {
+        return -1;
+    }
+    shutdown(fd, SHUT_WR);
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    close(fd);
+    return 0;
+}
+
+static int serve_ok(int listen_fd) {
+    return serve_reply(listen_fd, "{\"result\" : \"ok\"}");
+}
+
+int test_retry_and_breaker() {
+    canopy_context_t cctx;
+    canopy_remote_params_t cparams;
+    canopy_remote_t cremote;
+    canopy_device_t device;
+    canopy_connection_stats_t stats;
+    struct sync_call call;
+    cos_thread_t *thread;
+    char remote_addr[32];
+    int listen_fd;
+    int i;
+
+    listen_fd = listen_local(remote_addr, sizeof(remote_addr));
+    if (listen_fd < 0) {
+        return __LINE__;
+    }
+
+    canopy_ctx_init(&cctx, 0);
+    cparams = params;
+    cparams.remote = remote_addr;
+    cparams.retry_attempts = 3;
+    cparams.retry_backoff_ms = 10;
+    cparams.retry_backoff_max_ms = 20;
+    cparams.breaker_threshold = 4;
+    cparams.breaker_cooldown_ms = 300;
+    canopy_remote_init(&cctx, &cparams, NULL, 0, &cremote);
+    canopy_device_init(&device, &cremote, TOASTER_UUID);
+    call.remote = &cremote;
+    call.device = &device;
+    call.pull = true;
+
+    /* a pull is tried three times before giving up */
+    thread = cos_thread_start(sync_thread, &call);
+    for (i = 0; i < 3; i++) {
+        close(accept(listen_fd, NULL, NULL));
+    }
+    cos_thread_join(thread);
+    canopy_remote_get_connection_stats(&cremote, &stats);
+    if (call.err != CANOPY_ERROR_NETWORK || stats.requests != 3
+            || cremote.failures != 3 || cremote.open_until != 0) {
+        return __LINE__;
+    }
+
+    /* the next failure opens the breaker, which ends that call's retries */
+    thread = cos_thread_start(sync_thread, &call);
+    close(accept(listen_fd, NULL, NULL));
+    cos_thread_join(thread);
+    canopy_remote_get_connection_stats(&cremote, &stats);
+    if (call.err != CANOPY_ERROR_NETWORK || stats.requests != 4
+            || cremote.open_until == 0) {
+        return __LINE__;
+    }
+
+    /* and until the cooldown is over nothing goes out */
+    if (canopy_device_sync_with_remote(&cremote, &device, NULL)
+            != CANOPY_ERROR_REMOTE_UNAVAILABLE) {
+        return __LINE__;
+    }
+    canopy_remote_get_connection_stats(&cremote, &stats);
+    if (stats.requests != 4) {
+        return __LINE__;
+    }
+
+    /* after it, a probe that gets through closes it again */
+    usleep(350000);
+    call.pull = false;
+    thread = cos_thread_start(sync_thread, &call);
+    if (serve_ok(listen_fd) != 0) {
+        return __LINE__;
+    }
+    cos_thread_join(thread);
+    if (call.err != CANOPY_SUCCESS || cremote.failures != 0
+            || cremote.open_until != 0 || cremote.probing) {
+        return __LINE__;
+    }
+
+    canopy_ctx_shutdown(&cctx);
+    close(listen_fd);
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_timeouts
+ *
+ *  A request the remote sits on gives up after request_timeout_ms, or
+ *  sooner if its barrier runs out or is cancelled, and a sync waiting on
+ *  another one stops waiting when its barrier runs out.
+ */
+struct barrier_call {
+    canopy_remote_t     *remote;
+    canopy_device_t     *device;
+    canopy_barrier_t    *barrier;
+    canopy_error        err;
+    cos_time_t          took;
+};
+
+static void barrier_thread(void *arg) {
+    struct barrier_call *call = (struct barrier_call*)arg;
+    cos_time_t start;
+    cos_time_t end;
+
+    cos_get_time(&start);
+    call->err = canopy_device_sync_with_remote(call->remote, call->device,
+            call->barrier);
+    cos_get_time(&end);
+    call->took = end - start;
+}
+
+int test_timeouts() {
+    canopy_context_t cctx;
+    canopy_remote_params_t cparams;
+    canopy_remote_t cremote;
+    canopy_device_t device;
+    canopy_barrier_t barrier;
+    struct barrier_call call;
+    struct barrier_call waiter;
+    cos_thread_t *thread;
+    cos_thread_t *waiter_thread;
+    char remote_addr[32];
+    int listen_fd;
+    int fd;
+    int i;
+
+    listen_fd = listen_local(remote_addr, sizeof(remote_addr));
+    if (listen_fd < 0) {
+        return __LINE__;
+    }
+
+    canopy_ctx_init(&cctx, 0);
+    cparams = params;
+    cparams.remote = remote_addr;
+    cparams.retry_attempts = 1;
+    cparams.breaker_threshold = -1;
+    cparams.request_timeout_ms = 300;
+    canopy_remote_init(&cctx, &cparams, NULL, 0, &cremote);
+    canopy_device_init(&device, &cremote, TOASTER_UUID);
+    call.remote = &cremote;
+    call.device = &device;
+
+    /* the remote's own timeout */
+    call.barrier = NULL;
+    thread = cos_thread_start(barrier_thread, &call);
+    fd = accept(listen_fd, NULL, NULL);
+    cos_thread_join(thread);
+    close(fd);
+    if (call.err != CANOPY_ERROR_TIMEOUT || call.took < 250
+            || call.took > 2000) {
+        return __LINE__;
+    }
+
+    /* a barrier's, which is shorter */
+    canopy_barrier_init(&barrier, &cremote, 100);
+    call.barrier = &barrier;
+    thread = cos_thread_start(barrier_thread, &call);
+    fd = accept(listen_fd, NULL, NULL);
+    cos_thread_join(thread);
+    close(fd);
+    if (call.err != CANOPY_ERROR_TIMEOUT || call.took > 250) {
+        return __LINE__;
+    }
+
+    /* cancelling the barrier drops the request there and then */
+    canopy_barrier_init(&barrier, &cremote, 0);
+    thread = cos_thread_start(barrier_thread, &call);
+    fd = accept(listen_fd, NULL, NULL);
+    usleep(20000);
+    if (canopy_barrier_cancel(&barrier) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    cos_thread_join(thread);
+    close(fd);
+    if (call.err != CANOPY_ERROR_CANCELLED || call.took > 250) {
+        return __LINE__;
+    }
+
+    /* and one waiting on a sync of the same device stops waiting */
+    call.barrier = NULL;
+    thread = cos_thread_start(barrier_thread, &call);
+    fd = accept(listen_fd, NULL, NULL);
+    canopy_barrier_init(&barrier, &cremote, 50);
+    waiter = call;
+    waiter.barrier = &barrier;
+    waiter_thread = cos_thread_start(barrier_thread, &waiter);
+    cos_thread_join(waiter_thread);
+    if (waiter.err != CANOPY_ERROR_TIMEOUT || !device.sync_in_flight
+            || waiting(&cremote, &device) != 0) {
+        return __LINE__;
+    }
+    close(fd);
+    cos_thread_join(thread);
+    for (i = 0; i < 10 && device.sync_in_flight; i++) {
+        usleep(10000);
+    }
+    if (device.sync_in_flight || device.sync_riders != NULL) {
+        return __LINE__;
+    }
+
+    canopy_ctx_shutdown(&cctx);
+    close(listen_fd);
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_remote_group
+ *
+ *  A group sends requests to its primary, fails over to the secondary when
+ *  the primary drops them, and keeps away from the primary while its breaker
+ *  is open.  Of two primaries, the quicker one is used.
+ */
+int test_remote_group() {
+    canopy_context_t cctx;
+    canopy_remote_params_t aparams;
+    canopy_remote_params_t bparams;
+    canopy_remote_t a;
+    canopy_remote_t b;
+    canopy_remote_t c;
+    canopy_remote_t d;
+    canopy_remote_t group;
+    canopy_remote_t fast_group;
+    canopy_remote_t *primaries[2];
+    canopy_remote_t *secondaries[1];
+    canopy_device_t device;
+    canopy_connection_stats_t stats;
+    struct sync_call call;
+    cos_thread_t *thread;
+    char a_addr[32];
+    char b_addr[32];
+    int a_fd;
+    int b_fd;
+
+    a_fd = listen_local(a_addr, sizeof(a_addr));
+    b_fd = listen_local(b_addr, sizeof(b_addr));
+    if (a_fd < 0 || b_fd < 0) {
+        return __LINE__;
+    }
+
+    canopy_ctx_init(&cctx, 0);
+    aparams = params;
+    aparams.remote = a_addr;
+    aparams.retry_attempts = 1;
+    aparams.breaker_threshold = 1;
+    aparams.breaker_cooldown_ms = 60000;
+    bparams = aparams;
+    bparams.remote = b_addr;
+    canopy_remote_init(&cctx, &aparams, NULL, 0, &a);
+    canopy_remote_init(&cctx, &bparams, NULL, 0, &b);
+    primaries[0] = &a;
+    secondaries[0] = &b;
+    if (canopy_remote_group_init(&cctx, primaries, 1, secondaries, 1,
+            &group) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    /* the endpoints have the connections and reply buffers */
+    if (group.connections != NULL || group.pool != NULL
+            || group.params != a.params) {
+        return __LINE__;
+    }
+    /* an endpoint can only be in one group */
+    if (canopy_remote_group_init(&cctx, secondaries, 1, NULL, 0,
+            &fast_group) != CANOPY_ERROR_BAD_PARAM) {
+        return __LINE__;
+    }
+    canopy_device_init(&device, &group, TOASTER_UUID);
+    call.remote = &group;
+    call.device = &device;
+    call.pull = false;
+
+    /* the primary while it's up */
+    thread = cos_thread_start(sync_thread, &call);
+    if (serve_ok(a_fd) != 0) {
+        return __LINE__;
+    }
+    cos_thread_join(thread);
+    if (call.err != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+
+    /* the secondary when it drops the request */
+    thread = cos_thread_start(sync_thread, &call);
+    close(accept(a_fd, NULL, NULL));
+    if (serve_ok(b_fd) != 0) {
+        return __LINE__;
+    }
+    cos_thread_join(thread);
+    if (call.err != CANOPY_SUCCESS || a.open_until == 0) {
+        return __LINE__;
+    }
+
+    /* and only the secondary while the primary's breaker is open */
+    thread = cos_thread_start(sync_thread, &call);
+    if (serve_ok(b_fd) != 0) {
+        return __LINE__;
+    }
+    cos_thread_join(thread);
+    canopy_remote_get_connection_stats(&a, &stats);
+    if (call.err != CANOPY_SUCCESS || stats.requests != 2) {
+        return __LINE__;
+    }
+    canopy_remote_get_connection_stats(&group, &stats);
+    if (stats.requests != 0) {
+        return __LINE__;
+    }
+
+    /* of two primaries, the one with the lower round trip time */
+    canopy_remote_init(&cctx, &aparams, NULL, 0, &c);
+    canopy_remote_init(&cctx, &bparams, NULL, 0, &d);
+    c.srtt = 8 * 100;
+    d.srtt = 8 * 5;
+    primaries[0] = &c;
+    primaries[1] = &d;
+    if (canopy_remote_group_init(&cctx, primaries, 2, NULL, 0,
+            &fast_group) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    call.remote = &fast_group;
+    thread = cos_thread_start(sync_thread, &call);
+    if (serve_ok(b_fd) != 0) {
+        return __LINE__;
+    }
+    cos_thread_join(thread);
+    canopy_remote_get_connection_stats(&c, &stats);
+    if (call.err != CANOPY_SUCCESS || stats.requests != 0) {
+        return __LINE__;
+    }
+
+    canopy_ctx_shutdown(&cctx);
+    close(a_fd);
+    close(b_fd);
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_large_device
+ *
+ *  A reply for a device with far more variables than fit in a fixed token
+ *  array is parsed whole.
+ */
+#define LARGE_DEVICE_VARS 200
+
+int test_large_device() {
+    canopy_context_t cctx;
+    canopy_remote_params_t cparams;
+    canopy_remote_t cremote;
+    canopy_device_t device;
+    struct canopy_var *var;
+    struct sync_call call;
+    cos_thread_t *thread;
+    char remote_addr[32];
+    char *body;
+    size_t len = 0;
+    uint32_t value;
+    cos_time_t last;
+    int listen_fd;
+    int i;
+
+    listen_fd = listen_local(remote_addr, sizeof(remote_addr));
+    body = (char*)malloc(64 * 1024);
+    if (listen_fd < 0 || body == NULL) {
+        return __LINE__;
+    }
+    /* 8 tokens a variable, so well over 512 */
+    len += sprintf(&body[len], "{\"result\" : \"ok\", \"var_decls\" : {");
+    for (i = 0; i < LARGE_DEVICE_VARS; i++) {
+        len += sprintf(&body[len], "%s\"in int32 var%04d\" : {}",
+                (i ? ", " : ""), i);
+    }
+    len += sprintf(&body[len], "}, \"vars\" : {");
+    for (i = 0; i < LARGE_DEVICE_VARS; i++) {
+        len += sprintf(&body[len], "%s\"var%04d\" : {\"t\" : 1, \"v\" : %d}",
+                (i ? ", " : ""), i, i);
+    }
+    sprintf(&body[len], "}}");
+
+    canopy_ctx_init(&cctx, 0);
+    cparams = params;
+    cparams.remote = remote_addr;
+    canopy_remote_init(&cctx, &cparams, NULL, 0, &cremote);
+    canopy_device_init(&device, &cremote, TOASTER_UUID);
+    call.remote = &cremote;
+    call.device = &device;
+    call.pull = true;
+
+    thread = cos_thread_start(sync_thread, &call);
+    if (serve_reply(listen_fd, body) != 0) {
+        return __LINE__;
+    }
+    cos_thread_join(thread);
+    free(body);
+    if (call.err != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    if (canopy_device_var_handle(&device, "var0199", &var)
+            != CANOPY_SUCCESS
+            || canopy_var_get_int32(var, &value, &last) != CANOPY_SUCCESS
+            || value != 199) {
+        return __LINE__;
+    }
+
+    canopy_ctx_shutdown(&cctx);
+    close(listen_fd);
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_scheduler_unlocked
+ *
+ *  The context lock is free while the scheduler waits on the remote, and
+ *  unscheduling a device in the round waits for the round to finish.
+ */
+struct lock_call {
+    canopy_context_t    *ctx;
+    canopy_device_t     *device;
+    struct canopy_var   *var;
+    volatile bool       done;
+};
+
+static void lock_thread(void *arg) {
+    struct lock_call *call = (struct lock_call*)arg;
+
+    canopy_ctx_lock(call->ctx);
+    canopy_var_set_int32(call->var, 2);
+    canopy_ctx_unlock(call->ctx);
+    call->done = true;
+}
+
+static void unschedule_thread(void *arg) {
+    struct lock_call *call = (struct lock_call*)arg;
+
+    canopy_device_unschedule_sync(call->device);
+    call->done = true;
+}
+
+int test_scheduler_unlocked() {
+    canopy_context_t cctx;
+    canopy_remote_params_t cparams;
+    canopy_remote_t cremote;
+    canopy_device_t device;
+    struct canopy_var *var;
+    struct lock_call call;
+    cos_thread_t *thread;
+    struct pollfd pfd;
+    char remote_addr[32];
+    int listen_fd;
+    int fd;
+    int i;
+
+    listen_fd = listen_local(remote_addr, sizeof(remote_addr));
+    if (listen_fd < 0) {
+        return __LINE__;
+    }
+
+    canopy_ctx_init(&cctx, 1);
+    cparams = params;
+    cparams.remote = remote_addr;
+    cparams.retry_attempts = 1;
+    canopy_remote_init(&cctx, &cparams, NULL, 0, &cremote);
+    canopy_device_init(&device, &cremote, TOASTER_UUID);
+    canopy_device_var_declare(&device, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_INT32, "count", &var);
+    canopy_var_set_int32(var, 1);
+    canopy_device_schedule_sync(&device);
+    canopy_ctx_start_scheduler(&cctx);
+
+    /* the scheduler's request is in flight once it's connected */
+    fd = accept(listen_fd, NULL, NULL);
+    call.ctx = &cctx;
+    call.device = &device;
+    call.var = var;
+    call.done = false;
+    thread = cos_thread_start(lock_thread, &call);
+    for (i = 0; i < 20 && !call.done; i++) {
+        usleep(100000);
+    }
+    close(fd);
+    cos_thread_join(thread);
+    if (i == 20) {
+        return __LINE__;
+    }
+
+    /* the next round is held open until unscheduling has waited on it */
+    fd = accept(listen_fd, NULL, NULL);
+    call.done = false;
+    thread = cos_thread_start(unschedule_thread, &call);
+    usleep(200000);
+    if (call.done) {
+        return __LINE__;
+    }
+    close(fd);
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    for (i = 0; i < 50 && !call.done; i++) {
+        if (poll(&pfd, 1, 100) == 1) {
+            close(accept(listen_fd, NULL, NULL));
+        }
+    }
+    cos_thread_join(thread);
+    if (i == 50 || device.scheduled || device.sched_syncing) {
+        return __LINE__;
+    }
+
+    canopy_ctx_shutdown(&cctx);
+    close(listen_fd);
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_unschedule_in_callback
+ *
+ *  A change callback runs holding the context lock, and can unschedule its
+ *  device without cutting the round short; the device comes off the list
+ *  once the round is over.
+ */
+struct callback_call {
+    canopy_context_t    *ctx;
+    cos_thread_t        *thread;
+    struct lock_call    lock;
+    bool                locked_out;
+    bool                unscheduled;
+};
+
+static void ctx_lock_thread(void *arg) {
+    struct lock_call *call = (struct lock_call*)arg;
+
+    canopy_ctx_lock(call->ctx);
+    call->done = true;
+    canopy_ctx_unlock(call->ctx);
+}
+
+static void unschedule_callback(struct canopy_var *var, void *userdata) {
+    struct callback_call *call = (struct callback_call*)userdata;
+
+    call->lock.ctx = call->ctx;
+    call->lock.done = false;
+    call->thread = cos_thread_start(ctx_lock_thread, &call->lock);
+    usleep(200000);
+    call->locked_out = !call->lock.done;
+    call->unscheduled = canopy_device_unschedule_sync(var->device)
+            == CANOPY_SUCCESS && !var->device->scheduled
+            && var->device->sched_syncing;
+}
+
+int test_unschedule_in_callback() {
+    canopy_context_t cctx;
+    canopy_remote_params_t cparams;
+    canopy_remote_t cremote;
+    canopy_device_t first;
+    canopy_device_t second;
+    struct canopy_var *in;
+    struct canopy_var *out;
+    struct callback_call call;
+    char remote_addr[32];
+    int listen_fd;
+    int i;
+
+    listen_fd = listen_local(remote_addr, sizeof(remote_addr));
+    if (listen_fd < 0) {
+        return __LINE__;
+    }
+
+    canopy_ctx_init(&cctx, 3600);
+    cparams = params;
+    cparams.remote = remote_addr;
+    cparams.retry_attempts = 1;
+    canopy_remote_init(&cctx, &cparams, NULL, 0, &cremote);
+    canopy_device_init(&first, &cremote, TOASTER_UUID);
+    canopy_device_init(&second, &cremote, TOASTER_UUID);
+    canopy_device_var_declare(&first, CANOPY_VAR_IN,
+            CANOPY_VAR_DATATYPE_INT32, "level", &in);
+    canopy_device_var_declare(&first, CANOPY_VAR_OUT,
+            CANOPY_VAR_DATATYPE_INT32, "count", &out);
+    memset(&call, 0, sizeof(call));
+    call.ctx = &cctx;
+    canopy_var_on_change(in, unschedule_callback, &call);
+    canopy_var_set_int32(out, 1);
+
+    /* <first> is synced first, being the last scheduled */
+    canopy_device_schedule_sync(&second);
+    canopy_device_schedule_sync(&first);
+    canopy_ctx_start_scheduler(&cctx);
+    if (serve_reply(listen_fd, "{\"result\" : \"ok\", \"vars\" : "
+            "{\"level\" : {\"t\" : 1, \"v\" : 5}}}") != 0
+            || serve_ok(listen_fd) != 0) {
+        return __LINE__;
+    }
+    for (i = 0; i < 50; i++) {
+        usleep(100000);
+        canopy_ctx_lock(&cctx);
+        if (!first.sched_syncing) {
+            canopy_ctx_unlock(&cctx);
+            break;
+        }
+        canopy_ctx_unlock(&cctx);
+    }
+    cos_thread_join(call.thread);
+    if (i == 50 || !call.locked_out || !call.lock.done
+            || !call.unscheduled) {
+        return __LINE__;
+    }
+    if (first.scheduled || first.scheduled_next != NULL
+            || cremote.scheduled != &second
+            || second.scheduled_next != NULL) {
+        return __LINE__;
+    }
+
+    canopy_ctx_shutdown(&cctx);
+    close(listen_fd);
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_large_reply
+ *
+ *  A reply bigger than the biggest pooled buffer is taken in whole, and its
+ *  length is kept to size the next reply's buffer.
+ */
+#define LARGE_REPLY_PAD (3 * 1024 * 1024)
+
+int test_large_reply() {
+    canopy_context_t cctx;
+    canopy_remote_params_t cparams;
+    canopy_remote_t cremote;
+    canopy_device_t device;
+    struct sync_call call;
+    cos_thread_t *thread;
+    char remote_addr[32];
+    char *body;
+    int len;
+    int listen_fd;
+
+    listen_fd = listen_local(remote_addr, sizeof(remote_addr));
+    body = (char*)malloc(LARGE_REPLY_PAD + 64);
+    if (listen_fd < 0 || body == NULL) {
+        return __LINE__;
+    }
+    len = sprintf(body, "{\"result\" : \"ok\", \"pad\" : \"");
+    memset(&body[len], 'x', LARGE_REPLY_PAD);
+    len += LARGE_REPLY_PAD;
+    len += sprintf(&body[len], "\"}");
+
+    canopy_ctx_init(&cctx, 0);
+    cparams = params;
+    cparams.remote = remote_addr;
+    cparams.max_response_size = 4 * 1024 * 1024;
+    canopy_remote_init(&cctx, &cparams, NULL, 0, &cremote);
+    canopy_device_init(&device, &cremote, TOASTER_UUID);
+    call.remote = &cremote;
+    call.device = &device;
+    call.pull = true;
+
+    thread = cos_thread_start(sync_thread, &call);
+    if (serve_reply(listen_fd, body) != 0) {
+        return __LINE__;
+    }
+    cos_thread_join(thread);
+    free(body);
+    if (call.err != CANOPY_SUCCESS || cremote.rcv_end != len) {
+        return __LINE__;
+    }
+
+    canopy_ctx_shutdown(&cctx);
+    close(listen_fd);
+    return 0;
+}
+
+int main() {
+    if (setup_remote() != 0) {
+        printf("unable to set up remote\n");
+        return -1;
+    }
+    test(test_scheduler_params, "scheduler parameters");
+    test(test_schedule_devices, "scheduled device list");
+    test(test_dirty_wakes_scheduler, "dirty variable wakes the scheduler");
+    test(test_adaptive_sync, "adaptive sync period");
+    test(test_coalesced_sync, "coalesced syncs of a device");
+    test(test_retry_and_breaker, "retries and circuit breaker");
+    test(test_timeouts, "request timeouts and barriers");
+    test(test_remote_group, "remote groups fail over");
+    test(test_large_device, "device reply of more than 512 tokens");
+    test(test_large_reply, "reply bigger than the biggest pooled buffer");
+    test(test_scheduler_unlocked,
+            "context lock is free while the remote is waited on");
+    test(test_unschedule_in_callback, "unscheduling from a change callback");
+    canopy_ctx_shutdown(&ctx);
+    printf("%d passed, %d failed\n", test_passed, test_failed);
+    return (test_failed == 0) ? 0 : -1;
+}
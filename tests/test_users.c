@@ -0,0 +1,303 @@
+// Copyright 2015 Canopy Services, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include     <stdio.h>
+#include     <stdlib.h>
+#include     <errno.h>
+
+#include    <stdint.h>
+#include    <stdbool.h>
+#include    <string.h>
+
+#include    <jsmn/jsmn.h>
+
+#include    <canopy_min_internal.h>
+#include    <canopy_min.h>
+#include    <canopy_os.h>
+
+#define REMOTE_ADDR "dev02.canopy.link"
+
+
+static int test_passed = 0;
+static int test_failed = 0;
+
+/* Test runner */
+static void test(int (*func)(void), const char *name) {
+    int r = func();
+    if (r == 0) {
+        test_passed++;
+    } else {
+        test_failed++;
+        printf("FAILED: %s (at line %d)\n", name, r);
+    }
+}
+
+static canopy_context_t ctx;
+static canopy_remote_params_t params;
+static canopy_remote_t remote;
+static char rcv_buffer[4096];
+
+/*
+ * Sets up the remote the test users hang off of.  It's never contacted.
+ */
+static int setup_remote(void) {
+    canopy_error err = canopy_ctx_init(&ctx, 0);
+    if (err != CANOPY_SUCCESS) {
+        return -1;
+    }
+    memset(&params, 0, sizeof(params));
+    params.credential_type = CANOPY_USER_CREDENTIALS;
+    params.name = "greg";
+    params.password = "password";
+    params.auth_type = CANOPY_BASIC_AUTH;
+    params.remote = REMOTE_ADDR;
+    err = canopy_remote_init(&ctx, &params, rcv_buffer, sizeof(rcv_buffer),
+            &remote);
+    return (err == CANOPY_SUCCESS) ? 0 : -1;
+}
+
+/*****************************************************************************
+ *         test_emit_create_devices
+ *
+ *  The names are escaped, and too small a payload buffer is reported.
+ */
+static int test_emit_create_devices() {
+    char payload[256];
+    char *names[2] = { "kitchen \"toaster\"", "hall\\lamp" };
+    jsmn_parser parser;
+    jsmntok_t token[16];
+    size_t len;
+    int n;
+
+    if (c_json_emit_create_devices(payload, sizeof(payload), 2, names, &len)
+            != CANOPY_SUCCESS || len != strlen(payload)) {
+        return __LINE__;
+    }
+    jsmn_init(&parser);
+    n = jsmn_parse(&parser, payload, len, token, 16);
+    /* object, "friendly_names", array, 2 names, "quantity", 2 */
+    if (n != 7 || token[2].type != JSMN_ARRAY || token[2].size != 2) {
+        printf("%s\n", payload);
+        return __LINE__;
+    }
+    if (strncmp(&payload[token[3].start], "kitchen \\\"toaster\\\"",
+            token[3].end - token[3].start) != 0
+            || strncmp(&payload[token[4].start], "hall\\\\lamp",
+            token[4].end - token[4].start) != 0
+            || strncmp(&payload[token[6].start], "2", 1) != 0) {
+        return __LINE__;
+    }
+
+    /* No names, just the quantity */
+    if (c_json_emit_create_devices(payload, sizeof(payload), 7, NULL, &len)
+            != CANOPY_SUCCESS || strstr(payload, TAG_FRIENDLY_NAMES) != NULL
+            || strstr(payload, "\"quantity\" : 7") == NULL) {
+        return __LINE__;
+    }
+
+    if (c_json_emit_create_devices(payload, 32, 2, names, &len)
+            != CANOPY_ERROR_BUFFER_TOO_SMALL) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_parse_create_devices
+ *
+ *  The parallel arrays of the reply land in the caller's devices.
+ */
+static int test_parse_create_devices() {
+    char js[] = "{\"result\" : \"ok\", \"count\" : 2, "
+            "\"ids\" : [\"00000000-0000-4000-9000-000000000000\", "
+            "\"00000000-0000-4000-9000-000000000001\"], "
+            "\"friendly_names\" : [\"kitchen \\\"toaster\\\"\", \"lamp\"], "
+            "\"device_secret_keys\" : [\"key0\", \"key1\"]}";
+    char short_js[] = "{\"result\" : \"ok\", "
+            "\"ids\" : [\"00000000-0000-4000-9000-000000000000\"]}";
+    char failed_js[] = "{\"result\" : \"error\"}";
+    canopy_device_t storage[2];
+    canopy_device_t *devices[2] = { &storage[0], &storage[1] };
+
+    if (c_json_parse_create_devices(&remote, js, strlen(js), 2, devices)
+            != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    if (strcmp(storage[1].device_id, "00000000-0000-4000-9000-000000000001")
+            != 0 || strcmp(storage[0].friendly_name, "kitchen \"toaster\"")
+            != 0 || strcmp(storage[1].secret_key, "key1") != 0
+            || storage[0].remote != &remote) {
+        return __LINE__;
+    }
+
+    /* Fewer devices than asked for */
+    if (c_json_parse_create_devices(&remote, short_js, strlen(short_js), 2,
+            devices) == CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    if (c_json_parse_create_devices(&remote, failed_js, strlen(failed_js), 2,
+            devices) != CANOPY_ERROR_UNKNOWN) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_create_devices_params
+ */
+static int test_create_devices_params() {
+    canopy_user_t user;
+    canopy_device_t device;
+    canopy_device_t *devices[1] = { &device };
+    uint32_t count = 1;
+
+    memset(&user, 0, sizeof(user));
+    if (canopy_user_create_devices(&user, 1, NULL, devices, &count, NULL)
+            != CANOPY_ERROR_BAD_PARAM) {
+        return __LINE__;
+    }
+    user.remote = &remote;
+    if (canopy_user_create_devices(&user, 0, NULL, devices, &count, NULL)
+            != CANOPY_ERROR_BAD_PARAM || count != 0) {
+        return __LINE__;
+    }
+    if (canopy_user_create_devices(&user, 1, NULL, devices, NULL, NULL)
+            != CANOPY_ERROR_BAD_PARAM) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_parse_user
+ *
+ *  Known fields land in the user, unknown ones are skipped, and a parse
+ *  drops an unsent email change.
+ */
+static int test_parse_user() {
+    char reply[] = "{\"result\" : \"ok\", \"username\" : \"greg\", "
+            "\"devices\" : [{\"a\" : 1}, {\"b\" : [2, 3]}], "
+            "\"email\" : \"greg\\\"s@example.com\", \"validated\" : true}";
+    char error[] = "{\"result\" : \"error\", \"error_msg\" : \"no\"}";
+    char *str;
+    bool validated;
+    canopy_user_t user;
+
+    canopy_user_init(&user, &remote);
+    canopy_user_set_email(&user, "stale@example.com");
+    if (c_json_parse_user(&user, reply, strlen(reply)) != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    canopy_user_get_username(&user, &str);
+    if (strcmp(str, "greg") != 0) {
+        return __LINE__;
+    }
+    canopy_user_get_email(&user, &str);
+    if (strcmp(str, "greg\"s@example.com") != 0 || user.email_dirty) {
+        return __LINE__;
+    }
+    canopy_user_is_validated(&user, &validated);
+    if (!validated) {
+        return __LINE__;
+    }
+
+    if (c_json_parse_user(&user, error, strlen(error))
+            != CANOPY_ERROR_UNKNOWN) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_emit_user
+ *
+ *  Only the local changes are sent; the password change takes both
+ *  passwords.
+ */
+static int test_emit_user() {
+    char payload[512];
+    canopy_user_t user;
+    size_t len;
+
+    canopy_user_init(&user, &remote);
+    strcpy(user.name, "greg");
+    if (c_json_emit_user(&user, payload, sizeof(payload), &len)
+            != CANOPY_SUCCESS || strstr(payload, "\"") != NULL) {
+        return __LINE__;
+    }
+
+    if (canopy_user_set_email(&user, "new@example.com") != CANOPY_SUCCESS
+            || canopy_user_set_password(&user, "old", "new")
+                != CANOPY_SUCCESS) {
+        return __LINE__;
+    }
+    if (c_json_emit_user(&user, payload, sizeof(payload), &len)
+            != CANOPY_SUCCESS || len != strlen(payload)) {
+        return __LINE__;
+    }
+    if (strstr(payload, "\"email\" : \"new@example.com\"") == NULL
+            || strstr(payload, "\"old_password\" : \"old\"") == NULL
+            || strstr(payload, "\"password\" : \"new\"") == NULL
+            || strstr(payload, TAG_USERNAME) != NULL
+            || strstr(payload, TAG_VALIDATED) != NULL) {
+        printf("%s\n", payload);
+        return __LINE__;
+    }
+
+    if (c_json_emit_user(&user, payload, 24, &len)
+            != CANOPY_ERROR_BUFFER_TOO_SMALL) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ *         test_user_params
+ */
+static int test_user_params() {
+    char long_email[CANOPY_EMAIL_MAX_LENGTH + 1];
+    canopy_user_t user;
+
+    canopy_user_init(&user, &remote);
+    memset(long_email, 'e', sizeof(long_email) - 1);
+    long_email[sizeof(long_email) - 1] = '\0';
+    if (canopy_user_set_email(&user, long_email) != CANOPY_ERROR_BAD_PARAM
+            || user.email_dirty) {
+        return __LINE__;
+    }
+    if (canopy_user_set_password(&user, "old", "") != CANOPY_ERROR_BAD_PARAM
+            || user.password_dirty) {
+        return __LINE__;
+    }
+    if (canopy_create_user(&remote, "greg", "password", NULL, false, &user,
+            NULL) != CANOPY_ERROR_BAD_PARAM) {
+        return __LINE__;
+    }
+    return 0;
+}
+
+int main() {
+    if (setup_remote() != 0) {
+        printf("unable to set up remote\n");
+        return -1;
+    }
+    test(test_emit_create_devices, "create devices request");
+    test(test_parse_create_devices, "create devices reply");
+    test(test_create_devices_params, "create devices parameters");
+    test(test_parse_user, "user reply");
+    test(test_emit_user, "user request");
+    test(test_user_params, "user parameters");
+    printf("%d passed, %d failed\n", test_passed, test_failed);
+    return (test_failed == 0) ? 0 : -1;
+}